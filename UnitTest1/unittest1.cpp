@@ -37,6 +37,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0); 
 		}
 
+        TEST_METHOD(test_picohash_bench)
+        {
+            int ret = picohash_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_cnxcreation)
         {
             int ret = cnxcreation_test();
@@ -44,6 +51,41 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_cnx_wake_time)
+        {
+            int ret = cnx_wake_time_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_index)
+        {
+            int ret = stream_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_ready_queue)
+        {
+            int ret = stream_ready_queue_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_reassembly)
+        {
+            int ret = stream_reassembly_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_newreno_recovery)
+        {
+            int ret = newreno_recovery_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_parse_header)
         {
             int ret = parseheadertest();
@@ -79,6 +121,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_sack_bench)
+        {
+            int ret = sack_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_float16)
         {
             int ret = float16test();
@@ -100,6 +149,13 @@ namespace UnitTest1
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(test_sendack_fuzz)
+		{
+			int ret = sendack_fuzz_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(test_tls_api)
 		{
 			int ret = tls_api_test();
@@ -240,6 +296,132 @@ namespace UnitTest1
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(test_packet_pool)
+		{
+			int ret = tls_api_packet_pool_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_retransmit_by_reference)
+		{
+			int ret = tls_api_retransmit_by_reference_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_retransmit_ring)
+		{
+			int ret = tls_api_retransmit_ring_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_stream_scheduler)
+		{
+			int ret = tls_api_stream_scheduler_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_zero_copy_send)
+		{
+			int ret = tls_api_zero_copy_send_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_pull_stream)
+		{
+			int ret = tls_api_pull_stream_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_app_read)
+		{
+			int ret = tls_api_app_read_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_stream_packing)
+		{
+			int ret = tls_api_stream_packing_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_retransmit_merge)
+		{
+			int ret = tls_api_retransmit_merge_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_ack_only)
+		{
+			int ret = tls_api_ack_only_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_sent_frames)
+		{
+			int ret = tls_api_sent_frames_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_cubic)
+		{
+			int ret = tls_api_cubic_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_bbr)
+		{
+			int ret = tls_api_bbr_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_pacing)
+		{
+			int ret = tls_api_pacing_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_hystart)
+		{
+			int ret = tls_api_hystart_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_pto)
+		{
+			int ret = tls_api_pto_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_rack)
+		{
+			int ret = tls_api_rack_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(test_ack_policy)
+		{
+			int ret = tls_api_ack_policy_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
         TEST_METHOD(test_http0dot9)
         {
             int ret = http0dot9_test();
@@ -0,0 +1,422 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2017, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+/*
+ * BBR, after draft-cardwell-iccrg-bbr-congestion-control. Instead of
+ * reacting to losses, BBR builds a model of the path: the bottleneck
+ * bandwidth, which is the maximum delivery rate seen over the last 10
+ * round trips, and the minimum RTT seen over the last 10 seconds. The
+ * window is set to a multiple of the product of the two, and the pacing
+ * rate to a multiple of the bandwidth. The multiples, or gains, depend
+ * on the phase:
+ *  - startup doubles the sending rate every round trip, until the
+ *    bandwidth stops growing for 3 round trips;
+ *  - drain sends slower than the bandwidth, to empty the queue built
+ *    during startup;
+ *  - probe bandwidth cycles the pacing gain over 8 round trips, one
+ *    above 1 to probe for more bandwidth, one below 1 to drain the queue
+ *    that this may have created;
+ *  - probe RTT reduces the window to 4 packets for at least 200 ms when
+ *    the minimum RTT was not refreshed for 10 seconds.
+ * Losses that are not the result of congestion do not change the model.
+ * The delivery rate samples are computed in frames.c when packets are
+ * acknowledged, from the delivery state recorded in each sent packet.
+ */
+
+#define PICOQUIC_BBR_BW_FILTER_LENGTH 10
+#define PICOQUIC_BBR_MIN_RTT_FILTER_LENGTH 10000000 /* 10 seconds */
+#define PICOQUIC_BBR_PROBE_RTT_DURATION 200000 /* 200 ms */
+#define PICOQUIC_BBR_HIGH_GAIN 2.885 /* 2/ln(2) */
+#define PICOQUIC_BBR_CWIN_MINIMUM (4 * PICOQUIC_MAX_PACKET_SIZE)
+#define PICOQUIC_BBR_GAIN_CYCLE_LENGTH 8
+
+static const double picoquic_bbr_pacing_gain_cycle[PICOQUIC_BBR_GAIN_CYCLE_LENGTH] = {
+	1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+
+typedef enum
+{
+	picoquic_bbr_alg_startup = 0,
+	picoquic_bbr_alg_drain,
+	picoquic_bbr_alg_probe_bw,
+	picoquic_bbr_alg_probe_rtt
+} picoquic_bbr_alg_state_t;
+
+typedef struct st_picoquic_bbr_state_t {
+	picoquic_bbr_alg_state_t alg_state;
+	uint64_t btl_bw;
+	uint64_t bw_filter[PICOQUIC_BBR_BW_FILTER_LENGTH];
+	uint64_t min_rtt;
+	uint64_t min_rtt_stamp;
+	int min_rtt_expired;
+	uint64_t round_count;
+	uint64_t next_round_delivered;
+	int round_start;
+	uint64_t full_bw;
+	int full_bw_count;
+	int filled_pipe;
+	double pacing_gain;
+	double cwnd_gain;
+	int cycle_index;
+	uint64_t cycle_stamp;
+	uint64_t probe_rtt_done_stamp;
+	int probe_rtt_round_done;
+	uint64_t prior_cwin;
+} picoquic_bbr_state_t;
+
+void picoquic_bbr_init(picoquic_cnx_t * cnx)
+{
+	/* Initialize the state of the congestion control algorithm */
+	picoquic_bbr_state_t * bbr_state = (picoquic_bbr_state_t *)malloc(sizeof(picoquic_bbr_state_t));
+	cnx->congestion_alg_state = (void *)bbr_state;
+
+	if (bbr_state != NULL)
+	{
+		memset(bbr_state, 0, sizeof(picoquic_bbr_state_t));
+		bbr_state->alg_state = picoquic_bbr_alg_startup;
+		bbr_state->pacing_gain = PICOQUIC_BBR_HIGH_GAIN;
+		bbr_state->cwnd_gain = PICOQUIC_BBR_HIGH_GAIN;
+		bbr_state->next_round_delivered = cnx->delivered;
+		cnx->cwin = PICOQUIC_CWIN_INITIAL;
+		cnx->pacing_rate = (uint64_t)(PICOQUIC_BBR_HIGH_GAIN * cnx->cwin * 1000000.0 / cnx->smoothed_rtt);
+	}
+}
+
+/* Bandwidth delay product, times the gain. Before the model is built,
+ * this is the initial window. */
+static uint64_t picoquic_bbr_bdp(picoquic_bbr_state_t * bbr_state, double gain)
+{
+	uint64_t bdp;
+
+	if (bbr_state->btl_bw == 0 || bbr_state->min_rtt == 0)
+	{
+		bdp = PICOQUIC_CWIN_INITIAL;
+	}
+	else
+	{
+		bdp = (uint64_t)(gain * (double)bbr_state->btl_bw * (double)bbr_state->min_rtt / 1000000.0);
+	}
+
+	return bdp;
+}
+
+/* A round trip ends when a packet sent after the start of the round is
+ * acknowledged */
+static void picoquic_bbr_update_round(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state)
+{
+	if (cnx->rate_sample.prior_delivered >= bbr_state->next_round_delivered)
+	{
+		bbr_state->next_round_delivered = cnx->delivered;
+		bbr_state->round_count++;
+		bbr_state->round_start = 1;
+		bbr_state->bw_filter[bbr_state->round_count % PICOQUIC_BBR_BW_FILTER_LENGTH] = 0;
+	}
+	else
+	{
+		bbr_state->round_start = 0;
+	}
+}
+
+/* Windowed max filter of the delivery rate, one slot per round trip.
+ * App limited samples only count if they raise the estimate. */
+static void picoquic_bbr_update_btl_bw(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state)
+{
+	picoquic_rate_sample_t * rs = &cnx->rate_sample;
+
+	if (rs->delivery_rate >= bbr_state->btl_bw || !rs->is_app_limited)
+	{
+		uint64_t * slot = &bbr_state->bw_filter[bbr_state->round_count % PICOQUIC_BBR_BW_FILTER_LENGTH];
+
+		if (rs->delivery_rate > *slot)
+		{
+			*slot = rs->delivery_rate;
+		}
+	}
+
+	bbr_state->btl_bw = 0;
+	for (int i = 0; i < PICOQUIC_BBR_BW_FILTER_LENGTH; i++)
+	{
+		if (bbr_state->bw_filter[i] > bbr_state->btl_bw)
+		{
+			bbr_state->btl_bw = bbr_state->bw_filter[i];
+		}
+	}
+}
+
+/* The pipe is full when the bandwidth grew less than 25% over 3 rounds */
+static void picoquic_bbr_check_full_pipe(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state)
+{
+	if (!bbr_state->filled_pipe && bbr_state->round_start && !cnx->rate_sample.is_app_limited)
+	{
+		if (bbr_state->btl_bw >= bbr_state->full_bw + bbr_state->full_bw / 4)
+		{
+			bbr_state->full_bw = bbr_state->btl_bw;
+			bbr_state->full_bw_count = 0;
+		}
+		else
+		{
+			bbr_state->full_bw_count++;
+			if (bbr_state->full_bw_count >= 3)
+			{
+				bbr_state->filled_pipe = 1;
+			}
+		}
+	}
+}
+
+static void picoquic_bbr_enter_probe_bw(picoquic_bbr_state_t * bbr_state, uint64_t current_time)
+{
+	bbr_state->alg_state = picoquic_bbr_alg_probe_bw;
+	bbr_state->cwnd_gain = 2.0;
+	/* Start after the probing and draining phases, so that a flow that
+	 * just drained its startup queue does not probe right away */
+	bbr_state->cycle_index = 2;
+	bbr_state->pacing_gain = picoquic_bbr_pacing_gain_cycle[bbr_state->cycle_index];
+	bbr_state->cycle_stamp = current_time;
+}
+
+static void picoquic_bbr_check_drain(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state,
+	uint64_t current_time)
+{
+	if (bbr_state->alg_state == picoquic_bbr_alg_startup && bbr_state->filled_pipe)
+	{
+		bbr_state->alg_state = picoquic_bbr_alg_drain;
+		bbr_state->pacing_gain = 1.0 / PICOQUIC_BBR_HIGH_GAIN;
+		bbr_state->cwnd_gain = PICOQUIC_BBR_HIGH_GAIN;
+	}
+
+	if (bbr_state->alg_state == picoquic_bbr_alg_drain &&
+		cnx->bytes_in_transit <= picoquic_bbr_bdp(bbr_state, 1.0))
+	{
+		picoquic_bbr_enter_probe_bw(bbr_state, current_time);
+	}
+}
+
+/* Each phase of the gain cycle lasts one min RTT. The probing phase also
+ * waits until the extra data is in transit, the draining phase ends early
+ * once the queue is gone. */
+static void picoquic_bbr_update_gain_cycle(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state,
+	uint64_t current_time)
+{
+	if (bbr_state->alg_state == picoquic_bbr_alg_probe_bw)
+	{
+		int is_full_length = (current_time - bbr_state->cycle_stamp) > bbr_state->min_rtt;
+		int next_phase = is_full_length;
+
+		if (bbr_state->pacing_gain > 1.0)
+		{
+			next_phase = is_full_length &&
+				cnx->bytes_in_transit >= picoquic_bbr_bdp(bbr_state, bbr_state->pacing_gain);
+		}
+		else if (bbr_state->pacing_gain < 1.0)
+		{
+			next_phase = is_full_length ||
+				cnx->bytes_in_transit <= picoquic_bbr_bdp(bbr_state, 1.0);
+		}
+
+		if (next_phase)
+		{
+			bbr_state->cycle_index = (bbr_state->cycle_index + 1) % PICOQUIC_BBR_GAIN_CYCLE_LENGTH;
+			bbr_state->pacing_gain = picoquic_bbr_pacing_gain_cycle[bbr_state->cycle_index];
+			bbr_state->cycle_stamp = current_time;
+		}
+	}
+}
+
+static void picoquic_bbr_update_min_rtt(picoquic_bbr_state_t * bbr_state,
+	uint64_t rtt_measurement, uint64_t current_time)
+{
+	bbr_state->min_rtt_expired = bbr_state->min_rtt != 0 &&
+		current_time > bbr_state->min_rtt_stamp + PICOQUIC_BBR_MIN_RTT_FILTER_LENGTH;
+
+	if (rtt_measurement > 0 &&
+		(bbr_state->min_rtt == 0 || rtt_measurement <= bbr_state->min_rtt || bbr_state->min_rtt_expired))
+	{
+		bbr_state->min_rtt = rtt_measurement;
+		bbr_state->min_rtt_stamp = current_time;
+	}
+}
+
+/* When the min RTT was not refreshed for 10 seconds, drain the queue for
+ * at least 200 ms and one round trip to measure it again */
+static void picoquic_bbr_check_probe_rtt(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state,
+	uint64_t current_time)
+{
+	if (bbr_state->alg_state != picoquic_bbr_alg_probe_rtt && bbr_state->min_rtt_expired)
+	{
+		bbr_state->alg_state = picoquic_bbr_alg_probe_rtt;
+		bbr_state->pacing_gain = 1.0;
+		bbr_state->cwnd_gain = 1.0;
+		bbr_state->prior_cwin = cnx->cwin;
+		bbr_state->probe_rtt_done_stamp = 0;
+	}
+
+	if (bbr_state->alg_state == picoquic_bbr_alg_probe_rtt)
+	{
+		if (bbr_state->probe_rtt_done_stamp == 0 &&
+			cnx->bytes_in_transit <= PICOQUIC_BBR_CWIN_MINIMUM)
+		{
+			bbr_state->probe_rtt_done_stamp = current_time + PICOQUIC_BBR_PROBE_RTT_DURATION;
+			bbr_state->probe_rtt_round_done = 0;
+			bbr_state->next_round_delivered = cnx->delivered;
+		}
+		else if (bbr_state->probe_rtt_done_stamp != 0)
+		{
+			if (bbr_state->round_start)
+			{
+				bbr_state->probe_rtt_round_done = 1;
+			}
+
+			if (bbr_state->probe_rtt_round_done && current_time > bbr_state->probe_rtt_done_stamp)
+			{
+				bbr_state->min_rtt_stamp = current_time;
+				bbr_state->min_rtt_expired = 0;
+				if (cnx->cwin < bbr_state->prior_cwin)
+				{
+					cnx->cwin = bbr_state->prior_cwin;
+				}
+
+				if (bbr_state->filled_pipe)
+				{
+					picoquic_bbr_enter_probe_bw(bbr_state, current_time);
+				}
+				else
+				{
+					bbr_state->alg_state = picoquic_bbr_alg_startup;
+					bbr_state->pacing_gain = PICOQUIC_BBR_HIGH_GAIN;
+					bbr_state->cwnd_gain = PICOQUIC_BBR_HIGH_GAIN;
+				}
+			}
+		}
+	}
+}
+
+/* The window grows by the acknowledged bytes up to its target, so it
+ * recovers quickly after a timeout. */
+static void picoquic_bbr_set_cwin(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state,
+	uint64_t nb_bytes_acknowledged)
+{
+	uint64_t target = picoquic_bbr_bdp(bbr_state, bbr_state->cwnd_gain) + 3 * cnx->send_mtu;
+
+	if (bbr_state->filled_pipe)
+	{
+		cnx->cwin += nb_bytes_acknowledged;
+		if (cnx->cwin > target)
+		{
+			cnx->cwin = target;
+		}
+	}
+	else if (cnx->cwin < target || cnx->delivered < PICOQUIC_CWIN_INITIAL)
+	{
+		cnx->cwin += nb_bytes_acknowledged;
+	}
+
+	if (cnx->cwin < PICOQUIC_BBR_CWIN_MINIMUM)
+	{
+		cnx->cwin = PICOQUIC_BBR_CWIN_MINIMUM;
+	}
+
+	if (bbr_state->alg_state == picoquic_bbr_alg_probe_rtt && cnx->cwin > PICOQUIC_BBR_CWIN_MINIMUM)
+	{
+		cnx->cwin = PICOQUIC_BBR_CWIN_MINIMUM;
+	}
+}
+
+/* The pacing rate does not decrease in startup, as the first samples
+ * underestimate the bandwidth */
+static void picoquic_bbr_set_pacing_rate(picoquic_cnx_t * cnx, picoquic_bbr_state_t * bbr_state)
+{
+	uint64_t rate = (uint64_t)(bbr_state->pacing_gain * (double)bbr_state->btl_bw);
+
+	if (bbr_state->btl_bw > 0 && (bbr_state->filled_pipe || rate > cnx->pacing_rate))
+	{
+		cnx->pacing_rate = rate;
+	}
+}
+
+void picoquic_bbr_notify(picoquic_cnx_t * cnx,
+	picoquic_congestion_notification_t notification,
+	uint64_t rtt_measurement,
+	uint64_t nb_bytes_acknowledged,
+	uint64_t lost_packet_number,
+	uint64_t current_time)
+{
+	picoquic_bbr_state_t * bbr_state = (picoquic_bbr_state_t *)cnx->congestion_alg_state;
+
+	if (bbr_state != NULL)
+	{
+		switch (notification)
+		{
+		case picoquic_congestion_notification_acknowledgement:
+			picoquic_bbr_update_round(cnx, bbr_state);
+			picoquic_bbr_update_btl_bw(cnx, bbr_state);
+			picoquic_bbr_check_full_pipe(cnx, bbr_state);
+			picoquic_bbr_check_drain(cnx, bbr_state, current_time);
+			picoquic_bbr_update_gain_cycle(cnx, bbr_state, current_time);
+			picoquic_bbr_check_probe_rtt(cnx, bbr_state, current_time);
+			picoquic_bbr_set_pacing_rate(cnx, bbr_state);
+			picoquic_bbr_set_cwin(cnx, bbr_state, nb_bytes_acknowledged);
+			break;
+		case picoquic_congestion_notification_rtt_measurement:
+			picoquic_bbr_update_min_rtt(bbr_state, rtt_measurement, current_time);
+			break;
+		case picoquic_congestion_notification_timeout:
+			/* Nothing was acknowledged for a full timer: restart from
+			 * the minimum window, which then grows back by the
+			 * acknowledged bytes */
+			cnx->cwin = PICOQUIC_BBR_CWIN_MINIMUM;
+			break;
+		case picoquic_congestion_notification_repeat:
+		case picoquic_congestion_notification_spurious_repeat:
+		default:
+			/* Losses do not change the model */
+			break;
+		}
+	}
+}
+
+/* Release the state of the congestion control algorithm, and stop pacing */
+void picoquic_bbr_delete(picoquic_cnx_t * cnx)
+{
+	cnx->pacing_rate = 0;
+
+	if (cnx->congestion_alg_state != NULL)
+	{
+		free(cnx->congestion_alg_state);
+		cnx->congestion_alg_state = NULL;
+	}
+}
+
+/* Definition record for the BBR algorithm */
+
+#define PICOQUIC_BBR_ID 0x42425231 /* BBR1 */
+
+picoquic_congestion_algorithm_t picoquic_bbr_algorithm_struct = {
+	PICOQUIC_BBR_ID,
+	picoquic_bbr_init,
+	picoquic_bbr_notify,
+	picoquic_bbr_delete
+};
+
+picoquic_congestion_algorithm_t * picoquic_bbr_algorithm = &picoquic_bbr_algorithm_struct;
@@ -0,0 +1,353 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2017, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+/*
+ * CUBIC, as specified in RFC 8312. After a loss, the window follows a cubic
+ * function of the time since the start of the epoch, centered on the window
+ * W_max at which the loss occurred: it grows fast when far below W_max,
+ * flattens around it, then grows fast again to probe for more bandwidth.
+ * The window never grows slower than New Reno would over the same period,
+ * the "TCP friendly" region.
+ *
+ * The cubic function is computed in packets of the current MTU, and in
+ * seconds.
+ */
+
+#define PICOQUIC_CUBIC_C 0.4
+#define PICOQUIC_CUBIC_BETA 0.7
+
+typedef enum
+{
+	picoquic_cubic_alg_slow_start = 0,
+	picoquic_cubic_alg_recovery,
+	picoquic_cubic_alg_congestion_avoidance
+} picoquic_cubic_alg_state_t;
+
+typedef struct st_picoquic_cubic_state_t {
+	picoquic_cubic_alg_state_t alg_state;
+	uint64_t ssthresh;
+	uint64_t recovery_start;
+	uint64_t recovery_sequence; /* losses of packets sent before that are ignored */
+	uint64_t epoch_start;
+	double w_max;
+	double w_last_max;
+	double k;
+	double w_est;
+	double residual_ack;
+	/* State before the last reduction, restored if the loss was spurious */
+	uint64_t loss_sequence;
+	uint64_t previous_cwin;
+	uint64_t previous_ssthresh;
+	double previous_w_max;
+	double previous_w_last_max;
+	picoquic_hystart_state_t hystart;
+} picoquic_cubic_state_t;
+
+/* Cube root by Newton's method, starting from an upper bound. This is
+ * only computed once per epoch. */
+static double picoquic_cubic_root(double x)
+{
+	double y = 1.0;
+
+	if (x <= 0)
+	{
+		return 0;
+	}
+
+	while (y * y * y < x)
+	{
+		y *= 2.0;
+	}
+
+	for (int i = 0; i < 32; i++)
+	{
+		y = (2.0 * y + x / (y * y)) / 3.0;
+	}
+
+	return y;
+}
+
+/* W_cubic(t) = C*(t-K)^3 + W_max */
+static double picoquic_cubic_w_cubic(picoquic_cubic_state_t * cubic_state, double t)
+{
+	double delta = t - cubic_state->k;
+
+	return PICOQUIC_CUBIC_C * delta * delta * delta + cubic_state->w_max;
+}
+
+/* A new epoch starts when entering congestion avoidance. If no loss was
+ * seen yet, the current window is the plateau. */
+static void picoquic_cubic_start_epoch(picoquic_cnx_t * cnx,
+	picoquic_cubic_state_t * cubic_state, uint64_t current_time)
+{
+	double w = (double)cnx->cwin / (double)cnx->send_mtu;
+
+	if (cubic_state->w_max < w)
+	{
+		cubic_state->w_max = w;
+	}
+
+	cubic_state->k = picoquic_cubic_root((cubic_state->w_max - w) / PICOQUIC_CUBIC_C);
+	cubic_state->w_est = w;
+	cubic_state->epoch_start = current_time;
+	cubic_state->residual_ack = 0;
+	cubic_state->alg_state = picoquic_cubic_alg_congestion_avoidance;
+}
+
+void picoquic_cubic_init(picoquic_cnx_t * cnx)
+{
+	/* Initialize the state of the congestion control algorithm */
+	picoquic_cubic_state_t * cubic_state = (picoquic_cubic_state_t *)malloc(sizeof(picoquic_cubic_state_t));
+	cnx->congestion_alg_state = (void *)cubic_state;
+
+	if (cubic_state != NULL)
+	{
+		memset(cubic_state, 0, sizeof(picoquic_cubic_state_t));
+		cubic_state->alg_state = picoquic_cubic_alg_slow_start;
+		cubic_state->ssthresh = (uint64_t)((int64_t)-1);
+		cnx->cwin = PICOQUIC_CWIN_INITIAL;
+		picoquic_hystart_init(cnx, &cubic_state->hystart);
+	}
+}
+
+/*
+ * On loss, W_max is set to the current window, or less if the window did
+ * not recover to the previous W_max (fast convergence), so that the flow
+ * releases bandwidth to newer flows. The window is then reduced by beta.
+ */
+static void picoquic_cubic_enter_recovery(picoquic_cnx_t * cnx,
+	picoquic_congestion_notification_t notification,
+	picoquic_cubic_state_t * cubic_state,
+	uint64_t lost_packet_number,
+	uint64_t current_time)
+{
+	double w = (double)cnx->cwin / (double)cnx->send_mtu;
+
+	cubic_state->loss_sequence = lost_packet_number;
+	cubic_state->previous_cwin = cnx->cwin;
+	cubic_state->previous_ssthresh = cubic_state->ssthresh;
+	cubic_state->previous_w_max = cubic_state->w_max;
+	cubic_state->previous_w_last_max = cubic_state->w_last_max;
+
+	cubic_state->w_max = w;
+	if (cubic_state->w_max < cubic_state->w_last_max)
+	{
+		cubic_state->w_last_max = cubic_state->w_max;
+		cubic_state->w_max = cubic_state->w_max * (1.0 + PICOQUIC_CUBIC_BETA) / 2.0;
+	}
+	else
+	{
+		cubic_state->w_last_max = cubic_state->w_max;
+	}
+
+	cubic_state->ssthresh = (uint64_t)(cnx->cwin * PICOQUIC_CUBIC_BETA);
+	if (cubic_state->ssthresh < PICOQUIC_CWIN_MINIMUM)
+	{
+		cubic_state->ssthresh = PICOQUIC_CWIN_MINIMUM;
+	}
+
+	if (notification == picoquic_congestion_notification_timeout)
+	{
+		cnx->cwin = PICOQUIC_CWIN_MINIMUM;
+	}
+	else
+	{
+		cnx->cwin = cubic_state->ssthresh;
+	}
+
+	cubic_state->recovery_start = current_time;
+	cubic_state->recovery_sequence = cnx->send_sequence;
+	cubic_state->alg_state = picoquic_cubic_alg_recovery;
+	cubic_state->hystart.phase = picoquic_hystart_exited;
+}
+
+/* Per RFC 8312, the window grows toward W_cubic(t+RTT), by at most half
+ * the window per RTT, unless New Reno would have grown it faster. */
+static void picoquic_cubic_congestion_avoidance(picoquic_cnx_t * cnx,
+	picoquic_cubic_state_t * cubic_state,
+	uint64_t nb_bytes_acknowledged,
+	uint64_t current_time)
+{
+	double mss = (double)cnx->send_mtu;
+	double w = (double)cnx->cwin / mss;
+	double t = (double)(current_time - cubic_state->epoch_start) / 1000000.0;
+	double rtt = (double)cnx->smoothed_rtt / 1000000.0;
+	double w_cubic = picoquic_cubic_w_cubic(cubic_state, t);
+	double increase;
+
+	/* A New Reno flow with the same reduction factor grows by
+	 * 3*(1-beta)/(1+beta) packets per RTT */
+	cubic_state->w_est += 3.0 * (1.0 - PICOQUIC_CUBIC_BETA) / (1.0 + PICOQUIC_CUBIC_BETA) *
+		(double)nb_bytes_acknowledged / (double)cnx->cwin;
+
+	if (w_cubic < cubic_state->w_est)
+	{
+		/* TCP friendly region */
+		increase = (cubic_state->w_est - w) * mss;
+	}
+	else
+	{
+		double target = picoquic_cubic_w_cubic(cubic_state, t + rtt);
+
+		if (target > 1.5 * w)
+		{
+			target = 1.5 * w;
+		}
+
+		increase = (target - w) * (double)nb_bytes_acknowledged / w;
+	}
+
+	if (increase > 0)
+	{
+		cubic_state->residual_ack += increase;
+		cnx->cwin += (uint64_t)cubic_state->residual_ack;
+		cubic_state->residual_ack -= (double)((uint64_t)cubic_state->residual_ack);
+	}
+}
+
+/*
+ * The notifications are handled as in New Reno, except for the growth of
+ * the window in congestion avoidance. Losses of packets sent before the
+ * last reduction do not cause a new one.
+ */
+void picoquic_cubic_notify(picoquic_cnx_t * cnx,
+	picoquic_congestion_notification_t notification,
+	uint64_t rtt_measurement,
+	uint64_t nb_bytes_acknowledged,
+	uint64_t lost_packet_number,
+	uint64_t current_time)
+{
+	picoquic_cubic_state_t * cubic_state = (picoquic_cubic_state_t *)cnx->congestion_alg_state;
+
+	if (cubic_state != NULL)
+	{
+		switch (notification)
+		{
+		case picoquic_congestion_notification_acknowledgement:
+			switch (cubic_state->alg_state)
+			{
+			case picoquic_cubic_alg_slow_start:
+				if (cubic_state->hystart.phase != picoquic_hystart_exited)
+				{
+					cnx->cwin += picoquic_hystart_notify_ack(cnx, &cubic_state->hystart, nb_bytes_acknowledged);
+					if (cubic_state->hystart.phase == picoquic_hystart_exited)
+					{
+						cubic_state->ssthresh = cnx->cwin;
+					}
+				}
+				else
+				{
+					cnx->cwin += nb_bytes_acknowledged;
+				}
+				/* if cnx->cwin exceeds SSTHRESH, exit and go to CA */
+				if (cnx->cwin >= cubic_state->ssthresh)
+				{
+					picoquic_cubic_start_epoch(cnx, cubic_state, current_time);
+				}
+				break;
+			case picoquic_cubic_alg_recovery:
+				/* The recovery state lasts 1 RTT, during which the window is frozen */
+				if (current_time - cubic_state->recovery_start > cnx->rtt_min)
+				{
+					if (cnx->cwin < cubic_state->ssthresh)
+					{
+						cubic_state->alg_state = picoquic_cubic_alg_slow_start;
+					}
+					else
+					{
+						picoquic_cubic_start_epoch(cnx, cubic_state, current_time);
+					}
+				}
+				break;
+			case picoquic_cubic_alg_congestion_avoidance:
+				picoquic_cubic_congestion_avoidance(cnx, cubic_state, nb_bytes_acknowledged, current_time);
+				break;
+			default:
+				break;
+			}
+			break;
+		case picoquic_congestion_notification_repeat:
+		case picoquic_congestion_notification_timeout:
+			if (lost_packet_number >= cubic_state->recovery_sequence)
+			{
+				picoquic_cubic_enter_recovery(cnx, notification, cubic_state, lost_packet_number, current_time);
+			}
+			break;
+		case picoquic_congestion_notification_spurious_repeat:
+			/* If the loss that caused the last reduction was spurious,
+			 * undo the reduction */
+			if (lost_packet_number == cubic_state->loss_sequence &&
+				cubic_state->previous_cwin > cnx->cwin)
+			{
+				cnx->cwin = cubic_state->previous_cwin;
+				cubic_state->ssthresh = cubic_state->previous_ssthresh;
+				cubic_state->w_max = cubic_state->previous_w_max;
+				cubic_state->w_last_max = cubic_state->previous_w_last_max;
+
+				if (cnx->cwin < cubic_state->ssthresh)
+				{
+					cubic_state->alg_state = picoquic_cubic_alg_slow_start;
+				}
+				else
+				{
+					picoquic_cubic_start_epoch(cnx, cubic_state, current_time);
+				}
+			}
+			break;
+		case picoquic_congestion_notification_rtt_measurement:
+			if (cubic_state->alg_state == picoquic_cubic_alg_slow_start)
+			{
+				picoquic_hystart_notify_rtt(&cubic_state->hystart, rtt_measurement);
+			}
+			break;
+		default:
+			/* ignore */
+			break;
+		}
+	}
+}
+
+/* Release the state of the congestion control algorithm */
+void picoquic_cubic_delete(picoquic_cnx_t * cnx)
+{
+	if (cnx->congestion_alg_state != NULL)
+	{
+		free(cnx->congestion_alg_state);
+		cnx->congestion_alg_state = NULL;
+	}
+}
+
+/* Definition record for the CUBIC algorithm */
+
+#define PICOQUIC_CUBIC_ID 0x43554249 /* CUBI */
+
+picoquic_congestion_algorithm_t picoquic_cubic_algorithm_struct = {
+	PICOQUIC_CUBIC_ID,
+	picoquic_cubic_init,
+	picoquic_cubic_notify,
+	picoquic_cubic_delete
+};
+
+picoquic_congestion_algorithm_t * picoquic_cubic_algorithm = &picoquic_cubic_algorithm_struct;
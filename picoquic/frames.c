@@ -24,38 +24,201 @@
 #include <string.h>
 #include "picoquic_internal.h"
 
+/*
+ * Stream index. Stream IDs are mostly allocated in sequence, so they are
+ * used directly as index in a dense array. The array doubles as needed,
+ * as long as it does not become too sparse compared to the number of
+ * streams. Streams with larger IDs are kept in a hash table, and moved
+ * to the array when it grows past their ID.
+ */
+static uint64_t picoquic_stream_id_hash(void * key)
+{
+    picoquic_stream_head * stream = (picoquic_stream_head *)key;
+
+    return stream->stream_id;
+}
+
+static int picoquic_stream_id_compare(void * key1, void * key2)
+{
+    picoquic_stream_head * stream1 = (picoquic_stream_head *)key1;
+    picoquic_stream_head * stream2 = (picoquic_stream_head *)key2;
+
+    return (stream1->stream_id == stream2->stream_id) ? 0 : -1;
+}
+
+static picoquic_stream_head * picoquic_stream_table_retrieve(picoquic_cnx_t * cnx, uint32_t stream_id)
+{
+    picoquic_stream_head * stream = NULL;
+
+    if (cnx->stream_table != NULL)
+    {
+        picoquic_stream_head key;
+        picohash_item * item;
+
+        key.stream_id = stream_id;
+        item = picohash_retrieve(cnx->stream_table, &key);
+
+        if (item != NULL)
+        {
+            stream = (picoquic_stream_head *)item->key;
+        }
+    }
+
+    return stream;
+}
+
+static int picoquic_grow_stream_index(picoquic_cnx_t * cnx, uint32_t stream_id)
+{
+    int ret = 0;
+    size_t new_size = (cnx->stream_index_size == 0) ? PICOQUIC_STREAM_INDEX_MIN : cnx->stream_index_size;
+    size_t size_max = PICOQUIC_STREAM_INDEX_MIN + PICOQUIC_STREAM_INDEX_DENSITY * (cnx->nb_streams + 1);
+
+    while (new_size <= stream_id)
+    {
+        new_size *= 2;
+    }
+
+    if (new_size > size_max)
+    {
+        /* Too sparse, leave this stream to the hash table */
+        ret = -1;
+    }
+    else
+    {
+        picoquic_stream_head ** new_index = (picoquic_stream_head **)realloc(cnx->stream_index,
+            new_size * sizeof(picoquic_stream_head *));
+
+        if (new_index == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            memset(new_index + cnx->stream_index_size, 0,
+                (new_size - cnx->stream_index_size) * sizeof(picoquic_stream_head *));
+
+            if (cnx->stream_table != NULL && cnx->stream_table->count > 0)
+            {
+                /* Move the streams now covered by the array out of the hash table */
+                picoquic_stream_head * stream = cnx->first_stream.next_stream;
+
+                while (stream != NULL && stream->stream_id < new_size)
+                {
+                    if (stream->stream_id >= cnx->stream_index_size)
+                    {
+                        picohash_item * item = picohash_retrieve(cnx->stream_table, stream);
+
+                        if (item != NULL)
+                        {
+                            picohash_item_delete(cnx->stream_table, item, 0);
+                        }
+                        new_index[stream->stream_id] = stream;
+                    }
+                    stream = stream->next_stream;
+                }
+            }
+
+            cnx->stream_index = new_index;
+            cnx->stream_index_size = new_size;
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_index_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    int ret = 0;
+
+    if (stream->stream_id < cnx->stream_index_size ||
+        picoquic_grow_stream_index(cnx, stream->stream_id) == 0)
+    {
+        cnx->stream_index[stream->stream_id] = stream;
+    }
+    else
+    {
+        if (cnx->stream_table == NULL)
+        {
+            cnx->stream_table = picohash_create(PICOQUIC_STREAM_INDEX_MIN,
+                picoquic_stream_id_hash, picoquic_stream_id_compare);
+        }
+
+        if (cnx->stream_table == NULL)
+        {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else
+        {
+            ret = picohash_insert(cnx->stream_table, stream);
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_delete_stream_index(picoquic_cnx_t * cnx)
+{
+    if (cnx->stream_index != NULL)
+    {
+        free(cnx->stream_index);
+        cnx->stream_index = NULL;
+    }
+    cnx->stream_index_size = 0;
+
+    if (cnx->stream_table != NULL)
+    {
+        picohash_delete(cnx->stream_table, 0);
+        cnx->stream_table = NULL;
+    }
+}
+
 picoquic_stream_head * picoquic_create_stream(picoquic_cnx_t * cnx, uint32_t stream_id)
 {
 	picoquic_stream_head * stream = (picoquic_stream_head *)malloc(sizeof(picoquic_stream_head));
 	if (stream != NULL)
 	{
-        picoquic_stream_head * previous_stream = NULL;
-        picoquic_stream_head * next_stream = cnx->first_stream.next_stream;
+        picoquic_stream_head * previous_stream = &cnx->first_stream;
 
 		memset(stream, 0, sizeof(picoquic_stream_head));
 		stream->stream_id = stream_id;
 		stream->maxdata_local = cnx->local_parameters.initial_max_stream_data;
 		stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data;
+		stream->priority = PICOQUIC_STREAM_PRIORITY_DEFAULT;
+		stream->weight = PICOQUIC_STREAM_WEIGHT_DEFAULT;
+		picoquic_sack_list_init(&stream->sack_list, PICOQUIC_STREAM_ACK_RANGE_MAX);
+		picoquic_sack_list_init(&stream->recv_ranges, PICOQUIC_STREAM_RECV_RANGE_MAX);
+		stream->is_app_read = cnx->is_app_read_default;
 
-        /*
-         * Make sure that the streams are open in order.
-         */
-
-        while (next_stream != NULL && next_stream->stream_id < stream_id)
-        {
-            previous_stream = next_stream;
-            next_stream = next_stream->next_stream;
-        }
-
-        stream->next_stream = next_stream;
-
-        if (previous_stream == NULL)
+        if (picoquic_index_stream(cnx, stream) != 0)
         {
-            cnx->first_stream.next_stream = stream;
+            free(stream);
+            stream = NULL;
         }
         else
         {
+            /*
+             * Make sure that the streams are open in order. Streams are
+             * mostly created in increasing order, so start from the last.
+             */
+            if (cnx->last_stream != NULL && cnx->last_stream->stream_id < stream_id)
+            {
+                previous_stream = cnx->last_stream;
+            }
+
+            while (previous_stream->next_stream != NULL &&
+                previous_stream->next_stream->stream_id < stream_id)
+            {
+                previous_stream = previous_stream->next_stream;
+            }
+
+            stream->next_stream = previous_stream->next_stream;
             previous_stream->next_stream = stream;
+
+            if (stream->next_stream == NULL)
+            {
+                cnx->last_stream = stream;
+            }
+            cnx->nb_streams++;
         }
 	}
 
@@ -64,18 +227,20 @@ picoquic_stream_head * picoquic_create_stream(picoquic_cnx_t * cnx, uint32_t str
 
 picoquic_stream_head * picoquic_find_stream(picoquic_cnx_t * cnx, uint32_t stream_id, int create)
 {
-	picoquic_stream_head * stream = &cnx->first_stream;
+	picoquic_stream_head * stream;
 
-	do {
-		if (stream->stream_id == stream_id)
-		{
-			break;
-		}
-		else
-		{
-			stream = stream->next_stream;
-		}
-	} while (stream);
+	if (stream_id == 0)
+	{
+		stream = &cnx->first_stream;
+	}
+	else if (stream_id < cnx->stream_index_size)
+	{
+		stream = cnx->stream_index[stream_id];
+	}
+	else
+	{
+		stream = picoquic_stream_table_retrieve(cnx, stream_id);
+	}
 
 	if (create != 0 && stream == NULL)
 	{
@@ -276,6 +441,7 @@ int picoquic_decode_stream_reset_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 					stream->remote_error = error_code;
 
 					ret = picoquic_flow_control_check_stream_offset(cnx, stream, final_offset);
+					picoquic_update_stream_max_data(cnx, stream);
 
 					if (ret == 0)
 					{
@@ -293,6 +459,7 @@ int picoquic_decode_stream_reset_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 						{
 							stream->local_error = PICOQUIC_TRANSPORT_ERROR_QUIC_RECEIVED_RST;
 							stream->stream_flags |= picoquic_stream_flag_reset_requested;
+							picoquic_update_stream_ready(cnx, stream);
 						}
 					}
 				}
@@ -344,36 +511,144 @@ int picoquic_decode_stream_reset_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
  */
 static const int picoquic_offset_length_code[4] = { 0, 2, 4, 8 };
 
+/*
+ * Copy bytes in the receive ring, at their offset modulo the ring size.
+ */
+static void picoquic_recv_ring_write(uint8_t * ring, size_t ring_size,
+	uint64_t offset, const uint8_t * bytes, size_t length)
+{
+	size_t index = (size_t)(offset & (ring_size - 1));
+	size_t first = ring_size - index;
+
+	if (first > length)
+	{
+		first = length;
+	}
+
+	memcpy(ring + index, bytes, first);
+	memcpy(ring, bytes + first, length - first);
+}
+
+/*
+ * Make sure that the ring covers the bytes up to end_offset. The ring size
+ * doubles as needed, and the buffered ranges are copied to the new ring.
+ */
+static int picoquic_recv_ring_reserve(picoquic_stream_head * stream, uint64_t end_offset)
+{
+	int ret = 0;
+	uint64_t needed = end_offset - stream->consumed_offset;
+
+	if (needed > stream->recv_ring_size)
+	{
+		size_t new_size = (stream->recv_ring_size == 0) ? PICOQUIC_STREAM_RECV_RING_MIN : stream->recv_ring_size;
+		uint8_t * new_ring;
+
+		while (new_size < needed)
+		{
+			new_size *= 2;
+		}
+
+		new_ring = (uint8_t *)malloc(new_size);
+
+		if (new_ring == NULL)
+		{
+			ret = PICOQUIC_ERROR_MEMORY;
+		}
+		else
+		{
+			for (size_t i = 0; i < stream->recv_ranges.nb_ranges; i++)
+			{
+				uint64_t offset = stream->recv_ranges.ranges[i].start_of_sack_range;
+				uint64_t range_end = stream->recv_ranges.ranges[i].end_of_sack_range + 1;
+
+				while (offset < range_end)
+				{
+					size_t index = (size_t)(offset & (stream->recv_ring_size - 1));
+					size_t length = stream->recv_ring_size - index;
+
+					if (length > range_end - offset)
+					{
+						length = (size_t)(range_end - offset);
+					}
+
+					picoquic_recv_ring_write(new_ring, new_size, offset, stream->recv_ring + index, length);
+					offset += length;
+				}
+			}
+
+			if (stream->recv_ring != NULL)
+			{
+				free(stream->recv_ring);
+			}
+			stream->recv_ring = new_ring;
+			stream->recv_ring_size = new_size;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Pass data at consumed_offset to the application, and signal the fin
+ * with the last bytes.
+ */
+static void picoquic_stream_deliver(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+	uint8_t * bytes, size_t length)
+{
+	picoquic_call_back_event_t fin_now = picoquic_callback_no_event;
+
+	stream->consumed_offset += length;
+
+	if (stream->consumed_offset >= stream->fin_offset &&
+		(stream->stream_flags&
+		(picoquic_stream_flag_fin_received | picoquic_stream_flag_fin_signalled)) ==
+		picoquic_stream_flag_fin_received)
+	{
+		fin_now = picoquic_callback_stream_fin;
+		stream->stream_flags |= picoquic_stream_flag_fin_signalled;
+	}
+
+	cnx->callback_fn(cnx, stream->stream_id, bytes, length, fin_now, cnx->callback_ctx);
+}
+
+/*
+ * Deliver the buffered ranges that became contiguous with consumed_offset,
+ * then the fin if it was not carried with data.
+ */
 void picoquic_stream_data_callback(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
 {
-	picoquic_stream_data * data = stream->stream_data;
+	picoquic_sack_list_t * recv_ranges = &stream->recv_ranges;
+	size_t nb_delivered = 0;
 
-	while (data != NULL && data->offset <= stream->consumed_offset)
+	while (nb_delivered < recv_ranges->nb_ranges &&
+		recv_ranges->ranges[nb_delivered].start_of_sack_range <= stream->consumed_offset)
 	{
-		size_t start = (size_t)(stream->consumed_offset - data->offset);
-		size_t data_length = data->length - start;
-		picoquic_call_back_event_t fin_now = picoquic_callback_no_event;
-		
-		stream->consumed_offset += data_length;
+		uint64_t range_end = recv_ranges->ranges[nb_delivered].end_of_sack_range + 1;
 
-		if (stream->consumed_offset >= stream->fin_offset &&
-			(stream->stream_flags&
-			(picoquic_stream_flag_fin_received | picoquic_stream_flag_fin_signalled)) ==
-			picoquic_stream_flag_fin_received)
+		while (stream->consumed_offset < range_end)
 		{
-			fin_now = picoquic_callback_stream_fin;
-			stream->stream_flags |= picoquic_stream_flag_fin_signalled;
+			size_t index = (size_t)(stream->consumed_offset & (stream->recv_ring_size - 1));
+			size_t length = stream->recv_ring_size - index;
+
+			if (length > range_end - stream->consumed_offset)
+			{
+				length = (size_t)(range_end - stream->consumed_offset);
+			}
+
+			picoquic_stream_deliver(cnx, stream, stream->recv_ring + index, length);
 		}
+		nb_delivered++;
+	}
 
-		cnx->callback_fn(cnx, stream->stream_id, data->bytes + start, data_length, fin_now,
-			cnx->callback_ctx);
-		
-		free(data->bytes);
-		stream->stream_data = data->next_stream_data;
-		free(data);
-		data = stream->stream_data;
+	if (nb_delivered > 0)
+	{
+		memmove(&recv_ranges->ranges[0], &recv_ranges->ranges[nb_delivered],
+			(recv_ranges->nb_ranges - nb_delivered) * sizeof(picoquic_sack_range_t));
+		recv_ranges->nb_ranges -= nb_delivered;
 	}
 
+	picoquic_update_stream_max_data(cnx, stream);
+
 	/* handle the case where the fin frame does not carry any data */
 
 	if (stream->consumed_offset >= stream->fin_offset &&
@@ -385,137 +660,252 @@ void picoquic_stream_data_callback(picoquic_cnx_t * cnx, picoquic_stream_head *
 			cnx->callback_ctx);
 		stream->stream_flags |= picoquic_stream_flag_fin_signalled;
 	}
+
+	if ((stream->stream_flags&picoquic_stream_flag_fin_signalled) != 0 && stream->recv_ring != NULL)
+	{
+		free(stream->recv_ring);
+		stream->recv_ring = NULL;
+		stream->recv_ring_size = 0;
+		picoquic_sack_list_free(recv_ranges);
+	}
 }
 
-int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint32_t stream_id,
-    uint64_t offset, int fin, uint8_t * bytes, size_t length, uint64_t current_time)
+/*
+ * Stream 0 data is queued in the stream data list, sorted by offset, until
+ * it is read by TLS.
+ */
+static int picoquic_stream_zero_input(picoquic_stream_head * stream,
+	uint64_t offset, uint8_t * bytes, size_t length)
 {
-    int ret = 0;
-	uint32_t should_notify = 0;
-    /* Is there such a stream, is it still open? */
-	picoquic_stream_head * stream = NULL; 
-	uint64_t new_fin_offset = offset + length;
+	int ret = 0;
+	picoquic_stream_data ** pprevious = &stream->stream_data;
+	picoquic_stream_data * next = stream->stream_data;
+	size_t start = 0;
 
-	ret = picoquic_find_or_create_stream(cnx, stream_id, &stream, 1);
-	
-	if (ret == 0)
+	if (offset <= stream->consumed_offset)
 	{
-		if ((stream->stream_flags&picoquic_stream_flag_fin_received) != 0)
+		if (offset + length <= stream->consumed_offset)
 		{
-			if (new_fin_offset > stream->fin_offset)
-			{
-				ret = -1;
-			}
-			else if (fin != 0 && stream->fin_offset != new_fin_offset)
-			{
-				ret = -1;
-			}
+			/* already received */
+			start = length;
 		}
-		else if (fin)
+		else
 		{
-			if (stream_id == 0)
-			{
-				ret = -1;
-			}
-			else
-			{
-				stream->stream_flags |= picoquic_stream_flag_fin_received;
-				should_notify = stream_id;
-                cnx->latest_progress_time = current_time;
-			}
+			start = (size_t)(stream->consumed_offset - offset);
 		}
 	}
 
-	if (ret == 0 && new_fin_offset > stream->fin_offset)
+	/* Queue of a block in the stream */
+
+	while (next != NULL && start < length && next->offset <= offset + start)
 	{
-		ret = picoquic_flow_control_check_stream_offset(cnx, stream, new_fin_offset);
+		if (offset + length <= next->offset + next->length)
+		{
+			start = length;
+		}
+		else if (offset < next->offset + next->length)
+		{
+			start = (size_t)(next->offset + next->length - offset);
+		}
+		pprevious = &next->next_stream_data;
+		next = next->next_stream_data;
 	}
 
-	if (ret == 0)
-    {
-        picoquic_stream_data ** pprevious = &stream->stream_data;
-        picoquic_stream_data * next = stream->stream_data;
-        size_t start = 0;
-
-        if (offset <= stream->consumed_offset)
-        {
-            if (offset + length <= stream->consumed_offset)
-            {
-                /* already received */
-                start = length;
-            }
-            else
-            {
-                start = (size_t)(stream->consumed_offset - offset);
-            }
-        }
-        
-        /* Queue of a block in the stream */
+	if (start < length)
+	{
+		size_t data_length = length - start;
 
-        while (next != NULL && start < length && next->offset <= offset + start )
-        {
-            if (offset + length <= next->offset + next->length)
-            {
-                start = length;
-            }
-            else if (offset < next->offset + next->length)
-            {
-                start = (size_t)(next->offset + next->length - offset);
-            }
-            pprevious = &next->next_stream_data;
-            next = next->next_stream_data;
-        }
+		if (next != NULL && next->offset < offset + length)
+		{
+			data_length -= (size_t)(offset + length - next->offset);
+		}
 
-		if (start < length)
+		if (data_length > 0)
 		{
-			size_t data_length = length - start;
+			picoquic_stream_data * data = (picoquic_stream_data*)malloc(sizeof(picoquic_stream_data));
 
-			if (next != NULL && next->offset < offset + length)
+			if (data == NULL)
 			{
-				data_length -= (size_t)(offset + length - next->offset);
+				ret = -1;
 			}
-
-			if (data_length > 0)
+			else
 			{
-				picoquic_stream_data * data = (picoquic_stream_data*)malloc(sizeof(picoquic_stream_data));
-
-				if (data == NULL)
+				data->length = data_length;
+				data->release_fn = NULL;
+				data->release_ctx = NULL;
+				data->is_pulled = 0;
+				data->bytes = (uint8_t *)malloc(data_length);
+				if (data->bytes == NULL)
 				{
 					ret = -1;
+					free(data);
 				}
 				else
 				{
-					data->length = data_length;
-					data->bytes = (uint8_t *)malloc(data_length);
-					if (data->bytes == NULL)
-					{
-						ret = -1;
-						free(data);
-					}
-					else
-					{
-						data->offset = offset + start;
-						memcpy(data->bytes, bytes + start, data_length);
-						data->next_stream_data = next;
-						*pprevious = data;
-						should_notify = stream_id; /* this way, do not notify stream 0 */
-                        cnx->latest_progress_time = current_time;
-					}
+					data->offset = offset + start;
+					memcpy(data->bytes, bytes + start, data_length);
+					data->next_stream_data = next;
+					*pprevious = data;
 				}
 			}
 		}
-    }
-
-	if (ret == 0 && should_notify != 0 && cnx->callback_fn != NULL)
-	{
-		/* check how much data there is to send */
-		picoquic_stream_data_callback(cnx, stream);
 	}
-    
-    return ret;
+
+	return ret;
 }
 
-int picoquic_decode_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
+/*
+ * End of the contiguous data that can be read from consumed_offset.
+ */
+uint64_t picoquic_stream_readable_offset(picoquic_stream_head * stream)
+{
+	return (stream->recv_ranges.nb_ranges > 0 &&
+		stream->recv_ranges.ranges[0].start_of_sack_range <= stream->consumed_offset) ?
+		stream->recv_ranges.ranges[0].end_of_sack_range + 1 : stream->consumed_offset;
+}
+
+/*
+ * Data on the other streams is passed to the application without copy
+ * when it arrives in order. Otherwise, or if the application reads the
+ * data itself, it is copied in the receive ring.
+ */
+static int picoquic_stream_reassembly_input(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+	uint64_t offset, uint8_t * bytes, size_t length)
+{
+	int ret = 0;
+	uint64_t end_offset = offset + length;
+
+	if (end_offset > stream->consumed_offset)
+	{
+		if (offset < stream->consumed_offset)
+		{
+			/* Skip the part already received */
+			bytes += (size_t)(stream->consumed_offset - offset);
+			offset = stream->consumed_offset;
+			length = (size_t)(end_offset - offset);
+		}
+
+		if (offset == stream->consumed_offset && cnx->callback_fn != NULL && !stream->is_app_read)
+		{
+			picoquic_stream_deliver(cnx, stream, bytes, length);
+		}
+		else if (picoquic_check_sack_list(&stream->recv_ranges, offset, end_offset - 1) == 0)
+		{
+			ret = picoquic_recv_ring_reserve(stream, end_offset);
+
+			if (ret == 0)
+			{
+				picoquic_recv_ring_write(stream->recv_ring, stream->recv_ring_size, offset, bytes, length);
+				ret = (picoquic_update_sack_list(&stream->recv_ranges, offset, end_offset - 1, NULL) < 0) ?
+					PICOQUIC_ERROR_MEMORY : 0;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * In application read mode, the data stays in the ring until read, and the
+ * application is told when the readable data or the fin progressed.
+ */
+static int picoquic_stream_app_read_input(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+	uint64_t offset, uint8_t * bytes, size_t length, int is_new_fin)
+{
+	uint64_t readable_before = picoquic_stream_readable_offset(stream);
+	int ret = picoquic_stream_reassembly_input(cnx, stream, offset, bytes, length);
+
+	if (ret == 0)
+	{
+		uint64_t readable = picoquic_stream_readable_offset(stream);
+
+		picoquic_update_stream_max_data(cnx, stream);
+
+		if (cnx->callback_fn != NULL &&
+			(readable > readable_before || (is_new_fin && readable >= stream->fin_offset)))
+		{
+			cnx->callback_fn(cnx, stream->stream_id, NULL, 0, picoquic_callback_stream_readable,
+				cnx->callback_ctx);
+		}
+	}
+
+	return ret;
+}
+
+int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint32_t stream_id,
+    uint64_t offset, int fin, uint8_t * bytes, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+    /* Is there such a stream, is it still open? */
+	picoquic_stream_head * stream = NULL; 
+	uint64_t new_fin_offset = offset + length;
+	int is_new_fin = 0;
+
+	ret = picoquic_find_or_create_stream(cnx, stream_id, &stream, 1);
+	
+	if (ret == 0)
+	{
+		if ((stream->stream_flags&picoquic_stream_flag_fin_received) != 0)
+		{
+			if (new_fin_offset > stream->fin_offset)
+			{
+				ret = -1;
+			}
+			else if (fin != 0 && stream->fin_offset != new_fin_offset)
+			{
+				ret = -1;
+			}
+		}
+		else if (fin)
+		{
+			if (stream_id == 0)
+			{
+				ret = -1;
+			}
+			else
+			{
+				stream->stream_flags |= picoquic_stream_flag_fin_received;
+				is_new_fin = 1;
+                cnx->latest_progress_time = current_time;
+			}
+		}
+	}
+
+	if (ret == 0 && new_fin_offset > stream->fin_offset)
+	{
+		ret = picoquic_flow_control_check_stream_offset(cnx, stream, new_fin_offset);
+	}
+
+	if (ret == 0 && new_fin_offset > stream->consumed_offset)
+	{
+		cnx->latest_progress_time = current_time;
+	}
+
+	if (ret == 0)
+	{
+		if (stream_id == 0)
+		{
+			ret = picoquic_stream_zero_input(stream, offset, bytes, length);
+		}
+		else if (stream->is_app_read)
+		{
+			ret = picoquic_stream_app_read_input(cnx, stream, offset, bytes, length, is_new_fin);
+		}
+		else
+		{
+			ret = picoquic_stream_reassembly_input(cnx, stream, offset, bytes, length);
+
+			if (ret == 0 && cnx->callback_fn != NULL)
+			{
+				picoquic_stream_data_callback(cnx, stream);
+			}
+		}
+	}
+    
+    return ret;
+}
+
+int picoquic_decode_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
     size_t bytes_max, int restricted, size_t * consumed, uint64_t current_time)
 {
     int ret = 0;
@@ -607,199 +997,710 @@ int picoquic_decode_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 }
 
 
+/*
+ * Stream queues. Both queues are kept in arrival order, so a stream is
+ * queued in constant time. The order in which the ready streams are served
+ * is set by the stream scheduler.
+ */
+static void picoquic_stream_queue_insert(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+	picoquic_stream_queue_enum queue_id)
+{
+	picoquic_stream_queue_t * queue = &cnx->stream_queue[queue_id];
+	picoquic_stream_link_t * link = &stream->queue_link[queue_id];
+
+	if (!link->is_queued)
+	{
+		link->previous = queue->last;
+		link->next = NULL;
+
+		if (queue->last == NULL)
+		{
+			queue->first = stream;
+		}
+		else
+		{
+			queue->last->queue_link[queue_id].next = stream;
+		}
+		queue->last = stream;
+
+		link->is_queued = 1;
+	}
+}
+
+static void picoquic_stream_queue_remove(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+	picoquic_stream_queue_enum queue_id)
+{
+	picoquic_stream_queue_t * queue = &cnx->stream_queue[queue_id];
+	picoquic_stream_link_t * link = &stream->queue_link[queue_id];
+
+	if (link->is_queued)
+	{
+		if (link->previous == NULL)
+		{
+			queue->first = link->next;
+		}
+		else
+		{
+			link->previous->queue_link[queue_id].next = link->next;
+		}
+
+		if (link->next == NULL)
+		{
+			queue->last = link->previous;
+		}
+		else
+		{
+			link->next->queue_link[queue_id].previous = link->previous;
+		}
+
+		link->next = NULL;
+		link->previous = NULL;
+		link->is_queued = 0;
+	}
+}
+
+/*
+ * A stream is pulled when its queued data is all sent, and the next data
+ * is obtained from the provider of the application.
+ */
+static int picoquic_is_stream_pulled(picoquic_stream_head * stream)
+{
+	return (stream->provider_fn != NULL && stream->is_active &&
+		(stream->stream_flags&picoquic_stream_flag_fin_notified) == 0 &&
+		stream->sent_offset >= stream->queued_offset);
+}
+
+/*
+ * A stream is ready if it has a reset to send, data to send or to pull
+ * within the stream flow control limit, or a fin to send after all the data.
+ * Streams opened locally also have to be under the max stream id limit.
+ * The connection flow control is checked when picking the next stream.
+ */
+static int picoquic_is_stream_ready(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	int is_ready = 0;
+
+	if ((stream->stream_flags&picoquic_stream_flag_reset_requested) != 0)
+	{
+		is_ready = (stream->stream_flags&picoquic_stream_flag_reset_sent) == 0;
+	}
+	else if (((stream->sent_offset < stream->queued_offset || picoquic_is_stream_pulled(stream)) &&
+		(stream->stream_id == 0 ||
+		stream->sent_offset < stream->maxdata_remote)) ||
+		(stream->sent_offset >= stream->queued_offset &&
+		(stream->stream_flags&picoquic_stream_flag_fin_notified) != 0 &&
+		(stream->stream_flags&picoquic_stream_flag_fin_sent) == 0))
+	{
+		if (stream->stream_id == 0)
+		{
+			is_ready = 1;
+		}
+		else
+		{
+			/* Check parity */
+			int parity = ((cnx->quic->flags&picoquic_context_server) == 0) ? 0 : 1;
+
+			if (((stream->stream_id & 1) ^ parity) == 1)
+			{
+				/* if the stream is not active yet, verify that it fits under
+				 * the max stream id limit */
+				is_ready = stream->stream_id < cnx->max_stream_id_remote;
+			}
+			else
+			{
+				is_ready = 1;
+			}
+		}
+	}
+
+	return is_ready;
+}
+
+/* Streams entering or leaving the ready queue are passed to the scheduler */
+static void picoquic_ready_queue_insert(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	if (!stream->queue_link[picoquic_stream_queue_ready].is_queued)
+	{
+		picoquic_stream_queue_insert(cnx, stream, picoquic_stream_queue_ready);
+
+		if (stream->stream_id != 0 && cnx->stream_scheduler != NULL)
+		{
+			cnx->stream_scheduler->sched_add(cnx, stream);
+		}
+	}
+}
+
+static void picoquic_ready_queue_remove(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_stream_queue_remove(cnx, stream, picoquic_stream_queue_ready);
+
+	if (stream->stream_id != 0 && cnx->stream_scheduler != NULL)
+	{
+		cnx->stream_scheduler->sched_remove(cnx, stream);
+	}
+}
+
+/*
+ * A stream has unsent data if data is queued or can be pulled, even if it
+ * is blocked by flow control.
+ */
+static int picoquic_is_stream_unsent(picoquic_stream_head * stream)
+{
+	return stream->sent_offset < stream->queued_offset || picoquic_is_stream_pulled(stream);
+}
+
+/*
+ * Update the position of the stream in the ready queue, and the count of
+ * streams with unsent data. This is called when data is queued, when credit
+ * arrives, and after sending.
+ */
+void picoquic_update_stream_ready(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	int is_unsent = picoquic_is_stream_unsent(stream);
+
+	if (stream->stream_id != 0 && is_unsent != stream->is_unsent)
+	{
+		stream->is_unsent = is_unsent;
+		if (is_unsent)
+		{
+			cnx->nb_streams_unsent++;
+		}
+		else
+		{
+			cnx->nb_streams_unsent--;
+		}
+	}
+
+	if (picoquic_is_stream_ready(cnx, stream))
+	{
+		picoquic_ready_queue_insert(cnx, stream);
+	}
+	else
+	{
+		picoquic_ready_queue_remove(cnx, stream);
+	}
+}
+
+/* Used when a change of the connection state, such as a new max stream id, affects all streams */
+void picoquic_update_all_streams_ready(picoquic_cnx_t * cnx)
+{
+	picoquic_stream_head * stream = &cnx->first_stream;
+
+	while (stream != NULL)
+	{
+		picoquic_update_stream_ready(cnx, stream);
+		stream = stream->next_stream;
+	}
+}
+
+static int picoquic_stream_needs_max_data(picoquic_stream_head * stream)
+{
+	return (stream->stream_id != 0 &&
+		(stream->stream_flags&(picoquic_stream_flag_fin_received |
+			picoquic_stream_flag_reset_received)) == 0 &&
+		2 * stream->consumed_offset > stream->maxdata_local);
+}
+
+/*
+ * Update the position of the stream in the max data queue, after the
+ * application consumed data or a new limit was sent.
+ */
+void picoquic_update_stream_max_data(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	if (picoquic_stream_needs_max_data(stream))
+	{
+		picoquic_stream_queue_insert(cnx, stream, picoquic_stream_queue_max_data);
+	}
+	else
+	{
+		picoquic_stream_queue_remove(cnx, stream, picoquic_stream_queue_max_data);
+	}
+}
+
+/*
+ * Walk the ready queue, starting after the specified stream, or at the
+ * start of the queue if the stream is NULL. The streams that stopped
+ * being ready without an update, e.g. after a reset, are dropped on
+ * the way.
+ */
+picoquic_stream_head * picoquic_next_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	stream = (stream == NULL) ? cnx->stream_queue[picoquic_stream_queue_ready].first :
+		stream->queue_link[picoquic_stream_queue_ready].next;
+
+	while (stream != NULL && !picoquic_is_stream_ready(cnx, stream))
+	{
+		picoquic_stream_head * next = stream->queue_link[picoquic_stream_queue_ready].next;
+
+		picoquic_ready_queue_remove(cnx, stream);
+		stream = next;
+	}
+
+	return stream;
+}
+
 picoquic_stream_head * picoquic_find_ready_stream(picoquic_cnx_t * cnx, int restricted)
 {
 	picoquic_stream_head * stream = &cnx->first_stream;
 
 	if (restricted == 0 && cnx->maxdata_remote > cnx->data_sent)
 	{
-		do {
-			if ((stream->send_queue != NULL &&
-				stream->send_queue->length > stream->send_queue->offset &&
-				(stream->stream_id == 0 ||
-				stream->sent_offset < stream->maxdata_remote)) ||
-				((stream->stream_flags&picoquic_stream_flag_fin_notified) != 0 &&
-				(stream->stream_flags&picoquic_stream_flag_fin_sent) == 0) ||
-				((stream->stream_flags&picoquic_stream_flag_reset_requested) != 0 &&
-				(stream->stream_flags&picoquic_stream_flag_reset_sent) == 0))
+		/* Stream 0 comes first if it is ready. The other streams are
+		 * picked by the scheduler, and those that stopped being ready
+		 * without an update are dropped on the way. The ready queue is
+		 * the fallback if the scheduler lost track of a stream, e.g. after
+		 * a memory allocation failure, or if there is no scheduler. */
+		if (!picoquic_is_stream_ready(cnx, stream))
+		{
+			if (cnx->stream_scheduler != NULL)
 			{
-				/* if the stream is not active yet, verify that it fits under
-				 * the max stream id limit */
+				while ((stream = cnx->stream_scheduler->sched_next(cnx)) != NULL &&
+					!picoquic_is_stream_ready(cnx, stream))
+				{
+					picoquic_ready_queue_remove(cnx, stream);
+				}
+			}
+			else
+			{
+				stream = NULL;
+			}
+
+			if (stream == NULL)
+			{
+				stream = picoquic_next_ready_stream(cnx, NULL);
+			}
+		}
+	}
+	else
+	{
+		if (stream->sent_offset >= stream->queued_offset &&
+			((stream->stream_flags&picoquic_stream_flag_fin_notified) == 0 ||
+			(stream->stream_flags&picoquic_stream_flag_fin_sent) != 0) &&
+				((stream->stream_flags&picoquic_stream_flag_reset_requested) == 0 ||
+			(stream->stream_flags&picoquic_stream_flag_reset_sent) != 0))
+		{
+			stream = NULL;
+		}
+	}
+
+	return stream;
+}
+
+/*
+ * Check whether any stream still has data to send, even if it is
+ * blocked by flow control. A sender that is only blocked by flow control
+ * is limited by the peer, not by the application. The other streams are
+ * counted as they are updated, and stream 0, which is reset with the
+ * handshake, is checked directly.
+ */
+int picoquic_has_unsent_stream_data(picoquic_cnx_t * cnx)
+{
+	return cnx->nb_streams_unsent > 0 || picoquic_is_stream_unsent(&cnx->first_stream);
+}
+
+/*
+ * Encode the stream frame header, up to and including the 16 bit length
+ * field, which is filled later. Returns the length of the header, or zero
+ * if the header does not fit in the buffer.
+ */
+static size_t picoquic_encode_stream_frame_header(uint32_t stream_id, uint64_t offset,
+    uint8_t * bytes, size_t bytes_max)
+{
+    size_t byte_index = 1;
+    uint8_t ss_bits = 0;
+    uint8_t oo_bits = 0;
+
+    if (bytes_max < 1 + 4 + 8 + 2)
+    {
+        /* Check the exact length before giving up */
+        size_t needed = 1 + 2;
+
+        needed += (stream_id < 256) ? 1 : ((stream_id < 0x10000) ? 2 : 4);
+        needed += (offset == 0) ? 0 : ((offset < 0x10000) ? 2 : ((offset < 0x100000000ull) ? 4 : 8));
+
+        if (bytes_max < needed)
+        {
+            return 0;
+        }
+    }
+
+    /*
+     * Encode the stream ID length
+     */
+    if (stream_id < 256)
+    {
+        bytes[byte_index++] = (uint8_t)stream_id;
+        ss_bits = 0;
+    }
+    else if (stream_id < 0x10000)
+    {
+        picoformat_16(&bytes[byte_index], (uint16_t)stream_id);
+        byte_index += 2;
+        ss_bits = 1;
+    }
+    else
+    {
+        picoformat_32(&bytes[byte_index], (uint32_t)stream_id);
+        byte_index += 4;
+        ss_bits = 3;
+    }
+    /*
+     * Encode the offset
+     */
+    if (offset > 0)
+    {
+        if (offset < 0x10000)
+        {
+            picoformat_16(&bytes[byte_index], (uint16_t)offset);
+            byte_index += 2;
+            oo_bits = 1;
+        }
+        else if (offset < 0x100000000ull)
+        {
+            picoformat_32(&bytes[byte_index], (uint32_t)offset);
+            byte_index += 4;
+            oo_bits = 2;
+        }
+        else
+        {
+            picoformat_64(&bytes[byte_index], offset);
+            byte_index += 8;
+            oo_bits = 3;
+        }
+    }
+
+    bytes[0] = 0xC1 | (ss_bits << 3) | (oo_bits << 1);
+
+    /* Leave room for the length */
+    return byte_index + 2;
+}
+
+/*
+ * Copy data from the stream send queue, starting at the specified stream offset.
+ * The caller verifies that the data is still queued.
+ */
+static void picoquic_copy_queued_stream_data(picoquic_stream_head * stream,
+    uint64_t offset, uint8_t * bytes, size_t length)
+{
+    picoquic_stream_data * data = (stream->send_next != NULL && stream->send_next->offset <= offset) ?
+        stream->send_next : stream->send_queue;
+
+    while (length > 0 && data != NULL)
+    {
+        if (data->offset + data->length <= offset)
+        {
+            data = data->next_stream_data;
+        }
+        else
+        {
+            size_t start = (size_t)(offset - data->offset);
+            size_t copied = data->length - start;
+
+            if (copied > length)
+            {
+                copied = length;
+            }
+            memcpy(bytes, data->bytes + start, copied);
+            bytes += copied;
+            offset += copied;
+            length -= copied;
+        }
+    }
+}
+
+/*
+ * Pulled data is kept in chunks that hold the header and up to a packet of
+ * bytes in a single allocation. The chunks are recycled through a pool of
+ * the connection once acknowledged, so a stream that is pulled does not
+ * allocate memory for each frame.
+ */
+static picoquic_stream_data * picoquic_create_pulled_data(picoquic_cnx_t * cnx)
+{
+    picoquic_stream_data * stream_data = cnx->pulled_data_pool;
+
+    if (stream_data != NULL)
+    {
+        cnx->pulled_data_pool = stream_data->next_stream_data;
+        cnx->pulled_data_pool_size--;
+    }
+    else
+    {
+        stream_data = (picoquic_stream_data *)malloc(sizeof(picoquic_stream_data) + PICOQUIC_MAX_PACKET_SIZE);
+    }
+
+    if (stream_data != NULL)
+    {
+        stream_data->next_stream_data = NULL;
+        stream_data->bytes = (uint8_t *)(stream_data + 1);
+        stream_data->release_fn = NULL;
+        stream_data->release_ctx = NULL;
+        stream_data->is_pulled = 1;
+    }
+
+    return stream_data;
+}
+
+static void picoquic_release_stream_data(picoquic_cnx_t * cnx, picoquic_stream_data * stream_data)
+{
+    if (stream_data->is_pulled && cnx->pulled_data_pool_size < PICOQUIC_PULLED_DATA_POOL_MAX)
+    {
+        stream_data->next_stream_data = cnx->pulled_data_pool;
+        cnx->pulled_data_pool = stream_data;
+        cnx->pulled_data_pool_size++;
+    }
+    else
+    {
+        picoquic_free_stream_data(stream_data);
+    }
+}
+
+/*
+ * Get data from the provider of the application, directly in the packet.
+ * A copy is appended to the send queue and kept until acknowledged, so that
+ * the data can be repeated if lost: the packet itself is encrypted in place.
+ */
+static int picoquic_pull_stream_data(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+    uint8_t * bytes, size_t * length)
+{
+    int ret = 0;
+    int is_fin = 0;
+    size_t pulled;
+
+    if (*length > PICOQUIC_MAX_PACKET_SIZE)
+    {
+        *length = PICOQUIC_MAX_PACKET_SIZE;
+    }
+
+    pulled = stream->provider_fn(cnx, stream->stream_id, bytes, *length, &is_fin, stream->provider_ctx);
+
+    if (pulled > 0)
+    {
+        picoquic_stream_data * stream_data = picoquic_create_pulled_data(cnx);
+
+        if (stream_data == NULL)
+        {
+            ret = PICOQUIC_ERROR_MEMORY;
+            pulled = 0;
+        }
+        else
+        {
+            memcpy(stream_data->bytes, bytes, pulled);
+            stream_data->length = pulled;
+            stream_data->offset = stream->queued_offset;
 
-				if (stream->stream_id == 0)
-				{
-					break;
-				}
-				else
-				{
-					/* Check parity */
-					int parity = ((cnx->quic->flags&picoquic_context_server) == 0) ? 0 : 1;
+            if (stream->send_queue_last == NULL)
+            {
+                stream->send_queue = stream_data;
+            }
+            else
+            {
+                stream->send_queue_last->next_stream_data = stream_data;
+            }
+            stream->send_queue_last = stream_data;
+            stream->queued_offset += pulled;
 
-					if (((stream->stream_id & 1) ^ parity) == 1)
-					{
-						if (stream->stream_id < cnx->max_stream_id_remote)
-						{
-							break;
-						}
-					}
-					else
-					{
-						break;
-					}
-				}
-			}
+            if (stream->send_next == NULL)
+            {
+                stream->send_next = stream_data;
+            }
+        }
+    }
 
-			stream = stream->next_stream;
+    if (ret == 0)
+    {
+        if (is_fin)
+        {
+            stream->stream_flags |= picoquic_stream_flag_fin_notified;
+        }
+        else if (pulled == 0)
+        {
+            /* Nothing to send until the application marks the stream active again */
+            stream->is_active = 0;
+        }
+    }
 
-		} while (stream);
-	}
-	else
-	{
-		if ((stream->send_queue == NULL ||
-			stream->send_queue->length <= stream->send_queue->offset) &&
-			((stream->stream_flags&picoquic_stream_flag_fin_notified) == 0 ||
-			(stream->stream_flags&picoquic_stream_flag_fin_sent) != 0) &&
-				((stream->stream_flags&picoquic_stream_flag_reset_requested) == 0 ||
-			(stream->stream_flags&picoquic_stream_flag_reset_sent) != 0))
-		{
-			stream = NULL;
-		}
-	}
+    *length = pulled;
 
-	return stream;
+    return ret;
 }
 
 int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
-    uint8_t * bytes, size_t bytes_max, size_t * consumed)
+    uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent)
 {
     int ret = 0;
-    size_t byte_index = 1;
-    uint8_t ss_bits = 0;
-    uint8_t oo_bits = 0;
+    size_t byte_index = 0;
     size_t length;
+    int is_pulled = picoquic_is_stream_pulled(stream);
 
 	if ((stream->stream_flags&picoquic_stream_flag_reset_requested) != 0)
 	{
-		return picoquic_prepare_stream_reset_frame(cnx, stream, bytes, bytes_max, consumed);
+		ret = picoquic_prepare_stream_reset_frame(cnx, stream, bytes, bytes_max, consumed);
+
+		if (ret == 0 && *consumed > 0)
+		{
+			picoquic_record_sent_frame(sent, picoquic_sent_frame_reset_stream,
+				stream->stream_id, stream->sent_offset, 0, 0);
+		}
+
+		picoquic_update_stream_ready(cnx, stream);
+
+		return ret;
 	}
 
-    if ((stream->send_queue == NULL ||
-        stream->send_queue->length <= stream->send_queue->offset) &&
+    if (!is_pulled && stream->sent_offset >= stream->queued_offset &&
 		((stream->stream_flags&picoquic_stream_flag_fin_notified) == 0 ||
 		(stream->stream_flags&picoquic_stream_flag_fin_sent) != 0))
     {
         *consumed = 0;
     }
+    else if ((byte_index = picoquic_encode_stream_frame_header(stream->stream_id, stream->sent_offset,
+        bytes, bytes_max)) == 0)
+    {
+        *consumed = 0;
+    }
     else
     {
-        /*
-         * Encode the stream ID length
-         */
-        if (stream->stream_id < 256)
-        {
-            bytes[byte_index++] = (uint8_t)stream->stream_id;
-            ss_bits = 0;
-        }
-        else if (stream->stream_id < 0x10000)
-        {
-            picoformat_16(&bytes[byte_index], (uint16_t)stream->stream_id);
-            byte_index += 2;
-            ss_bits = 1;
-        }
-        else
-        {
-            picoformat_32(&bytes[byte_index], (uint32_t)stream->stream_id);
-            byte_index += 4;
-            ss_bits = 3;
-        }
-        /*
-         * Encode the offset
-         */
-        if (stream->sent_offset > 0)
-        {
-            if (stream->sent_offset < 0x10000)
-            {
-                picoformat_16(&bytes[byte_index], (uint16_t)stream->sent_offset);
-                byte_index += 2;
-                oo_bits = 1;
-            }
-            else if (stream->sent_offset < 0x100000000ull)
-            {
-                picoformat_32(&bytes[byte_index], (uint32_t)stream->sent_offset);
-                byte_index += 4;
-                oo_bits = 2;
-            }
-            else
-            {
-                picoformat_64(&bytes[byte_index], stream->sent_offset);
-                byte_index += 8;
-                oo_bits = 3;
-            }
-        }
+        uint64_t offset = stream->sent_offset;
+        int fin = 0;
+
         /*
          * Compute the available length
          */
-        length = bytes_max - byte_index - 2;
+        length = bytes_max - byte_index;
 
-        if (stream->send_queue == NULL)
+        if (!is_pulled && length > stream->queued_offset - stream->sent_offset)
         {
-            length = 0;
+            length = (size_t)(stream->queued_offset - stream->sent_offset);
         }
-        else
-        {
-            size_t available = (size_t)(stream->send_queue->length - stream->send_queue->offset);
-
-            if (available < length)
-            {
-                length = available;
-            }
 
-			/* Abide by flow control and packet size  restrictions */
-			if (stream->stream_id != 0)
+		/* Abide by flow control and packet size  restrictions */
+		if (stream->stream_id != 0)
+		{
+			if (length > (cnx->maxdata_remote - cnx->data_sent))
 			{
-				if (length > (cnx->maxdata_remote - cnx->data_sent))
-				{
-					length = (size_t)(cnx->maxdata_remote - cnx->data_sent);
-				}
+				length = (size_t)(cnx->maxdata_remote - cnx->data_sent);
+			}
 
-				if (length > (stream->maxdata_remote - stream->sent_offset))
-				{
-					length = (size_t)(stream->maxdata_remote - stream->sent_offset);
-				}
+			if (length > (stream->maxdata_remote - stream->sent_offset))
+			{
+				length = (size_t)(stream->maxdata_remote - stream->sent_offset);
 			}
+		}
+
+        if (is_pulled && length > 0)
+        {
+            ret = picoquic_pull_stream_data(cnx, stream, &bytes[byte_index], &length);
+        }
+
+        if (ret != 0 || (is_pulled && length == 0 &&
+            (stream->stream_flags&picoquic_stream_flag_fin_notified) == 0))
+        {
+            /* The provider had nothing to send */
+            *consumed = 0;
+            picoquic_update_stream_ready(cnx, stream);
+
+            return ret;
         }
 
         /* Encode the length */
-        picoformat_16(&bytes[byte_index], (uint16_t)length);
-        byte_index += 2;
+        picoformat_16(&bytes[byte_index - 2], (uint16_t)length);
 
         if (length > 0)
         {
-            memcpy(&bytes[byte_index], stream->send_queue->bytes + stream->send_queue->offset, length);
-            byte_index += length;
-
-            stream->send_queue->offset += length;
-            if (stream->send_queue->offset >= stream->send_queue->length)
+            /* The data stays queued until acknowledged */
+            if (!is_pulled)
             {
-                picoquic_stream_data * next = stream->send_queue->next_stream_data;
-                free(stream->send_queue->bytes);
-                free(stream->send_queue);
-                stream->send_queue = next;
+                picoquic_copy_queued_stream_data(stream, stream->sent_offset, &bytes[byte_index], length);
             }
+            byte_index += length;
 
             stream->sent_offset += length;
 			cnx->data_sent += length;
+
+            while (stream->send_next != NULL &&
+                stream->send_next->offset + stream->send_next->length <= stream->sent_offset)
+            {
+                stream->send_next = stream->send_next->next_stream_data;
+            }
         }
 
-        bytes[0] = 0xC1 | (ss_bits << 3) | (oo_bits << 1);
 		if ((stream->stream_flags&picoquic_stream_flag_fin_notified) != 0 &&
-			stream->send_queue == 0)
+			stream->sent_offset >= stream->queued_offset)
 		{
 			/* Set the fin bit */
 			stream->stream_flags |= picoquic_stream_flag_fin_sent;
 			bytes[0] |= 0x20;
+			fin = 1;
 		}
         *consumed = byte_index;
+
+        picoquic_record_sent_frame(sent, picoquic_sent_frame_stream,
+            stream->stream_id, offset, length, fin);
+
+        if (stream->stream_id != 0 && cnx->stream_scheduler != NULL)
+        {
+            cnx->stream_scheduler->sched_notify(cnx, stream, length);
+        }
+    }
+
+    picoquic_update_stream_ready(cnx, stream);
+
+    return ret;
+}
+
+/*
+ * Repeat the data of a lost stream frame. The bytes that were acknowledged
+ * in the meantime, and thus are not queued anymore, are not repeated.
+ */
+static int picoquic_prepare_repeated_stream_frame(picoquic_cnx_t * cnx, picoquic_sent_frame_t * frame,
+    uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent)
+{
+    int ret = 0;
+    picoquic_stream_head * stream = picoquic_find_stream(cnx, frame->stream_id, 0);
+    uint64_t offset = frame->offset;
+    size_t length = frame->length;
+    size_t byte_index;
+
+    *consumed = 0;
+
+    if (stream != NULL && (stream->stream_flags&picoquic_stream_flag_reset_requested) == 0)
+    {
+        if (stream->send_queue == NULL ||
+            stream->send_queue->offset >= offset + length)
+        {
+            /* All the data was acknowledged, only the fin may need repeating */
+            offset += length;
+            length = 0;
+        }
+        else if (stream->send_queue->offset > offset)
+        {
+            length -= (size_t)(stream->send_queue->offset - offset);
+            offset = stream->send_queue->offset;
+        }
+
+        if (length > 0 || frame->fin)
+        {
+            byte_index = picoquic_encode_stream_frame_header(frame->stream_id, offset, bytes, bytes_max);
+
+            if (byte_index == 0 || byte_index + length > bytes_max)
+            {
+                ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+            }
+            else
+            {
+                picoformat_16(&bytes[byte_index - 2], (uint16_t)length);
+                picoquic_copy_queued_stream_data(stream, offset, &bytes[byte_index], length);
+                byte_index += length;
+                if (frame->fin)
+                {
+                    bytes[0] |= 0x20;
+                }
+                *consumed = byte_index;
+
+                picoquic_record_sent_frame(sent, picoquic_sent_frame_stream,
+                    frame->stream_id, offset, length, frame->fin);
+            }
+        }
     }
 
     return ret;
@@ -830,10 +1731,11 @@ An ACK frame is shown below.
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 */
 
-static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t largest,
+static void picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t largest,
 	uint64_t current_time, uint64_t ack_delay)
 {
-	picoquic_packet * packet = cnx->retransmit_newest;
+	picoquic_sent_packet_t * packet = NULL;
+	picoquic_ack_only_packet_t * ack_only = NULL;
 
 	/* Check whether this is a new acknowledgement */
 	if (largest > cnx->highest_acknowledged )
@@ -844,13 +1746,13 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 		{
 			/* if the ACK is reasonably recent, use it to update the RTT */
 			/* find the stored copy of the largest acknowledged packet */
-
-			while (packet != NULL && packet->sequence_number > largest)
+			packet = picoquic_find_sent_packet(cnx, largest);
+			if (packet == NULL)
 			{
-				packet = packet->next_packet;
+				ack_only = picoquic_find_ack_only_packet(cnx, largest);
 			}
 
-			if (packet == NULL || packet->sequence_number < largest)
+			if (packet == NULL && ack_only == NULL)
 			{
 				/* There is no copy of this packet in store.
 				 * This can only come from some kind of fake acknowledgement,
@@ -860,21 +1762,24 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 			}
 			else
 			{
+				uint64_t send_time = (packet != NULL) ? packet->send_time : ack_only->send_time;
 				uint64_t acknowledged_time = current_time - ack_delay;
-				int64_t rtt_estimate = acknowledged_time - packet->send_time;
+				int64_t rtt_estimate = acknowledged_time - send_time;
 
-				cnx->latest_time_acknowledged = packet->send_time;
+				cnx->latest_time_acknowledged = send_time;
                 cnx->latest_progress_time = current_time;
 
 				if (rtt_estimate > 0)
 				{
+					cnx->latest_rtt = rtt_estimate;
+
 					if (cnx->smoothed_rtt == PICOQUIC_INITIAL_RTT &&
 						cnx->rtt_variant == 0)
 					{
 						cnx->smoothed_rtt = rtt_estimate;
 						cnx->rtt_variant = rtt_estimate / 2;
 						cnx->rtt_min = rtt_estimate;
-						cnx->retransmit_timer = 3 * rtt_estimate;
+						cnx->retransmit_timer = 3 * rtt_estimate + PICOQUIC_MAX_ACK_DELAY;
 					}
 					else
 					{
@@ -892,7 +1797,7 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 						}
 						cnx->rtt_variant += delta_rtt_average / 4;
 
-						cnx->retransmit_timer = cnx->smoothed_rtt + 4 * cnx->rtt_variant;
+						cnx->retransmit_timer = cnx->smoothed_rtt + 4 * cnx->rtt_variant + PICOQUIC_MAX_ACK_DELAY;
 
 						if (rtt_estimate < (int64_t) cnx->rtt_min)
 						{
@@ -915,302 +1820,282 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 			}
 		}
 	}
-
-	return packet;
-}
-
-static int picoquic_process_ack_of_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes, 
-    size_t bytes_max, size_t * consumed)
-{
-	int ret = 0;
-	size_t byte_index = 1;
-	uint8_t first_byte = bytes[0];
-	int has_num_block = (first_byte >> 4) & 1;
-	uint64_t target_sequence = 0;
-	picoquic_sack_item_t * sack = &cnx->first_sack_item;
-	picoquic_sack_item_t * previous_sack;
-	uint64_t largest = 0;
-	int ll = (first_byte >> 2) & 3;
-    int mm = (first_byte & 3);
-    int num_block = 0;
-    int num_ts = 0;
-	size_t min_len = 1 + has_num_block + 1 + (1 << ll);
-	int sack_count;
-
-	/* Decode the first bytes of the ACK, until finding the largest data value */
-	if (first_byte < 0xA0 || first_byte > 0xBF || min_len > bytes_max)
-	{
-		ret = -1;
-	}
-	else
-	{
-		/* Find the oldest ACK range, in order to calibrate the
-		* extension of the largest number to 64 bits */
-
-		while (sack->next_sack != NULL)
-		{
-			sack = sack->next_sack;
-		}
-		target_sequence = sack->start_of_sack_range - 1;
-
-		if (has_num_block)
-		{
-            num_block = bytes[byte_index++];
-		}
-        num_ts = bytes[byte_index++];
-
-		/* decoding the largest */
-		switch (ll)
-		{
-		case 0:
-			largest = bytes[byte_index++];
-			largest = picoquic_get_packet_number64(target_sequence,
-				0xFFFFFFFFFFFFFF00ull, (uint32_t)largest);
-			break;
-		case 1:
-			largest = PICOPARSE_16(bytes + byte_index);
-			largest = picoquic_get_packet_number64(target_sequence,
-				0xFFFFFFFFFFFF0000ull, (uint32_t)largest);
-			byte_index += 2;
-			break;
-		case 2:
-			largest = PICOPARSE_32(bytes + byte_index);
-			largest = picoquic_get_packet_number64(target_sequence,
-				0xFFFFFFFF00000000ull, (uint32_t)largest);
-			byte_index += 4;
-			break;
-		case 3:
-			largest = PICOPARSE_64(bytes + byte_index);
-			byte_index += 8;
-			break;
-		}
-		/* Skip everything else -- we are only interested in ACK parsing */
-
-        byte_index += 2; /* ACK delay */
-
-        /* last range and blocks */
-        switch (mm)
-        {
-        case 0:
-            byte_index += 1 + num_block*(1 + 1);
-            break;
-        case 1:
-            byte_index += 2 + num_block*(1 + 2);
-            break;
-        case 2:
-            byte_index += 4 + num_block*(1 + 4);
-            break;
-        case 3:
-            byte_index += 8 + num_block*(1 + 8);
-            break;
-        }
-
-        if (num_ts > 0)
-        {
-            byte_index += 2 + num_ts * 3;
-        }
-
-        *consumed = byte_index;
-
-        /* Process the parsed ACK */
-		sack = &cnx->first_sack_item;
-		previous_sack = NULL;
-		sack_count = 0;
-
-		do {
-			if (sack->start_of_sack_range < largest &&
-				sack->end_of_sack_range < largest)
-			{
-				sack_count++;
-
-				if (sack_count > 2)
-				{
-					previous_sack->next_sack = sack->next_sack;
-					free(sack);
-					sack = previous_sack->next_sack;
-				}
-				else
-				{
-					previous_sack = sack;
-					sack = sack->next_sack;
-				}
-			}
-			else
-			{
-				previous_sack = sack;
-				sack = sack->next_sack;
-			}
-		} while (sack != NULL);
-	}
-
-	return ret;
 }
 
-static int picoquic_process_ack_of_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
-    size_t bytes_max, size_t * consumed)
-{
-
-    /* skip stream frame */
-    int ret = 0;
-    size_t byte_index = 1;
-    uint8_t first_byte = bytes[0];
-    uint8_t stream_id_length = 1 + ((first_byte >> 3) & 3);
-    uint8_t offset_length = picoquic_offset_length_code[(first_byte >> 1) & 3];
-    uint8_t data_length_length = (first_byte & 1) * 2;
-    size_t data_length;
-    uint32_t stream_id;
-    uint64_t offset;
-    picoquic_stream_head * stream = NULL;
-
-    if (bytes_max < (1u + stream_id_length + offset_length + data_length_length))
-    {
-        ret = -1;
-    }
-    else
-    {
-        switch (stream_id_length)
-        {
-        case 1:
-            stream_id = bytes[byte_index];
-            break;
-        case 2:
-            stream_id = PICOPARSE_16(&bytes[byte_index]);
-            break;
-        case 3:
-            stream_id = PICOPARSE_24(&bytes[byte_index]);
-            break;
-        case 4:
-            stream_id = PICOPARSE_32(&bytes[byte_index]);
-            break;
-        }
-        
-        byte_index += stream_id_length;
+/*
+ * When an ACK frame that we sent is acknowledged, the peer knows about
+ * the packets up to its largest value, so older ranges can be forgotten.
+ */
+static void picoquic_process_ack_of_ack_frame(picoquic_cnx_t * cnx, uint64_t largest)
+{
+	picoquic_sack_list_t * sack_list = &cnx->sack_list;
+	size_t below = sack_list->nb_ranges;
 
-        switch (offset_length)
-        {
-        case 0:
-            offset = 0;
-            break;
-        case 2:
-            offset = PICOPARSE_16(&bytes[byte_index]);
-            break;
-        case 4:
-            offset = PICOPARSE_32(&bytes[byte_index]);
-            break;
-        case 8:
-            offset = PICOPARSE_64(&bytes[byte_index]);
-            break;
-        }
+	/* Count the ranges entirely below the largest, keep the highest two of those */
+	while (below > 0 &&
+		sack_list->ranges[below - 1].end_of_sack_range >= largest)
+	{
+		below--;
+	}
+
+	if (below > 2)
+	{
+		memmove(&sack_list->ranges[0], &sack_list->ranges[below - 2],
+			(sack_list->nb_ranges - below + 2) * sizeof(picoquic_sack_range_t));
+		sack_list->nb_ranges -= below - 2;
+	}
+}
 
-        if (data_length_length == 0)
+/*
+ * Record the acknowledged stream data, and free the queued data once
+ * all the bytes up to the end of a chunk are acknowledged.
+ */
+static void picoquic_process_ack_of_stream_frame(picoquic_cnx_t * cnx, picoquic_sent_frame_t * frame)
+{
+    picoquic_stream_head * stream = picoquic_find_stream(cnx, frame->stream_id, 0);
+
+    if (stream != NULL && frame->length > 0)
+    {
+        picoquic_sack_list_t * sack_list = &stream->sack_list;
+        uint64_t end_offset = frame->offset + frame->length;
+        size_t nb_absorbed = 0;
+
+        if (frame->offset <= stream->acked_offset)
         {
-            data_length = bytes_max - byte_index;
+            if (end_offset > stream->acked_offset)
+            {
+                stream->acked_offset = end_offset;
+            }
         }
         else
         {
-            data_length = PICOPARSE_16(&bytes[byte_index]);
-            byte_index += 2;
+            (void)picoquic_update_sack_list(sack_list, frame->offset, end_offset - 1, NULL);
+        }
 
-            if (byte_index + data_length > bytes_max)
+        /* Absorb the lowest ranges that now extend the acknowledged prefix */
+        while (nb_absorbed < sack_list->nb_ranges &&
+            sack_list->ranges[nb_absorbed].start_of_sack_range <= stream->acked_offset)
+        {
+            if (sack_list->ranges[nb_absorbed].end_of_sack_range >= stream->acked_offset)
             {
-                ret = -1;
+                stream->acked_offset = sack_list->ranges[nb_absorbed].end_of_sack_range + 1;
             }
+            nb_absorbed++;
         }
 
-        if (ret == 0)
+        if (nb_absorbed > 0)
         {
-            *consumed = byte_index + data_length;
-
-            /* record the ack range for the stream */
+            memmove(&sack_list->ranges[0], &sack_list->ranges[nb_absorbed],
+                (sack_list->nb_ranges - nb_absorbed) * sizeof(picoquic_sack_range_t));
+            sack_list->nb_ranges -= nb_absorbed;
+        }
 
-            stream = picoquic_find_stream(cnx, stream_id, 0);
+        while (stream->send_queue != NULL && stream->send_queue != stream->send_next &&
+            stream->send_queue->offset + stream->send_queue->length <= stream->acked_offset)
+        {
+            picoquic_stream_data * next = stream->send_queue->next_stream_data;
+            picoquic_release_stream_data(cnx, stream->send_queue);
+            stream->send_queue = next;
+        }
 
-            if (stream != NULL)
-            {
-                uint64_t blocksize;
-                (void)picoquic_update_sack_list(&stream->first_sack_item,
-                    offset, offset + data_length - 1, &blocksize);
-            }
+        if (stream->send_queue == NULL)
+        {
+            stream->send_queue_last = NULL;
         }
     }
+}
 
-    return ret;
+/*
+ * Process the acknowledgement of a packet from its description, without
+ * parsing any byte. The ACK of ACK pruning only depends on the largest
+ * acknowledged value, so it is performed once per received ACK frame.
+ */
+static void picoquic_process_acked_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p,
+	uint64_t * ack_of_ack_largest)
+{
+	if (p->has_ack && p->ack_largest > *ack_of_ack_largest)
+	{
+		*ack_of_ack_largest = p->ack_largest;
+	}
+
+	for (int i = 0; i < p->nb_frames; i++)
+	{
+		if (p->frames[i].frame_type == picoquic_sent_frame_stream)
+		{
+			picoquic_process_ack_of_stream_frame(cnx, &p->frames[i]);
+		}
+	}
 }
 
-void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t * cnx, picoquic_packet * p)
+/*
+ * Update the delivery state when a packet is acknowledged, and take a
+ * delivery rate sample from the state recorded when it was sent.
+ */
+static void picoquic_update_rate_sample(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p,
+	uint64_t current_time)
 {
-	int ret = 0;
-	size_t byte_index;
-	picoquic_packet_header ph;
-	int frame_is_pure_ack = 0;
-	size_t frame_length = 0;
+	picoquic_rate_sample_t * rs = &cnx->rate_sample;
+	uint64_t send_elapsed = p->send_time - p->delivered_sent_time;
+	uint64_t ack_elapsed = current_time - p->delivered_time;
+
+	cnx->delivered += p->length + p->checksum_overhead;
+	cnx->delivered_time = current_time;
+	if (p->send_time > cnx->delivered_sent_time)
+	{
+		cnx->delivered_sent_time = p->send_time;
+	}
+
+	if (cnx->app_limited != 0 && cnx->delivered > cnx->app_limited)
+	{
+		cnx->app_limited = 0;
+	}
+
+	rs->prior_delivered = p->delivered;
+	rs->delivered = cnx->delivered - p->delivered;
+	rs->interval = (send_elapsed > ack_elapsed) ? send_elapsed : ack_elapsed;
+	rs->delivery_rate = (rs->interval == 0) ? 0 : (rs->delivered * 1000000) / rs->interval;
+	rs->is_app_limited = p->is_app_limited;
+}
 
-	/* Get the packet type */
-	ret = picoquic_parse_packet_header(p->bytes, p->length, &ph);
-	byte_index = ph.offset;
+/*
+ * ACK only packets are not in the retransmit queue. The most recent one
+ * in the acknowledged range carries the largest ACK, so the search stops
+ * at the first match.
+ */
+static void picoquic_process_ack_only_range(
+	picoquic_cnx_t * cnx, uint64_t highest, uint64_t lowest, uint64_t * ack_of_ack_largest)
+{
+	if (highest - lowest >= PICOQUIC_ACK_ONLY_RING_SIZE)
+	{
+		lowest = highest - PICOQUIC_ACK_ONLY_RING_SIZE + 1;
+	}
 
-	while (ret == 0 && byte_index < p->length)
+	while (highest >= lowest)
 	{
-		if (p->bytes[byte_index] >= picoquic_frame_type_ack_range_min &&
-			p->bytes[byte_index] <= picoquic_frame_type_ack_range_max)
+		picoquic_ack_only_packet_t * a = picoquic_find_ack_only_packet(cnx, highest);
+
+		if (a != NULL)
 		{
-			ret = picoquic_process_ack_of_ack_frame(cnx, &p->bytes[byte_index], 
-                p->length - byte_index, &frame_length);
-            byte_index += frame_length;
+			if (a->ack_largest > *ack_of_ack_largest)
+			{
+				*ack_of_ack_largest = a->ack_largest;
+			}
+			break;
 		}
-        else if (p->bytes[byte_index] >= picoquic_frame_type_stream_range_min &&
-            p->bytes[byte_index] <= picoquic_frame_type_stream_range_max)
-        {
-            ret = picoquic_process_ack_of_stream_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
-            byte_index += frame_length;
-        }
-        else
+
+		if (highest == 0)
 		{
-			ret = picoquic_skip_frame(&p->bytes[byte_index],
-				p->length - ph.offset, &frame_length, &frame_is_pure_ack);
-			byte_index += frame_length;
+			break;
 		}
+		highest--;
 	}
 }
 
-static picoquic_packet * picoquic_process_ack_range(
-	picoquic_cnx_t * cnx, uint64_t highest, uint64_t range, picoquic_packet * p,
-	uint64_t current_time)
+/*
+ * If a packet that was declared lost is acknowledged, the loss was spurious.
+ * Unless the loss was declared by the timer, this means that the packets
+ * were reordered, and the RACK reordering window is raised by a quarter RTT,
+ * at most once per RTT. The congestion controller may undo its reaction.
+ */
+static void picoquic_process_spurious_range(
+	picoquic_cnx_t * cnx, uint64_t highest, uint64_t lowest, uint64_t current_time)
 {
-	/* Compare the range to the retransmit queue */
-	while (p != NULL && range > 0)
+	for (int i = 0; i < PICOQUIC_LOST_RING_SIZE; i++)
 	{
-		if (p->sequence_number > highest)
+		picoquic_lost_packet_t * l = &cnx->lost_ring[i];
+		uint64_t lost_packet_number = l->sequence_number;
+
+		if (lost_packet_number < lowest || lost_packet_number > highest)
 		{
-			p = p->next_packet;
+			continue;
 		}
-		else
-		{
-			/* If the packet contained an ACK frame, perform the ACK of ACK pruning logic */
-			picoquic_process_possible_ack_of_ack_frame(cnx, p);
 
-			if (p->sequence_number == highest)
+		l->sequence_number = UINT64_MAX;
+		cnx->nb_spurious++;
+
+		if (!l->timer_based)
+		{
+			if (cnx->rack_reorder_mult < PICOQUIC_RACK_REORDER_MULT_MAX &&
+				current_time >= cnx->rack_reorder_raise_time + cnx->smoothed_rtt)
 			{
-				/* TODO: RTT Estimate */
-				picoquic_packet * next = p->next_packet;
-				if (cnx->congestion_alg != NULL)
-				{
-					cnx->congestion_alg->alg_notify(cnx,
-						picoquic_congestion_notification_acknowledgement,
-						0, p->length, 0, current_time);
-				}
-				picoquic_dequeue_retransmit_packet(cnx, p, 1);
-				p = next;
-				/* Any acknowledgement shows progress */
-				cnx->nb_retransmit = 0;
+				cnx->rack_reorder_mult++;
+				cnx->rack_reorder_raise_time = current_time;
+			}
+			else if (cnx->rack_reorder_mult == PICOQUIC_RACK_REORDER_MULT_MAX)
+			{
+				cnx->rack_reorder_raise_time = current_time;
 			}
+		}
 
-			range--;
-			highest--;
+		if (cnx->congestion_alg != NULL)
+		{
+			cnx->congestion_alg->alg_notify(cnx,
+				picoquic_congestion_notification_spurious_repeat,
+				0, 0, lost_packet_number, current_time);
 		}
 	}
+}
+
+/*
+ * Process an acknowledged range of sequence numbers, from highest down.
+ * The packets are found directly by their sequence number, and the range
+ * is first clipped to the sequence numbers still in the retransmit queue.
+ */
+static void picoquic_process_ack_range(
+	picoquic_cnx_t * cnx, uint64_t highest, uint64_t range,
+	uint64_t current_time, uint64_t * ack_of_ack_largest)
+{
+	uint64_t lowest = (range > highest) ? 0 : highest - range + 1;
+
+	if (range == 0)
+	{
+		return;
+	}
+
+	picoquic_process_ack_only_range(cnx, highest, lowest, ack_of_ack_largest);
+	picoquic_process_spurious_range(cnx, highest, lowest, current_time);
+
+	if (cnx->retransmit_newest == NULL)
+	{
+		return;
+	}
+
+	if (highest > cnx->retransmit_newest->sequence_number)
+	{
+		highest = cnx->retransmit_newest->sequence_number;
+	}
+
+	if (lowest < cnx->retransmit_oldest->sequence_number)
+	{
+		lowest = cnx->retransmit_oldest->sequence_number;
+	}
+
+	while (cnx->retransmit_newest != NULL && highest >= lowest)
+	{
+		picoquic_sent_packet_t * p = picoquic_find_sent_packet(cnx, highest);
+
+		if (p != NULL)
+		{
+			picoquic_process_acked_packet(cnx, p, ack_of_ack_largest);
+			picoquic_update_rate_sample(cnx, p, current_time);
+
+			if (cnx->congestion_alg != NULL)
+			{
+				cnx->congestion_alg->alg_notify(cnx,
+					picoquic_congestion_notification_acknowledgement,
+					0, p->length, 0, current_time);
+			}
+			picoquic_dequeue_retransmit_packet(cnx, p, 1);
+			/* Any acknowledgement shows progress */
+			cnx->nb_retransmit = 0;
+		}
 
-	return p;
+		if (highest == 0)
+		{
+			break;
+		}
+		highest--;
+	}
 }
 
 int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
@@ -1229,7 +2114,7 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 	uint64_t ack_range = 0;
 	uint64_t gap_begin;
 	uint64_t ack_delay = 0;
-	picoquic_packet * top_packet = cnx->retransmit_newest;
+	uint64_t ack_of_ack_largest = 0;
 
 	if (first_byte < 0xA0 || first_byte > 0xBF)
 	{
@@ -1293,12 +2178,12 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 		}
 
 		/* Attempt to update the RTT */
-		top_packet = picoquic_update_rtt(cnx, largest, current_time, ack_delay);
+		picoquic_update_rtt(cnx, largest, current_time, ack_delay);
 
 		/* Process the first range, which is always present */
 		if (last_range < largest)
 		{
-			top_packet = picoquic_process_ack_range(cnx, largest, last_range + 1, top_packet, current_time);
+			picoquic_process_ack_range(cnx, largest, last_range + 1, current_time, &ack_of_ack_largest);
 			gap_begin = largest - last_range - 1;
 		}
 		else
@@ -1321,7 +2206,6 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 				{
 				case 0:
 					ack_range = bytes[byte_index++];
-					byte_index += 1;
 					break;
 				case 1:
 					ack_range = PICOPARSE_16(bytes + byte_index);
@@ -1340,7 +2224,7 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 				if (gap_begin >= ack_range)
 				{
 					/* mark the range as received */
-					top_packet = picoquic_process_ack_range(cnx, gap_begin, ack_range, top_packet, current_time);
+					picoquic_process_ack_range(cnx, gap_begin, ack_range, current_time, &ack_of_ack_largest);
 
 					/* start of next gap */
 					gap_begin -= ack_range;
@@ -1352,6 +2236,12 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 			}
 		}
 
+		if (ack_of_ack_largest > 0)
+		{
+			/* Some acknowledged packets carried ACK frames */
+			picoquic_process_ack_of_ack_frame(cnx, ack_of_ack_largest);
+		}
+
 		if (ret == 0)
 		{
 			if (num_ts > 0)
@@ -1373,41 +2263,187 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 	return ret;
 }
 
+/*
+ * The LL and MM fields of the ACK frame code the width of the largest
+ * acknowledged and of the block lengths: 1, 2, 4 or 8 bytes.
+ */
+static int picoquic_ack_length_code(uint64_t value)
+{
+	int code = 0;
+
+	if (value > 0xFFFFFFFFull)
+	{
+		code = 3;
+	}
+	else if (value > 0xFFFF)
+	{
+		code = 2;
+	}
+	else if (value > 0xFF)
+	{
+		code = 1;
+	}
+
+	return code;
+}
+
+static size_t picoquic_format_ack_length(uint8_t * bytes, int code, uint64_t value)
+{
+	switch (code)
+	{
+	case 0:
+		bytes[0] = (uint8_t)value;
+		break;
+	case 1:
+		picoformat_16(bytes, (uint16_t)value);
+		break;
+	case 2:
+		picoformat_32(bytes, (uint32_t)value);
+		break;
+	default:
+		picoformat_64(bytes, value);
+		break;
+	}
+
+	return ((size_t)1) << code;
+}
+
+/*
+ * Encode the ACK blocks that follow the first range, from the highest down,
+ * as long as they fit in the space and their length fits in the MM width.
+ * Gaps larger than 255 are extended with empty blocks. If bytes is NULL,
+ * the blocks are only counted. Returns the number of ranges encoded,
+ * including the first one.
+ */
+static size_t picoquic_format_ack_blocks(picoquic_cnx_t * cnx, int mm,
+	uint8_t * bytes, size_t * byte_index, size_t bytes_max, int * num_block)
+{
+	picoquic_sack_range_t * ranges = cnx->sack_list.ranges;
+	size_t range_index = cnx->sack_list.nb_ranges - 1;
+	size_t block_size = 1 + (((size_t)1) << mm);
+	uint64_t lowest_acknowledged = ranges[range_index].start_of_sack_range;
+	size_t nb_encoded = 1;
+
+	*num_block = 0;
+
+	while (range_index > 0)
+	{
+		uint64_t gap = lowest_acknowledged - ranges[range_index - 1].end_of_sack_range - 1;
+		uint64_t ack_range = ranges[range_index - 1].end_of_sack_range -
+			ranges[range_index - 1].start_of_sack_range + 1;
+		uint64_t nb_empty = (gap > 255) ? (gap - 1) / 255 : 0;
+
+		if (picoquic_ack_length_code(ack_range) > mm ||
+			*num_block + nb_empty + 1 > 255 ||
+			*byte_index + (nb_empty + 1) * block_size > bytes_max)
+		{
+			break;
+		}
+
+		for (uint64_t i = 0; i < nb_empty; i++)
+		{
+			if (bytes != NULL)
+			{
+				bytes[*byte_index] = 255;
+				(void)picoquic_format_ack_length(bytes + *byte_index + 1, mm, 0);
+			}
+			*byte_index += block_size;
+			gap -= 255;
+		}
+
+		if (bytes != NULL)
+		{
+			bytes[*byte_index] = (uint8_t)gap;
+			(void)picoquic_format_ack_length(bytes + *byte_index + 1, mm, ack_range);
+		}
+		*byte_index += block_size;
+		*num_block += (int)nb_empty + 1;
+
+		lowest_acknowledged = ranges[range_index - 1].start_of_sack_range;
+		range_index--;
+		nb_encoded++;
+	}
+
+	return nb_encoded;
+}
+
+/*
+ * The largest acknowledged is sent on 16 bits, which the peer decodes
+ * correctly as long as it has less than 32768 packets in flight, or
+ * on 32 bits if many packets are received per RTT. The smallest width of
+ * the block lengths that encodes the most ranges in the available space
+ * is picked. The ranges that do not fit are counted as truncated.
+ */
 int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
 	uint8_t * bytes, size_t bytes_max, size_t * consumed)
 {
 	int ret = 0;
 	size_t byte_index = 0;
 	int num_block = 0;
-	picoquic_sack_item_t * next_sack = cnx->first_sack_item.next_sack;
+	picoquic_sack_range_t * ranges = cnx->sack_list.ranges;
+	size_t nb_ranges = cnx->sack_list.nb_ranges;
 	uint64_t ack_delay = 0;
-	uint64_t ack_range = 0;
-	uint64_t lowest_acknowledged = 0;
+	uint64_t largest = 0;
+	uint64_t first_range = 0;
+	size_t nb_encoded = 0;
+	int ll = (cnx->ack_rate_nb_last < PICOQUIC_ACK_LARGEST_16BIT_RATE &&
+		cnx->ack_rate_nb_received < PICOQUIC_ACK_LARGEST_16BIT_RATE) ? 1 : 2;
+	int mm = 0;
 
-	/* Check that there is enough room in the packet, and something to acknowledge */
-	if (cnx->first_sack_item.start_of_sack_range == 0 &&
-		cnx->first_sack_item.end_of_sack_range == 0)
+	if (nb_ranges > 0)
 	{
-		*consumed = 0;
+		/* The ranges are ordered from lowest to highest, start from the highest */
+		largest = ranges[nb_ranges - 1].end_of_sack_range;
+		first_range = largest - ranges[nb_ranges - 1].start_of_sack_range;
+
+		for (int mm_test = picoquic_ack_length_code(first_range); mm_test <= 3; mm_test++)
+		{
+			/* First byte, time stamps, largest, delay, first range, then number of blocks */
+			size_t header_length = 4 + (((size_t)1) << ll) + (((size_t)1) << mm_test);
+			size_t nb_fit;
+
+			if (header_length > bytes_max)
+			{
+				break;
+			}
+
+			byte_index = header_length + 1;
+			nb_fit = picoquic_format_ack_blocks(cnx, mm_test, NULL, &byte_index, bytes_max, &num_block);
+
+			if (nb_fit > nb_encoded)
+			{
+				nb_encoded = nb_fit;
+				mm = mm_test;
+
+				if (nb_encoded == nb_ranges)
+				{
+					break;
+				}
+			}
+		}
 	}
-	else if (bytes_max < 13)
+
+	/* Check that there is enough room in the packet, and something to acknowledge */
+	if (nb_encoded == 0)
 	{
-		/* A valid ACK, with our encoding, uses at least 13 bytes.
-		 * If there is not enough space, don't attempt to encode it.
-		 */
 		*consumed = 0;
 	}
 	else
 	{
-		/* Encode the first byte as 101NLLMM, with N=1, LL=2, MM=2 */
-		bytes[byte_index++] = 0xBA;
-		/* Encode the number of blocks, always present. Will be overwritten later */
-		bytes[byte_index++] = 0;
+		int has_num_block = (nb_encoded > 1) ? 1 : 0;
+
+		byte_index = 0;
+		/* Encode the first byte as 101NLLMM */
+		bytes[byte_index++] = (uint8_t)(0xA0 | (has_num_block << 4) | (ll << 2) | mm);
+		/* Encode the number of blocks if there are some. Will be overwritten later */
+		if (has_num_block)
+		{
+			bytes[byte_index++] = 0;
+		}
 		/* Encode a number of time stamps -- set to zero for now */
 		bytes[byte_index++] = 0;
-		/* Encode the largest seen on 4 bytes */
-		picoformat_32(bytes + byte_index, (uint32_t)cnx->first_sack_item.end_of_sack_range);
-		byte_index += 4;
+		/* Encode the largest seen */
+		byte_index += picoquic_format_ack_length(bytes + byte_index, ll, largest);
 		/* Encode the ACK delay for the largest seen */
 		if (current_time > cnx->time_stamp_largest_received)
 		{
@@ -1416,67 +2452,102 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
 		picoformat_16(bytes + byte_index, picoquic_deltat_to_float16(ack_delay));
 		byte_index += 2;
 		/* Encode the size of the first ack range */
-		ack_range = cnx->first_sack_item.end_of_sack_range - cnx->first_sack_item.start_of_sack_range;
-		picoformat_32(bytes + byte_index, (uint32_t)ack_range);
-		byte_index += 4;
-		/* Set the lowest acknowledged */
-		lowest_acknowledged = cnx->first_sack_item.start_of_sack_range;
+		byte_index += picoquic_format_ack_length(bytes + byte_index, mm, first_range);
 		/* Encode each of the ack block items */
-		while (next_sack != NULL && num_block < 255 && (byte_index + 5) <= bytes_max)
+		if (has_num_block)
 		{
-			uint64_t gap = lowest_acknowledged - next_sack->end_of_sack_range -1;
-			while (gap > 255 && num_block < 255 && (byte_index + 5) <= bytes_max)
-			{
-				bytes[byte_index++] = 255;
-				picoformat_32(bytes + byte_index, (uint32_t)ack_range);
-				byte_index += 4;
-				gap -= 255;
-				num_block++;
-			}
-
-			if (num_block < 255 && (byte_index + 5) <= bytes_max)
-			{
-				ack_range = next_sack->end_of_sack_range - next_sack->start_of_sack_range;
-				bytes[byte_index++] = (uint8_t)gap;
-				picoformat_32(bytes + byte_index, (uint32_t)ack_range + 1);
-				byte_index += 4;
-				lowest_acknowledged = next_sack->start_of_sack_range;
-				next_sack = next_sack->next_sack;
-				num_block++;
-			}
+			nb_encoded = picoquic_format_ack_blocks(cnx, mm, bytes, &byte_index, bytes_max, &num_block);
+			bytes[1] = (uint8_t)num_block;
 		}
-		bytes[1] = num_block;
 
 		/* Do not encode additional time stamps yet */
 		*consumed = byte_index;
 
+		cnx->nb_ack_ranges_truncated += nb_ranges - nb_encoded;
+
 		/* Remember the ACK value and time */
-		cnx->highest_ack_sent = cnx->first_sack_item.end_of_sack_range;
+		cnx->highest_ack_sent = largest;
 		cnx->highest_ack_time = current_time;
 	}
 
 	if (ret == 0)
 	{
 		cnx->ack_needed = 0;
+		cnx->ack_nb_pending = 0;
+		cnx->ack_reorder_detected = 0;
 	}
 
 	return ret;
 }
 
+/*
+ * Delayed ACK policy. The ACK is sent once enough packets were received,
+ * when the packets arrive out of order, or when the first packet not yet
+ * acknowledged has waited for the maximum delay.
+ */
 int picoquic_is_ack_needed(picoquic_cnx_t * cnx, uint64_t current_time)
 {
 	int ret = 0;
+	uint64_t ack_frequency = (cnx->ack_adaptive) ? cnx->ack_frequency_adaptive : cnx->ack_frequency;
 
-	if (cnx->highest_ack_sent + 2 <= cnx->first_sack_item.end_of_sack_range ||
-		(cnx->first_sack_item.next_sack != NULL &&
-			cnx->highest_ack_time + 10000 <= current_time))
+	if (cnx->ack_needed &&
+		(cnx->highest_ack_sent + ack_frequency <= picoquic_sack_list_largest(&cnx->sack_list) ||
+		(cnx->ack_on_reorder && cnx->ack_reorder_detected) ||
+		cnx->ack_pending_time + cnx->ack_delay_max <= current_time))
 	{
-		ret = cnx->ack_needed;
+		ret = 1;
 	}
 
 	return ret;
 }
 
+/*
+ * Update the delayed ACK state when a packet is received, before its number
+ * is added to the list. The number of packets received in each RTT tracks
+ * the congestion window of the peer. In adaptive mode, the frequency is set
+ * so that about four ACKs are sent per RTT.
+ */
+void picoquic_update_ack_policy(picoquic_cnx_t * cnx, uint64_t pn64, uint64_t current_time)
+{
+	if (cnx->sack_list.nb_ranges > 0 &&
+		pn64 != picoquic_sack_list_largest(&cnx->sack_list) + 1)
+	{
+		cnx->ack_reorder_detected = 1;
+	}
+
+	if (cnx->ack_nb_pending == 0)
+	{
+		cnx->ack_pending_time = current_time;
+	}
+	cnx->ack_nb_pending++;
+
+	cnx->ack_rate_nb_received++;
+
+	if (current_time >= cnx->ack_rate_start_time + cnx->smoothed_rtt)
+	{
+		cnx->ack_rate_nb_last = cnx->ack_rate_nb_received;
+
+		if (cnx->ack_adaptive)
+		{
+			uint64_t ack_frequency = cnx->ack_rate_nb_received / 4;
+
+			if (ack_frequency < cnx->ack_frequency)
+			{
+				ack_frequency = cnx->ack_frequency;
+			}
+			else if (ack_frequency > PICOQUIC_ACK_FREQUENCY_MAX)
+			{
+				ack_frequency = PICOQUIC_ACK_FREQUENCY_MAX;
+			}
+
+			cnx->ack_frequency_adaptive = (uint32_t)ack_frequency;
+		}
+
+		cnx->ack_rate_start_time = current_time;
+		cnx->ack_rate_nb_received = 0;
+	}
+}
+
 /*
  * Connection close frame
  */
@@ -1692,6 +2763,7 @@ int picoquic_decode_max_stream_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 				if (maxdata > stream->maxdata_remote)
 				{
 					stream->maxdata_remote = maxdata;
+					picoquic_update_stream_ready(cnx, stream);
 				}
 			}
 		}
@@ -1701,18 +2773,19 @@ int picoquic_decode_max_stream_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 }
 
 int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx,
-	uint8_t * bytes, size_t bytes_max, size_t * consumed)
+	uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent)
 {
 	int ret = 0;
 	size_t byte_index = 0;
-	picoquic_stream_head * stream = &cnx->first_stream;
+	picoquic_stream_head * stream = cnx->stream_queue[picoquic_stream_queue_max_data].first;
 
-	while (stream != NULL && ret == 0 && byte_index < bytes_max)
+	/* Keep one frame description for the stream frame that follows */
+	while (stream != NULL && ret == 0 && byte_index < bytes_max &&
+		sent->nb_frames < PICOQUIC_MAX_SENT_FRAMES - 1)
 	{
-		if (stream->stream_id != 0 &&
-			(stream->stream_flags&(picoquic_stream_flag_fin_received |
-				picoquic_stream_flag_reset_received)) == 0 &&
-			2 * stream->consumed_offset > stream->maxdata_local)
+		picoquic_stream_head * next = stream->queue_link[picoquic_stream_queue_max_data].next;
+
+		if (picoquic_stream_needs_max_data(stream))
 		{
 			size_t bytes_in_frame = 0;
 
@@ -1720,12 +2793,19 @@ int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx,
 				bytes + byte_index, bytes_max - byte_index,
 				stream->maxdata_local + 2 * stream->consumed_offset,
 				&bytes_in_frame);
-			if (ret == 0)
+			if (ret == 0 && bytes_in_frame > 0)
 			{
 				byte_index += bytes_in_frame;
+				picoquic_record_sent_frame(sent, picoquic_sent_frame_max_stream_data,
+					stream->stream_id, 0, 0, 0);
 			}
 		}
-		stream = stream->next_stream;
+
+		if (ret == 0)
+		{
+			picoquic_update_stream_max_data(cnx, stream);
+		}
+		stream = next;
 	}
 
 	if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
@@ -1744,6 +2824,69 @@ int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx,
 
 	return ret;
 }
+/*
+ * Repeat a frame that was sent in a lost packet. Stream data is copied
+ * again from the send queue, and the control frames are repeated with
+ * the current value of the connection or stream parameters.
+ */
+int picoquic_prepare_repeated_frame(picoquic_cnx_t * cnx, picoquic_sent_frame_t * frame,
+	uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent)
+{
+	int ret = 0;
+	picoquic_stream_head * stream = NULL;
+
+	*consumed = 0;
+
+	switch (frame->frame_type)
+	{
+	case picoquic_sent_frame_stream:
+		ret = picoquic_prepare_repeated_stream_frame(cnx, frame, bytes, bytes_max, consumed, sent);
+		break;
+	case picoquic_sent_frame_reset_stream:
+		stream = picoquic_find_stream(cnx, frame->stream_id, 0);
+		if (stream != NULL)
+		{
+			if (bytes_max < 17)
+			{
+				ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+			}
+			else
+			{
+				bytes[0] = picoquic_frame_type_reset_stream;
+				picoformat_32(bytes + 1, stream->stream_id);
+				picoformat_32(bytes + 5, stream->local_error);
+				picoformat_64(bytes + 9, stream->sent_offset);
+				*consumed = 17;
+			}
+		}
+		break;
+	case picoquic_sent_frame_max_data:
+		ret = picoquic_prepare_max_data_frame(cnx, 0, bytes, bytes_max, consumed);
+		break;
+	case picoquic_sent_frame_max_stream_data:
+		stream = picoquic_find_stream(cnx, frame->stream_id, 0);
+		if (stream != NULL)
+		{
+			ret = picoquic_prepare_max_stream_data_frame(cnx, stream, bytes, bytes_max,
+				stream->maxdata_local, consumed);
+		}
+		break;
+	case picoquic_sent_frame_connection_close:
+		ret = picoquic_prepare_connection_close_frame(cnx, bytes, bytes_max, consumed);
+		break;
+	default:
+		break;
+	}
+
+	if (ret == 0 && *consumed > 0 && frame->frame_type != picoquic_sent_frame_stream)
+	{
+		picoquic_record_sent_frame(sent, (picoquic_sent_frame_type_enum)frame->frame_type,
+			frame->stream_id, 0, 0, 0);
+	}
+
+	return ret;
+}
+
 /*
  * Max stream ID frame
  */
@@ -1790,6 +2933,7 @@ int picoquic_decode_max_stream_id_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 		if (max_stream_id > cnx->max_stream_id_remote)
 		{
 			cnx->max_stream_id_remote = max_stream_id;
+			picoquic_update_all_streams_ready(cnx);
 		}
 	}
 
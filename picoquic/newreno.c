@@ -34,8 +34,117 @@ typedef struct st_picoquic_newreno_state_t {
 	uint64_t residual_ack;
 	uint64_t ssthresh;
 	uint64_t recovery_start;
+	uint64_t recovery_sequence; /* losses of packets sent before that are ignored */
+	picoquic_hystart_state_t hystart;
 } picoquic_newreno_state_t;
 
+/*
+ * HyStart++ parameters, per RFC 9406. The RTT increase threshold is one
+ * eighth of the last round min RTT, within 4 and 16 ms, checked after 8
+ * samples in the round. The conservative slow start grows 4 times slower
+ * than the slow start, and lasts 5 rounds.
+ */
+#define PICOQUIC_HYSTART_MIN_RTT_THRESH 4000 /* 4 ms */
+#define PICOQUIC_HYSTART_MAX_RTT_THRESH 16000 /* 16 ms */
+#define PICOQUIC_HYSTART_MIN_RTT_DIVISOR 8
+#define PICOQUIC_HYSTART_N_RTT_SAMPLE 8
+#define PICOQUIC_HYSTART_CSS_GROWTH_DIVISOR 4
+#define PICOQUIC_HYSTART_CSS_ROUNDS 5
+
+void picoquic_hystart_init(picoquic_cnx_t * cnx, picoquic_hystart_state_t * hystart)
+{
+	hystart->phase = picoquic_hystart_slow_start;
+	hystart->round_end_delivered = cnx->delivered;
+	hystart->last_round_min_rtt = UINT64_MAX;
+	hystart->current_round_min_rtt = UINT64_MAX;
+	hystart->css_baseline_min_rtt = UINT64_MAX;
+	hystart->rtt_sample_count = 0;
+	hystart->css_round_count = 0;
+}
+
+/* Track the min RTT of the round, and compare it to the previous round */
+void picoquic_hystart_notify_rtt(picoquic_hystart_state_t * hystart, uint64_t rtt_measurement)
+{
+	if (hystart->phase != picoquic_hystart_exited)
+	{
+		if (rtt_measurement < hystart->current_round_min_rtt)
+		{
+			hystart->current_round_min_rtt = rtt_measurement;
+		}
+		hystart->rtt_sample_count++;
+
+		if (hystart->phase == picoquic_hystart_slow_start)
+		{
+			if (hystart->rtt_sample_count >= PICOQUIC_HYSTART_N_RTT_SAMPLE &&
+				hystart->current_round_min_rtt != UINT64_MAX &&
+				hystart->last_round_min_rtt != UINT64_MAX)
+			{
+				uint64_t rtt_thresh = hystart->last_round_min_rtt / PICOQUIC_HYSTART_MIN_RTT_DIVISOR;
+
+				if (rtt_thresh < PICOQUIC_HYSTART_MIN_RTT_THRESH)
+				{
+					rtt_thresh = PICOQUIC_HYSTART_MIN_RTT_THRESH;
+				}
+				else if (rtt_thresh > PICOQUIC_HYSTART_MAX_RTT_THRESH)
+				{
+					rtt_thresh = PICOQUIC_HYSTART_MAX_RTT_THRESH;
+				}
+
+				if (hystart->current_round_min_rtt >= hystart->last_round_min_rtt + rtt_thresh)
+				{
+					/* The queue is building up: grow more slowly */
+					hystart->phase = picoquic_hystart_conservative;
+					hystart->css_baseline_min_rtt = hystart->current_round_min_rtt;
+					hystart->css_round_count = 0;
+				}
+			}
+		}
+		else if (hystart->current_round_min_rtt < hystart->css_baseline_min_rtt)
+		{
+			/* The RTT increase was spurious, resume the slow start */
+			hystart->phase = picoquic_hystart_slow_start;
+			hystart->css_baseline_min_rtt = UINT64_MAX;
+		}
+	}
+}
+
+/*
+ * Detect the end of the round, and return by how much the window can grow
+ * for the acknowledged bytes. The slow start is over when the phase becomes
+ * picoquic_hystart_exited. If HyStart++ is disabled, the window grows as in
+ * the standard slow start, and the phase never changes.
+ */
+uint64_t picoquic_hystart_notify_ack(picoquic_cnx_t * cnx, picoquic_hystart_state_t * hystart,
+	uint64_t nb_bytes_acknowledged)
+{
+	uint64_t increase = nb_bytes_acknowledged;
+
+	if (!cnx->is_hystart_disabled && hystart->phase != picoquic_hystart_exited &&
+		cnx->rate_sample.prior_delivered >= hystart->round_end_delivered)
+	{
+		hystart->round_end_delivered = cnx->delivered;
+		hystart->last_round_min_rtt = hystart->current_round_min_rtt;
+		hystart->current_round_min_rtt = UINT64_MAX;
+		hystart->rtt_sample_count = 0;
+
+		if (hystart->phase == picoquic_hystart_conservative)
+		{
+			hystart->css_round_count++;
+			if (hystart->css_round_count >= PICOQUIC_HYSTART_CSS_ROUNDS)
+			{
+				hystart->phase = picoquic_hystart_exited;
+			}
+		}
+	}
+
+	if (!cnx->is_hystart_disabled && hystart->phase == picoquic_hystart_conservative)
+	{
+		increase /= PICOQUIC_HYSTART_CSS_GROWTH_DIVISOR;
+	}
+
+	return increase;
+}
+
 void picoquic_newreno_init(picoquic_cnx_t * cnx)
 {
 	/* Initialize the state of the congestion control algorithm */
@@ -47,16 +156,30 @@ void picoquic_newreno_init(picoquic_cnx_t * cnx)
 		nr_state->alg_state = picoquic_newreno_alg_slow_start;
 		cnx->cwin = PICOQUIC_CWIN_INITIAL;
 		nr_state->residual_ack = 0;
+		nr_state->ssthresh = (uint64_t)((int64_t)-1);
+		nr_state->recovery_start = 0;
+		nr_state->recovery_sequence = 0;
+		picoquic_hystart_init(cnx, &nr_state->hystart);
 	}
 }
 
-/* The recovery state last 1 RTT, during which parameters will be frozen
+/* The recovery state last 1 RTT, during which parameters will be frozen.
+ * The window is only reduced once per flight: the losses of packets sent
+ * before the last recovery started are ignored, unless the congestion is
+ * persistent.
  */
 static void picoquic_newreno_enter_recovery(picoquic_cnx_t * cnx,
 	picoquic_congestion_notification_t notification,
 	picoquic_newreno_state_t * nr_state,
+	uint64_t lost_packet_number,
 	uint64_t current_time)
 {
+	if (notification != picoquic_congestion_notification_timeout &&
+		lost_packet_number < nr_state->recovery_sequence)
+	{
+		return;
+	}
+
 	nr_state->ssthresh = cnx->cwin / 2;
 	if (nr_state->ssthresh < PICOQUIC_CWIN_MINIMUM)
 	{
@@ -73,9 +196,13 @@ static void picoquic_newreno_enter_recovery(picoquic_cnx_t * cnx,
 	}
 
 	nr_state->recovery_start = current_time;
+	nr_state->recovery_sequence = cnx->send_sequence;
 
 	nr_state->residual_ack = 0;
 
+	/* HyStart++ only applies to the initial slow start */
+	nr_state->hystart.phase = picoquic_hystart_exited;
+
 	nr_state->alg_state = picoquic_newreno_alg_recovery;
 }
 
@@ -102,7 +229,19 @@ void picoquic_newreno_notify(picoquic_cnx_t * cnx,
 			switch (notification)
 			{
 			case picoquic_congestion_notification_acknowledgement:
-				cnx->cwin += nb_bytes_acknowledged;
+				if (nr_state->hystart.phase != picoquic_hystart_exited)
+				{
+					cnx->cwin += picoquic_hystart_notify_ack(cnx, &nr_state->hystart, nb_bytes_acknowledged);
+					if (nr_state->hystart.phase == picoquic_hystart_exited)
+					{
+						/* The RTT increase was confirmed, the window is large enough */
+						nr_state->ssthresh = cnx->cwin;
+					}
+				}
+				else
+				{
+					cnx->cwin += nb_bytes_acknowledged;
+				}
 				/* if cnx->cwin exceeds SSTHRESH, exit and go to CA */
 				if (cnx->cwin >= nr_state->ssthresh)
 				{
@@ -112,12 +251,13 @@ void picoquic_newreno_notify(picoquic_cnx_t * cnx,
 			case picoquic_congestion_notification_repeat:
 			case picoquic_congestion_notification_timeout:
 				/* enter recovery */
-				picoquic_newreno_enter_recovery(cnx, notification, nr_state, current_time);
+				picoquic_newreno_enter_recovery(cnx, notification, nr_state, lost_packet_number, current_time);
 				break;
 			case picoquic_congestion_notification_spurious_repeat:
 				break;
 			case picoquic_congestion_notification_rtt_measurement:
-				/* TODO: consider using RTT increases as signal to get out of slow start */
+				/* RTT increases are a signal to get out of slow start */
+				picoquic_hystart_notify_rtt(&nr_state->hystart, rtt_measurement);
 				break;
 			default:
 				/* ignore */
@@ -144,7 +284,7 @@ void picoquic_newreno_notify(picoquic_cnx_t * cnx,
 				case picoquic_congestion_notification_repeat:
 				case picoquic_congestion_notification_timeout:
 					/* re-enter recovery */
-					picoquic_newreno_enter_recovery(cnx, notification, nr_state, current_time);
+					picoquic_newreno_enter_recovery(cnx, notification, nr_state, lost_packet_number, current_time);
 					break;
 				case picoquic_congestion_notification_spurious_repeat:
 					/* To do: if spurious repeat of initial loss detected,
@@ -171,7 +311,7 @@ void picoquic_newreno_notify(picoquic_cnx_t * cnx,
 			case picoquic_congestion_notification_repeat:
 			case picoquic_congestion_notification_timeout:
 				/* re-enter recovery */
-				picoquic_newreno_enter_recovery(cnx, notification, nr_state, current_time);
+				picoquic_newreno_enter_recovery(cnx, notification, nr_state, lost_packet_number, current_time);
 				break;
 			case picoquic_congestion_notification_spurious_repeat:
 			case picoquic_congestion_notification_rtt_measurement:
@@ -312,7 +312,7 @@ void picoquic_queue_stateless_reset(picoquic_cnx_t * cnx,
         byte_index += 4;
         /* Copy the stream zero data */
         if (picoquic_prepare_stream_frame(cnx, &cnx->first_stream, bytes + byte_index,
-            PICOQUIC_MAX_PACKET_SIZE - byte_index - checksum_length, &data_bytes) == 0)
+            PICOQUIC_MAX_PACKET_SIZE - byte_index - checksum_length, &data_bytes, NULL) == 0)
         {
             byte_index += data_bytes;
             sp->length = fnv1a_protect(bytes, byte_index, PICOQUIC_MAX_PACKET_SIZE);
@@ -323,7 +323,7 @@ void picoquic_queue_stateless_reset(picoquic_cnx_t * cnx,
         }
         else
         {
-            picoquic_delete_stateless_packet(sp);
+            picoquic_delete_stateless_packet(cnx->quic, sp);
         }
     }
 }
@@ -729,7 +729,7 @@ int picoquic_incoming_packet(
         {
             /* Build a packet number to 64 bits */
             ph.pn64 = picoquic_get_packet_number64(
-                cnx->first_sack_item.end_of_sack_range, ph.pnmask, ph.pn);
+                picoquic_sack_list_largest(&cnx->sack_list), ph.pnmask, ph.pn);
 
             /* verify that the packet is new */
 			if (picoquic_is_pn_already_received(cnx, ph.pn64) != 0)
@@ -798,12 +798,10 @@ int picoquic_incoming_packet(
 	{
 		if (cnx != NULL && ph.ptype != picoquic_packet_version_negotiation)
 		{
-			/* Mark the sequence number as received */
+			/* Mark the sequence number as received. Packets that only carry
+			 * ACK or padding do not need to be acknowledged. */
+			picoquic_update_ack_policy(cnx, ph.pn64, current_time);
 			ret = picoquic_record_pn_received(cnx, ph.pn64, current_time);
-            if (ret == 0)
-            {
-                cnx->ack_needed = 1;
-            }
 		}
 	}
 	else if (ret == PICOQUIC_ERROR_AEAD_CHECK ||
@@ -20,21 +20,175 @@
 */
 
 /*
- * Basic hash implementation, like we have seen tons off already.
+ * Open addressing hash table, using Robin Hood insertion and backward shift
+ * deletion. The number of slots is always a power of 2.
  */
 #include <stdlib.h>
 #include <string.h>
 #include "picohash.h"
 
+#define PICOHASH_MIN_BIN 16
+#define PICOHASH_MIGRATE_STEP 4
+
+static size_t picohash_home(uint64_t hash, size_t nb_bin)
+{
+    /* Mix the bits, so that sequential hash values do not create clusters */
+    return (size_t)((hash * 0x9E3779B97F4A7C15ull) >> 32) & (nb_bin - 1);
+}
+
+static size_t picohash_distance(uint64_t hash, size_t index, size_t nb_bin)
+{
+    return (index + nb_bin - picohash_home(hash, nb_bin)) & (nb_bin - 1);
+}
+
+static picohash_item * picohash_find_in_bins(picohash_table * hash_table,
+    picohash_item * bins, size_t nb_bin, uint64_t hash, void * key)
+{
+    size_t index = picohash_home(hash, nb_bin);
+    picohash_item * item = NULL;
+
+    for (size_t dist = 0; dist < nb_bin; dist++)
+    {
+        picohash_item * slot = &bins[index];
+
+        if (slot->key == NULL ||
+            picohash_distance(slot->hash, index, nb_bin) < dist)
+        {
+            break;
+        }
+        else if (slot->hash == hash && hash_table->picohash_compare(key, slot->key) == 0)
+        {
+            item = slot;
+            break;
+        }
+
+        index = (index + 1) & (nb_bin - 1);
+    }
+
+    return item;
+}
+
+static void picohash_insert_in_bins(picohash_item * bins, size_t nb_bin, uint64_t hash, void * key)
+{
+    size_t index = picohash_home(hash, nb_bin);
+    size_t dist = 0;
+    picohash_item current;
+
+    current.hash = hash;
+    current.key = key;
+
+    while (bins[index].key != NULL)
+    {
+        size_t slot_dist = picohash_distance(bins[index].hash, index, nb_bin);
+
+        if (slot_dist < dist)
+        {
+            /* Take from the rich, and keep looking for a place for the evicted entry */
+            picohash_item evicted = bins[index];
+
+            bins[index] = current;
+            current = evicted;
+            dist = slot_dist;
+        }
+
+        index = (index + 1) & (nb_bin - 1);
+        dist++;
+    }
+
+    bins[index] = current;
+}
+
+static void picohash_remove_from_bins(picohash_item * bins, size_t nb_bin, size_t index)
+{
+    size_t next = (index + 1) & (nb_bin - 1);
+
+    /* Backward shift, so there is no need for tombstones */
+    while (bins[next].key != NULL &&
+        picohash_distance(bins[next].hash, next, nb_bin) != 0)
+    {
+        bins[index] = bins[next];
+        index = next;
+        next = (next + 1) & (nb_bin - 1);
+    }
+
+    bins[index].hash = 0;
+    bins[index].key = NULL;
+}
+
+static void picohash_migrate(picohash_table * hash_table, size_t nb_steps)
+{
+    while (hash_table->old_bin != NULL && nb_steps > 0)
+    {
+        if (hash_table->old_count == 0)
+        {
+            free(hash_table->old_bin);
+            hash_table->old_bin = NULL;
+            hash_table->old_nb_bin = 0;
+            hash_table->migrate_index = 0;
+        }
+        else
+        {
+            picohash_item * slot;
+
+            while (hash_table->old_bin[hash_table->migrate_index].key == NULL)
+            {
+                hash_table->migrate_index = (hash_table->migrate_index + 1) & (hash_table->old_nb_bin - 1);
+            }
+
+            slot = &hash_table->old_bin[hash_table->migrate_index];
+            picohash_insert_in_bins(hash_table->hash_bin, hash_table->nb_bin, slot->hash, slot->key);
+            picohash_remove_from_bins(hash_table->old_bin, hash_table->old_nb_bin, hash_table->migrate_index);
+            hash_table->old_count--;
+            nb_steps--;
+        }
+    }
+}
+
+static int picohash_grow(picohash_table * hash_table)
+{
+    int ret = 0;
+    size_t nb_bin = hash_table->nb_bin * 2;
+    picohash_item * bins;
+
+    /* Complete the previous migration before starting a new one */
+    picohash_migrate(hash_table, hash_table->old_count + 1);
+
+    bins = (picohash_item *)malloc(sizeof(picohash_item)*nb_bin);
+
+    if (bins == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        (void)memset(bins, 0, sizeof(picohash_item)*nb_bin);
+        hash_table->old_bin = hash_table->hash_bin;
+        hash_table->old_nb_bin = hash_table->nb_bin;
+        hash_table->old_count = hash_table->count;
+        hash_table->migrate_index = 0;
+        hash_table->hash_bin = bins;
+        hash_table->nb_bin = nb_bin;
+    }
+
+    return ret;
+}
 
 picohash_table * picohash_create(size_t nb_bin,
     uint64_t(*picohash_hash) (void *),
     int(*picohash_compare)(void *, void *))
 {
     picohash_table * t = (picohash_table *)malloc(sizeof(picohash_table));
+    size_t actual_nb_bin = PICOHASH_MIN_BIN;
+
+    while (actual_nb_bin < nb_bin)
+    {
+        actual_nb_bin *= 2;
+    }
+
     if (t != NULL)
     {
-        t->hash_bin = (picohash_item **)malloc(sizeof(picohash_item *)*nb_bin);
+        (void)memset(t, 0, sizeof(picohash_table));
+        t->hash_bin = (picohash_item *)malloc(sizeof(picohash_item)*actual_nb_bin);
 
         if (t->hash_bin == NULL)
         {
@@ -43,9 +197,8 @@ picohash_table * picohash_create(size_t nb_bin,
         }
         else
         {
-            (void)memset(t->hash_bin, 0, sizeof(picohash_item *)*nb_bin);
-            t->nb_bin = nb_bin;
-            t->count = 0;
+            (void)memset(t->hash_bin, 0, sizeof(picohash_item)*actual_nb_bin);
+            t->nb_bin = actual_nb_bin;
             t->picohash_hash = picohash_hash;
             t->picohash_compare = picohash_compare;
         }
@@ -57,19 +210,13 @@ picohash_table * picohash_create(size_t nb_bin,
 picohash_item * picohash_retrieve(picohash_table * hash_table, void * key)
 {
     uint64_t hash = hash_table->picohash_hash(key);
-    uint32_t bin = hash % hash_table->nb_bin;
-    picohash_item * item = hash_table->hash_bin[bin];
+    picohash_item * item = picohash_find_in_bins(hash_table,
+        hash_table->hash_bin, hash_table->nb_bin, hash, key);
 
-    while (item != NULL)
+    if (item == NULL && hash_table->old_bin != NULL)
     {
-        if (hash_table->picohash_compare(key, item->key) == 0)
-        {
-            break;
-        }
-        else
-        {
-            item = item->next_in_bin;
-        }
+        item = picohash_find_in_bins(hash_table,
+            hash_table->old_bin, hash_table->old_nb_bin, hash, key);
     }
 
     return item;
@@ -78,21 +225,26 @@ picohash_item * picohash_retrieve(picohash_table * hash_table, void * key)
 int picohash_insert(picohash_table * hash_table, void* key)
 {
     uint64_t hash = hash_table->picohash_hash(key);
-    uint32_t bin = hash % hash_table->nb_bin;
     int ret = 0;
-    picohash_item * item = (picohash_item *)malloc(sizeof(picohash_item));
-    
-    if (item == NULL)
+
+    if (key == NULL)
     {
         ret = -1;
     }
     else
     {
-        item->hash = hash;
-        item->key = key;
-        item->next_in_bin = hash_table->hash_bin[bin];
-        hash_table->hash_bin[bin] = item;
-        hash_table->count++;
+        picohash_migrate(hash_table, PICOHASH_MIGRATE_STEP);
+
+        if (4 * (hash_table->count - hash_table->old_count + 1) > 3 * hash_table->nb_bin)
+        {
+            ret = picohash_grow(hash_table);
+        }
+
+        if (ret == 0)
+        {
+            picohash_insert_in_bins(hash_table->hash_bin, hash_table->nb_bin, hash, key);
+            hash_table->count++;
+        }
     }
     
     return ret;
@@ -100,45 +252,46 @@ int picohash_insert(picohash_table * hash_table, void* key)
 
 void picohash_item_delete(picohash_table * hash_table, picohash_item * item, int delete_key_too)
 {
-    uint32_t bin = item->hash % hash_table->nb_bin;
-    picohash_item * previous = hash_table->hash_bin[bin];
-    
-    if (previous == item)
+    void * key = item->key;
+
+    if (hash_table->old_bin != NULL &&
+        item >= hash_table->old_bin && item < hash_table->old_bin + hash_table->old_nb_bin)
     {
-        hash_table->hash_bin[bin] = item->next_in_bin;
+        picohash_remove_from_bins(hash_table->old_bin, hash_table->old_nb_bin,
+            item - hash_table->old_bin);
+        hash_table->old_count--;
     }
-    else while (previous != NULL)
+    else
     {
-        if (previous->next_in_bin == item)
-        {
-            previous->next_in_bin = item->next_in_bin;
-            break;
-        }
-        else
-        {
-            previous = previous->next_in_bin;
-        }
+        picohash_remove_from_bins(hash_table->hash_bin, hash_table->nb_bin,
+            item - hash_table->hash_bin);
     }
+    hash_table->count--;
 
     if (delete_key_too)
     {
-        free(item->key);
+        free(key);
     }
 
-    free(item);
+    picohash_migrate(hash_table, PICOHASH_MIGRATE_STEP);
 }
 
 void picohash_delete(picohash_table * hash_table, int delete_key_too)
 {
-    for (uint32_t i = 0; i < hash_table->nb_bin; i++)
+    if (delete_key_too)
     {
-        while (hash_table->hash_bin[i] != NULL)
+        for (size_t i = 0; i < hash_table->nb_bin; i++)
+        {
+            free(hash_table->hash_bin[i].key);
+        }
+
+        for (size_t i = 0; i < hash_table->old_nb_bin; i++)
         {
-            /* TODO: could be faster */
-            picohash_item_delete(hash_table, hash_table->hash_bin[i], delete_key_too);
+            free(hash_table->old_bin[i].key);
         }
     }
 
+    free(hash_table->old_bin);
     free(hash_table->hash_bin);
     free(hash_table);
 }
@@ -34,10 +34,23 @@ extern "C" {
 #endif
 
 
+    /*
+     * Open addressing table, using Robin Hood hashing. Each slot holds the
+     * hash value and the key pointer inline, so a lookup compares hashes in
+     * a contiguous array and only dereferences the key when hashes match.
+     * An empty slot has a NULL key.
+     *
+     * When the load factor exceeds 3/4, the table allocates an array twice
+     * as large and migrates the old entries a few at a time, on each insert
+     * or delete. Lookups check both arrays until the migration completes.
+     *
+     * The item pointers returned by picohash_retrieve are only valid until
+     * the next insert or delete.
+     */
+
     typedef struct _picohash_item
     {
         uint64_t hash;
-        struct _picohash_item * next_in_bin;
         void * key;
     } picohash_item;
 
@@ -45,9 +58,13 @@ extern "C" {
     typedef struct picohash_table
     {
         /* TODO: lock ! */
-        picohash_item ** hash_bin;
+        picohash_item * hash_bin;
         size_t nb_bin;
         size_t count;
+        picohash_item * old_bin;
+        size_t old_nb_bin;
+        size_t old_count;
+        size_t migrate_index;
         uint64_t(*picohash_hash) (void *);
         int(*picohash_compare)(void *, void *);
     } picohash_table;
@@ -115,9 +115,9 @@ extern "C" {
 	} picoquic_stateless_packet_t;
 
 	/*
-	 * The simple packet structure is used to store packets that
-	 * have been sent but are not yet acknowledged.
-	 * Packets are stored in unencrypted format.
+	 * The simple packet structure is used to prepare packets before encryption.
+	 * The packet remains owned by the application after picoquic_prepare_packet:
+	 * the retransmission queue only keeps a compact description of the frames.
 	 * The checksum length is the difference between encrypted and unencrypted.
 	 */
 	typedef struct _picoquic_packet {
@@ -139,7 +139,8 @@ extern "C" {
 		picoquic_callback_no_event = 0,
 		picoquic_callback_stream_fin,
 		picoquic_callback_stream_reset,
-        picoquic_callback_close
+        picoquic_callback_close,
+		picoquic_callback_stream_readable
 	} picoquic_call_back_event_t;
 
 	/* Callback function for providing stream data to the application */
@@ -179,6 +180,11 @@ extern "C" {
     int64_t picoquic_get_next_wake_delay(picoquic_quic_t * quic, 
         uint64_t current_time,
         int64_t delay_max);
+    /* Iterate over the connections that are due to wake up at current time.
+     * The list is computed when calling picoquic_get_first_due_cnx, so the
+     * application can prepare packets while iterating. */
+    picoquic_cnx_t * picoquic_get_first_due_cnx(picoquic_quic_t * quic, uint64_t current_time);
+    picoquic_cnx_t * picoquic_get_next_due_cnx(picoquic_cnx_t * cnx);
 
 	picoquic_state_enum picoquic_get_cnx_state(picoquic_cnx_t * cnx);
 
@@ -188,6 +194,11 @@ extern "C" {
     uint64_t picoquic_get_initial_cnxid(picoquic_cnx_t * cnx);
     uint64_t picoquic_get_cnx_start_time(picoquic_cnx_t * cnx);
 
+    /* Packing statistics: number of packets sent, bytes used by these packets,
+     * and bytes that would have been used if all packets were full size. */
+    void picoquic_get_packing_stats(picoquic_cnx_t * cnx, uint64_t * nb_packets,
+        uint64_t * nb_bytes_used, uint64_t * nb_bytes_mtu);
+
     int picoquic_is_cnx_backlog_empty(picoquic_cnx_t * cnx);
 
     void picoquic_set_callback(picoquic_cnx_t * cnx,
@@ -196,7 +207,7 @@ extern "C" {
 	/* Send and receive network packets */
 
 	picoquic_stateless_packet_t * picoquic_dequeue_stateless_packet(picoquic_quic_t * quic);
-	void picoquic_delete_stateless_packet(picoquic_stateless_packet_t * sp);
+	void picoquic_delete_stateless_packet(picoquic_quic_t * quic, picoquic_stateless_packet_t * sp);
 
 	int picoquic_incoming_packet(
 		picoquic_quic_t * quic,
@@ -205,7 +216,31 @@ extern "C" {
 		struct sockaddr * addr_from,
 		uint64_t current_time);
 
-	picoquic_packet * picoquic_create_packet();
+	/* Packets are allocated from a per context pool. The pool keeps at most
+	 * packet_pool_max free packets of each kind, and counts how many requests
+	 * were served from the pool (hit) or required an allocation (miss). */
+	picoquic_packet * picoquic_create_packet(picoquic_quic_t * quic);
+	void picoquic_delete_packet(picoquic_quic_t * quic, picoquic_packet * packet);
+	void picoquic_set_packet_pool_max(picoquic_quic_t * quic, size_t packet_pool_max);
+	void picoquic_get_packet_pool_stats(picoquic_quic_t * quic, uint64_t * nb_hit, uint64_t * nb_miss);
+
+	/* Set the maximum number of ranges tracked when acknowledging packets.
+	 * Applies to the connections created afterwards. The ranges of acknowledged
+	 * stream data are not capped, since forgetting one would stall the stream. */
+	void picoquic_set_sack_range_max(picoquic_quic_t * quic, size_t sack_range_max);
+
+	/* Delayed ACK policy of a connection. An ACK is sent when ack_frequency packets
+	 * were received since the last one, or ack_delay_max microseconds after the first
+	 * packet not yet acknowledged; the delay cannot exceed the 10 ms that peers
+	 * assume in their timers. If ack_on_reorder is set, packets received out of
+	 * order are acknowledged immediately. In adaptive mode, the frequency follows
+	 * the number of packets received per RTT, i.e. the congestion window of the
+	 * peer, so that about four ACKs are sent per RTT. */
+#define PICOQUIC_ACK_FREQUENCY_DEFAULT 2
+#define PICOQUIC_ACK_FREQUENCY_MAX 64
+
+	void picoquic_set_ack_policy(picoquic_cnx_t * cnx, uint32_t ack_frequency,
+		uint64_t ack_delay_max, int ack_on_reorder, int ack_adaptive);
 
 	int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 		uint64_t current_time, uint8_t * send_buffer, size_t send_buffer_max, size_t * send_length);
@@ -217,6 +252,55 @@ extern "C" {
 	int picoquic_reset_stream(picoquic_cnx_t * cnx,
 		uint32_t stream_id);
 
+	/* Queue a buffer without copying it. The stack takes ownership of the
+	 * buffer if the call succeeds, and calls the release function once all
+	 * the bytes in the buffer are acknowledged, or when the stream is
+	 * deleted. If the release function is NULL, the buffer is released
+	 * with free(). If the call fails, the buffer stays with the caller. */
+	typedef void(*picoquic_stream_data_release_fn)(uint8_t * bytes, size_t length, void * release_ctx);
+
+	int picoquic_add_buffer_to_stream(picoquic_cnx_t * cnx,
+		uint32_t stream_id, uint8_t * data, size_t length, int set_fin,
+		picoquic_stream_data_release_fn release_fn, void * release_ctx);
+
+	/* Pull mode. Instead of queuing data in advance, the application sets a
+	 * data provider on the stream and marks the stream active. When the stream
+	 * is scheduled, the provider writes up to bytes_max bytes directly in the
+	 * packet, within the flow control limits, and returns the number of bytes
+	 * written. It sets *is_fin when the stream is complete. A provider that
+	 * returns no data and no fin makes the stream inactive, until it is
+	 * marked active again. The data is kept until acknowledged, so it
+	 * can be repeated if lost. */
+	typedef size_t(*picoquic_stream_data_provider_fn)(picoquic_cnx_t * cnx,
+		uint32_t stream_id, uint8_t * bytes, size_t bytes_max, int * is_fin, void * provider_ctx);
+
+	int picoquic_set_stream_data_provider(picoquic_cnx_t * cnx, uint32_t stream_id,
+		picoquic_stream_data_provider_fn provider_fn, void * provider_ctx);
+
+	int picoquic_mark_active_stream(picoquic_cnx_t * cnx, uint32_t stream_id, int is_active);
+
+	/* Application read mode. The received data is kept in the stream receive
+	 * buffer instead of being passed to the callback, which only gets a
+	 * picoquic_callback_stream_readable event when more data can be read.
+	 * The application reads when it wants, either by copy, or in place by
+	 * peeking at the next contiguous bytes and then consuming them. Flow
+	 * control credit is only granted as the data is consumed, so a slow
+	 * reader stops the peer instead of growing the buffer. The mode is set
+	 * per connection for the streams created afterwards, or per stream.
+	 * *is_fin is set when the returned bytes reach the end of the stream;
+	 * the stream is finished when these bytes are consumed. */
+	void picoquic_set_app_read_mode(picoquic_cnx_t * cnx, int is_app_read);
+
+	int picoquic_set_stream_app_read(picoquic_cnx_t * cnx, uint32_t stream_id, int is_app_read);
+
+	int picoquic_stream_peek(picoquic_cnx_t * cnx, uint32_t stream_id,
+		uint8_t ** bytes, size_t * length, int * is_fin);
+
+	int picoquic_stream_consume(picoquic_cnx_t * cnx, uint32_t stream_id, size_t length);
+
+	int picoquic_stream_read(picoquic_cnx_t * cnx, uint32_t stream_id,
+		uint8_t * buffer, size_t buffer_max, size_t * nb_read, int * is_fin);
+
 
 	/* Congestion algorithm definition */
 	typedef enum {
@@ -243,10 +327,60 @@ extern "C" {
 		picoquic_congestion_algorithm_delete alg_delete;
 	} picoquic_congestion_algorithm_t;
 
+	extern picoquic_congestion_algorithm_t * picoquic_newreno_algorithm;
+	extern picoquic_congestion_algorithm_t * picoquic_cubic_algorithm;
+	extern picoquic_congestion_algorithm_t * picoquic_bbr_algorithm;
+
 	void picoquic_set_default_congestion_algorithm(picoquic_quic_t * quic, picoquic_congestion_algorithm_t const * algo);
 
 	void picoquic_set_congestion_algorithm(picoquic_cnx_t * cnx, picoquic_congestion_algorithm_t const * algo);
 
+	/* Pacing is on by default. Without it, a window is sent in one burst. */
+	void picoquic_set_pacing(picoquic_cnx_t * cnx, int is_enabled);
+
+	/* HyStart++ is on by default, for the algorithms that use a slow start.
+	 * Without it, the slow start only ends with a loss. */
+	void picoquic_set_hystart(picoquic_cnx_t * cnx, int is_enabled);
+
+	/* Stream scheduler definition.
+	 * The scheduler is told when a stream becomes ready or stops being ready,
+	 * picks the next stream to send among the ready streams, and is told how
+	 * many bytes were sent on the chosen stream. Stream 0 is always served
+	 * first, and is never passed to the scheduler. */
+	typedef void(*picoquic_stream_scheduler_init) (picoquic_cnx_t * cnx);
+	typedef struct _picoquic_stream_head * (*picoquic_stream_scheduler_next) (picoquic_cnx_t * cnx);
+	typedef void(*picoquic_stream_scheduler_add) (picoquic_cnx_t * cnx, struct _picoquic_stream_head * stream);
+	typedef void(*picoquic_stream_scheduler_remove) (picoquic_cnx_t * cnx, struct _picoquic_stream_head * stream);
+	typedef void(*picoquic_stream_scheduler_notify) (picoquic_cnx_t * cnx,
+		struct _picoquic_stream_head * stream, uint64_t nb_bytes_sent);
+	typedef void(*picoquic_stream_scheduler_delete) (picoquic_cnx_t * cnx);
+
+	typedef struct st_picoquic_stream_scheduler_t {
+		uint32_t stream_scheduler_id;
+		picoquic_stream_scheduler_init sched_init;
+		picoquic_stream_scheduler_add sched_add;
+		picoquic_stream_scheduler_remove sched_remove;
+		picoquic_stream_scheduler_next sched_next;
+		picoquic_stream_scheduler_notify sched_notify;
+		picoquic_stream_scheduler_delete sched_delete;
+	} picoquic_stream_scheduler_t;
+
+	extern picoquic_stream_scheduler_t const * picoquic_round_robin_scheduler;
+	extern picoquic_stream_scheduler_t const * picoquic_strict_priority_scheduler;
+	extern picoquic_stream_scheduler_t const * picoquic_wfq_scheduler;
+
+	void picoquic_set_default_stream_scheduler(picoquic_quic_t * quic, picoquic_stream_scheduler_t const * scheduler);
+
+	void picoquic_set_stream_scheduler(picoquic_cnx_t * cnx, picoquic_stream_scheduler_t const * scheduler);
+
+	/* Lower priority values are served first by the strict priority scheduler.
+	 * The weight sets the share of the stream under weighted fair queuing. */
+#define PICOQUIC_STREAM_PRIORITY_DEFAULT 8
+#define PICOQUIC_STREAM_WEIGHT_DEFAULT 16
+
+	int picoquic_set_stream_priority(picoquic_cnx_t * cnx,
+		uint32_t stream_id, uint8_t priority, uint8_t weight);
+
     /* For building a basic HTTP 0.9 test server */
     int http0dot9_get(uint8_t * command, size_t command_length,
         uint8_t * response, size_t response_max, size_t *response_length);
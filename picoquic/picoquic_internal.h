@@ -36,17 +36,39 @@ extern "C" {
 #define PICOQUIC_ENFORCED_INITIAL_MTU 1200
 #define PICOQUIC_RESET_SECRET_SIZE 16
 #define PICOQUIC_RETRY_SECRET_SIZE 64
+#define PICOQUIC_DEFAULT_PACKET_POOL_MAX 1024
+#define PICOQUIC_MAX_SENT_FRAMES 16
+#define PICOQUIC_RETRANSMIT_RING_MIN 64
+#define PICOQUIC_ACK_ONLY_RING_SIZE 32
+#define PICOQUIC_LOST_RING_SIZE 32
+#define PICOQUIC_DEFAULT_SACK_RANGE_MAX 64
+#define PICOQUIC_SACK_RANGE_ALLOC_MIN 8
+#define PICOQUIC_STREAM_INDEX_MIN 16
+#define PICOQUIC_STREAM_INDEX_DENSITY 8
+#define PICOQUIC_STREAM_RECV_RING_MIN 4096
+#define PICOQUIC_PULLED_DATA_POOL_MAX 32
+#define PICOQUIC_STREAM_RECV_RANGE_MAX ((size_t)-1) /* bounded by the flow control window */
+#define PICOQUIC_STREAM_ACK_RANGE_MAX ((size_t)-1) /* bounded by the send queue */
 
 #define PICOQUIC_INITIAL_RTT 250000 /* 250 ms */
 #define PICOQUIC_INITIAL_RETRANSMIT_TIMER 1000000 /* one second */
 #define PICOQUIC_MIN_RETRANSMIT_TIMER 50000 /* 50 ms */
 #define PICOQUIC_ACK_DELAY_MAX 20000 /* 20 ms */
+#define PICOQUIC_MAX_ACK_DELAY 10000 /* 10 ms, delayed ACK timer of the peer */
+#define PICOQUIC_PERSISTENT_CONGESTION_PTO 2 /* consecutive probe timeouts before the window collapses */
+#define PICOQUIC_MAX_CONSECUTIVE_PTO 8 /* the connection is dropped after that */
+#define PICOQUIC_RACK_REORDER_MULT_MIN 1 /* reordering window of a quarter RTT */
+#define PICOQUIC_RACK_REORDER_MULT_MAX 4 /* up to a full RTT */
+#define PICOQUIC_RACK_REORDER_PERSIST 16 /* RTTs without spurious loss before the window shrinks */
+#define PICOQUIC_ACK_LARGEST_16BIT_RATE 2048 /* packets per RTT below which the largest acknowledged uses 16 bits */
 
 #define PICOQUIC_MICROSEC_SILENCE_MAX 120000000 /* 120 seconds for now */
 #define PICOQUIC_MICROSEC_WAIT_MAX 10000000 /* 10 seconds for now */
 
 #define PICOQUIC_CWIN_INITIAL  (10*PICOQUIC_MAX_PACKET_SIZE)
 #define PICOQUIC_CWIN_MINIMUM  (2*PICOQUIC_MAX_PACKET_SIZE)
+#define PICOQUIC_PACING_BUCKET_MAX (4*PICOQUIC_MAX_PACKET_SIZE) /* burst allowed after idle */
+#define PICOQUIC_PACING_WINDOW_GAIN 2 /* window paced over half the RTT if no pacing rate */
 
 	/*
 	* Supported versions
@@ -86,11 +108,32 @@ extern "C" {
 
 		picoquic_stateless_packet_t * pending_stateless_packet;
 
+		/* Pool of free packets, to avoid calls to malloc and free on the send and ack path.
+		 * A QUIC context is only used by one thread, so no locking is required. */
+		picoquic_packet * packet_pool;
+		picoquic_stateless_packet_t * stateless_packet_pool;
+		size_t packet_pool_size;
+		size_t stateless_packet_pool_size;
+		size_t packet_pool_max;
+		uint64_t packet_pool_hit;
+		uint64_t packet_pool_miss;
+		struct st_picoquic_sent_packet_t * sent_packet_pool;
+		size_t sent_packet_pool_size;
+
+		/* Maximum number of ranges tracked in each SACK list */
+		size_t sack_range_max;
+
 		picoquic_congestion_algorithm_t const * default_congestion_alg;
+		picoquic_stream_scheduler_t const * default_stream_scheduler;
 
 		struct st_picoquic_cnx_t * cnx_list;
 		struct st_picoquic_cnx_t * cnx_last;
 
+		/* Binary heap of connections, ordered by next wake time */
+		struct st_picoquic_cnx_t ** wake_heap;
+		size_t wake_heap_size;
+		size_t wake_heap_max;
+
 		picohash_table * table_cnx_by_id;
 		picohash_table * table_cnx_by_net;
 	} picoquic_quic_t;
@@ -109,15 +152,27 @@ extern "C" {
 	} picoquic_transport_parameters;
 
 	/*
-	 * SACK dashboard item, part of connection context.
+	 * SACK dashboard, part of connection and stream contexts.
+	 * The ranges are kept in a contiguous array, ordered from the lowest
+	 * to the highest, so that lookups use a binary search, packets that
+	 * arrive in order extend the last range, and other updates only move
+	 * items inside the array. The array grows by doubling until it
+	 * holds max_ranges; past that, the lowest range is forgotten and the
+	 * numbers below the horizon are treated as already received.
 	 */
 
-	typedef struct st_picoquic_sack_item_t {
-		struct st_picoquic_sack_item_t * next_sack;
+	typedef struct st_picoquic_sack_range_t {
 		uint64_t start_of_sack_range;
 		uint64_t end_of_sack_range;
-		// uint64_t time_stamp_last_in_range;
-	} picoquic_sack_item_t;
+	} picoquic_sack_range_t;
+
+	typedef struct st_picoquic_sack_list_t {
+		picoquic_sack_range_t * ranges;
+		size_t nb_ranges;
+		size_t nb_ranges_alloc;
+		size_t max_ranges;
+		uint64_t horizon;
+	} picoquic_sack_list_t;
 
 	/*
 	 * Types of frames
@@ -153,6 +208,9 @@ extern "C" {
 		uint64_t offset;
 		size_t length;
 		uint8_t * bytes;
+		picoquic_stream_data_release_fn release_fn;
+		void * release_ctx;
+		int is_pulled; /* bytes follow the header in the same allocation */
 	} picoquic_stream_data;
 
 	typedef enum picoquic_stream_flags {
@@ -166,6 +224,29 @@ extern "C" {
 		picoquic_stream_flag_reset_signalled = 128
 	} picoquic_stream_flags;
 
+	/*
+	 * Streams that have something to send, and streams that need a
+	 * MAX_STREAM_DATA update, are kept in queues of the connection, so
+	 * the sender does not need to look at idle streams. Each stream
+	 * carries one link per queue, plus one for the stream scheduler.
+	 */
+	typedef enum {
+		picoquic_stream_queue_ready = 0,
+		picoquic_stream_queue_max_data = 1,
+		picoquic_nb_stream_queues = 2
+	} picoquic_stream_queue_enum;
+
+	typedef struct st_picoquic_stream_link_t {
+		struct _picoquic_stream_head * next;
+		struct _picoquic_stream_head * previous;
+		int is_queued;
+	} picoquic_stream_link_t;
+
+	typedef struct st_picoquic_stream_queue_t {
+		struct _picoquic_stream_head * first;
+		struct _picoquic_stream_head * last;
+	} picoquic_stream_queue_t;
+
 	typedef struct _picoquic_stream_head {
 		struct _picoquic_stream_head * next_stream;
 		uint32_t stream_id;
@@ -178,13 +259,50 @@ extern "C" {
 		uint32_t remote_error;
 		picoquic_stream_data * stream_data;
 		uint64_t sent_offset;
+		uint64_t queued_offset;
 		picoquic_stream_data * send_queue;
-        picoquic_sack_item_t first_sack_item;
+		picoquic_stream_data * send_queue_last;
+		picoquic_stream_data * send_next;
+		uint64_t acked_offset;
+		picoquic_sack_list_t sack_list;
+		picoquic_stream_link_t queue_link[picoquic_nb_stream_queues];
+		uint8_t priority;
+		uint8_t weight;
+		picoquic_stream_link_t scheduler_link;
+		size_t scheduler_index;
+		uint64_t scheduler_tag;
+		picoquic_stream_data_provider_fn provider_fn;
+		void * provider_ctx;
+		int is_active;
+		int is_unsent;
+		uint8_t * recv_ring;
+		size_t recv_ring_size;
+		picoquic_sack_list_t recv_ranges;
+		int is_app_read;
 	} picoquic_stream_head;
 
 	/*
-	 * Packet sent, and queued for retransmission.
-	 * The packet is not encrypted.
+	 * On stream 0, received data is kept in the stream_data list, sorted by
+	 * offset, until read by TLS. On the other streams, data that arrives at
+	 * consumed_offset is passed to the callback directly from the packet.
+	 * Data that arrives out of order is copied in the receive ring, at
+	 * position offset modulo the ring size, and its ranges are recorded in
+	 * recv_ranges. The ring covers the bytes from consumed_offset, and flow
+	 * control limits its size to the receive window. In application read
+	 * mode, all the data goes through the ring, and consumed_offset only
+	 * moves when the application reads.
+	 *
+	 * The send queue holds the data posted by the application, in order.
+	 * The offset of each chunk is its position in the stream. Chunks stay
+	 * in the queue after being sent, and are only freed once acknowledged,
+	 * so that lost data can be copied again in a new packet. All the bytes
+	 * before acked_offset are acknowledged, and the sack_list of the stream
+	 * records the acknowledged ranges above it. The send_next chunk
+	 * contains sent_offset, i.e. the next byte to send for the first
+	 * time. New chunks are appended after send_queue_last.
+	 * A chunk either holds a copy of the application data, freed with the
+	 * chunk, or a buffer given by the application, returned through the
+	 * release function of the chunk.
 	 */
 
 	typedef enum
@@ -201,6 +319,115 @@ extern "C" {
 		picoquic_packet_type_max = 9
 	} picoquic_packet_type_enum;
 
+	/*
+	 * Packet sent, and queued for retransmission.
+	 * The packet bytes are not kept, only a compact description of the frames
+	 * that it carried. If the packet is lost, the frames are regenerated from
+	 * the current state of the connection: stream data is copied again from
+	 * the stream send queue, control frames are repeated with current values.
+	 * ACK frames are never repeated. The packet only documents whether it
+	 * carried one, and its largest value, which is all that the processing
+	 * of acknowledgements requires.
+	 */
+
+	typedef enum
+	{
+		picoquic_sent_frame_stream = 0,
+		picoquic_sent_frame_reset_stream = 1,
+		picoquic_sent_frame_max_data = 2,
+		picoquic_sent_frame_max_stream_data = 3,
+		picoquic_sent_frame_connection_close = 4
+	} picoquic_sent_frame_type_enum;
+
+	typedef struct st_picoquic_sent_frame_t {
+		uint8_t frame_type;
+		uint8_t fin;
+		uint16_t length;
+		uint32_t stream_id;
+		uint64_t offset;
+	} picoquic_sent_frame_t;
+
+	typedef struct st_picoquic_sent_packet_t {
+		struct st_picoquic_sent_packet_t * previous_packet;
+		struct st_picoquic_sent_packet_t * next_packet;
+
+		uint64_t sequence_number;
+		uint64_t send_time;
+		uint64_t cnx_id;
+		size_t length;
+		size_t checksum_overhead;
+		picoquic_packet_type_enum ptype;
+		int has_ack;
+		uint64_t ack_largest;
+		/* Delivery state of the connection when the packet was sent */
+		uint64_t delivered;
+		uint64_t delivered_time;
+		uint64_t delivered_sent_time;
+		int is_app_limited;
+		int nb_frames;
+		picoquic_sent_frame_t frames[PICOQUIC_MAX_SENT_FRAMES];
+	} picoquic_sent_packet_t;
+
+	/*
+	 * Delivery rate sample, taken when a packet is acknowledged: the bytes
+	 * delivered since the packet was sent, over the longest of the send and
+	 * ack intervals. Samples taken while the application did not fill the
+	 * window underestimate the path and are marked app limited.
+	 */
+	typedef struct st_picoquic_rate_sample_t {
+		uint64_t prior_delivered;
+		uint64_t delivered;
+		uint64_t interval;
+		uint64_t delivery_rate; /* bytes per second */
+		int is_app_limited;
+	} picoquic_rate_sample_t;
+
+	/*
+	 * HyStart++ slow start exit, per RFC 9406. The minimum RTT is tracked
+	 * per round trip, a round ending when the data delivered at its start
+	 * is acknowledged. An RTT increase moves the sender to a conservative
+	 * slow start, which ends slow start after a few rounds unless the RTT
+	 * goes back down. The state can be embedded in any congestion algorithm.
+	 */
+	typedef enum {
+		picoquic_hystart_slow_start = 0,
+		picoquic_hystart_conservative,
+		picoquic_hystart_exited
+	} picoquic_hystart_phase_t;
+
+	typedef struct st_picoquic_hystart_state_t {
+		picoquic_hystart_phase_t phase;
+		uint64_t round_end_delivered;
+		uint64_t last_round_min_rtt;
+		uint64_t current_round_min_rtt;
+		uint64_t css_baseline_min_rtt;
+		unsigned int rtt_sample_count;
+		unsigned int css_round_count;
+	} picoquic_hystart_state_t;
+
+	/*
+	 * Packets that only carry an ACK are never repeated and do not count
+	 * as bytes in transit. They are not queued for retransmission; only
+	 * their send time and largest acknowledged number are kept, in a small
+	 * ring indexed by sequence number, for RTT samples and for pruning the
+	 * ACK ranges once the peer acknowledges them.
+	 */
+	typedef struct st_picoquic_ack_only_packet_t {
+		uint64_t sequence_number;
+		uint64_t send_time;
+		uint64_t ack_largest;
+	} picoquic_ack_only_packet_t;
+
+	/*
+	 * The numbers of the last packets declared lost are kept in a small
+	 * ring. If one of them is acknowledged later, the loss was spurious,
+	 * most likely caused by reordering.
+	 */
+	typedef struct st_picoquic_lost_packet_t {
+		uint64_t sequence_number;
+		int timer_based;
+	} picoquic_lost_packet_t;
+
 	/*
 	 * Per connection context.
 	 */
@@ -211,6 +438,8 @@ extern "C" {
 		/* Management of context retrieval tables */
 		struct st_picoquic_cnx_t * next_in_table;
 		struct st_picoquic_cnx_t * previous_in_table;
+		struct st_picoquic_cnx_t * next_due_cnx;
+		size_t wake_heap_index;
 		struct st_picoquic_cnx_id_t * first_cnx_id;
 		struct st_picoquic_net_id_t * first_net_id;
 
@@ -229,6 +458,7 @@ extern "C" {
 		/* Call back function and context */
 		picoquic_stream_data_cb_fn callback_fn;
 		void * callback_ctx;
+		int is_app_read_default;
 
         /* Peer address. To do: allow for multiple addresses */
         struct sockaddr_storage peer_addr;
@@ -261,30 +491,70 @@ extern "C" {
         void * aead_de_encrypt_ctx; /* used by logging functions to see what is sent. */
 
 		/* Receive state */
-		picoquic_sack_item_t first_sack_item;
+		picoquic_sack_list_t sack_list;
         uint64_t time_stamp_largest_received;
 		uint64_t sack_block_size_max;
 		uint64_t highest_ack_sent;
 		uint64_t highest_ack_time;
 		int ack_needed;
 
+		/* Delayed ACK policy */
+		uint32_t ack_frequency;
+		uint32_t ack_frequency_adaptive;
+		uint64_t ack_delay_max;
+		int ack_on_reorder;
+		int ack_adaptive;
+		int ack_reorder_detected;
+		uint64_t ack_nb_pending;
+		uint64_t ack_pending_time;
+		uint64_t ack_rate_start_time;
+		uint64_t ack_rate_nb_received;
+		uint64_t ack_rate_nb_last;
+		uint64_t nb_ack_ranges_truncated;
+
 		/* Time measurement */
 		uint64_t smoothed_rtt;
 		uint64_t rtt_variant;
 		uint64_t retransmit_timer;
 		uint64_t rtt_min;
+		uint64_t latest_rtt;
+
+		/* Packing statistics */
+		uint64_t nb_packets_sent;
+		uint64_t nb_packet_bytes_used;
+		uint64_t nb_packet_bytes_mtu;
 
 		/* Retransmission state */
 		uint64_t nb_retransmit;
 		uint64_t latest_retransmit_time;
 		uint64_t highest_acknowledged; 
 		uint64_t latest_time_acknowledged; /* time at which the highest acknowledged was sent */
-		picoquic_packet * retransmit_newest;
-		picoquic_packet * retransmit_oldest;
+		picoquic_sent_packet_t * retransmit_newest;
+		picoquic_sent_packet_t * retransmit_oldest;
+		picoquic_sent_packet_t ** retransmit_ring;
+		size_t retransmit_ring_size;
+		size_t nb_retransmit_packets;
+		picoquic_ack_only_packet_t ack_only_ring[PICOQUIC_ACK_ONLY_RING_SIZE];
+
+		/* Loss detection: the RACK reordering window is a multiple of a quarter RTT,
+		 * raised when spurious losses are detected */
+		uint64_t rack_reorder_mult;
+		uint64_t rack_reorder_raise_time;
+		uint64_t nb_spurious;
+		picoquic_lost_packet_t lost_ring[PICOQUIC_LOST_RING_SIZE];
 
 		/* Congestion control state */
 		uint64_t cwin;
 		uint64_t bytes_in_transit;
+		uint64_t pacing_rate; /* bytes per second, set by the congestion algorithm, 0 if none */
+		uint64_t pacing_next_time; /* new data is not sent before that time */
+		int is_pacing_disabled;
+		int is_hystart_disabled;
+		uint64_t delivered;
+		uint64_t delivered_time;
+		uint64_t delivered_sent_time;
+		uint64_t app_limited; /* delivered count at which the app limited period ends, 0 if none */
+		picoquic_rate_sample_t rate_sample;
 		void * congestion_alg_state;
 		picoquic_congestion_algorithm_t const * congestion_alg;
 
@@ -298,8 +568,22 @@ extern "C" {
 		uint32_t max_stream_id_local;
 		uint32_t max_stream_id_remote;
 
-		/* Management of streams */
+		/* Management of streams. The streams are chained in increasing ID
+		 * order, starting with stream 0, and also indexed by ID: IDs below
+		 * stream_index_size are found in the dense array, others in the
+		 * hash table. */
 		picoquic_stream_head first_stream;
+		picoquic_stream_head * last_stream;
+		picoquic_stream_head ** stream_index;
+		size_t stream_index_size;
+		picohash_table * stream_table;
+		size_t nb_streams;
+		picoquic_stream_queue_t stream_queue[picoquic_nb_stream_queues];
+		size_t nb_streams_unsent; /* streams other than 0 with data not sent yet, ready or not */
+		picoquic_stream_data * pulled_data_pool;
+		size_t pulled_data_pool_size;
+		void * stream_scheduler_state;
+		picoquic_stream_scheduler_t const * stream_scheduler;
 
 	} picoquic_cnx_t;
 
@@ -308,8 +592,18 @@ extern "C" {
 	void picoquic_queue_stateless_packet(picoquic_quic_t * quic, picoquic_stateless_packet_t * sp);
 
 	/* handling of retransmission queue */
-	void picoquic_enqueue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p);
-	void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p, int should_free);
+	picoquic_sent_packet_t * picoquic_create_sent_packet(picoquic_quic_t * quic);
+	void picoquic_delete_sent_packet(picoquic_quic_t * quic, picoquic_sent_packet_t * sent);
+	void picoquic_record_sent_frame(picoquic_sent_packet_t * sent, picoquic_sent_frame_type_enum frame_type,
+		uint32_t stream_id, uint64_t offset, size_t length, int fin);
+	int picoquic_reserve_retransmit_ring(picoquic_cnx_t * cnx, uint64_t sequence_number);
+	picoquic_sent_packet_t * picoquic_find_sent_packet(picoquic_cnx_t * cnx, uint64_t sequence_number);
+	void picoquic_enqueue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p);
+	void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p, int should_free);
+	void picoquic_record_ack_only_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p);
+	picoquic_ack_only_packet_t * picoquic_find_ack_only_packet(picoquic_cnx_t * cnx, uint64_t sequence_number);
+	void picoquic_record_lost_packet(picoquic_cnx_t * cnx, uint64_t sequence_number, int timer_based);
+	uint64_t picoquic_rack_reorder_window(picoquic_cnx_t * cnx, uint64_t current_time);
 
 	/* Reset connection after receiving version negotiation */
 	int picoquic_reset_cnx_version(picoquic_cnx_t * cnx, uint8_t * bytes, size_t length);
@@ -318,12 +612,25 @@ extern "C" {
 	picoquic_cnx_t * picoquic_cnx_by_id(picoquic_quic_t * quic, uint64_t cnx_id);
 	picoquic_cnx_t * picoquic_cnx_by_net(picoquic_quic_t * quic, struct sockaddr* addr);
 
-    /* Next time is used to order the list of available connections,
+    /* Next time is used to order the heap of available connections,
      * so ready connections are polled first */
     void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx);
 
+    /* Schedule the connection for immediate polling, e.g. when new data is queued */
+    void picoquic_cnx_wake_now(picoquic_cnx_t * cnx);
+
     void picoquic_cnx_set_next_wake_time(picoquic_cnx_t * cnx, uint64_t current_time);
 
+    /* Slow start exit, shared by the congestion algorithms */
+    void picoquic_hystart_init(picoquic_cnx_t * cnx, picoquic_hystart_state_t * hystart);
+    void picoquic_hystart_notify_rtt(picoquic_hystart_state_t * hystart, uint64_t rtt_measurement);
+    uint64_t picoquic_hystart_notify_ack(picoquic_cnx_t * cnx, picoquic_hystart_state_t * hystart,
+        uint64_t nb_bytes_acknowledged);
+
+    /* Pacing of new data */
+    int picoquic_is_sending_authorized_by_pacing(picoquic_cnx_t * cnx, uint64_t current_time, uint64_t * next_time);
+    void picoquic_update_pacing_after_send(picoquic_cnx_t * cnx, uint64_t nb_bytes, uint64_t current_time);
+
 	/* Integer parsing macros */
 #define PICOPARSE_16(b) ((((uint16_t)(b)[0])<<8)|(b)[1])
 #define PICOPARSE_24(b) ((((uint32_t)PICOPARSE_16(b))<<16)|((b)[2]))
@@ -361,39 +668,56 @@ extern "C" {
 
 	/* handling of ACK logic */
 	int picoquic_is_ack_needed(picoquic_cnx_t * cnx, uint64_t current_time);
+	void picoquic_update_ack_policy(picoquic_cnx_t * cnx, uint64_t pn64, uint64_t current_time);
 
 	int picoquic_is_pn_already_received(picoquic_cnx_t * cnx, uint64_t pn64);
 	int picoquic_record_pn_received(picoquic_cnx_t * cnx, uint64_t pn64, uint64_t current_microsec);
 	uint16_t picoquic_deltat_to_float16(uint64_t delta_t);
 	uint64_t picoquic_float16_to_deltat(uint16_t float16);
 
-    int picoquic_update_sack_list(picoquic_sack_item_t * sack,
+    void picoquic_sack_list_init(picoquic_sack_list_t * sack_list, size_t max_ranges);
+    void picoquic_sack_list_free(picoquic_sack_list_t * sack_list);
+    uint64_t picoquic_sack_list_largest(picoquic_sack_list_t const * sack_list);
+    int picoquic_update_sack_list(picoquic_sack_list_t * sack_list,
         uint64_t pn64_min, uint64_t pn64_max,
         uint64_t * sack_block_size_max);
     /*
      * Check whether the data fills a hole. returns 0 if it does, -1 otherwise.
      */
-    int picoquic_check_sack_list(picoquic_sack_item_t * sack,
+    int picoquic_check_sack_list(picoquic_sack_list_t const * sack_list,
         uint64_t pn64_min, uint64_t pn64_max);
 
 	/* stream management */
 	picoquic_stream_head * picoquic_find_stream(picoquic_cnx_t * cnx, uint32_t stream_id, int create);
+	void picoquic_delete_stream_index(picoquic_cnx_t * cnx);
 	picoquic_stream_head * picoquic_find_ready_stream(picoquic_cnx_t * cnx, int restricted);
+	int picoquic_has_unsent_stream_data(picoquic_cnx_t * cnx);
+	void picoquic_update_stream_ready(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+	void picoquic_update_all_streams_ready(picoquic_cnx_t * cnx);
+	picoquic_stream_head * picoquic_next_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+	void picoquic_update_stream_max_data(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+	void picoquic_stream_data_callback(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+	uint64_t picoquic_stream_readable_offset(picoquic_stream_head * stream);
 	int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint32_t stream_id,
 		uint64_t offset, int fin, uint8_t * bytes, size_t length, uint64_t current_time);
 	int picoquic_decode_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 		size_t bytes_max, int restricted, size_t * consumed, uint64_t current_time);
 	int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
-		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+		uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent);
 	int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+	int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
+		size_t bytes_max, int restricted, size_t * consumed, uint64_t current_time);
 	int picoquic_prepare_connection_close_frame(picoquic_cnx_t * cnx,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
 	int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx,
-		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+		uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent);
 	int picoquic_prepare_max_data_frame(picoquic_cnx_t * cnx, uint64_t maxdata_increase,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+	int picoquic_prepare_repeated_frame(picoquic_cnx_t * cnx, picoquic_sent_frame_t * frame,
+		uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent);
     void picoquic_clear_stream(picoquic_stream_head * stream);
+    void picoquic_free_stream_data(picoquic_stream_data * stream_data);
 
 	/* send/receive */
 
@@ -20,6 +20,7 @@
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include "picoquic_internal.h"
 #include "tls_api.h"
@@ -27,10 +28,14 @@
 /*
  * Default congestion algorithm
  */
-extern picoquic_congestion_algorithm_t * picoquic_newreno_algorithm;
-
 #define PICOQUIC_DEFAULT_CONGESTION_ALGORITHM picoquic_newreno_algorithm;
 
+/*
+ * Default stream scheduler. With equal priorities, strict priority serves
+ * the lowest stream ID first, as the sender always did.
+ */
+#define PICOQUIC_DEFAULT_STREAM_SCHEDULER picoquic_strict_priority_scheduler
+
 /*
 * Structures used in the hash table of connections
 */
@@ -115,7 +120,10 @@ picoquic_quic_t * picoquic_create(uint32_t nb_connections,
 		quic->default_callback_fn = default_callback_fn;
 		quic->default_callback_ctx = default_callback_ctx;
 		quic->default_congestion_alg = PICOQUIC_DEFAULT_CONGESTION_ALGORITHM;
+		quic->default_stream_scheduler = PICOQUIC_DEFAULT_STREAM_SCHEDULER;
 		quic->default_alpn = picoquic_string_duplicate(default_alpn);
+		quic->packet_pool_max = PICOQUIC_DEFAULT_PACKET_POOL_MAX;
+		quic->sack_range_max = PICOQUIC_DEFAULT_SACK_RANGE_MAX;
 
         if (cert_file_name != NULL)
         {
@@ -173,6 +181,34 @@ void picoquic_free(picoquic_quic_t * quic)
             picoquic_delete_cnx(quic->cnx_list);
         }
 
+        /* delete the pooled packets, after the connections returned theirs */
+        while (quic->packet_pool != NULL)
+        {
+            picoquic_packet * to_delete = quic->packet_pool;
+            quic->packet_pool = to_delete->next_packet;
+            free(to_delete);
+        }
+
+        while (quic->stateless_packet_pool != NULL)
+        {
+            picoquic_stateless_packet_t * to_delete = quic->stateless_packet_pool;
+            quic->stateless_packet_pool = to_delete->next_packet;
+            free(to_delete);
+        }
+
+        while (quic->sent_packet_pool != NULL)
+        {
+            picoquic_sent_packet_t * to_delete = quic->sent_packet_pool;
+            quic->sent_packet_pool = to_delete->next_packet;
+            free(to_delete);
+        }
+
+        if (quic->wake_heap != NULL)
+        {
+            free(quic->wake_heap);
+            quic->wake_heap = NULL;
+        }
+
         if (quic->table_cnx_by_id != NULL)
         {
             picohash_delete(quic->table_cnx_by_id, 1);
@@ -207,14 +243,155 @@ void picoquic_set_cookie_mode(picoquic_quic_t * quic, int cookie_mode)
     }
 }
 
+picoquic_packet * picoquic_create_packet(picoquic_quic_t * quic)
+{
+    picoquic_packet * packet = quic->packet_pool;
+
+    if (packet != NULL)
+    {
+        quic->packet_pool = packet->next_packet;
+        quic->packet_pool_size--;
+        quic->packet_pool_hit++;
+    }
+    else
+    {
+        packet = (picoquic_packet *)malloc(sizeof(picoquic_packet));
+        quic->packet_pool_miss++;
+    }
+
+    if (packet != NULL)
+    {
+        /* No need to clear the content bytes, they are always written before use */
+        memset(packet, 0, offsetof(picoquic_packet, bytes));
+    }
+
+    return packet;
+}
+
+void picoquic_delete_packet(picoquic_quic_t * quic, picoquic_packet * packet)
+{
+    if (quic->packet_pool_size < quic->packet_pool_max)
+    {
+        packet->previous_packet = NULL;
+        packet->next_packet = quic->packet_pool;
+        quic->packet_pool = packet;
+        quic->packet_pool_size++;
+    }
+    else
+    {
+        free(packet);
+    }
+}
+
+void picoquic_set_packet_pool_max(picoquic_quic_t * quic, size_t packet_pool_max)
+{
+    quic->packet_pool_max = packet_pool_max;
+
+    while (quic->packet_pool_size > packet_pool_max)
+    {
+        picoquic_packet * to_delete = quic->packet_pool;
+        quic->packet_pool = to_delete->next_packet;
+        quic->packet_pool_size--;
+        free(to_delete);
+    }
+
+    while (quic->stateless_packet_pool_size > packet_pool_max)
+    {
+        picoquic_stateless_packet_t * to_delete = quic->stateless_packet_pool;
+        quic->stateless_packet_pool = to_delete->next_packet;
+        quic->stateless_packet_pool_size--;
+        free(to_delete);
+    }
+
+    while (quic->sent_packet_pool_size > packet_pool_max)
+    {
+        picoquic_sent_packet_t * to_delete = quic->sent_packet_pool;
+        quic->sent_packet_pool = to_delete->next_packet;
+        quic->sent_packet_pool_size--;
+        free(to_delete);
+    }
+}
+
+void picoquic_get_packet_pool_stats(picoquic_quic_t * quic, uint64_t * nb_hit, uint64_t * nb_miss)
+{
+    *nb_hit = quic->packet_pool_hit;
+    *nb_miss = quic->packet_pool_miss;
+}
+
+void picoquic_set_sack_range_max(picoquic_quic_t * quic, size_t sack_range_max)
+{
+    quic->sack_range_max = sack_range_max;
+}
+
+picoquic_sent_packet_t * picoquic_create_sent_packet(picoquic_quic_t * quic)
+{
+    picoquic_sent_packet_t * sent = quic->sent_packet_pool;
+
+    if (sent != NULL)
+    {
+        quic->sent_packet_pool = sent->next_packet;
+        quic->sent_packet_pool_size--;
+    }
+    else
+    {
+        sent = (picoquic_sent_packet_t *)malloc(sizeof(picoquic_sent_packet_t));
+    }
+
+    if (sent != NULL)
+    {
+        /* The frame descriptions are written before use */
+        memset(sent, 0, offsetof(picoquic_sent_packet_t, frames));
+    }
+
+    return sent;
+}
+
+void picoquic_delete_sent_packet(picoquic_quic_t * quic, picoquic_sent_packet_t * sent)
+{
+    if (quic->sent_packet_pool_size < quic->packet_pool_max)
+    {
+        sent->previous_packet = NULL;
+        sent->next_packet = quic->sent_packet_pool;
+        quic->sent_packet_pool = sent;
+        quic->sent_packet_pool_size++;
+    }
+    else
+    {
+        free(sent);
+    }
+}
+
 picoquic_stateless_packet_t * picoquic_create_stateless_packet(picoquic_quic_t * quic)
 {
-	return (picoquic_stateless_packet_t *)malloc(sizeof(picoquic_stateless_packet_t));
+	picoquic_stateless_packet_t * sp = quic->stateless_packet_pool;
+
+	if (sp != NULL)
+	{
+		quic->stateless_packet_pool = sp->next_packet;
+		quic->stateless_packet_pool_size--;
+		quic->packet_pool_hit++;
+	}
+	else
+	{
+		sp = (picoquic_stateless_packet_t *)malloc(sizeof(picoquic_stateless_packet_t));
+		quic->packet_pool_miss++;
+	}
+
+	return sp;
 }
 
-void picoquic_delete_stateless_packet(picoquic_stateless_packet_t * sp)
+void picoquic_delete_stateless_packet(picoquic_quic_t * quic, picoquic_stateless_packet_t * sp)
 {
-	free(sp);
+	if (quic->stateless_packet_pool_size < quic->packet_pool_max)
+	{
+		sp->next_packet = quic->stateless_packet_pool;
+		quic->stateless_packet_pool = sp;
+		quic->stateless_packet_pool_size++;
+	}
+	else
+	{
+		free(sp);
+	}
 }
 
 void picoquic_queue_stateless_packet(picoquic_quic_t * quic, picoquic_stateless_packet_t * sp)
@@ -278,6 +455,11 @@ int picoquic_register_cnx_id(picoquic_quic_t * quic, picoquic_cnx_t * cnx, uint6
         }
     }
 
+    if (key != NULL && ret != 0)
+    {
+        free(key);
+    }
+
     return ret;
 }
 
@@ -341,40 +523,30 @@ void picoquic_init_transport_parameters(picoquic_transport_parameters * tp)
 	tp->max_packet_size = PICOQUIC_MAX_PACKET_SIZE - 16 - 40;
 }
 
-static void picoquic_insert_cnx_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
-{
-    picoquic_cnx_t * cnx_next = quic->cnx_list;
-    picoquic_cnx_t * previous = NULL;
-    while (cnx_next != NULL &&
-        cnx_next->next_wake_time <= cnx->next_wake_time)
-    {
-        previous = cnx_next;
-        cnx_next = cnx_next->next_in_table;
-    }
-
-    cnx->previous_in_table = previous;
-    if (previous == NULL)
-    {
-        quic->cnx_list = cnx;
-    }
-    else
-    {
-        previous->next_in_table = cnx;
-    }
+/*
+ * The list of connections is kept in creation order, newest first, for
+ * enumeration. The wake time order is kept in a binary heap, so updates
+ * cost O(log N) and the next connection to wake up is always at the root.
+ */
 
-    cnx->next_in_table = cnx_next;
+static void picoquic_insert_cnx_in_list(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    cnx->previous_in_table = NULL;
+    cnx->next_in_table = quic->cnx_list;
 
-    if (cnx_next == NULL)
+    if (quic->cnx_list == NULL)
     {
         quic->cnx_last = cnx;
     }
     else
     {
-        cnx_next->previous_in_table = cnx;
+        quic->cnx_list->previous_in_table = cnx;
     }
+
+    quic->cnx_list = cnx;
 }
 
-void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+static void picoquic_remove_cnx_from_list(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
 {
     if (cnx->next_in_table == NULL)
     {
@@ -393,8 +565,129 @@ void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx
     {
         cnx->previous_in_table->next_in_table = cnx->next_in_table;
     }
+}
+
+static void picoquic_wake_heap_set(picoquic_quic_t * quic, size_t index, picoquic_cnx_t * cnx)
+{
+    quic->wake_heap[index] = cnx;
+    cnx->wake_heap_index = index;
+}
+
+static void picoquic_wake_heap_sift_up(picoquic_quic_t * quic, size_t index)
+{
+    picoquic_cnx_t * cnx = quic->wake_heap[index];
+
+    while (index > 0)
+    {
+        size_t parent = (index - 1) / 2;
+
+        if (quic->wake_heap[parent]->next_wake_time <= cnx->next_wake_time)
+        {
+            break;
+        }
+
+        picoquic_wake_heap_set(quic, index, quic->wake_heap[parent]);
+        index = parent;
+    }
+
+    picoquic_wake_heap_set(quic, index, cnx);
+}
+
+static void picoquic_wake_heap_sift_down(picoquic_quic_t * quic, size_t index)
+{
+    picoquic_cnx_t * cnx = quic->wake_heap[index];
+
+    for (;;)
+    {
+        size_t child = 2 * index + 1;
+
+        if (child >= quic->wake_heap_size)
+        {
+            break;
+        }
+
+        if (child + 1 < quic->wake_heap_size &&
+            quic->wake_heap[child + 1]->next_wake_time < quic->wake_heap[child]->next_wake_time)
+        {
+            child++;
+        }
+
+        if (cnx->next_wake_time <= quic->wake_heap[child]->next_wake_time)
+        {
+            break;
+        }
+
+        picoquic_wake_heap_set(quic, index, quic->wake_heap[child]);
+        index = child;
+    }
+
+    picoquic_wake_heap_set(quic, index, cnx);
+}
+
+static int picoquic_wake_heap_insert(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    int ret = 0;
+
+    if (quic->wake_heap_size >= quic->wake_heap_max)
+    {
+        size_t new_max = (quic->wake_heap_max == 0) ? 16 : 2 * quic->wake_heap_max;
+        picoquic_cnx_t ** new_heap = (picoquic_cnx_t **)realloc(quic->wake_heap,
+            new_max * sizeof(picoquic_cnx_t *));
+
+        if (new_heap == NULL)
+        {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else
+        {
+            quic->wake_heap = new_heap;
+            quic->wake_heap_max = new_max;
+        }
+    }
+
+    if (ret == 0)
+    {
+        picoquic_wake_heap_set(quic, quic->wake_heap_size, cnx);
+        quic->wake_heap_size++;
+        picoquic_wake_heap_sift_up(quic, cnx->wake_heap_index);
+    }
+
+    return ret;
+}
+
+static void picoquic_wake_heap_remove(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    size_t index = cnx->wake_heap_index;
+
+    quic->wake_heap_size--;
+
+    if (index < quic->wake_heap_size)
+    {
+        picoquic_wake_heap_set(quic, index, quic->wake_heap[quic->wake_heap_size]);
+        picoquic_reinsert_by_wake_time(quic, quic->wake_heap[index]);
+    }
+
+    quic->wake_heap[quic->wake_heap_size] = NULL;
+}
+
+void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    size_t index = cnx->wake_heap_index;
+
+    if (index > 0 && quic->wake_heap[(index - 1) / 2]->next_wake_time > cnx->next_wake_time)
+    {
+        picoquic_wake_heap_sift_up(quic, index);
+    }
+    else
+    {
+        picoquic_wake_heap_sift_down(quic, index);
+    }
+}
 
-    picoquic_insert_cnx_by_wake_time(quic, cnx);
+void picoquic_cnx_wake_now(picoquic_cnx_t * cnx)
+{
+    cnx->next_wake_time = 0;
+    picoquic_reinsert_by_wake_time(cnx->quic, cnx);
 }
 
 picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic, 
@@ -412,7 +705,15 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
         cnx->start_time = start_time;
 
         cnx->quic = quic;
-        picoquic_insert_cnx_by_wake_time(quic, cnx);
+        if (picoquic_wake_heap_insert(quic, cnx) != 0)
+        {
+            free(cnx);
+            cnx = NULL;
+        }
+        else
+        {
+            picoquic_insert_cnx_in_list(quic, cnx);
+        }
     }
 
     if (cnx != NULL)
@@ -487,14 +788,25 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 		if (cnx != NULL)
 		{
 
-			cnx->first_sack_item.start_of_sack_range = 0;
-			cnx->first_sack_item.end_of_sack_range = 0;
-			cnx->first_sack_item.next_sack = NULL;
+			picoquic_sack_list_init(&cnx->sack_list, quic->sack_range_max);
 			cnx->sack_block_size_max = 0;
 			cnx->highest_ack_sent = 0;
 			cnx->highest_ack_time = start_time;
             cnx->time_stamp_largest_received = start_time;
 
+			cnx->ack_frequency = PICOQUIC_ACK_FREQUENCY_DEFAULT;
+			cnx->ack_frequency_adaptive = PICOQUIC_ACK_FREQUENCY_DEFAULT;
+			cnx->ack_delay_max = PICOQUIC_MAX_ACK_DELAY;
+			cnx->ack_on_reorder = 1;
+			cnx->ack_adaptive = 0;
+			cnx->ack_reorder_detected = 0;
+			cnx->ack_nb_pending = 0;
+			cnx->ack_pending_time = start_time;
+			cnx->ack_rate_start_time = start_time;
+			cnx->ack_rate_nb_received = 0;
+			cnx->ack_rate_nb_last = 0;
+			cnx->nb_ack_ranges_truncated = 0;
+
 			cnx->first_stream.stream_id = 0;
 			cnx->first_stream.consumed_offset = 0;
 			cnx->first_stream.stream_flags = 0;
@@ -506,6 +818,16 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 			cnx->first_stream.remote_error = 0;
 			cnx->first_stream.maxdata_local = (uint64_t)((int64_t)-1);
 			cnx->first_stream.maxdata_remote = (uint64_t)((int64_t)-1);
+			picoquic_sack_list_init(&cnx->first_stream.sack_list, PICOQUIC_STREAM_ACK_RANGE_MAX);
+			cnx->first_stream.priority = PICOQUIC_STREAM_PRIORITY_DEFAULT;
+			cnx->first_stream.weight = PICOQUIC_STREAM_WEIGHT_DEFAULT;
+
+			cnx->stream_scheduler_state = NULL;
+			cnx->stream_scheduler = quic->default_stream_scheduler;
+			if (cnx->stream_scheduler != NULL)
+			{
+				cnx->stream_scheduler->sched_init(cnx);
+			}
 
 			cnx->aead_decrypt_ctx = NULL;
 			cnx->aead_encrypt_ctx = NULL;
@@ -522,6 +844,19 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 
 			cnx->retransmit_newest = NULL;
 			cnx->retransmit_oldest = NULL;
+			cnx->nb_retransmit_packets = 0;
+			for (int i = 0; i < PICOQUIC_ACK_ONLY_RING_SIZE; i++)
+			{
+				/* Never matches a sequence number already sent */
+				cnx->ack_only_ring[i].sequence_number = UINT64_MAX;
+			}
+			cnx->rack_reorder_mult = PICOQUIC_RACK_REORDER_MULT_MIN;
+			cnx->rack_reorder_raise_time = 0;
+			cnx->nb_spurious = 0;
+			for (int i = 0; i < PICOQUIC_LOST_RING_SIZE; i++)
+			{
+				cnx->lost_ring[i].sequence_number = UINT64_MAX;
+			}
 			cnx->highest_acknowledged = cnx->send_sequence - 1;
 
 			cnx->latest_time_acknowledged = start_time;
@@ -534,10 +869,17 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 			cnx->rtt_variant = 0;
 			cnx->retransmit_timer = PICOQUIC_INITIAL_RETRANSMIT_TIMER;
 			cnx->rtt_min = 0;
+			cnx->latest_rtt = PICOQUIC_INITIAL_RTT;
 
 			/* Congestion control state */
 			cnx->cwin = PICOQUIC_CWIN_INITIAL;
 			cnx->bytes_in_transit = 0;
+			cnx->pacing_rate = 0;
+			cnx->pacing_next_time = start_time;
+			cnx->delivered = 0;
+			cnx->delivered_time = start_time;
+			cnx->delivered_sent_time = start_time;
+			cnx->app_limited = 0;
 			cnx->congestion_alg_state = NULL;
 			cnx->congestion_alg = cnx->quic->default_congestion_alg;
 			if (cnx->congestion_alg != NULL)
@@ -623,6 +965,14 @@ uint64_t picoquic_get_cnx_start_time(picoquic_cnx_t * cnx)
     return cnx->start_time;
 }
 
+void picoquic_get_packing_stats(picoquic_cnx_t * cnx, uint64_t * nb_packets,
+    uint64_t * nb_bytes_used, uint64_t * nb_bytes_mtu)
+{
+    *nb_packets = cnx->nb_packets_sent;
+    *nb_bytes_used = cnx->nb_packet_bytes_used;
+    *nb_bytes_mtu = cnx->nb_packet_bytes_mtu;
+}
+
 picoquic_state_enum picoquic_get_cnx_state(picoquic_cnx_t * cnx)
 {
 	return cnx->cnx_state;
@@ -640,16 +990,63 @@ picoquic_cnx_t * picoquic_get_next_cnx(picoquic_cnx_t * cnx)
 }
 
 
+/*
+ * The due connections are found by walking the heap from the root,
+ * breadth first, and stopping at the first node that is not due in each
+ * branch. The walk uses the list being built as its queue, so the cost
+ * is proportional to the number of due connections.
+ */
+picoquic_cnx_t * picoquic_get_first_due_cnx(picoquic_quic_t * quic, uint64_t current_time)
+{
+    picoquic_cnx_t * first = NULL;
+    picoquic_cnx_t * last = NULL;
+    picoquic_cnx_t * next = NULL;
+
+    if (quic->wake_heap_size > 0 && quic->wake_heap[0]->next_wake_time <= current_time)
+    {
+        first = quic->wake_heap[0];
+        first->next_due_cnx = NULL;
+        last = first;
+        next = first;
+    }
+
+    while (next != NULL)
+    {
+        size_t child = 2 * next->wake_heap_index + 1;
+
+        for (int i = 0; i < 2 && child < quic->wake_heap_size; i++, child++)
+        {
+            picoquic_cnx_t * cnx = quic->wake_heap[child];
+
+            if (cnx->next_wake_time <= current_time)
+            {
+                cnx->next_due_cnx = NULL;
+                last->next_due_cnx = cnx;
+                last = cnx;
+            }
+        }
+
+        next = next->next_due_cnx;
+    }
+
+    return first;
+}
+
+picoquic_cnx_t * picoquic_get_next_due_cnx(picoquic_cnx_t * cnx)
+{
+    return cnx->next_due_cnx;
+}
+
 int64_t picoquic_get_next_wake_delay(picoquic_quic_t * quic, 
     uint64_t current_time, int64_t delay_max)
 {
     int64_t wake_delay;
 
-    if (quic->cnx_list != NULL)
+    if (quic->wake_heap_size > 0)
     {
-        if (quic->cnx_list->next_wake_time > current_time)
+        if (quic->wake_heap[0]->next_wake_time > current_time)
         {
-            wake_delay = quic->cnx_list->next_wake_time - current_time;
+            wake_delay = quic->wake_heap[0]->next_wake_time - current_time;
 
             if (wake_delay > delay_max)
             {
@@ -677,6 +1074,31 @@ void picoquic_set_callback(picoquic_cnx_t * cnx,
     cnx->callback_ctx = callback_ctx;
 }
 
+void picoquic_set_app_read_mode(picoquic_cnx_t * cnx, int is_app_read)
+{
+    cnx->is_app_read_default = is_app_read;
+}
+
+/*
+ * Free a chunk of stream data, returning the buffer to the application
+ * if it was provided by the application.
+ */
+void picoquic_free_stream_data(picoquic_stream_data * stream_data)
+{
+    if (stream_data->bytes != NULL && !stream_data->is_pulled)
+    {
+        if (stream_data->release_fn != NULL)
+        {
+            stream_data->release_fn(stream_data->bytes, stream_data->length, stream_data->release_ctx);
+        }
+        else
+        {
+            free(stream_data->bytes);
+        }
+    }
+    free(stream_data);
+}
+
 void picoquic_clear_stream(picoquic_stream_head * stream)
 {
     picoquic_stream_data ** pdata[2] = { &stream->stream_data, &stream->send_queue };
@@ -688,36 +1110,137 @@ void picoquic_clear_stream(picoquic_stream_head * stream)
         while ((next = *pdata[i]) != NULL)
         {
             *pdata[i] = next->next_stream_data;
-
-            if (next->bytes != NULL)
-            {
-                free(next->bytes);
-            }
-            free(next);
+            picoquic_free_stream_data(next);
         }
     }
+
+    stream->send_queue_last = NULL;
+    stream->send_next = NULL;
+    stream->queued_offset = 0;
+
+    stream->acked_offset = 0;
+    picoquic_sack_list_free(&stream->sack_list);
+
+    if (stream->recv_ring != NULL)
+    {
+        free(stream->recv_ring);
+        stream->recv_ring = NULL;
+    }
+    stream->recv_ring_size = 0;
+    picoquic_sack_list_free(&stream->recv_ranges);
+}
+
+/*
+ * The packets in the retransmit queue are chained from newest to oldest,
+ * and also indexed by sequence number in a ring: the packet with sequence
+ * number N is in slot N modulo the ring size. Sequence numbers are allocated
+ * in order, so all the packets in the queue fit in the ring as long as its
+ * size exceeds the distance between the oldest and the newest.
+ */
+int picoquic_reserve_retransmit_ring(picoquic_cnx_t * cnx, uint64_t sequence_number)
+{
+	int ret = 0;
+	uint64_t oldest = (cnx->retransmit_oldest == NULL) ? sequence_number : cnx->retransmit_oldest->sequence_number;
+
+	if (sequence_number - oldest >= cnx->retransmit_ring_size)
+	{
+		size_t new_size = (cnx->retransmit_ring_size == 0) ? PICOQUIC_RETRANSMIT_RING_MIN : 2 * cnx->retransmit_ring_size;
+		picoquic_sent_packet_t ** new_ring;
+
+		while (sequence_number - oldest >= new_size)
+		{
+			new_size *= 2;
+		}
+
+		new_ring = (picoquic_sent_packet_t **)malloc(new_size * sizeof(picoquic_sent_packet_t *));
+
+		if (new_ring == NULL)
+		{
+			ret = PICOQUIC_ERROR_MEMORY;
+		}
+		else
+		{
+			picoquic_sent_packet_t * p = cnx->retransmit_newest;
+
+			memset(new_ring, 0, new_size * sizeof(picoquic_sent_packet_t *));
+
+			while (p != NULL)
+			{
+				new_ring[p->sequence_number & (new_size - 1)] = p;
+				p = p->next_packet;
+			}
+
+			if (cnx->retransmit_ring != NULL)
+			{
+				free(cnx->retransmit_ring);
+			}
+			cnx->retransmit_ring = new_ring;
+			cnx->retransmit_ring_size = new_size;
+		}
+	}
+
+	return ret;
+}
+
+picoquic_sent_packet_t * picoquic_find_sent_packet(picoquic_cnx_t * cnx, uint64_t sequence_number)
+{
+	picoquic_sent_packet_t * p = NULL;
+
+	if (cnx->retransmit_newest != NULL &&
+		sequence_number <= cnx->retransmit_newest->sequence_number &&
+		sequence_number >= cnx->retransmit_oldest->sequence_number)
+	{
+		p = cnx->retransmit_ring[sequence_number & (cnx->retransmit_ring_size - 1)];
+
+		if (p != NULL && p->sequence_number != sequence_number)
+		{
+			p = NULL;
+		}
+	}
+
+	return p;
 }
 
-void picoquic_enqueue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p)
+/*
+ * Queue a packet as the newest in the retransmit queue. The ring must have
+ * been reserved for the sequence number before preparing the packet.
+ * The delivery state is recorded in the packet, for the rate sample taken
+ * when it is acknowledged.
+ */
+void picoquic_enqueue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p)
 {
-	if (cnx->retransmit_oldest == NULL)
+	if (cnx->bytes_in_transit == 0)
+	{
+		/* Start of a new flight: do not count the idle time in the samples */
+		cnx->delivered_time = p->send_time;
+		cnx->delivered_sent_time = p->send_time;
+	}
+	p->delivered = cnx->delivered;
+	p->delivered_time = cnx->delivered_time;
+	p->delivered_sent_time = cnx->delivered_sent_time;
+	p->is_app_limited = (cnx->app_limited != 0);
+
+	p->previous_packet = NULL;
+	if (cnx->retransmit_newest == NULL)
 	{
-		p->previous_packet = NULL;
-		cnx->retransmit_newest = p;
+		p->next_packet = NULL;
+		cnx->retransmit_oldest = p;
 	}
 	else
 	{
-		cnx->retransmit_oldest->next_packet = p;
-		p->previous_packet = cnx->retransmit_oldest;
+		p->next_packet = cnx->retransmit_newest;
+		p->next_packet->previous_packet = p;
 	}
-	p->next_packet = NULL;
-	cnx->retransmit_oldest = p;
+	cnx->retransmit_newest = p;
+
+	cnx->retransmit_ring[p->sequence_number & (cnx->retransmit_ring_size - 1)] = p;
+	cnx->nb_retransmit_packets++;
 
 	/* Account for bytes in transit, for congestion control */
-	cnx->bytes_in_transit += p->length;
+	cnx->bytes_in_transit += p->length + p->checksum_overhead;
 }
 
-void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p, int should_free)
+void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p, int should_free)
 {
 	if (p->previous_packet == NULL)
 	{
@@ -737,28 +1260,64 @@ void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet *
 		p->next_packet->previous_packet = p->previous_packet;
 	}
 
+	cnx->retransmit_ring[p->sequence_number & (cnx->retransmit_ring_size - 1)] = NULL;
+	cnx->nb_retransmit_packets--;
+
 	/* Account for bytes in transit, for congestion control */
-	if (cnx->retransmit_newest == NULL)
+	cnx->bytes_in_transit -= p->length + p->checksum_overhead;
+
+	if (should_free)
 	{
-		cnx->bytes_in_transit = 0;
+		picoquic_delete_sent_packet(cnx->quic, p);
 	}
-	else
-	{
-		size_t dequeued_length = p->length + p->checksum_overhead;
+}
 
-		if (cnx->bytes_in_transit > dequeued_length)
-		{
-			cnx->bytes_in_transit -= dequeued_length;
-		}
-		else
-		{
-			cnx->bytes_in_transit = 0;
-		}
-	}
-	if (should_free)
+/*
+ * Keep track of a packet that only carries an ACK. The slot of an older
+ * packet is simply overwritten: if its acknowledgement arrives that late,
+ * the ACK ranges it carried have long been superseded.
+ */
+void picoquic_record_ack_only_packet(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p)
+{
+	picoquic_ack_only_packet_t * a = &cnx->ack_only_ring[p->sequence_number & (PICOQUIC_ACK_ONLY_RING_SIZE - 1)];
+
+	a->sequence_number = p->sequence_number;
+	a->send_time = p->send_time;
+	a->ack_largest = (p->has_ack) ? p->ack_largest : 0;
+}
+
+picoquic_ack_only_packet_t * picoquic_find_ack_only_packet(picoquic_cnx_t * cnx, uint64_t sequence_number)
+{
+	picoquic_ack_only_packet_t * a = &cnx->ack_only_ring[sequence_number & (PICOQUIC_ACK_ONLY_RING_SIZE - 1)];
+
+	return (a->sequence_number == sequence_number && sequence_number < cnx->send_sequence) ? a : NULL;
+}
+
+/* Keep track of a packet declared lost, to detect spurious losses */
+void picoquic_record_lost_packet(picoquic_cnx_t * cnx, uint64_t sequence_number, int timer_based)
+{
+	picoquic_lost_packet_t * l = &cnx->lost_ring[sequence_number & (PICOQUIC_LOST_RING_SIZE - 1)];
+
+	l->sequence_number = sequence_number;
+	l->timer_based = timer_based;
+}
+
+/*
+ * The RACK reordering window is a fraction of min(smoothed RTT, latest RTT).
+ * It starts at a quarter, and goes back there if no spurious loss was seen
+ * for a number of RTTs.
+ */
+uint64_t picoquic_rack_reorder_window(picoquic_cnx_t * cnx, uint64_t current_time)
+{
+	uint64_t rtt = (cnx->latest_rtt < cnx->smoothed_rtt) ? cnx->latest_rtt : cnx->smoothed_rtt;
+
+	if (cnx->rack_reorder_mult > PICOQUIC_RACK_REORDER_MULT_MIN &&
+		current_time > cnx->rack_reorder_raise_time + PICOQUIC_RACK_REORDER_PERSIST * cnx->smoothed_rtt)
 	{
-		free(p);
+		cnx->rack_reorder_mult = PICOQUIC_RACK_REORDER_MULT_MIN;
 	}
+
+	return (rtt * cnx->rack_reorder_mult) / 4;
 }
 
 /*
@@ -877,23 +1436,8 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
             }
         }
 
-        if (cnx->next_in_table == NULL)
-        {
-            cnx->quic->cnx_last = cnx->previous_in_table;
-        }
-        else
-        {
-            cnx->next_in_table->previous_in_table = cnx->previous_in_table;
-        }
-
-        if (cnx->previous_in_table == NULL)
-        {
-            cnx->quic->cnx_list = cnx->next_in_table;
-        }
-        else
-        {
-            cnx->previous_in_table->next_in_table = cnx->next_in_table;
-        }
+        picoquic_remove_cnx_from_list(cnx->quic, cnx);
+        picoquic_wake_heap_remove(cnx->quic, cnx);
 
         if (cnx->aead_decrypt_ctx != NULL)
         {
@@ -918,6 +1462,14 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
 			picoquic_dequeue_retransmit_packet(cnx, cnx->retransmit_newest, 1);
 		}
 
+		if (cnx->retransmit_ring != NULL)
+		{
+			free(cnx->retransmit_ring);
+			cnx->retransmit_ring = NULL;
+		}
+
+		picoquic_sack_list_free(&cnx->sack_list);
+
         while ((stream = cnx->first_stream.next_stream) != NULL)
         {
             cnx->first_stream.next_stream = stream->next_stream;
@@ -925,6 +1477,17 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
             free(stream);
         }
         picoquic_clear_stream(&cnx->first_stream);
+        picoquic_delete_stream_index(cnx);
+
+        while (cnx->pulled_data_pool != NULL)
+        {
+            picoquic_stream_data * to_delete = cnx->pulled_data_pool;
+            cnx->pulled_data_pool = to_delete->next_stream_data;
+            free(to_delete);
+        }
+        cnx->pulled_data_pool_size = 0;
+        cnx->last_stream = NULL;
+        cnx->nb_streams = 0;
 
         if (cnx->tls_ctx != NULL)
         {
@@ -937,6 +1500,11 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
 			cnx->congestion_alg->alg_delete(cnx);
 		}
 
+		if (cnx->stream_scheduler != NULL)
+		{
+			cnx->stream_scheduler->sched_delete(cnx);
+		}
+
         free(cnx);
     }
 }
@@ -1006,3 +1574,82 @@ void picoquic_set_congestion_algorithm(picoquic_cnx_t * cnx, picoquic_congestion
 		cnx->congestion_alg->alg_init(cnx);
 	}
 }
+
+void picoquic_set_pacing(picoquic_cnx_t * cnx, int is_enabled)
+{
+	cnx->is_pacing_disabled = !is_enabled;
+}
+
+void picoquic_set_hystart(picoquic_cnx_t * cnx, int is_enabled)
+{
+	cnx->is_hystart_disabled = !is_enabled;
+}
+
+/*
+ * Set the delayed ACK policy
+ */
+
+void picoquic_set_ack_policy(picoquic_cnx_t * cnx, uint32_t ack_frequency,
+	uint64_t ack_delay_max, int ack_on_reorder, int ack_adaptive)
+{
+	if (ack_frequency == 0)
+	{
+		ack_frequency = 1;
+	}
+	else if (ack_frequency > PICOQUIC_ACK_FREQUENCY_MAX)
+	{
+		ack_frequency = PICOQUIC_ACK_FREQUENCY_MAX;
+	}
+
+	if (ack_delay_max > PICOQUIC_MAX_ACK_DELAY)
+	{
+		ack_delay_max = PICOQUIC_MAX_ACK_DELAY;
+	}
+
+	cnx->ack_frequency = ack_frequency;
+	cnx->ack_frequency_adaptive = ack_frequency;
+	cnx->ack_delay_max = ack_delay_max;
+	cnx->ack_on_reorder = ack_on_reorder;
+	cnx->ack_adaptive = ack_adaptive;
+}
+
+/*
+ * Set or reset the stream scheduler
+ */
+
+void picoquic_set_default_stream_scheduler(picoquic_quic_t * quic, picoquic_stream_scheduler_t const * scheduler)
+{
+	quic->default_stream_scheduler = scheduler;
+}
+
+void picoquic_set_stream_scheduler(picoquic_cnx_t * cnx, picoquic_stream_scheduler_t const * scheduler)
+{
+	picoquic_stream_head * stream;
+
+	if (cnx->stream_scheduler != NULL)
+	{
+		cnx->stream_scheduler->sched_delete(cnx);
+	}
+
+	/* Forget the index of the previous scheduler, and pass the ready streams to the new one */
+	for (stream = cnx->first_stream.next_stream; stream != NULL; stream = stream->next_stream)
+	{
+		memset(&stream->scheduler_link, 0, sizeof(picoquic_stream_link_t));
+	}
+
+	cnx->stream_scheduler = scheduler;
+
+	if (cnx->stream_scheduler != NULL)
+	{
+		cnx->stream_scheduler->sched_init(cnx);
+
+		for (stream = cnx->stream_queue[picoquic_stream_queue_ready].first; stream != NULL;
+			stream = stream->queue_link[picoquic_stream_queue_ready].next)
+		{
+			if (stream->stream_id != 0)
+			{
+				cnx->stream_scheduler->sched_add(cnx, stream);
+			}
+		}
+	}
+}
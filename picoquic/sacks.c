@@ -20,6 +20,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include "picoquic_internal.h"
 
 
@@ -33,223 +34,259 @@
 */
 
 /*
- * Check whether the packet was already received.
+ * Initialize an empty list. The ranges are only allocated when the
+ * first range is recorded.
  */
-int picoquic_is_pn_already_received(picoquic_cnx_t * cnx, uint64_t pn64)
+void picoquic_sack_list_init(picoquic_sack_list_t * sack_list, size_t max_ranges)
 {
-    int is_received = 0;
-    picoquic_sack_item_t * sack = &cnx->first_sack_item;
+    memset(sack_list, 0, sizeof(picoquic_sack_list_t));
+    sack_list->max_ranges = max_ranges;
+}
 
-    do
+/*
+ * Release the ranges and reset the list to empty, keeping the maximum size.
+ */
+void picoquic_sack_list_free(picoquic_sack_list_t * sack_list)
+{
+    if (sack_list->ranges != NULL)
     {
-        if (pn64 > sack->end_of_sack_range)
-            break;
-        else if (pn64 >= sack->start_of_sack_range)
+        free(sack_list->ranges);
+        sack_list->ranges = NULL;
+    }
+    sack_list->nb_ranges = 0;
+    sack_list->nb_ranges_alloc = 0;
+    sack_list->horizon = 0;
+}
+
+uint64_t picoquic_sack_list_largest(picoquic_sack_list_t const * sack_list)
+{
+    return (sack_list->nb_ranges == 0) ? 0 : sack_list->ranges[sack_list->nb_ranges - 1].end_of_sack_range;
+}
+
+/*
+ * Binary search of the number of ranges that start at or below pn64.
+ * If pn64 is in a range, that range is the last of those.
+ */
+static size_t picoquic_sack_find_range(picoquic_sack_list_t const * sack_list, uint64_t pn64)
+{
+    size_t low = 0;
+    size_t high = sack_list->nb_ranges;
+
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+
+        if (sack_list->ranges[middle].start_of_sack_range <= pn64)
         {
-            if (sack->start_of_sack_range == 0 && sack->end_of_sack_range == 0)
-                is_received = 0;
-            else
-                is_received = 1;
-            break;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Make room for one more range. Returns 0 if there is room, -1 if the list
+ * is already at its maximum size or the allocation failed.
+ */
+static int picoquic_sack_reserve_range(picoquic_sack_list_t * sack_list)
+{
+    int ret = 0;
+    size_t max_ranges = (sack_list->max_ranges == 0) ? PICOQUIC_DEFAULT_SACK_RANGE_MAX : sack_list->max_ranges;
+
+    if (sack_list->nb_ranges >= sack_list->nb_ranges_alloc)
+    {
+        if (sack_list->nb_ranges_alloc >= max_ranges)
+        {
+            ret = -1;
         }
         else
         {
-            sack = sack->next_sack;
+            size_t new_alloc = (sack_list->nb_ranges_alloc == 0) ?
+                PICOQUIC_SACK_RANGE_ALLOC_MIN : 2 * sack_list->nb_ranges_alloc;
+            picoquic_sack_range_t * new_ranges;
+
+            if (new_alloc > max_ranges)
+            {
+                new_alloc = max_ranges;
+            }
+
+            new_ranges = (picoquic_sack_range_t *)realloc(sack_list->ranges,
+                new_alloc * sizeof(picoquic_sack_range_t));
+
+            if (new_ranges == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                sack_list->ranges = new_ranges;
+                sack_list->nb_ranges_alloc = new_alloc;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Check whether the packet was already received.
+ */
+int picoquic_is_pn_already_received(picoquic_cnx_t * cnx, uint64_t pn64)
+{
+    int is_received = 0;
+    picoquic_sack_list_t * sack_list = &cnx->sack_list;
+
+    if (pn64 < sack_list->horizon)
+    {
+        is_received = 1;
+    }
+    else if (pn64 <= picoquic_sack_list_largest(sack_list) && sack_list->nb_ranges > 0)
+    {
+        size_t i = picoquic_sack_find_range(sack_list, pn64);
+
+        if (i > 0 && pn64 <= sack_list->ranges[i - 1].end_of_sack_range)
+        {
+            is_received = 1;
         }
-    } while (sack != NULL);
+    }
 
     return is_received;
 }
 
 /*
  * Packet was already received and checksum, etc. was properly verified.
- * Record it in the chain.
+ * Record it in the list. Returns 0 if the list was updated, 1 for a duplicate.
+ *
+ * Most packets arrive in order and just extend the highest range, and new
+ * holes are usually appended after it. Otherwise, the ranges that touch
+ * [pn64_min, pn64_max] are adjacent in the array, so they are merged in the
+ * first of them and the others are removed by moving the upper part of the
+ * array. If the new range touches none, it is inserted. When the list is
+ * full, the lowest range is dropped to make room.
  */
 
-int picoquic_update_sack_list(picoquic_sack_item_t * sack, 
+int picoquic_update_sack_list(picoquic_sack_list_t * sack_list,
     uint64_t pn64_min, uint64_t pn64_max,
     uint64_t * sack_block_size_max)
 {
-    int ret = 1; /* duplicate by default, reset to 0 if update found */
-    picoquic_sack_item_t * previous = NULL;
+    int ret = 0;
+    picoquic_sack_range_t * ranges = sack_list->ranges;
+    size_t nb_ranges = sack_list->nb_ranges;
+    size_t first;
+    size_t last;
     uint64_t block_size;
 
-    if (sack->start_of_sack_range == 0 &&
-        sack->end_of_sack_range == 0)
+    if (pn64_max < sack_list->horizon)
+    {
+        /* Already forgotten, treated as received */
+        return 1;
+    }
+    else if (pn64_min < sack_list->horizon)
+    {
+        pn64_min = sack_list->horizon;
+    }
+
+    if (nb_ranges > 0 && pn64_min > ranges[nb_ranges - 1].start_of_sack_range &&
+        pn64_min <= ranges[nb_ranges - 1].end_of_sack_range + 1)
     {
-        /* This is the first packet ever received.. */
-        sack->start_of_sack_range = pn64_min;
-        sack->end_of_sack_range = pn64_max;
-        *sack_block_size_max = 1;
-        ret = 0;
+        if (pn64_max <= ranges[nb_ranges - 1].end_of_sack_range)
+        {
+            /* complete overlap */
+            ret = 1;
+        }
+        else
+        {
+            ranges[nb_ranges - 1].end_of_sack_range = pn64_max;
+            pn64_min = ranges[nb_ranges - 1].start_of_sack_range;
+        }
     }
     else
     {
-        do
+        last = picoquic_sack_find_range(sack_list, pn64_max + 1);
+        first = last;
+
+        while (first > 0 && ranges[first - 1].end_of_sack_range + 1 >= pn64_min)
         {
-            if (pn64_max > sack->end_of_sack_range)
-            {
-                ret = 0;
+            first--;
+        }
 
-                if (pn64_min <= sack->end_of_sack_range + 1)
-                {
-                    /* if this actually fills the hole, merge with previous item */
-                    if (previous != NULL && pn64_max + 1 >= previous->start_of_sack_range)
-                    {
-                        previous->start_of_sack_range = sack->start_of_sack_range;
-                        previous->next_sack = sack->next_sack;
-                        free(sack);
-                        sack = previous;
-                    }
-                    else
-                    {
-                        /* add at end of range */
-                        sack->end_of_sack_range = pn64_max;
-                    }
-
-                    block_size = sack->end_of_sack_range - sack->start_of_sack_range;
-                    if (block_size > *sack_block_size_max)
-                    {
-                        *sack_block_size_max = block_size;
-                    }
-
-                    /* Check whether there is a need to continue */ 
-                    if (pn64_min >= sack->start_of_sack_range)
-                    {
-                        break;
-                    }
-                    else if (sack->next_sack == NULL)
-                    {
-                        /* Last in range. Just expand. */
-                        sack->start_of_sack_range = pn64_min; 
-                        break;
-                    }
-                    else
-                    {
-                        /* Continue with reminder of range */
-                        pn64_max = sack->start_of_sack_range - 1;
-                        previous = sack;
-                        sack = sack->next_sack;
-                    }
-                }
-                else if (previous != NULL && pn64_max + 1 >= previous->start_of_sack_range)
+        if (last == first)
+        {
+            /* Found a new hole */
+            int is_forgotten = 0;
+
+            if (picoquic_sack_reserve_range(sack_list) != 0)
+            {
+                if (first == 0)
                 {
-                    /* Extend the previous range */
-                    previous->start_of_sack_range = pn64_min;
-                    block_size = previous->end_of_sack_range - previous->start_of_sack_range;
-                    if (block_size > *sack_block_size_max)
-                    {
-                        *sack_block_size_max = block_size;
-                    }
-                    break;
+                    /* The new range would be the lowest, just forget it. */
+                    sack_list->horizon = pn64_max + 1;
+                    is_forgotten = 1;
                 }
                 else
                 {
-                    /* Found a new hole */
-                    picoquic_sack_item_t * new_hole = (picoquic_sack_item_t *)malloc(sizeof(picoquic_sack_item_t));
-                    if (new_hole == NULL)
-                    {
-                        /* memory error. That's infortunate */
-                        ret = -1;
-                    }
-                    else
-                    {
-                        /* swap old and new, so it works even if previous == NULL */
-                        new_hole->start_of_sack_range = sack->start_of_sack_range;
-                        new_hole->end_of_sack_range = sack->end_of_sack_range;
-                        new_hole->next_sack = sack->next_sack;
-                        sack->start_of_sack_range = pn64_min;
-                        sack->end_of_sack_range = pn64_max;
-                        sack->next_sack = new_hole; 
-                        
-                        block_size = sack->end_of_sack_range - sack->start_of_sack_range;
-                        if (block_size > *sack_block_size_max)
-                        {
-                            *sack_block_size_max = block_size;
-                        }
-                    }
-                    /* No need to continue, everything is consumed. */
-                    break;
+                    sack_list->horizon = ranges[0].end_of_sack_range + 1;
+                    memmove(&ranges[0], &ranges[1], (nb_ranges - 1) * sizeof(picoquic_sack_range_t));
+                    nb_ranges--;
+                    first--;
                 }
             }
-            else if (pn64_max >= sack->start_of_sack_range)
+
+            if (!is_forgotten)
             {
-                if (pn64_min < sack->start_of_sack_range)
-                {
-                    ret = 0;
-
-                    if (sack->next_sack == NULL)
-                    {
-                        /* Just extend the last range */
-                        sack->start_of_sack_range = pn64_min;
-
-                        block_size = sack->end_of_sack_range - pn64_min;
-                        if (block_size > *sack_block_size_max)
-                        {
-                            *sack_block_size_max = block_size;
-                        }
-                        
-                        break;
-                    }
-                    else
-                    {
-                        /* continue with reminder. */
-                        pn64_max = sack->start_of_sack_range - 1;
-                        previous = sack;
-                        sack = sack->next_sack;
-                    }
-                }
-                else
-                {
-                    /*comple overlap */
-                    break;
-                }
+                ranges = sack_list->ranges;
+                memmove(&ranges[first + 1], &ranges[first],
+                    (nb_ranges - first) * sizeof(picoquic_sack_range_t));
+                ranges[first].start_of_sack_range = pn64_min;
+                ranges[first].end_of_sack_range = pn64_max;
+                nb_ranges++;
             }
-            else if (sack->next_sack == NULL)
+        }
+        else if (last == first + 1 &&
+            ranges[first].start_of_sack_range <= pn64_min &&
+            ranges[first].end_of_sack_range >= pn64_max)
+        {
+            /* complete overlap */
+            ret = 1;
+        }
+        else
+        {
+            if (ranges[first].start_of_sack_range < pn64_min)
             {
-                ret = 0;
-                if (pn64_max + 1 == sack->start_of_sack_range)
-                {
-                    uint64_t block_size;
-                    sack->start_of_sack_range = pn64_min;
-                    block_size = sack->end_of_sack_range - sack->start_of_sack_range;
-                    if (block_size > *sack_block_size_max)
-                    {
-                        *sack_block_size_max = block_size;
-                    }
-                }
-                else
-                {
-                    /* this is an old packet, beyond the current range of SACK */
-                    /* Found a new hole */
-                    picoquic_sack_item_t * new_hole = (picoquic_sack_item_t *)malloc(sizeof(picoquic_sack_item_t));
-                    if (new_hole == NULL)
-                    {
-                        /* memory error. That's infortunate */
-                        ret = -1;
-                    }
-                    else
-                    {
-                        /* Create new hole at the tail. */
-                        new_hole->start_of_sack_range = pn64_min;
-                        new_hole->end_of_sack_range = pn64_max;
-                        new_hole->next_sack = NULL;
-                        sack->next_sack = new_hole;
-                        block_size = pn64_max - pn64_min;
-                        if (block_size > *sack_block_size_max)
-                        {
-                            *sack_block_size_max = block_size;
-                        }
-                    }
-                }
-                break;
+                pn64_min = ranges[first].start_of_sack_range;
             }
-            else
+
+            if (ranges[last - 1].end_of_sack_range > pn64_max)
+            {
+                pn64_max = ranges[last - 1].end_of_sack_range;
+            }
+
+            ranges[first].start_of_sack_range = pn64_min;
+            ranges[first].end_of_sack_range = pn64_max;
+
+            if (last > first + 1)
             {
-                previous = sack;
-                sack = sack->next_sack;
+                memmove(&ranges[first + 1], &ranges[last],
+                    (nb_ranges - last) * sizeof(picoquic_sack_range_t));
+                nb_ranges -= last - first - 1;
             }
-        } while (sack != NULL);
+        }
+
+        sack_list->nb_ranges = nb_ranges;
+    }
+
+    if (ret == 0 && sack_block_size_max != NULL)
+    {
+        block_size = pn64_max - pn64_min;
+        if (block_size > *sack_block_size_max)
+        {
+            *sack_block_size_max = block_size;
+        }
     }
 
     return ret;
@@ -258,67 +295,48 @@ int picoquic_update_sack_list(picoquic_sack_item_t * sack,
 int picoquic_record_pn_received(picoquic_cnx_t * cnx, uint64_t pn64, uint64_t current_microsec)
 {
     int ret = 0;
-    picoquic_sack_item_t * sack = &cnx->first_sack_item;
+    picoquic_sack_list_t * sack_list = &cnx->sack_list;
 
-    if ((sack->start_of_sack_range == 0 &&
-        sack->end_of_sack_range == 0) ||
-        pn64 > sack->end_of_sack_range)
+    if (sack_list->nb_ranges == 0 ||
+        pn64 > picoquic_sack_list_largest(sack_list))
     {
-        /* This is the first packet ever received.. */
+        /* This is the largest packet received so far */
         cnx->time_stamp_largest_received = current_microsec;
     }
 
-    ret = picoquic_update_sack_list(sack, pn64, pn64, &cnx->sack_block_size_max);
+    ret = picoquic_update_sack_list(sack_list, pn64, pn64, &cnx->sack_block_size_max);
+
+    return ret;
 }
 
 /*
  * Check whether the data fills a hole. returns 0 if it does, -1 otherwise.
  */
-int picoquic_check_sack_list(picoquic_sack_item_t * sack,
+int picoquic_check_sack_list(picoquic_sack_list_t const * sack_list,
     uint64_t pn64_min, uint64_t pn64_max)
 {
-    int ret = -1; /* duplicate by default, reset to 0 if update found */
-    picoquic_sack_item_t * previous = NULL;
-    uint64_t block_size;
+    int ret = 0;
 
-    if (sack->start_of_sack_range == 0 &&
-        sack->end_of_sack_range == 0)
+    if (pn64_max < sack_list->horizon)
     {
-        ret = 0;
+        ret = -1;
     }
     else
     {
-        do
+        size_t i;
+
+        if (pn64_min < sack_list->horizon)
         {
-            if (pn64_max > sack->end_of_sack_range)
-            {
-                ret = 0;
-                break;
-            }
-            else if (pn64_max >= sack->start_of_sack_range)
-            {
-                if (pn64_min < sack->start_of_sack_range)
-                {
-                    ret = 0;
-                }
-                else
-                {
-                    /*complete overlap */
-                    ret = -1;
-                }
-                break;
-            }
-            else if (sack->next_sack == NULL)
-            {
-                ret = 0;
-                break;
-            }
-            else
-            {
-                previous = sack;
-                sack = sack->next_sack;
-            }
-        } while (sack != NULL);
+            pn64_min = sack_list->horizon;
+        }
+
+        i = picoquic_sack_find_range(sack_list, pn64_min);
+
+        if (i > 0 && pn64_max <= sack_list->ranges[i - 1].end_of_sack_range)
+        {
+            /* complete overlap */
+            ret = -1;
+        }
     }
 
     return ret;
@@ -419,8 +437,9 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 {
     int ret = -1;
     size_t nb_blocks = 0;
-    picoquic_sack_item_t * previous_sack = &cnx->first_sack_item;
-    picoquic_sack_item_t * sack = cnx->first_sack_item.next_sack;
+    picoquic_sack_range_t * ranges = cnx->sack_list.ranges;
+    size_t nb_ranges = cnx->sack_list.nb_ranges;
+    size_t range_index = 0;
     uint64_t block_size;
     uint8_t ack_type = 0xA8;
     uint8_t mm = 0;
@@ -446,17 +465,18 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
         length_mm = 8;
     }
 
-    if (bytes_max < 1u + 2u + 4u + 2u + length_mm)
+    if (nb_ranges == 0 || bytes_max < 1u + 2u + 4u + 2u + length_mm)
     {
         *nb_bytes = 0;
         ret = -1;
     }
     else
     {
+        range_index = nb_ranges - 1;
         ack_type |= mm;
         bytes[byte_index++] = ack_type;
 
-        if (sack != NULL)
+        if (nb_ranges > 1)
         {
             /* reserve space for encoding the nb_blocks and nb_time_stamps later */
             byte_index += 2;
@@ -464,7 +484,7 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
         /*
          * Encode the max received.
          */
-        picoformat_32(bytes + byte_index, (uint32_t)cnx->first_sack_item.end_of_sack_range);
+        picoformat_32(bytes + byte_index, (uint32_t)ranges[range_index].end_of_sack_range);
         byte_index += 4;
         /*
          * Encode the ack delay
@@ -490,7 +510,7 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
          * Notice the 'reverse order" of blocks
          */
          /* Encode first ACK block length */
-        block_size = cnx->first_sack_item.end_of_sack_range - cnx->first_sack_item.start_of_sack_range;
+        block_size = ranges[range_index].end_of_sack_range - ranges[range_index].start_of_sack_range;
         switch (mm)
         {
         case 0:
@@ -511,12 +531,12 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
         byte_index += length_mm;
 
         /* Encode each block */
-        while (sack != NULL && nb_blocks < 255)
+        while (range_index > 0 && nb_blocks < 255)
         {
-            uint64_t gap = previous_sack->start_of_sack_range - sack->end_of_sack_range - 1;
+            uint64_t gap = ranges[range_index].start_of_sack_range - ranges[range_index - 1].end_of_sack_range - 1;
             uint32_t blocks_needed = (uint32_t)((gap + 254) / 255);
 
-            block_size = sack->end_of_sack_range - sack->start_of_sack_range;
+            block_size = ranges[range_index - 1].end_of_sack_range - ranges[range_index - 1].start_of_sack_range;
             if (nb_blocks + blocks_needed > 255 ||
                 (byte_index + blocks_needed*(1 + length_mm)) > bytes_max)
             {
@@ -553,8 +573,7 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
             }
             byte_index += length_mm;
             nb_blocks += blocks_needed;
-            previous_sack = sack;
-            sack = sack->next_sack;
+            range_index--;
         }
 
         /*
@@ -563,7 +582,7 @@ int picoquic_encode_sack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
          * and evaluation of out of order deliveries.
          */
 
-        if (cnx->first_sack_item.next_sack != NULL)
+        if (nb_ranges > 1)
         {
             bytes[1] = (uint8_t)nb_blocks;
             bytes[2] = 0;
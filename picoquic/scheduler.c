@@ -0,0 +1,460 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2017, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+/*
+ * Stream schedulers. Each scheduler keeps its own index of the ready
+ * streams, which is updated when a stream enters or leaves the ready queue
+ * of the connection, so picking the next stream does not scan the queue.
+ * Stream 0 is served before calling the scheduler, and is never indexed.
+ */
+
+/* FIFO of streams, linked through the scheduler link of the streams */
+static void picoquic_scheduler_fifo_append(picoquic_stream_queue_t * fifo, picoquic_stream_head * stream)
+{
+	picoquic_stream_link_t * link = &stream->scheduler_link;
+
+	link->next = NULL;
+	link->previous = fifo->last;
+	if (fifo->last == NULL)
+	{
+		fifo->first = stream;
+	}
+	else
+	{
+		fifo->last->scheduler_link.next = stream;
+	}
+	fifo->last = stream;
+	link->is_queued = 1;
+}
+
+static void picoquic_scheduler_fifo_remove(picoquic_stream_queue_t * fifo, picoquic_stream_head * stream)
+{
+	picoquic_stream_link_t * link = &stream->scheduler_link;
+
+	if (link->previous == NULL)
+	{
+		fifo->first = link->next;
+	}
+	else
+	{
+		link->previous->scheduler_link.next = link->next;
+	}
+
+	if (link->next == NULL)
+	{
+		fifo->last = link->previous;
+	}
+	else
+	{
+		link->next->scheduler_link.previous = link->previous;
+	}
+
+	link->next = NULL;
+	link->previous = NULL;
+	link->is_queued = 0;
+}
+
+/*
+ * Round robin: the ready streams are kept in a FIFO. The first stream is
+ * served, and then moves to the end of the FIFO if it is still ready.
+ */
+static void picoquic_round_robin_init(picoquic_cnx_t * cnx)
+{
+	picoquic_stream_queue_t * rr_state = (picoquic_stream_queue_t *)malloc(sizeof(picoquic_stream_queue_t));
+	cnx->stream_scheduler_state = (void *)rr_state;
+
+	if (rr_state != NULL)
+	{
+		rr_state->first = NULL;
+		rr_state->last = NULL;
+	}
+}
+
+static void picoquic_round_robin_add(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_stream_queue_t * rr_state = (picoquic_stream_queue_t *)cnx->stream_scheduler_state;
+
+	if (rr_state != NULL && !stream->scheduler_link.is_queued)
+	{
+		picoquic_scheduler_fifo_append(rr_state, stream);
+	}
+}
+
+static void picoquic_round_robin_remove(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_stream_queue_t * rr_state = (picoquic_stream_queue_t *)cnx->stream_scheduler_state;
+
+	if (rr_state != NULL && stream->scheduler_link.is_queued)
+	{
+		picoquic_scheduler_fifo_remove(rr_state, stream);
+	}
+}
+
+static picoquic_stream_head * picoquic_round_robin_next(picoquic_cnx_t * cnx)
+{
+	picoquic_stream_queue_t * rr_state = (picoquic_stream_queue_t *)cnx->stream_scheduler_state;
+
+	return (rr_state == NULL) ? NULL : rr_state->first;
+}
+
+static void picoquic_round_robin_notify(picoquic_cnx_t * cnx,
+	picoquic_stream_head * stream, uint64_t nb_bytes_sent)
+{
+	picoquic_stream_queue_t * rr_state = (picoquic_stream_queue_t *)cnx->stream_scheduler_state;
+
+	if (rr_state != NULL && stream->scheduler_link.is_queued && rr_state->last != stream)
+	{
+		picoquic_scheduler_fifo_remove(rr_state, stream);
+		picoquic_scheduler_fifo_append(rr_state, stream);
+	}
+}
+
+static void picoquic_round_robin_delete(picoquic_cnx_t * cnx)
+{
+	if (cnx->stream_scheduler_state != NULL)
+	{
+		free(cnx->stream_scheduler_state);
+		cnx->stream_scheduler_state = NULL;
+	}
+}
+
+/*
+ * Binary heap of ready streams, used by the schedulers that serve streams
+ * in the order of a key. The position of each stream in the heap is kept
+ * in the stream, so it can be removed or moved when its key changes.
+ */
+#define PICOQUIC_SCHEDULER_HEAP_MIN 16
+
+typedef int(*picoquic_scheduler_is_before_fn)(picoquic_stream_head * stream, picoquic_stream_head * other);
+
+typedef struct st_picoquic_scheduler_heap_t {
+	picoquic_stream_head ** heap;
+	size_t heap_size;
+	size_t heap_alloc;
+	picoquic_scheduler_is_before_fn is_before;
+} picoquic_scheduler_heap_t;
+
+static void picoquic_scheduler_heap_set(picoquic_scheduler_heap_t * h, size_t index, picoquic_stream_head * stream)
+{
+	h->heap[index] = stream;
+	stream->scheduler_index = index;
+}
+
+static void picoquic_scheduler_heap_sift_up(picoquic_scheduler_heap_t * h, size_t index)
+{
+	picoquic_stream_head * stream = h->heap[index];
+
+	while (index > 0 && h->is_before(stream, h->heap[(index - 1) / 2]))
+	{
+		picoquic_scheduler_heap_set(h, index, h->heap[(index - 1) / 2]);
+		index = (index - 1) / 2;
+	}
+
+	picoquic_scheduler_heap_set(h, index, stream);
+}
+
+static void picoquic_scheduler_heap_sift_down(picoquic_scheduler_heap_t * h, size_t index)
+{
+	picoquic_stream_head * stream = h->heap[index];
+
+	while (2 * index + 1 < h->heap_size)
+	{
+		size_t child = 2 * index + 1;
+
+		if (child + 1 < h->heap_size && h->is_before(h->heap[child + 1], h->heap[child]))
+		{
+			child++;
+		}
+
+		if (!h->is_before(h->heap[child], stream))
+		{
+			break;
+		}
+
+		picoquic_scheduler_heap_set(h, index, h->heap[child]);
+		index = child;
+	}
+
+	picoquic_scheduler_heap_set(h, index, stream);
+}
+
+/* If the heap cannot grow, the stream is served from the ready queue once the heap is empty */
+static void picoquic_scheduler_heap_add(picoquic_scheduler_heap_t * h, picoquic_stream_head * stream)
+{
+	if (h->heap_size >= h->heap_alloc)
+	{
+		size_t new_alloc = (h->heap_alloc == 0) ? PICOQUIC_SCHEDULER_HEAP_MIN : 2 * h->heap_alloc;
+		picoquic_stream_head ** new_heap = (picoquic_stream_head **)realloc(h->heap,
+			new_alloc * sizeof(picoquic_stream_head *));
+
+		if (new_heap == NULL)
+		{
+			return;
+		}
+
+		h->heap = new_heap;
+		h->heap_alloc = new_alloc;
+	}
+
+	stream->scheduler_link.is_queued = 1;
+	h->heap[h->heap_size] = stream;
+	h->heap_size++;
+	picoquic_scheduler_heap_sift_up(h, h->heap_size - 1);
+}
+
+static void picoquic_scheduler_heap_remove(picoquic_scheduler_heap_t * h, picoquic_stream_head * stream)
+{
+	size_t index = stream->scheduler_index;
+	picoquic_stream_head * moved = h->heap[--h->heap_size];
+
+	if (moved != stream)
+	{
+		picoquic_scheduler_heap_set(h, index, moved);
+		picoquic_scheduler_heap_sift_up(h, index);
+		picoquic_scheduler_heap_sift_down(h, moved->scheduler_index);
+	}
+
+	stream->scheduler_link.is_queued = 0;
+}
+
+static picoquic_stream_head * picoquic_scheduler_heap_first(picoquic_scheduler_heap_t * h)
+{
+	return (h->heap_size == 0) ? NULL : h->heap[0];
+}
+
+static void picoquic_scheduler_heap_free(picoquic_scheduler_heap_t * h)
+{
+	if (h->heap != NULL)
+	{
+		free(h->heap);
+		h->heap = NULL;
+	}
+}
+
+/*
+ * Strict priority: serve the ready stream with the lowest priority value,
+ * and the lowest stream ID among those. When all streams have the same
+ * priority, this is the order in which streams were always served.
+ */
+static int picoquic_strict_priority_is_before(picoquic_stream_head * stream, picoquic_stream_head * other)
+{
+	return (stream->priority < other->priority ||
+		(stream->priority == other->priority && stream->stream_id < other->stream_id));
+}
+
+static void picoquic_strict_priority_init(picoquic_cnx_t * cnx)
+{
+	picoquic_scheduler_heap_t * sp_state = (picoquic_scheduler_heap_t *)malloc(sizeof(picoquic_scheduler_heap_t));
+	cnx->stream_scheduler_state = (void *)sp_state;
+
+	if (sp_state != NULL)
+	{
+		memset(sp_state, 0, sizeof(picoquic_scheduler_heap_t));
+		sp_state->is_before = picoquic_strict_priority_is_before;
+	}
+}
+
+static void picoquic_strict_priority_add(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_scheduler_heap_t * sp_state = (picoquic_scheduler_heap_t *)cnx->stream_scheduler_state;
+
+	if (sp_state != NULL && !stream->scheduler_link.is_queued)
+	{
+		picoquic_scheduler_heap_add(sp_state, stream);
+	}
+}
+
+static void picoquic_strict_priority_remove(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_scheduler_heap_t * sp_state = (picoquic_scheduler_heap_t *)cnx->stream_scheduler_state;
+
+	if (sp_state != NULL && stream->scheduler_link.is_queued)
+	{
+		picoquic_scheduler_heap_remove(sp_state, stream);
+	}
+}
+
+static picoquic_stream_head * picoquic_strict_priority_next(picoquic_cnx_t * cnx)
+{
+	picoquic_scheduler_heap_t * sp_state = (picoquic_scheduler_heap_t *)cnx->stream_scheduler_state;
+
+	return (sp_state == NULL) ? NULL : picoquic_scheduler_heap_first(sp_state);
+}
+
+static void picoquic_strict_priority_notify(picoquic_cnx_t * cnx,
+	picoquic_stream_head * stream, uint64_t nb_bytes_sent)
+{
+	/* Nothing to remember */
+}
+
+static void picoquic_strict_priority_delete(picoquic_cnx_t * cnx)
+{
+	picoquic_scheduler_heap_t * sp_state = (picoquic_scheduler_heap_t *)cnx->stream_scheduler_state;
+
+	if (sp_state != NULL)
+	{
+		picoquic_scheduler_heap_free(sp_state);
+		free(sp_state);
+		cnx->stream_scheduler_state = NULL;
+	}
+}
+
+/*
+ * Weighted fair queuing. Each stream carries a virtual finish tag, which
+ * advances by the bytes sent divided by the weight of the stream. The
+ * stream with the lowest tag is served, and the lowest stream ID among
+ * those with the same tag. A stream that becomes ready restarts from the
+ * virtual time of the connection, i.e. the tag of the last stream served,
+ * so it cannot claim the bandwidth it did not use.
+ */
+#define PICOQUIC_WFQ_SCALE 256
+
+typedef struct st_picoquic_wfq_state_t {
+	uint64_t virtual_time;
+	picoquic_scheduler_heap_t ready;
+} picoquic_wfq_state_t;
+
+static int picoquic_wfq_is_before(picoquic_stream_head * stream, picoquic_stream_head * other)
+{
+	return (stream->scheduler_tag < other->scheduler_tag ||
+		(stream->scheduler_tag == other->scheduler_tag && stream->stream_id < other->stream_id));
+}
+
+static void picoquic_wfq_init(picoquic_cnx_t * cnx)
+{
+	picoquic_wfq_state_t * wfq_state = (picoquic_wfq_state_t *)malloc(sizeof(picoquic_wfq_state_t));
+	cnx->stream_scheduler_state = (void *)wfq_state;
+
+	if (wfq_state != NULL)
+	{
+		memset(wfq_state, 0, sizeof(picoquic_wfq_state_t));
+		wfq_state->ready.is_before = picoquic_wfq_is_before;
+	}
+}
+
+static void picoquic_wfq_add(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_wfq_state_t * wfq_state = (picoquic_wfq_state_t *)cnx->stream_scheduler_state;
+
+	if (wfq_state != NULL && !stream->scheduler_link.is_queued)
+	{
+		if (stream->scheduler_tag < wfq_state->virtual_time)
+		{
+			stream->scheduler_tag = wfq_state->virtual_time;
+		}
+
+		picoquic_scheduler_heap_add(&wfq_state->ready, stream);
+	}
+}
+
+static void picoquic_wfq_remove(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+	picoquic_wfq_state_t * wfq_state = (picoquic_wfq_state_t *)cnx->stream_scheduler_state;
+
+	if (wfq_state != NULL && stream->scheduler_link.is_queued)
+	{
+		picoquic_scheduler_heap_remove(&wfq_state->ready, stream);
+	}
+}
+
+static picoquic_stream_head * picoquic_wfq_next(picoquic_cnx_t * cnx)
+{
+	picoquic_wfq_state_t * wfq_state = (picoquic_wfq_state_t *)cnx->stream_scheduler_state;
+
+	return (wfq_state == NULL) ? NULL : picoquic_scheduler_heap_first(&wfq_state->ready);
+}
+
+static void picoquic_wfq_notify(picoquic_cnx_t * cnx,
+	picoquic_stream_head * stream, uint64_t nb_bytes_sent)
+{
+	picoquic_wfq_state_t * wfq_state = (picoquic_wfq_state_t *)cnx->stream_scheduler_state;
+
+	if (wfq_state != NULL)
+	{
+		if (stream->scheduler_tag > wfq_state->virtual_time)
+		{
+			wfq_state->virtual_time = stream->scheduler_tag;
+		}
+		stream->scheduler_tag = wfq_state->virtual_time +
+			(nb_bytes_sent * PICOQUIC_WFQ_SCALE) / stream->weight;
+
+		if (stream->scheduler_link.is_queued)
+		{
+			picoquic_scheduler_heap_sift_down(&wfq_state->ready, stream->scheduler_index);
+		}
+	}
+}
+
+static void picoquic_wfq_delete(picoquic_cnx_t * cnx)
+{
+	picoquic_wfq_state_t * wfq_state = (picoquic_wfq_state_t *)cnx->stream_scheduler_state;
+
+	if (wfq_state != NULL)
+	{
+		picoquic_scheduler_heap_free(&wfq_state->ready);
+		free(wfq_state);
+		cnx->stream_scheduler_state = NULL;
+	}
+}
+
+/* Definition records for the schedulers */
+
+#define PICOQUIC_ROUND_ROBIN_ID 0x52524F42 /* RROB */
+#define PICOQUIC_STRICT_PRIORITY_ID 0x53505249 /* SPRI */
+#define PICOQUIC_WFQ_ID 0x57465130 /* WFQ0 */
+
+static picoquic_stream_scheduler_t picoquic_round_robin_scheduler_struct = {
+	PICOQUIC_ROUND_ROBIN_ID,
+	picoquic_round_robin_init,
+	picoquic_round_robin_add,
+	picoquic_round_robin_remove,
+	picoquic_round_robin_next,
+	picoquic_round_robin_notify,
+	picoquic_round_robin_delete
+};
+
+static picoquic_stream_scheduler_t picoquic_strict_priority_scheduler_struct = {
+	PICOQUIC_STRICT_PRIORITY_ID,
+	picoquic_strict_priority_init,
+	picoquic_strict_priority_add,
+	picoquic_strict_priority_remove,
+	picoquic_strict_priority_next,
+	picoquic_strict_priority_notify,
+	picoquic_strict_priority_delete
+};
+
+static picoquic_stream_scheduler_t picoquic_wfq_scheduler_struct = {
+	PICOQUIC_WFQ_ID,
+	picoquic_wfq_init,
+	picoquic_wfq_add,
+	picoquic_wfq_remove,
+	picoquic_wfq_next,
+	picoquic_wfq_notify,
+	picoquic_wfq_delete
+};
+
+picoquic_stream_scheduler_t const * picoquic_round_robin_scheduler = &picoquic_round_robin_scheduler_struct;
+picoquic_stream_scheduler_t const * picoquic_strict_priority_scheduler = &picoquic_strict_priority_scheduler_struct;
+picoquic_stream_scheduler_t const * picoquic_wfq_scheduler = &picoquic_wfq_scheduler_struct;
@@ -29,24 +29,31 @@
  * Sending logic.
  *
  * Data is sent over streams. This is instantiated by the "Post to stream" command, which
- * chains data to the head of stream structure. Data is unchained when it sent for the
- * first time.
+ * chains data to the head of stream structure. Data is unchained when all of it has
+ * been acknowledged.
  * 
  * Data is sent in packets, which contain stream frames and possibly other frames.
  * The retransmission logic operates on packets. If a packet is seen as lost, the
  * important frames that it contains will have to be retransmitted.
  *
- * Unacknowledged packets are kept in a chained list. Packets get removed from that
- * list during the processing of acknowledgements. Packets are marked lost when a
- * sufficiently older packet is acknowledged, or after a timer. Lost packets
- * generate new packets, which are queued in the chained list.
+ * Unacknowledged packets are kept in a chained list, as compact descriptions of the
+ * frames that they carried. Packets get removed from that list during the processing
+ * of acknowledgements. Packets are marked lost when a sufficiently older packet is
+ * acknowledged, or after a timer. The frames of lost packets are regenerated in new
+ * packets, which are queued in the chained list.
  *
  * Stream 0 is special, in the sense that it cannot be closed or reset, and is not
  * subject to flow control.
  */
 
-int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint32_t stream_id, 
-	const uint8_t * data, size_t length, int set_fin)
+/*
+ * Queue data on a stream. The data is either copied in a new buffer, or,
+ * if is_owned is set, the buffer is taken from the application and
+ * returned through the release function once acknowledged.
+ */
+static int picoquic_queue_stream_data(picoquic_cnx_t * cnx, uint32_t stream_id,
+	uint8_t * data, size_t length, int set_fin, int is_owned,
+	picoquic_stream_data_release_fn release_fn, void * release_ctx)
 {
     int ret = 0;
     picoquic_stream_head * stream = NULL;
@@ -91,7 +98,20 @@ int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint32_t stream_id,
         }
         else
         {
-            stream_data->bytes = (uint8_t *)malloc(length);
+            stream_data->is_pulled = 0;
+
+            if (is_owned)
+            {
+                stream_data->bytes = data;
+                stream_data->release_fn = release_fn;
+                stream_data->release_ctx = release_ctx;
+            }
+            else
+            {
+                stream_data->bytes = (uint8_t *)malloc(length);
+                stream_data->release_fn = NULL;
+                stream_data->release_ctx = NULL;
+            }
 
             if (stream_data->bytes == NULL)
             {
@@ -101,28 +121,143 @@ int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint32_t stream_id,
             }
             else
             {
-                picoquic_stream_data ** pprevious = &stream->send_queue;
-                picoquic_stream_data * next = stream->send_queue;
-
-                memcpy(stream_data->bytes, data, length);
+                if (!is_owned)
+                {
+                    memcpy(stream_data->bytes, data, length);
+                }
                 stream_data->length = length;
-                stream_data->offset = 0;
+                stream_data->offset = stream->queued_offset;
                 stream_data->next_stream_data = NULL;
 
-                while (next != NULL)
+                /* Append at the tail of the queue */
+                if (stream->send_queue_last == NULL)
+                {
+                    stream->send_queue = stream_data;
+                }
+                else
                 {
-                    pprevious = &next->next_stream_data;
-                    next = next->next_stream_data;
+                    stream->send_queue_last->next_stream_data = stream_data;
                 }
+                stream->send_queue_last = stream_data;
+                stream->queued_offset += length;
 
-                *pprevious = stream_data;
+                if (stream->send_next == NULL)
+                {
+                    stream->send_next = stream_data;
+                }
             }
         }
     }
+    else if (ret == 0 && is_owned && data != NULL)
+    {
+        /* Nothing to queue, the buffer can be returned at once */
+        if (release_fn != NULL)
+        {
+            release_fn(data, length, release_ctx);
+        }
+        else
+        {
+            free(data);
+        }
+    }
+
+    if (ret == 0)
+    {
+        picoquic_update_stream_ready(cnx, stream);
+        picoquic_cnx_wake_now(cnx);
+    }
 
     return ret;
 }
 
+int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint32_t stream_id, 
+	const uint8_t * data, size_t length, int set_fin)
+{
+	return picoquic_queue_stream_data(cnx, stream_id, (uint8_t *)data, length, set_fin, 0, NULL, NULL);
+}
+
+int picoquic_add_buffer_to_stream(picoquic_cnx_t * cnx,
+	uint32_t stream_id, uint8_t * data, size_t length, int set_fin,
+	picoquic_stream_data_release_fn release_fn, void * release_ctx)
+{
+	return picoquic_queue_stream_data(cnx, stream_id, data, length, set_fin, 1, release_fn, release_ctx);
+}
+
+/*
+ * Pull mode. The provider is called when the stream is scheduled, once all
+ * the queued data is sent, as long as the stream is marked active.
+ */
+int picoquic_set_stream_data_provider(picoquic_cnx_t * cnx, uint32_t stream_id,
+	picoquic_stream_data_provider_fn provider_fn, void * provider_ctx)
+{
+	int ret = 0;
+	picoquic_stream_head * stream = NULL;
+
+	if (stream_id == 0)
+	{
+		ret = PICOQUIC_ERROR_CANNOT_CONTROL_STREAM_ZERO;
+	}
+	else
+	{
+		stream = picoquic_find_stream(cnx, stream_id, 1);
+
+		if (stream == NULL)
+		{
+			ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+		}
+		else
+		{
+			stream->provider_fn = provider_fn;
+			stream->provider_ctx = provider_ctx;
+			picoquic_update_stream_ready(cnx, stream);
+
+			if (provider_fn != NULL && stream->is_active)
+			{
+				picoquic_cnx_wake_now(cnx);
+			}
+		}
+	}
+
+	return ret;
+}
+
+int picoquic_mark_active_stream(picoquic_cnx_t * cnx, uint32_t stream_id, int is_active)
+{
+	int ret = 0;
+	picoquic_stream_head * stream = NULL;
+
+	if (stream_id == 0)
+	{
+		ret = PICOQUIC_ERROR_CANNOT_CONTROL_STREAM_ZERO;
+	}
+	else
+	{
+		stream = picoquic_find_stream(cnx, stream_id, 1);
+
+		if (stream == NULL)
+		{
+			ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+		}
+		else if (is_active && (stream->stream_flags&(picoquic_stream_flag_fin_notified |
+			picoquic_stream_flag_reset_requested)) != 0)
+		{
+			ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+		}
+		else
+		{
+			stream->is_active = is_active;
+			picoquic_update_stream_ready(cnx, stream);
+
+			if (is_active)
+			{
+				picoquic_cnx_wake_now(cnx);
+			}
+		}
+	}
+
+	return ret;
+}
+
 int picoquic_reset_stream(picoquic_cnx_t * cnx,
 	uint32_t stream_id)
 {
@@ -150,22 +285,273 @@ int picoquic_reset_stream(picoquic_cnx_t * cnx,
 		{
 			stream->local_error = PICOQUIC_TRANSPORT_ERROR_CANCELLED;
 			stream->stream_flags |= picoquic_stream_flag_reset_requested;
+			picoquic_update_stream_ready(cnx, stream);
+			picoquic_cnx_wake_now(cnx);
 		}
 	}
 
 	return ret;
 }
 
-picoquic_packet * picoquic_create_packet()
+/*
+ * Set the priority and weight used by the stream scheduler. The stream is
+ * created if needed, so the priority can be set before queuing data.
+ * A weight of zero is treated as the minimum weight, 1.
+ */
+int picoquic_set_stream_priority(picoquic_cnx_t * cnx,
+	uint32_t stream_id, uint8_t priority, uint8_t weight)
 {
-    picoquic_packet * packet = (picoquic_packet *)malloc(sizeof(picoquic_packet));
+	int ret = 0;
+	picoquic_stream_head * stream = NULL;
 
-    if (packet != NULL)
-    {
-        memset(packet, 0, sizeof(picoquic_packet));
-    }
+	if (stream_id == 0)
+	{
+		ret = PICOQUIC_ERROR_CANNOT_CONTROL_STREAM_ZERO;
+	}
+	else
+	{
+		stream = picoquic_find_stream(cnx, stream_id, 1);
+
+		if (stream == NULL)
+		{
+			ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+		}
+		else
+		{
+			/* The stream is indexed again by the scheduler under its new priority */
+			int is_scheduled = stream->scheduler_link.is_queued && cnx->stream_scheduler != NULL;
+
+			if (is_scheduled)
+			{
+				cnx->stream_scheduler->sched_remove(cnx, stream);
+			}
+
+			stream->priority = priority;
+			stream->weight = (weight == 0) ? 1 : weight;
+
+			if (is_scheduled)
+			{
+				cnx->stream_scheduler->sched_add(cnx, stream);
+			}
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Switch a stream to or from application read mode. When leaving the mode,
+ * the data already readable is passed to the callback.
+ */
+int picoquic_set_stream_app_read(picoquic_cnx_t * cnx, uint32_t stream_id, int is_app_read)
+{
+	int ret = 0;
+	picoquic_stream_head * stream = NULL;
+
+	if (stream_id == 0)
+	{
+		ret = PICOQUIC_ERROR_CANNOT_CONTROL_STREAM_ZERO;
+	}
+	else
+	{
+		stream = picoquic_find_stream(cnx, stream_id, 1);
+
+		if (stream == NULL)
+		{
+			ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+		}
+		else
+		{
+			stream->is_app_read = is_app_read;
+
+			if (!is_app_read && cnx->callback_fn != NULL)
+			{
+				picoquic_stream_data_callback(cnx, stream);
+			}
+		}
+	}
+
+	return ret;
+}
+
+static int picoquic_find_readable_stream(picoquic_cnx_t * cnx, uint32_t stream_id,
+	picoquic_stream_head ** stream)
+{
+	int ret = 0;
+
+	if (stream_id == 0)
+	{
+		ret = PICOQUIC_ERROR_CANNOT_CONTROL_STREAM_ZERO;
+	}
+	else if ((*stream = picoquic_find_stream(cnx, stream_id, 0)) == NULL)
+	{
+		ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+	}
+	else if (((*stream)->stream_flags&picoquic_stream_flag_reset_received) != 0)
+	{
+		ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+	}
+
+	return ret;
+}
+
+/*
+ * Return a pointer to the next contiguous bytes in the receive ring. The
+ * readable data may wrap around the end of the ring, in which case the
+ * rest is returned by the next peek, after the first part is consumed.
+ */
+int picoquic_stream_peek(picoquic_cnx_t * cnx, uint32_t stream_id,
+	uint8_t ** bytes, size_t * length, int * is_fin)
+{
+	picoquic_stream_head * stream = NULL;
+	int ret = picoquic_find_readable_stream(cnx, stream_id, &stream);
+
+	*bytes = NULL;
+	*length = 0;
+	*is_fin = 0;
+
+	if (ret == 0)
+	{
+		uint64_t readable = picoquic_stream_readable_offset(stream) - stream->consumed_offset;
+
+		if (readable > 0)
+		{
+			size_t index = (size_t)(stream->consumed_offset & (stream->recv_ring_size - 1));
+
+			*bytes = stream->recv_ring + index;
+			*length = stream->recv_ring_size - index;
+
+			if (*length > readable)
+			{
+				*length = (size_t)readable;
+			}
+		}
+
+		*is_fin = ((stream->stream_flags&picoquic_stream_flag_fin_received) != 0 &&
+			stream->consumed_offset + *length >= stream->fin_offset);
+	}
+
+	return ret;
+}
+
+/*
+ * Release bytes read by the application. Flow control credit is granted
+ * as the stream progresses, and the ring is freed at the end of the stream.
+ * At most the readable bytes are consumed.
+ */
+int picoquic_stream_consume(picoquic_cnx_t * cnx, uint32_t stream_id, size_t length)
+{
+	picoquic_stream_head * stream = NULL;
+	int ret = picoquic_find_readable_stream(cnx, stream_id, &stream);
+
+	if (ret == 0)
+	{
+		picoquic_sack_list_t * recv_ranges = &stream->recv_ranges;
+		uint64_t readable = picoquic_stream_readable_offset(stream) - stream->consumed_offset;
+
+		if (length > readable)
+		{
+			length = (size_t)readable;
+		}
+
+		if (length > 0)
+		{
+			stream->consumed_offset += length;
+
+			if (stream->consumed_offset > recv_ranges->ranges[0].end_of_sack_range)
+			{
+				memmove(&recv_ranges->ranges[0], &recv_ranges->ranges[1],
+					(recv_ranges->nb_ranges - 1) * sizeof(picoquic_sack_range_t));
+				recv_ranges->nb_ranges--;
+			}
+			else
+			{
+				recv_ranges->ranges[0].start_of_sack_range = stream->consumed_offset;
+			}
+		}
+
+		if (stream->consumed_offset >= stream->fin_offset &&
+			(stream->stream_flags&
+			(picoquic_stream_flag_fin_received | picoquic_stream_flag_fin_signalled)) ==
+			picoquic_stream_flag_fin_received)
+		{
+			stream->stream_flags |= picoquic_stream_flag_fin_signalled;
+
+			if (stream->recv_ring != NULL)
+			{
+				free(stream->recv_ring);
+				stream->recv_ring = NULL;
+				stream->recv_ring_size = 0;
+			}
+			picoquic_sack_list_free(recv_ranges);
+		}
+
+		picoquic_update_stream_max_data(cnx, stream);
+
+		if (stream->queue_link[picoquic_stream_queue_max_data].is_queued)
+		{
+			picoquic_cnx_wake_now(cnx);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Copy the readable bytes in the application buffer, and consume them.
+ */
+int picoquic_stream_read(picoquic_cnx_t * cnx, uint32_t stream_id,
+	uint8_t * buffer, size_t buffer_max, size_t * nb_read, int * is_fin)
+{
+	int ret = 0;
+	uint8_t * bytes = NULL;
+	size_t length = 0;
+
+	*nb_read = 0;
+	*is_fin = 0;
+
+	do
+	{
+		ret = picoquic_stream_peek(cnx, stream_id, &bytes, &length, is_fin);
+
+		if (ret == 0)
+		{
+			if (length > buffer_max - *nb_read)
+			{
+				length = buffer_max - *nb_read;
+				*is_fin = 0;
+			}
+
+			if (length > 0)
+			{
+				memcpy(buffer + *nb_read, bytes, length);
+				*nb_read += length;
+			}
+
+			ret = picoquic_stream_consume(cnx, stream_id, length);
+		}
+	} while (ret == 0 && length > 0 && *is_fin == 0 && *nb_read < buffer_max);
+
+	return ret;
+}
+
+/*
+ * Document a frame in the description of the packet being prepared.
+ * Stateless packets are not described, the description is then NULL.
+ */
+void picoquic_record_sent_frame(picoquic_sent_packet_t * sent, picoquic_sent_frame_type_enum frame_type,
+	uint32_t stream_id, uint64_t offset, size_t length, int fin)
+{
+	if (sent != NULL && sent->nb_frames < PICOQUIC_MAX_SENT_FRAMES)
+	{
+		picoquic_sent_frame_t * frame = &sent->frames[sent->nb_frames++];
 
-    return packet;
+		frame->frame_type = (uint8_t)frame_type;
+		frame->fin = (uint8_t)fin;
+		frame->length = (uint16_t)length;
+		frame->stream_id = stream_id;
+		frame->offset = offset;
+	}
 }
 
 size_t picoquic_create_packet_header(
@@ -212,61 +598,84 @@ size_t picoquic_create_packet_header(
 	return length;
 }
 
+/*
+ * Probe timeout, per RFC 9002: smoothed RTT plus 4 RTT variations plus the
+ * maximum ACK delay of the peer, as computed in the retransmit timer. It
+ * doubles after each consecutive timeout, and is reset when an ACK arrives.
+ */
+static uint64_t picoquic_probe_timeout(picoquic_cnx_t * cnx)
+{
+	uint64_t pto = cnx->retransmit_timer << cnx->nb_retransmit;
+
+	if (pto > PICOQUIC_MICROSEC_WAIT_MAX)
+	{
+		pto = PICOQUIC_MICROSEC_WAIT_MAX;
+	}
+
+	return pto;
+}
+
+/*
+ * When the probe timeout fires, the oldest packets are repeated as a probe.
+ * This is not by itself a sign of congestion: the repeated frames are
+ * reported as losses, and the window only collapses after consecutive
+ * timeouts, when the congestion is persistent.
+ */
+static picoquic_congestion_notification_t picoquic_loss_notification(picoquic_cnx_t * cnx,
+	int timer_based)
+{
+	return (timer_based && cnx->nb_retransmit >= PICOQUIC_PERSISTENT_CONGESTION_PTO) ?
+		picoquic_congestion_notification_timeout : picoquic_congestion_notification_repeat;
+}
+
+/*
+ * Time at which the packet is declared lost if a later packet is
+ * acknowledged, per RACK: the latest RTT plus the reordering window.
+ */
+static uint64_t picoquic_rack_loss_time(picoquic_cnx_t * cnx, picoquic_sent_packet_t * p,
+	uint64_t current_time)
+{
+	return p->send_time + cnx->latest_rtt + picoquic_rack_reorder_window(cnx, current_time);
+}
+
 /*
  * If a retransmit is needed, fill the packet with the required
  * retransmission. Also, prune the retransmit queue as needed.
  */
 
 static int picoquic_retransmit_needed_by_packet(picoquic_cnx_t * cnx, 
-    picoquic_packet * p, uint64_t current_time, int * timer_based)
+    picoquic_sent_packet_t * p, uint64_t current_time, int * timer_based)
 {
 
     int64_t delta_seq = cnx->highest_acknowledged - p->sequence_number;
     int should_retransmit = 0;
 
-    if (delta_seq > 3)
+    if (delta_seq > 0 && current_time >= picoquic_rack_loss_time(cnx, p, current_time))
+    {
+        /*
+         * RACK logic.
+         * A packet sent after this one was acknowledged, and more than
+         * the RTT plus the reordering window elapsed since this one was sent.
+         */
+        should_retransmit = 1;
+    }
+    else if (delta_seq > 3 && cnx->rack_reorder_mult == PICOQUIC_RACK_REORDER_MULT_MIN)
     {
         /*
          * SACK Logic.
          * more than N packets were seen at the receiver after this one.
+         * Not used once reordering was observed on the path.
          */
         should_retransmit = 1;
     }
     else
     {
-        int64_t delta_t = cnx->latest_time_acknowledged - p->send_time;
-
-        /* TODO: out of order delivery time ought to be dynamic */
-        if (delta_t > 10000)
-        {
-            /*
-             * RACK logic.
-             * The latest acknowledged was sent more than X ms after this one.
-             */
-            should_retransmit = 1;
-        }
-        else if (delta_t > 0)
-        {
-            /* If the delta-t is larger than zero, add the time since the
-            * last ACK was received. If that is larger than the inter packet
-            * time, consider that there is a loss */
-            uint64_t time_from_last_ack = current_time - cnx->latest_time_acknowledged + delta_t;
-
-            if (time_from_last_ack > 10000)
-            {
-                should_retransmit = 1;
-            }
-        }
-
         if (should_retransmit == 0)
         {
             /* Don't fire yet, because of possible out of order delivery */
             int64_t time_out = current_time - p->send_time;
-            uint64_t retransmit_timer = (cnx->nb_retransmit == 0) ?
-                cnx->retransmit_timer : (1000000 << (cnx->nb_retransmit - 1));
 
-            /* TODO: timer limit ought to be dynamic */
-            if ((uint64_t)time_out < retransmit_timer)
+            if ((uint64_t)time_out < picoquic_probe_timeout(cnx))
             {
                 /* Do not retransmit if the timer has not yet elapsed */
                 should_retransmit = 0;
@@ -282,80 +691,83 @@ static int picoquic_retransmit_needed_by_packet(picoquic_cnx_t * cnx,
     return should_retransmit;
 }
 
-int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time, 
-	picoquic_packet * packet, int * use_fnv1a, size_t * header_length)
+/*
+ * After the frames of a lost packet are regenerated, the frames of the next
+ * lost packets of the same type are added to the same packet, as long as
+ * they fit. The regenerated frames are never larger than the original ones,
+ * and the packet headers have the same size. Each coalesced packet counts
+ * as a loss for congestion control.
+ */
+static size_t picoquic_coalesce_retransmit(picoquic_cnx_t * cnx, uint64_t current_time,
+	picoquic_packet_type_enum ptype, uint64_t cnx_id, uint8_t * bytes, size_t length,
+	size_t header_length, size_t checksum_length, picoquic_sent_packet_t * sent)
 {
-	picoquic_packet * p;
-	size_t length = 0;
+	picoquic_sent_packet_t * p;
 
-	/* TODO: while packets are pure ACK, drop them from retransmit queue */
 	while ((p = cnx->retransmit_oldest) != NULL)
 	{
-		int64_t delta_seq = cnx->highest_acknowledged - p->sequence_number;
-		int should_retransmit = 0;
 		int timer_based_retransmit = 0;
+		int is_repeated = 0;
 		uint64_t lost_packet_number = p->sequence_number;
 
-		length = 0;
+		if (p->ptype != ptype || p->cnx_id != cnx_id ||
+			length + p->length - header_length > cnx->send_mtu - checksum_length ||
+			sent->nb_frames + p->nb_frames > PICOQUIC_MAX_SENT_FRAMES)
+		{
+			break;
+		}
 
-#if 0
-		if (delta_seq > 3)
+		if (!picoquic_retransmit_needed_by_packet(cnx, p, current_time, &timer_based_retransmit))
 		{
-			/*
-			 * SACK Logic.
-			 * more than N packets were seen at the receiver after this one.
-			 */
-			should_retransmit = 1;
+			break;
 		}
-		else
+
+		for (int i = 0; i < p->nb_frames; i++)
 		{
-			int64_t delta_t = cnx->latest_time_acknowledged - p->send_time;
+			size_t frame_length = 0;
 
-			/* TODO: out of order delivery time ought to be dynamic */
-			if (delta_t > 10000)
+			if (picoquic_prepare_repeated_frame(cnx, &p->frames[i], &bytes[length],
+				cnx->send_mtu - checksum_length - length, &frame_length, sent) == 0 &&
+				frame_length > 0)
 			{
-				/*
-				 * RACK logic.
-				 * The latest acknowledged was sent more than X ms after this one.
-				 */
-				should_retransmit = 1;
+				length += frame_length;
+				is_repeated = 1;
 			}
-			else if (delta_t > 0)
-			{
-				/* If the delta-t is larger than zero, add the time since the
-				 * last ACK was received. If that is larger than the inter packet
-				 * time, consider that there is a loss */
-				uint64_t time_from_last_ack = current_time - cnx->latest_time_acknowledged + delta_t;
+		}
 
-				if (time_from_last_ack > 10000)
-				{
-					should_retransmit = 1;
-				}
-			}
+		picoquic_dequeue_retransmit_packet(cnx, p, 1);
 
-			if (should_retransmit == 0)
-			{
-				/* Don't fire yet, because of possible out of order delivery */
-				int64_t time_out = current_time - p->send_time;
-				uint64_t retransmit_timer = (cnx->nb_retransmit == 0) ?
-					cnx->retransmit_timer : (1000000 << (cnx->nb_retransmit - 1));
+		if (is_repeated)
+		{
+			picoquic_record_lost_packet(cnx, lost_packet_number, timer_based_retransmit);
 
-				/* TODO: timer limit ought to be dynamic */
-				if ((uint64_t) time_out < retransmit_timer)
-				{
-					/* Do not retransmit if the timer has not yet elapsed */
-					should_retransmit = 0;
-				}
-				else
-				{
-					should_retransmit = 1;
-					timer_based_retransmit = 1;
-				}
+			if (cnx->congestion_alg != NULL)
+			{
+				cnx->congestion_alg->alg_notify(cnx,
+					picoquic_loss_notification(cnx, timer_based_retransmit),
+					0, 0, lost_packet_number, current_time);
 			}
 		}
-#else
+	}
+
+	return length;
+}
+
+int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time, 
+	picoquic_packet * packet, picoquic_sent_packet_t * sent, int * use_fnv1a, size_t * header_length)
+{
+	picoquic_sent_packet_t * p;
+	size_t length = 0;
+
+	while ((p = cnx->retransmit_oldest) != NULL)
+	{
+		int should_retransmit = 0;
+		int timer_based_retransmit = 0;
+		uint64_t lost_packet_number = p->sequence_number;
+
+		length = 0;
+
         should_retransmit = picoquic_retransmit_needed_by_packet(cnx, p, current_time, &timer_based_retransmit);
-#endif
 
 		if (should_retransmit == 0)
 		{
@@ -366,29 +778,27 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 		}
 		else
 		{
-			/* check if this is an ACK only packet */
-			picoquic_packet_header ph;
 			int ret = 0;
 			int packet_is_pure_ack = 1;
-			int frame_is_pure_ack = 0;
 			uint8_t * bytes = packet->bytes;
 			size_t frame_length = 0;
-			size_t byte_index = 0; /* Used when parsing the old packet */
 			size_t checksum_length;
-
+			picoquic_packet_type_enum ptype = p->ptype;
 
 			*header_length = 0;
-			/* Get the packet type */
-			ret = picoquic_parse_packet_header(p->bytes, p->length, &ph);
+			sent->has_ack = 0;
+			sent->nb_frames = 0;
+			sent->ptype = ptype;
+			sent->cnx_id = p->cnx_id;
 
-			length = picoquic_create_packet_header(cnx, ph.ptype, ph.cnx_id, cnx->send_sequence, 
+			length = picoquic_create_packet_header(cnx, ptype, p->cnx_id, cnx->send_sequence, 
 				bytes);
 			packet->sequence_number = cnx->send_sequence;
 
 			*header_length = length;
 
-			if (ph.ptype == picoquic_packet_1rtt_protected_phi0 ||
-				ph.ptype == picoquic_packet_1rtt_protected_phi1)
+			if (ptype == picoquic_packet_1rtt_protected_phi0 ||
+				ptype == picoquic_packet_1rtt_protected_phi1)
 			{
 				*use_fnv1a = 0;
 				checksum_length = 16;
@@ -399,21 +809,18 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 				checksum_length = 8;
 			}
 
-			/* Copy the relevant bytes from one packet to the next */
-			byte_index = ph.offset;
-
-			while (ret == 0 && byte_index < p->length)
+			/* Regenerate the frames of the old packet. The frames that
+			 * are now useless, e.g. acknowledged data, are skipped. */
+			for (int i = 0; ret == 0 && i < p->nb_frames; i++)
 			{
-				ret = picoquic_skip_frame(&p->bytes[byte_index],
-					p->length - ph.offset, &frame_length, &frame_is_pure_ack);
+				ret = picoquic_prepare_repeated_frame(cnx, &p->frames[i], &bytes[length],
+					cnx->send_mtu - checksum_length - length, &frame_length, sent);
 
-				if (!frame_is_pure_ack)
+				if (ret == 0 && frame_length > 0)
 				{
-					memcpy(&bytes[length], &p->bytes[byte_index], frame_length);
 					length += frame_length;
 					packet_is_pure_ack = 0;
 				}
-				byte_index += frame_length;
 			}
 
 			/* Update the number of bytes in transit and remove old packet from queue */
@@ -427,9 +834,17 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 			}
 			else
 			{
+				picoquic_congestion_notification_t notification =
+					picoquic_loss_notification(cnx, timer_based_retransmit);
+
+				/* Check the next packets before the timer is backed off */
+				length = picoquic_coalesce_retransmit(cnx, current_time, ptype, sent->cnx_id,
+					bytes, length, *header_length, checksum_length, sent);
+
+
 				if (timer_based_retransmit != 0)
 				{
-					if (cnx->nb_retransmit > 4)
+					if (cnx->nb_retransmit >= PICOQUIC_MAX_CONSECUTIVE_PTO)
 					{
 						/*
 						 * Max retransmission count was exceeded. Disconnect.
@@ -453,7 +868,7 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 				if (should_retransmit != 0)
 				{
 					/* special case for the client initial */
-					if (ph.ptype == picoquic_packet_client_initial)
+					if (ptype == picoquic_packet_client_initial)
 					{
 						while (length < (cnx->send_mtu - checksum_length))
 						{
@@ -462,13 +877,11 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 					}
 					packet->length = length;
 
+					picoquic_record_lost_packet(cnx, lost_packet_number, timer_based_retransmit);
 
 					if (cnx->congestion_alg != NULL)
 					{
-						cnx->congestion_alg->alg_notify(cnx,
-							(timer_based_retransmit == 0)?
-							picoquic_congestion_notification_repeat:
-							picoquic_congestion_notification_timeout,
+						cnx->congestion_alg->alg_notify(cnx, notification,
 							0, 0, lost_packet_number, current_time);
 					}
 
@@ -482,77 +895,172 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 }
 
 /*
- * Returns true if there is nothing to repeat in the retransmission queue
+ * Returns true if there is nothing to repeat in the retransmission queue.
+ * ACK only packets are never queued, so any queued packet has frames.
  */
 int picoquic_is_cnx_backlog_empty(picoquic_cnx_t * cnx)
 {
-    picoquic_packet * p = cnx->retransmit_oldest;
-    int backlog_empty = 1;
+    return (cnx->nb_retransmit_packets == 0);
+}
 
-    /* TODO: while packets are pure ACK, drop them from retransmit queue */
-    while (p != NULL && backlog_empty == 1)
-    {
-        /* check if this is an ACK only packet */
-        picoquic_packet_header ph;
-        int ret = 0;
-        int frame_is_pure_ack = 0;
-        size_t frame_length = 0;
-        size_t byte_index = 0; /* Used when parsing the old packet */
-        size_t checksum_length;
-        /* Get the packet type */
-        ret = picoquic_parse_packet_header(p->bytes, p->length, &ph);
-
-        if (ph.ptype == picoquic_packet_1rtt_protected_phi0 ||
-            ph.ptype == picoquic_packet_1rtt_protected_phi1)
-        {
-            checksum_length = 16;
-        }
-        else
-        {
-            checksum_length = 8;
-        }
+/* Decide whether MAX data need to be sent or not */
+int picoquic_should_send_max_data(picoquic_cnx_t * cnx)
+{
+    int ret = 0;
 
-        /* Copy the relevant bytes from one packet to the next */
-        byte_index = ph.offset;
+    if (2 * cnx->data_received > cnx->maxdata_local ||
+        cnx->stream_queue[picoquic_stream_queue_max_data].first != NULL)
+        ret = 1;
 
-        while (ret == 0 && byte_index < p->length)
-        {
-            ret = picoquic_skip_frame(&p->bytes[byte_index],
-                p->length - ph.offset, &frame_length, &frame_is_pure_ack);
+    return ret;
+}
 
-            if (!frame_is_pure_ack)
-            {
-                backlog_empty = 0;
-                break;
-            }
-            byte_index += frame_length;
-        }
 
-        p = p->previous_packet;
-    }
+/*
+ * Add the MAX_DATA and MAX_STREAM_DATA frames that are due.
+ */
+static int picoquic_prepare_flow_control_frames(picoquic_cnx_t * cnx,
+	uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent)
+{
+	int ret = 0;
+	size_t byte_index = 0;
+	size_t data_bytes = 0;
+
+	if (2 * cnx->data_received > cnx->maxdata_local)
+	{
+		ret = picoquic_prepare_max_data_frame(cnx, 2 * cnx->data_received, bytes, bytes_max, &data_bytes);
+
+		if (ret == 0)
+		{
+			byte_index += data_bytes;
+			picoquic_record_sent_frame(sent, picoquic_sent_frame_max_data, 0, 0, 0, 0);
+		}
+		else if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
+		{
+			ret = 0;
+		}
+	}
+
+	if (ret == 0)
+	{
+		data_bytes = 0;
+		ret = picoquic_prepare_required_max_stream_data_frames(cnx, bytes + byte_index,
+			bytes_max - byte_index, &data_bytes, sent);
 
-    return backlog_empty;
+		if (ret == 0)
+		{
+			byte_index += data_bytes;
+		}
+	}
+
+	*consumed = byte_index;
+
+	return ret;
 }
 
-/* Decide whether MAX data need to be sent or not */
-int picoquic_should_send_max_data(picoquic_cnx_t * cnx)
+/*
+ * Fill the rest of the packet with frames from the other ready streams.
+ * Each frame needs a description in the packet, for retransmission. The
+ * loop stops when a stream that is still ready cannot send anything, which
+ * happens when the room left is too small for a frame header.
+ */
+static int picoquic_pack_stream_frames(picoquic_cnx_t * cnx, int stream_restricted,
+	uint8_t * bytes, size_t bytes_max, size_t * consumed, picoquic_sent_packet_t * sent)
 {
-    int ret = 0;
+	int ret = 0;
+	size_t byte_index = 0;
+	picoquic_stream_head * stream;
 
-    if (2 * cnx->data_received > cnx->maxdata_local)
-        ret = 1;
+	while (ret == 0 && byte_index < bytes_max &&
+		sent->nb_frames < PICOQUIC_MAX_SENT_FRAMES &&
+		(stream = picoquic_find_ready_stream(cnx, stream_restricted)) != NULL)
+	{
+		size_t data_bytes = 0;
 
-    return ret;
+		ret = picoquic_prepare_stream_frame(cnx, stream, bytes + byte_index, bytes_max - byte_index,
+			&data_bytes, sent);
+
+		if (ret == 0)
+		{
+			if (data_bytes == 0 && stream->queue_link[picoquic_stream_queue_ready].is_queued)
+			{
+				break;
+			}
+			byte_index += data_bytes;
+		}
+	}
+
+	if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
+	{
+		ret = 0;
+	}
+
+	*consumed = byte_index;
+
+	return ret;
+}
+
+/*
+ * Pacing spreads the new packets over the round trip, instead of sending a
+ * new window in one burst. The rate is set by the congestion algorithm, or
+ * else derived from the congestion window and the smoothed RTT. The pacer
+ * keeps the earliest time at which new data can be sent, and lets the sender
+ * catch up with a short burst after an idle period.
+ */
+static uint64_t picoquic_pacing_delay(picoquic_cnx_t * cnx, uint64_t nb_bytes)
+{
+	uint64_t delay;
+
+	if (cnx->pacing_rate > 0)
+	{
+		delay = (nb_bytes * 1000000) / cnx->pacing_rate;
+	}
+	else
+	{
+		delay = (nb_bytes * cnx->smoothed_rtt) / (PICOQUIC_PACING_WINDOW_GAIN * cnx->cwin);
+	}
+
+	return delay;
+}
+
+int picoquic_is_sending_authorized_by_pacing(picoquic_cnx_t * cnx, uint64_t current_time, uint64_t * next_time)
+{
+	int ret = 1;
+
+	if (!cnx->is_pacing_disabled && cnx->pacing_next_time > current_time)
+	{
+		ret = 0;
+
+		if (next_time != NULL && cnx->pacing_next_time < *next_time)
+		{
+			*next_time = cnx->pacing_next_time;
+		}
+	}
+
+	return ret;
 }
 
+void picoquic_update_pacing_after_send(picoquic_cnx_t * cnx, uint64_t nb_bytes, uint64_t current_time)
+{
+	uint64_t bucket_delay = picoquic_pacing_delay(cnx, PICOQUIC_PACING_BUCKET_MAX);
+
+	/* The credit accumulated while idle is capped to the bucket size */
+	if (cnx->pacing_next_time + bucket_delay < current_time)
+	{
+		cnx->pacing_next_time = current_time - bucket_delay;
+	}
+
+	cnx->pacing_next_time += picoquic_pacing_delay(cnx, nb_bytes);
+}
 
 /* Decide the next time at which the connection should send data */
 void picoquic_cnx_set_next_wake_time(picoquic_cnx_t * cnx, uint64_t current_time)
 {
     uint64_t old_time = cnx->next_wake_time;
     uint64_t next_time = cnx->latest_progress_time + PICOQUIC_MICROSEC_SILENCE_MAX;
-    picoquic_packet * p = cnx->retransmit_oldest;
+    picoquic_sent_packet_t * p = cnx->retransmit_oldest;
     picoquic_stream_head * stream = NULL;
+    uint64_t pacing_time = UINT64_MAX;
     int timer_based = 0;
     int blocked = 1;
 
@@ -578,13 +1086,19 @@ void picoquic_cnx_set_next_wake_time(picoquic_cnx_t * cnx, uint64_t current_time
         {
             int restricted = (cnx->cnx_state == picoquic_state_client_ready ||
                 cnx->cnx_state == picoquic_state_server_ready) ? 0 : 1;
-            picoquic_find_ready_stream(cnx, restricted);
+            stream = picoquic_find_ready_stream(cnx, restricted);
 
             if (stream != NULL)
             {
                 blocked = 0;
             }
         }
+
+        if (blocked == 0 && !picoquic_is_sending_authorized_by_pacing(cnx, current_time, &pacing_time))
+        {
+            /* Wake up when the next paced packet is due */
+            blocked = 1;
+        }
     }
 
     if (blocked == 0)
@@ -596,33 +1110,29 @@ void picoquic_cnx_set_next_wake_time(picoquic_cnx_t * cnx, uint64_t current_time
         /* Consider delayed ACK */
         if (cnx->ack_needed)
         {
-            next_time = cnx->highest_ack_time + 10000;
+            next_time = cnx->ack_pending_time + cnx->ack_delay_max;
         }
 
         /* Consider delayed RACK */
         if (p != NULL)
         {
-            if (cnx->latest_time_acknowledged > p->send_time &&
-                p->send_time + 10000 < next_time)
+            if ((int64_t)(cnx->highest_acknowledged - p->sequence_number) > 0 &&
+                picoquic_rack_loss_time(cnx, p, current_time) < next_time)
             {
-                next_time = p->send_time + 10000;
+                next_time = picoquic_rack_loss_time(cnx, p, current_time);
             }
 
-            if (cnx->nb_retransmit == 0)
+            if (p->send_time + picoquic_probe_timeout(cnx) < next_time)
             {
-                if (p->send_time + cnx->retransmit_timer < next_time)
-                {
-                    next_time = p->send_time + cnx->retransmit_timer;
-                }
-            }
-            else
-            {
-                if (p->send_time + (1000000ull << (cnx->nb_retransmit - 1)) < next_time)
-                {
-                    next_time = p->send_time + (1000000ull << (cnx->nb_retransmit - 1));
-                }
+                next_time = p->send_time + picoquic_probe_timeout(cnx);
             }
         }
+
+        /* Consider the pacer */
+        if (pacing_time < next_time)
+        {
+            next_time = pacing_time;
+        }
     }
 
     cnx->next_wake_time = next_time;
@@ -648,6 +1158,16 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 	size_t header_length = 0;
 	uint8_t * bytes = packet->bytes;
 	size_t length = 0;
+	int window_open = 0;
+	picoquic_sent_packet_t * sent = NULL;
+
+	/* Make sure that the packet can be queued before committing any state */
+	if (picoquic_reserve_retransmit_ring(cnx, cnx->send_sequence) != 0 ||
+		(sent = picoquic_create_sent_packet(cnx->quic)) == NULL)
+	{
+		*send_length = 0;
+		return PICOQUIC_ERROR_MEMORY;
+	}
 
     /* Check that the connection is still alive */
     if ((current_time - cnx->latest_progress_time) > PICOQUIC_MICROSEC_SILENCE_MAX)
@@ -726,8 +1246,12 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 
 	stream = picoquic_find_ready_stream(cnx, stream_restricted);
 
+	/* New data is only sent if the congestion window is open and the pacer allows it */
+	window_open = cnx->cwin > cnx->bytes_in_transit &&
+		picoquic_is_sending_authorized_by_pacing(cnx, current_time, NULL);
+
 	if (ret == 0 && retransmit_possible &&
-		(length = picoquic_retransmit_needed(cnx, current_time, packet, &use_fnv1a, &header_length)) > 0)
+		(length = picoquic_retransmit_needed(cnx, current_time, packet, sent, &use_fnv1a, &header_length)) > 0)
 	{
 		/* Set the new checksum length */
 		checksum_overhead = (use_fnv1a) ? 8 : 16;
@@ -735,9 +1259,40 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 		if (picoquic_prepare_ack_frame(cnx, current_time, &bytes[length],
 			cnx->send_mtu - checksum_overhead - length, &data_bytes) == 0)
 		{
+			if (data_bytes > 0)
+			{
+				sent->has_ack = 1;
+				sent->ack_largest = picoquic_sack_list_largest(&cnx->sack_list);
+			}
 			length += data_bytes;
 			packet->length = length;
 		}
+
+		/* Fill the room left after the repeated frames with new frames, in
+		 * protected packets only, since the repeated packet type may not match
+		 * the current state of the handshake */
+		if (!use_fnv1a && window_open &&
+			sent->nb_frames < PICOQUIC_MAX_SENT_FRAMES)
+		{
+			data_bytes = 0;
+			ret = picoquic_prepare_flow_control_frames(cnx, &bytes[length],
+				cnx->send_mtu - checksum_overhead - length, &data_bytes, sent);
+
+			if (ret == 0)
+			{
+				length += data_bytes;
+				data_bytes = 0;
+				ret = picoquic_pack_stream_frames(cnx, stream_restricted, &bytes[length],
+					cnx->send_mtu - checksum_overhead - length, &data_bytes, sent);
+			}
+
+			if (ret == 0)
+			{
+				length += data_bytes;
+				packet->length = length;
+			}
+		}
+
 		/* document the send time & overhead */
 		packet->send_time = current_time;
 		packet->checksum_overhead = checksum_overhead;
@@ -756,6 +1311,19 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 		header_length = length;
 		packet->sequence_number = cnx->send_sequence;
 		packet->send_time = current_time;
+		sent->ptype = packet_type;
+		sent->cnx_id = cnx_id;
+		sent->has_ack = 0;
+		sent->nb_frames = 0;
+
+		if (stream == NULL && cnx->cwin >= cnx->bytes_in_transit + cnx->send_mtu &&
+			cnx->app_limited == 0 && !picoquic_has_unsent_stream_data(cnx))
+		{
+			/* The window has room for a full packet but the application has
+			 * nothing to send. The rate samples are app limited until the data
+			 * now in transit is delivered. */
+			cnx->app_limited = cnx->delivered + cnx->bytes_in_transit + 1;
+		}
 
 		if (cnx->cnx_state == picoquic_state_disconnecting)
 		{
@@ -763,9 +1331,11 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
             /* add a final ack so receiver gets clean state */
             ret = picoquic_prepare_ack_frame(cnx, current_time, &bytes[length],
                 cnx->send_mtu - checksum_overhead - length, &consumed);
-            if (ret == 0)
+            if (ret == 0 && consumed > 0)
             {
                 length += consumed;
+                sent->has_ack = 1;
+                sent->ack_largest = picoquic_sack_list_largest(&cnx->sack_list);
             }
 
             consumed = 0;
@@ -775,6 +1345,7 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 			if (ret == 0)
 			{
 				length += consumed;
+				picoquic_record_sent_frame(sent, picoquic_sent_frame_connection_close, 0, 0, 0, 0);
 			}
 
 			cnx->cnx_state = picoquic_state_disconnected;
@@ -783,7 +1354,8 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
                 (cnx->callback_fn)(cnx, 0, NULL, 0, picoquic_callback_close, cnx->callback_ctx);
             }
 		}
-		else if ((stream == NULL || cnx->cwin <= cnx->bytes_in_transit) &&
+		else if (((stream == NULL && picoquic_should_send_max_data(cnx) == 0) ||
+			!window_open) &&
 			picoquic_is_ack_needed(cnx, current_time) == 0)
 		{
 			length = 0;
@@ -792,42 +1364,52 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 		{
 			ret = picoquic_prepare_ack_frame(cnx, current_time, &bytes[length],
 				cnx->send_mtu - checksum_overhead - length, &data_bytes);
-			if (ret == 0)
+			if (ret == 0 && data_bytes > 0)
 			{
 				length += data_bytes;
+				sent->has_ack = 1;
+				sent->ack_largest = picoquic_sack_list_largest(&cnx->sack_list);
 			}
+			data_bytes = 0;
 
-			if (cnx->cwin > cnx->bytes_in_transit)
+			if (window_open)
 			{
-				/* If necessary, encode the max data frame */
-				if (2 * cnx->data_received > cnx->maxdata_local)
-				{
-					ret = picoquic_prepare_max_data_frame(cnx, 2 * cnx->data_received, &bytes[length],
-						cnx->send_mtu - checksum_overhead - length, &data_bytes);
-
-					if (ret == 0)
-					{
-						length += data_bytes;
-					}
-				}
-				/* If necessary, encode the max stream data frames */
-				ret = picoquic_prepare_required_max_stream_data_frames(cnx, &bytes[length],
-					cnx->send_mtu - checksum_overhead - length, &data_bytes);
+				/* If necessary, encode the max data and max stream data frames */
+				ret = picoquic_prepare_flow_control_frames(cnx, &bytes[length],
+					cnx->send_mtu - checksum_overhead - length, &data_bytes, sent);
 
 				if (ret == 0)
 				{
 					length += data_bytes;
 				}
+				data_bytes = 0;
 				/* Encode the stream frame */
 				if (stream != NULL)
 				{
 					ret = picoquic_prepare_stream_frame(cnx, stream, &bytes[length],
-						cnx->send_mtu - checksum_overhead - length, &data_bytes);
+						cnx->send_mtu - checksum_overhead - length, &data_bytes, sent);
 				}
 			}
 			if (ret == 0)
 			{
 				length += data_bytes;
+
+				if (stream != NULL && window_open)
+				{
+					size_t packed_bytes = 0;
+
+					/* Add frames from the other ready streams */
+					ret = picoquic_pack_stream_frames(cnx, stream_restricted, &bytes[length],
+						cnx->send_mtu - checksum_overhead - length, &packed_bytes, sent);
+
+					if (ret == 0)
+					{
+						length += packed_bytes;
+					}
+				}
+			}
+			if (ret == 0)
+			{
 				if (packet_type == picoquic_packet_client_initial)
 				{
 					while (length < cnx->send_mtu - checksum_overhead)
@@ -839,7 +1421,7 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 
 			/* If stream zero packets are sent, progress the state */
 			if (ret == 0 && stream != NULL && stream->stream_id == 0 && data_bytes > 0 &&
-				stream->send_queue == NULL)
+				stream->sent_offset >= stream->queued_offset)
 			{
 				switch (cnx->cnx_state)
 				{
@@ -886,32 +1468,37 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 
 		*send_length = length;
 
-		/* Account for bytes in transit, for congestion control */
-		cnx->bytes_in_transit += length;
+		cnx->nb_packets_sent++;
+		cnx->nb_packet_bytes_used += length;
+		cnx->nb_packet_bytes_mtu += cnx->send_mtu;
 
-		/* Manage the double linked packet list for retransmissions */
-		packet->previous_packet = NULL;
-		if (cnx->retransmit_newest == NULL)
+		/* Document the packet in the retransmit queue, and account for
+		 * bytes in transit, for congestion control */
+		sent->sequence_number = packet->sequence_number;
+		sent->send_time = current_time;
+		sent->length = packet->length;
+		sent->checksum_overhead = packet->checksum_overhead;
+
+		if (sent->nb_frames == 0)
 		{
-			packet->next_packet = NULL;
-			cnx->retransmit_oldest = packet;
+			/* ACK only, nothing to repeat and not in transit */
+			picoquic_record_ack_only_packet(cnx, sent);
+			picoquic_delete_sent_packet(cnx->quic, sent);
 		}
 		else
 		{
-			packet->next_packet = cnx->retransmit_newest;
-			packet->next_packet->previous_packet = packet;
+			picoquic_update_pacing_after_send(cnx, sent->length + sent->checksum_overhead, current_time);
+			picoquic_enqueue_retransmit_packet(cnx, sent);
 		}
-		cnx->retransmit_newest = packet;
 	}
 	else
 	{
 		*send_length = 0;
+		picoquic_delete_sent_packet(cnx->quic, sent);
 	}
 	
-    if (*send_length > 0)
-    {
-        picoquic_cnx_set_next_wake_time(cnx, current_time);
-    }
+    /* Also reschedule when nothing was sent, e.g. to wait for the pacer */
+    picoquic_cnx_set_next_wake_time(cnx, current_time);
 
 	return ret;
 }
@@ -923,6 +1510,7 @@ int picoquic_close(picoquic_cnx_t * cnx)
         cnx->cnx_state == picoquic_state_client_ready)
     {
         cnx->cnx_state = picoquic_state_disconnecting;
+        picoquic_cnx_wake_now(cnx);
     }
     else
     {
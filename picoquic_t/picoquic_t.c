@@ -30,15 +30,23 @@ typedef struct st_picoquic_test_def_t {
 
 static picoquic_test_def_t test_table[] = {
     { "picohash", picohash_test },
+    { "picohash_bench", picohash_bench_test },
     { "cnxcreation", cnxcreation_test },
+    { "cnx_wake_time", cnx_wake_time_test },
+    { "stream_index", stream_index_test },
+    { "stream_ready_queue", stream_ready_queue_test },
+    { "stream_reassembly", stream_reassembly_test },
+    { "newreno_recovery", newreno_recovery_test },
     { "parseheader", parseheadertest },
     { "pn2pn64", pn2pn64test },
     { "intformat", intformattest},
     {"fnv1a", fnv1atest},
     { "sack", sacktest },
+    { "sack_bench", sack_bench_test },
     { "float16", float16test },
     { "StreamZeroFrame", StreamZeroFrameTest },
     { "sendack", sendacktest },
+    { "sendack_fuzz", sendack_fuzz_test },
     { "tls_api", tls_api_test },
     {"tls_api_version_negotiation", tls_api_version_negotiation_test},
     { "transport_param", transport_param_test },
@@ -55,6 +63,24 @@ static picoquic_test_def_t test_table[] = {
     { "tls_api_very_long_max", tls_api_very_long_max_test },
     { "tls_api_very_long_with_err", tls_api_very_long_with_err_test },
     { "tls_api_very_long_congestion", tls_api_very_long_congestion_test },
+    { "tls_api_packet_pool", tls_api_packet_pool_test },
+    { "tls_api_retransmit_by_reference", tls_api_retransmit_by_reference_test },
+    { "tls_api_retransmit_ring", tls_api_retransmit_ring_test },
+    { "tls_api_stream_scheduler", tls_api_stream_scheduler_test },
+    { "tls_api_zero_copy_send", tls_api_zero_copy_send_test },
+    { "tls_api_pull_stream", tls_api_pull_stream_test },
+    { "tls_api_app_read", tls_api_app_read_test },
+    { "tls_api_stream_packing", tls_api_stream_packing_test },
+    { "tls_api_retransmit_merge", tls_api_retransmit_merge_test },
+    { "tls_api_ack_only", tls_api_ack_only_test },
+    { "tls_api_sent_frames", tls_api_sent_frames_test },
+    { "tls_api_cubic", tls_api_cubic_test },
+    { "tls_api_bbr", tls_api_bbr_test },
+    { "tls_api_pacing", tls_api_pacing_test },
+    { "tls_api_hystart", tls_api_hystart_test },
+    { "tls_api_pto", tls_api_pto_test },
+    { "tls_api_rack", tls_api_rack_test },
+    { "tls_api_ack_policy", tls_api_ack_policy_test },
     { "http0dot9", http0dot9_test },
     { "hrr", tls_api_hrr_test }
 };
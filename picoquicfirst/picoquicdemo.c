@@ -634,14 +634,14 @@ int quic_server(const char * server_name, int server_port,
                         (const char *)sp->bytes, (int)sp->length);
 
                     printf("Sending stateless packet, %d bytes\n", sent);
-                    picoquic_delete_stateless_packet(sp);
+                    picoquic_delete_stateless_packet(qserver, sp);
                     is_active = 1;
                 }
 
-                cnx_next = picoquic_get_first_cnx(qserver);
+                cnx_next = picoquic_get_first_due_cnx(qserver, current_time);
                 while (ret == 0 && cnx_next != NULL)
                 {
-                    p = picoquic_create_packet();
+                    p = picoquic_create_packet(qserver);
 
                     if (p == NULL)
                     {
@@ -651,11 +651,11 @@ int quic_server(const char * server_name, int server_port,
                     {
                         ret = picoquic_prepare_packet(cnx_next, p, current_time,
                             send_buffer, sizeof(send_buffer), &send_length);
+                        picoquic_delete_packet(qserver, p);
 
                         if (ret == PICOQUIC_ERROR_DISCONNECTED)
                         {
                             ret = 0;
-                            free(p);
                             picoquic_delete_cnx(cnx_next);
                             is_active = 1;
                             break;
@@ -665,7 +665,7 @@ int quic_server(const char * server_name, int server_port,
                             int peer_addr_len = 0;
                             struct sockaddr * peer_addr;
 
-                            if (p->length > 0)
+                            if (send_length > 0)
                             {
                                 printf("Connection state = %d\n",
                                     picoquic_get_cnx_state(cnx_next));
@@ -685,17 +685,13 @@ int quic_server(const char * server_name, int server_port,
                                     (int)send_length, sent);
                                 is_active = 1;
                             }
-                            else
-                            {
-                                free(p);
-                            }
                         }
                         else
                         {
                             break;
                         }
 
-                        cnx_next = picoquic_get_next_cnx(cnx_next);
+                        cnx_next = picoquic_get_next_due_cnx(cnx_next);
                     }
                 }
             }
@@ -1176,7 +1172,7 @@ int quic_client(const char * ip_address_text, int server_port)
 		{
             picoquic_set_callback(cnx_client, first_client_callback, &callback_ctx);
 
-			p = picoquic_create_packet();
+			p = picoquic_create_packet(qclient);
 
 			if (p == NULL)
 			{
@@ -1186,6 +1182,7 @@ int quic_client(const char * ip_address_text, int server_port)
 			{
 				ret = picoquic_prepare_packet(cnx_client, p, current_time,
 					send_buffer, sizeof(send_buffer), &send_length);
+				picoquic_delete_packet(qclient, p);
 
 				if (ret == 0 && send_length > 0)
 				{
@@ -1195,10 +1192,6 @@ int quic_client(const char * ip_address_text, int server_port)
 					picoquic_log_packet(stdout, qclient, cnx_client, (struct sockaddr *) &server_address,
 						0, send_buffer, bytes_sent, current_time);
 				}
-				else
-				{
-					free(p);
-				}
 			}
 		}
     }
@@ -1316,7 +1309,7 @@ int quic_client(const char * ip_address_text, int server_port)
 
             if (ret == 0)
             {
-                p = picoquic_create_packet();
+                p = picoquic_create_packet(qclient);
 
                 if (p == NULL)
                 {
@@ -1328,6 +1321,7 @@ int quic_client(const char * ip_address_text, int server_port)
 
                     ret = picoquic_prepare_packet(cnx_client, p, current_time, 
 						send_buffer, sizeof(send_buffer), &send_length);
+                    picoquic_delete_packet(qclient, p);
 
 					if (ret == 0 && send_length > 0)
 					{
@@ -1338,10 +1332,6 @@ int quic_client(const char * ip_address_text, int server_port)
 
                         is_active = 1;
 					}
-					else
-					{
-						free(p);
-                    }
                 }
             }
         }
@@ -209,3 +209,680 @@ int cnxcreation_test()
 
     return ret;
 }
+
+/*
+ * Wake time heap unit test
+ * - Create a set of connections, assign them scrambled wake times.
+ * - Verify that the next wake delay matches the earliest connection.
+ * - Verify that the due connections iterator returns exactly the
+ *   connections whose wake time has passed.
+ * - Change wake times and delete some connections, verify again.
+ */
+
+#define CNX_WAKE_TEST_NB 64
+
+static int cnx_wake_time_verify(picoquic_quic_t * quic, picoquic_cnx_t ** test_cnx, uint64_t current_time)
+{
+    int ret = 0;
+    int nb_due = 0;
+    int nb_found = 0;
+    uint64_t earliest = UINT64_MAX;
+    int64_t expected_delay;
+    picoquic_cnx_t * cnx;
+
+    for (int i = 0; i < CNX_WAKE_TEST_NB; i++)
+    {
+        if (test_cnx[i] != NULL)
+        {
+            if (test_cnx[i]->next_wake_time < earliest)
+            {
+                earliest = test_cnx[i]->next_wake_time;
+            }
+
+            if (test_cnx[i]->next_wake_time <= current_time)
+            {
+                nb_due++;
+            }
+        }
+    }
+
+    expected_delay = (earliest > current_time) ? (int64_t)(earliest - current_time) : 0;
+    if (expected_delay > 100000000)
+    {
+        expected_delay = 100000000;
+    }
+
+    if (picoquic_get_next_wake_delay(quic, current_time, 100000000) != expected_delay)
+    {
+        ret = -1;
+    }
+
+    cnx = picoquic_get_first_due_cnx(quic, current_time);
+    while (ret == 0 && cnx != NULL)
+    {
+        if (cnx->next_wake_time > current_time)
+        {
+            ret = -1;
+        }
+        nb_found++;
+        cnx = picoquic_get_next_due_cnx(cnx);
+    }
+
+    if (ret == 0 && nb_found != nb_due)
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int cnx_wake_time_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * test_cnx[CNX_WAKE_TEST_NB];
+    struct sockaddr_in test4;
+    const uint8_t test_ipv4[4] = { 192, 0, 2, 0 };
+
+    memset(test_cnx, 0, sizeof(test_cnx));
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    memcpy(&test4.sin_addr, test_ipv4, 4);
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < CNX_WAKE_TEST_NB; i++)
+    {
+        test4.sin_port = (uint16_t)(1000 + i);
+        test_cnx[i] = picoquic_create_cnx(quic, 1000 + i, (struct sockaddr *)&test4, 0, 0, NULL, NULL);
+        if (test_cnx[i] == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            test_cnx[i]->next_wake_time = ((i * 37) % CNX_WAKE_TEST_NB) * 1000;
+            picoquic_reinsert_by_wake_time(quic, test_cnx[i]);
+        }
+    }
+
+    for (uint64_t t = 0; ret == 0 && t <= CNX_WAKE_TEST_NB * 1000; t += 7500)
+    {
+        ret = cnx_wake_time_verify(quic, test_cnx, t);
+    }
+
+    /* Move some connections earlier and some later */
+    for (int i = 0; ret == 0 && i < CNX_WAKE_TEST_NB; i += 3)
+    {
+        test_cnx[i]->next_wake_time = (i & 1) ? 500 : 10000000;
+        picoquic_reinsert_by_wake_time(quic, test_cnx[i]);
+    }
+
+    for (uint64_t t = 0; ret == 0 && t <= CNX_WAKE_TEST_NB * 1000; t += 7500)
+    {
+        ret = cnx_wake_time_verify(quic, test_cnx, t);
+    }
+
+    /* Delete first, last and some in the middle */
+    for (int i = 0; ret == 0 && i < CNX_WAKE_TEST_NB; i += 5)
+    {
+        picoquic_delete_cnx(test_cnx[i]);
+        test_cnx[i] = NULL;
+    }
+
+    for (uint64_t t = 0; ret == 0 && t <= CNX_WAKE_TEST_NB * 1000; t += 7500)
+    {
+        ret = cnx_wake_time_verify(quic, test_cnx, t);
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Stream index test. Create streams in increasing order, then some
+ * with large IDs that go to the hash table, and some out of order.
+ * Verify that each stream can be found, that the hash table entries
+ * move to the array as it grows, and that the list stays in order.
+ */
+
+#define STREAM_INDEX_TEST_NB 2000
+
+static int stream_index_verify(picoquic_cnx_t * cnx, uint32_t stream_id)
+{
+    picoquic_stream_head * stream = picoquic_find_stream(cnx, stream_id, 0);
+
+    return (stream != NULL && stream->stream_id == stream_id) ? 0 : -1;
+}
+
+int stream_index_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test4;
+    const uint8_t test_ipv4[4] = { 192, 0, 2, 0 };
+    const uint32_t sparse_id[] = { 403, 1000001, 3000001 };
+    const size_t nb_sparse = sizeof(sparse_id) / sizeof(uint32_t);
+    picoquic_stream_head * stream;
+    size_t nb_streams = 0;
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    memcpy(&test4.sin_addr, test_ipv4, 4);
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(quic, 1000, (struct sockaddr *)&test4, 0, 0, NULL, NULL);
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Sparse streams first, before the array can cover them */
+    for (size_t i = 0; ret == 0 && i < nb_sparse; i++)
+    {
+        if (picoquic_find_stream(cnx, sparse_id[i], 1) == NULL ||
+            sparse_id[i] < cnx->stream_index_size)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Then streams in increasing order, skipping one in three */
+    for (uint32_t i = 0; ret == 0 && i < STREAM_INDEX_TEST_NB; i++)
+    {
+        uint32_t stream_id = 2 * i + 1;
+
+        if ((i % 3) != 2 && stream_id != sparse_id[0] && picoquic_find_stream(cnx, stream_id, 1) == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Then the missing ones, in decreasing order */
+    for (uint32_t i = STREAM_INDEX_TEST_NB; ret == 0 && i > 0; i--)
+    {
+        uint32_t stream_id = 2 * i - 1;
+
+        if (((i - 1) % 3) == 2 && picoquic_find_stream(cnx, stream_id, 0) != NULL)
+        {
+            ret = -1;
+        }
+        else if (picoquic_find_stream(cnx, stream_id, 1) == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* The first sparse stream is now in the array, the others remain in the table */
+    if (ret == 0 && (sparse_id[0] >= cnx->stream_index_size ||
+        cnx->stream_index[sparse_id[0]] == NULL ||
+        cnx->stream_table == NULL || cnx->stream_table->count != nb_sparse - 1))
+    {
+        ret = -1;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < STREAM_INDEX_TEST_NB; i++)
+    {
+        ret = stream_index_verify(cnx, 2 * i + 1);
+
+        if (ret == 0 && picoquic_find_stream(cnx, 2 * i + 2, 0) != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_sparse; i++)
+    {
+        ret = stream_index_verify(cnx, sparse_id[i]);
+    }
+
+    /* The list of streams is in increasing order */
+    stream = (cnx == NULL) ? NULL : &cnx->first_stream;
+    while (ret == 0 && stream != NULL && stream->next_stream != NULL)
+    {
+        if (stream->next_stream->stream_id <= stream->stream_id)
+        {
+            ret = -1;
+        }
+        stream = stream->next_stream;
+        nb_streams++;
+    }
+
+    if (ret == 0 && (nb_streams != STREAM_INDEX_TEST_NB + nb_sparse - 1 ||
+        nb_streams != cnx->nb_streams || cnx->last_stream != stream))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Ready queue test. Open many idle streams, queue data on a few of them,
+ * and verify that only those are in the ready queue, in arrival order,
+ * that the scheduler serves them in stream ID order, and that they leave
+ * the queue once everything is sent.
+ */
+
+#define STREAM_READY_TEST_NB 1000
+#define STREAM_READY_TEST_PERIOD 97
+
+int stream_ready_queue_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test4;
+    const uint8_t test_ipv4[4] = { 192, 0, 2, 0 };
+    uint8_t data[64];
+    uint8_t bytes[256];
+    size_t consumed;
+    size_t nb_active = 0;
+    uint32_t last_sent_id = 0;
+    picoquic_stream_head * stream;
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    memcpy(&test4.sin_addr, test_ipv4, 4);
+    memset(data, 0x5A, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(quic, 1000, (struct sockaddr *)&test4, 0, 0, NULL, NULL);
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    for (uint32_t i = 1; ret == 0 && i <= STREAM_READY_TEST_NB; i++)
+    {
+        if (picoquic_find_stream(cnx, 2 * i, 1) == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Queue data in decreasing order, the queue keeps that order */
+    for (uint32_t i = STREAM_READY_TEST_NB; ret == 0 && i > 0; i--)
+    {
+        if ((i % STREAM_READY_TEST_PERIOD) == 0)
+        {
+            ret = picoquic_add_to_stream(cnx, 2 * i, data, sizeof(data), 1);
+            nb_active++;
+        }
+    }
+
+    /* Stream 0 may also be queued, with the start of the handshake */
+    if (ret == 0)
+    {
+        size_t nb_queued = 0;
+        uint32_t previous_id = 2 * STREAM_READY_TEST_NB + 1;
+
+        stream = cnx->stream_queue[picoquic_stream_queue_ready].first;
+
+        while (ret == 0 && stream != NULL)
+        {
+            if (stream->stream_id != 0)
+            {
+                if (stream->stream_id >= previous_id ||
+                    (stream->stream_id % (2 * STREAM_READY_TEST_PERIOD)) != 0)
+                {
+                    ret = -1;
+                }
+                previous_id = stream->stream_id;
+                nb_queued++;
+            }
+            stream = stream->queue_link[picoquic_stream_queue_ready].next;
+        }
+
+        if (ret == 0 && nb_queued != nb_active)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Send everything, one stream at a time, lowest ID first */
+    while (ret == 0 && (stream = picoquic_find_ready_stream(cnx, 0)) != NULL)
+    {
+        if (stream->stream_id == 0)
+        {
+            ret = picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed, NULL);
+        }
+        else if (nb_active == 0 || (stream->stream_id % (2 * STREAM_READY_TEST_PERIOD)) != 0 ||
+            stream->stream_id <= last_sent_id)
+        {
+            ret = -1;
+        }
+        else
+        {
+            last_sent_id = stream->stream_id;
+            ret = picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed, NULL);
+
+            if (ret == 0 && (consumed == 0 ||
+                stream->queue_link[picoquic_stream_queue_ready].is_queued ||
+                (stream->stream_flags&picoquic_stream_flag_fin_sent) == 0))
+            {
+                ret = -1;
+            }
+            nb_active--;
+        }
+    }
+
+    if (ret == 0 && (nb_active != 0 ||
+        cnx->stream_queue[picoquic_stream_queue_ready].first != NULL ||
+        cnx->stream_queue[picoquic_stream_queue_ready].last != NULL))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Verify that stream data is delivered in order, once, whatever the order
+ * in which the frames arrive, and that data received in order is passed
+ * to the application without using the receive ring.
+ */
+#define STREAM_REASSEMBLY_TEST_LENGTH 20000
+#define STREAM_REASSEMBLY_TEST_CHUNK 1000
+#define STREAM_REASSEMBLY_TEST_NB (STREAM_REASSEMBLY_TEST_LENGTH / STREAM_REASSEMBLY_TEST_CHUNK)
+
+typedef struct st_stream_reassembly_test_ctx_t {
+    uint8_t received[STREAM_REASSEMBLY_TEST_LENGTH];
+    size_t nb_received;
+    int nb_fin;
+    int is_error;
+} stream_reassembly_test_ctx_t;
+
+static void stream_reassembly_test_callback(picoquic_cnx_t * cnx,
+    uint32_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+    stream_reassembly_test_ctx_t * ctx = (stream_reassembly_test_ctx_t *)callback_ctx;
+
+    if (fin_or_event == picoquic_callback_stream_fin)
+    {
+        ctx->nb_fin++;
+    }
+    else if (fin_or_event != picoquic_callback_no_event)
+    {
+        ctx->is_error = 1;
+    }
+
+    if (ctx->nb_received + length > sizeof(ctx->received) ||
+        (ctx->nb_fin > 0 && fin_or_event != picoquic_callback_stream_fin))
+    {
+        ctx->is_error = 1;
+    }
+    else if (length > 0)
+    {
+        memcpy(ctx->received + ctx->nb_received, bytes, length);
+        ctx->nb_received += length;
+    }
+}
+
+static int stream_reassembly_verify(stream_reassembly_test_ctx_t * ctx, uint8_t const * data)
+{
+    int ret = 0;
+
+    if (ctx->is_error || ctx->nb_fin != 1 || ctx->nb_received != STREAM_REASSEMBLY_TEST_LENGTH ||
+        memcmp(ctx->received, data, STREAM_REASSEMBLY_TEST_LENGTH) != 0)
+    {
+        ret = -1;
+    }
+
+    memset(ctx, 0, sizeof(stream_reassembly_test_ctx_t));
+
+    return ret;
+}
+
+int stream_reassembly_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    struct sockaddr_in test4;
+    const uint8_t test_ipv4[4] = { 192, 0, 2, 0 };
+    static uint8_t data[STREAM_REASSEMBLY_TEST_LENGTH];
+    static stream_reassembly_test_ctx_t ctx;
+    uint64_t current_time = 0;
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    memcpy(&test4.sin_addr, test_ipv4, 4);
+    memset(&ctx, 0, sizeof(ctx));
+
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (uint8_t)(i + (i >> 8));
+    }
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(quic, 1000, (struct sockaddr *)&test4, 0, 0, NULL, NULL);
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            picoquic_set_callback(cnx, stream_reassembly_test_callback, &ctx);
+        }
+    }
+
+    /* In order delivery, with the fin on a separate empty frame */
+    for (int i = 0; ret == 0 && i < STREAM_REASSEMBLY_TEST_NB; i++)
+    {
+        ret = picoquic_stream_network_input(cnx, 2, i*STREAM_REASSEMBLY_TEST_CHUNK, 0,
+            data + i*STREAM_REASSEMBLY_TEST_CHUNK, STREAM_REASSEMBLY_TEST_CHUNK, current_time);
+
+        if (ret == 0 && ((stream = picoquic_find_stream(cnx, 2, 0)) == NULL || stream->recv_ring != NULL))
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ret = picoquic_stream_network_input(cnx, 2, STREAM_REASSEMBLY_TEST_LENGTH, 1,
+            data, 0, current_time);
+    }
+
+    if (ret == 0)
+    {
+        ret = stream_reassembly_verify(&ctx, data);
+    }
+
+    /*
+     * Out of order delivery, with duplicates and overlapping frames. Chunk 0
+     * arrives last, so everything else goes through the ring.
+     */
+    for (int i = 1; ret == 0 && i <= STREAM_REASSEMBLY_TEST_NB; i++)
+    {
+        int chunk = (i * 7) % STREAM_REASSEMBLY_TEST_NB;
+        size_t offset = chunk * STREAM_REASSEMBLY_TEST_CHUNK;
+
+        ret = picoquic_stream_network_input(cnx, 4, offset, chunk == STREAM_REASSEMBLY_TEST_NB - 1,
+            data + offset, STREAM_REASSEMBLY_TEST_CHUNK, current_time);
+
+        if (ret == 0 && chunk > 1)
+        {
+            /* Duplicate the previous chunk, overlapping half of this one */
+            offset -= STREAM_REASSEMBLY_TEST_CHUNK / 2;
+            ret = picoquic_stream_network_input(cnx, 4, offset, 0,
+                data + offset, STREAM_REASSEMBLY_TEST_CHUNK, current_time);
+        }
+
+        if (ret == 0 && chunk != 0 && ctx.nb_received != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ret = stream_reassembly_verify(&ctx, data);
+    }
+
+    if (ret == 0 && ((stream = picoquic_find_stream(cnx, 4, 0)) == NULL ||
+        stream->recv_ring != NULL || stream->recv_ranges.nb_ranges != 0))
+    {
+        ret = -1;
+    }
+
+    /* Late retransmissions are ignored */
+    if (ret == 0)
+    {
+        ret = picoquic_stream_network_input(cnx, 4, 0, 0, data, STREAM_REASSEMBLY_TEST_CHUNK, current_time);
+
+        if (ret == 0 && (ctx.nb_received != 0 || ctx.nb_fin != 0 || ctx.is_error))
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * New Reno recovery test. Several losses from the same flight only halve
+ * the window once: the packets sent before the recovery started are
+ * ignored, even after the recovery period, and even once the connection is
+ * back in congestion avoidance. The loss of a packet sent after that halves
+ * the window again, and a timeout always collapses it.
+ */
+static int newreno_recovery_notify(picoquic_cnx_t * cnx,
+    picoquic_congestion_notification_t notification, uint64_t lost_packet_number,
+    uint64_t current_time, uint64_t expected_cwin)
+{
+    cnx->congestion_alg->alg_notify(cnx, notification, 0, 0, lost_packet_number, current_time);
+
+    return (cnx->cwin == expected_cwin) ? 0 : -1;
+}
+
+int newreno_recovery_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test4;
+    const uint8_t test_ipv4[4] = { 192, 0, 2, 0 };
+    const uint64_t rtt_min = 20000;
+    uint64_t current_time = 1000000;
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    memcpy(&test4.sin_addr, test_ipv4, 4);
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(quic, 1000, (struct sockaddr *)&test4, 0, 0, NULL, NULL);
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            picoquic_set_congestion_algorithm(cnx, picoquic_newreno_algorithm);
+            ret = (cnx->congestion_alg == picoquic_newreno_algorithm) ? 0 : -1;
+            cnx->rtt_min = rtt_min;
+            cnx->cwin = 1000000;
+            cnx->send_sequence = 1000;
+        }
+    }
+
+    /* The first loss of the flight halves the window */
+    if (ret == 0)
+    {
+        ret = newreno_recovery_notify(cnx, picoquic_congestion_notification_repeat, 900, current_time, 500000);
+    }
+
+    /* The other losses of the flight are ignored, after the recovery period too */
+    if (ret == 0)
+    {
+        cnx->send_sequence = 1100;
+        current_time += 2 * rtt_min;
+        ret = newreno_recovery_notify(cnx, picoquic_congestion_notification_repeat, 950, current_time, 500000);
+    }
+
+    if (ret == 0)
+    {
+        current_time += rtt_min;
+        ret = newreno_recovery_notify(cnx, picoquic_congestion_notification_acknowledgement, 0, current_time, 500000);
+    }
+
+    if (ret == 0)
+    {
+        current_time += rtt_min;
+        ret = newreno_recovery_notify(cnx, picoquic_congestion_notification_repeat, 999, current_time, 500000);
+    }
+
+    /* A packet sent after the recovery started is a new congestion signal */
+    if (ret == 0)
+    {
+        current_time += rtt_min;
+        ret = newreno_recovery_notify(cnx, picoquic_congestion_notification_repeat, 1000, current_time, 250000);
+    }
+
+    /* A timeout reduces the window, whichever packet it was for */
+    if (ret == 0)
+    {
+        current_time += 2 * rtt_min;
+        ret = newreno_recovery_notify(cnx, picoquic_congestion_notification_timeout, 1050, current_time, PICOQUIC_CWIN_MINIMUM);
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
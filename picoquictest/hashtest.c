@@ -20,7 +20,10 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <malloc.h>
+#include <time.h>
 #include "../picoquic/picohash.h"
 
 struct hashtestkey
@@ -152,3 +155,213 @@ int picohash_test()
 
     return ret;
 }
+
+/*
+ * Micro benchmark, comparing the open addressing table to the chained
+ * table that was used before. Both tables start with a small number of
+ * bins, as would happen on a server created with a small nb_connections,
+ * and then receive a large number of keys.
+ */
+
+#define PICOHASH_BENCH_NB_KEYS 20000
+#define PICOHASH_BENCH_NB_BIN 32
+#define PICOHASH_BENCH_NB_ROUNDS 4
+
+typedef struct st_hashbench_chained_item_t
+{
+    uint64_t hash;
+    struct st_hashbench_chained_item_t * next_in_bin;
+    void * key;
+} hashbench_chained_item_t;
+
+typedef struct st_hashbench_chained_table_t
+{
+    hashbench_chained_item_t ** hash_bin;
+    size_t nb_bin;
+} hashbench_chained_table_t;
+
+static int hashbench_chained_insert(hashbench_chained_table_t * t, void * key)
+{
+    int ret = 0;
+    uint64_t hash = hashtest_hash(key);
+    uint32_t bin = hash % t->nb_bin;
+    hashbench_chained_item_t * item = (hashbench_chained_item_t *)malloc(sizeof(hashbench_chained_item_t));
+
+    if (item == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        item->hash = hash;
+        item->key = key;
+        item->next_in_bin = t->hash_bin[bin];
+        t->hash_bin[bin] = item;
+    }
+
+    return ret;
+}
+
+static hashbench_chained_item_t * hashbench_chained_retrieve(hashbench_chained_table_t * t, void * key)
+{
+    uint64_t hash = hashtest_hash(key);
+    uint32_t bin = hash % t->nb_bin;
+    hashbench_chained_item_t * item = t->hash_bin[bin];
+
+    while (item != NULL && hashtest_compare(key, item->key) != 0)
+    {
+        item = item->next_in_bin;
+    }
+
+    return item;
+}
+
+static void hashbench_chained_delete(hashbench_chained_table_t * t)
+{
+    for (size_t i = 0; i < t->nb_bin; i++)
+    {
+        while (t->hash_bin[i] != NULL)
+        {
+            hashbench_chained_item_t * item = t->hash_bin[i];
+            t->hash_bin[i] = item->next_in_bin;
+            free(item);
+        }
+    }
+}
+
+int picohash_bench_test()
+{
+    int ret = 0;
+    struct hashtestkey * keys = (struct hashtestkey *)malloc(sizeof(struct hashtestkey)*PICOHASH_BENCH_NB_KEYS);
+    hashbench_chained_item_t * chained_bins[PICOHASH_BENCH_NB_BIN];
+    hashbench_chained_table_t chained;
+    picohash_table * t = picohash_create(PICOHASH_BENCH_NB_BIN, hashtest_hash, hashtest_compare);
+    struct hashtestkey hk;
+    clock_t start;
+    clock_t chained_ticks = 0;
+    clock_t open_ticks = 0;
+
+    memset(chained_bins, 0, sizeof(chained_bins));
+    chained.hash_bin = chained_bins;
+    chained.nb_bin = PICOHASH_BENCH_NB_BIN;
+
+    if (keys == NULL || t == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        for (uint64_t i = 0; i < PICOHASH_BENCH_NB_KEYS; i++)
+        {
+            /* Spread the keys like random connection ID would be */
+            keys[i].x = (i + 1) * 0x5851F42D4C957F2Dull;
+        }
+
+        /* Chained table */
+        start = clock();
+        for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i++)
+        {
+            ret = hashbench_chained_insert(&chained, &keys[i]);
+        }
+
+        for (int r = 0; ret == 0 && r < PICOHASH_BENCH_NB_ROUNDS; r++)
+        {
+            for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i++)
+            {
+                if (hashbench_chained_retrieve(&chained, &keys[i]) == NULL)
+                {
+                    ret = -1;
+                }
+            }
+        }
+        chained_ticks = clock() - start;
+
+        /* Open addressing table */
+        start = clock();
+        for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i++)
+        {
+            ret = picohash_insert(t, &keys[i]);
+        }
+
+        for (int r = 0; ret == 0 && r < PICOHASH_BENCH_NB_ROUNDS; r++)
+        {
+            for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i++)
+            {
+                picohash_item * pi = picohash_retrieve(t, &keys[i]);
+
+                if (pi == NULL || pi->key != &keys[i])
+                {
+                    ret = -1;
+                }
+            }
+        }
+        open_ticks = clock() - start;
+
+        if (ret == 0 && t->count != PICOHASH_BENCH_NB_KEYS)
+        {
+            ret = -1;
+        }
+
+        /* Keys that were not inserted should not be found */
+        for (uint64_t i = 0; ret == 0 && i < 1000; i++)
+        {
+            hk.x = 2 * i + 1;
+            ret = (picohash_retrieve(t, &hk) == NULL) ? 0 : -1;
+        }
+
+        /* Delete every other key, verify that the others remain */
+        for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i += 2)
+        {
+            picohash_item * pi = picohash_retrieve(t, &keys[i]);
+
+            if (pi == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                picohash_item_delete(t, pi, 0);
+            }
+        }
+
+        for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i++)
+        {
+            picohash_item * pi = picohash_retrieve(t, &keys[i]);
+
+            if ((i & 1) == 0)
+            {
+                ret = (pi == NULL) ? 0 : -1;
+            }
+            else
+            {
+                ret = (pi != NULL) ? 0 : -1;
+            }
+        }
+
+        if (ret == 0 && t->count != PICOHASH_BENCH_NB_KEYS / 2)
+        {
+            ret = -1;
+        }
+
+        if (ret == 0)
+        {
+            printf("    Chained: %.3f ms, open addressing: %.3f ms.\n",
+                1000.0*((double)chained_ticks) / CLOCKS_PER_SEC,
+                1000.0*((double)open_ticks) / CLOCKS_PER_SEC);
+        }
+    }
+
+    hashbench_chained_delete(&chained);
+
+    if (t != NULL)
+    {
+        picohash_delete(t, 0);
+    }
+
+    if (keys != NULL)
+    {
+        free(keys);
+    }
+
+    return ret;
+}
@@ -27,15 +27,23 @@ extern "C" {
 #endif
 
     int picohash_test();
+    int picohash_bench_test();
     int cnxcreation_test();
+    int cnx_wake_time_test();
+    int stream_index_test();
+    int stream_ready_queue_test();
+    int stream_reassembly_test();
+    int newreno_recovery_test();
     int parseheadertest();
     int pn2pn64test();
     int intformattest();
     int fnv1atest();
     int sacktest();
+    int sack_bench_test();
     int float16test();
     int StreamZeroFrameTest();
 	int sendacktest();
+	int sendack_fuzz_test();
     int tls_api_test(); 
 	int tls_api_loss_test(uint64_t mask);
 	int tls_api_many_losses();
@@ -54,6 +62,24 @@ extern "C" {
 	int tls_api_very_long_max_test();
 	int tls_api_very_long_with_err_test();
 	int tls_api_very_long_congestion_test();
+	int tls_api_packet_pool_test();
+	int tls_api_retransmit_by_reference_test();
+	int tls_api_retransmit_ring_test();
+	int tls_api_stream_scheduler_test();
+	int tls_api_zero_copy_send_test();
+	int tls_api_pull_stream_test();
+	int tls_api_app_read_test();
+	int tls_api_stream_packing_test();
+	int tls_api_retransmit_merge_test();
+	int tls_api_ack_only_test();
+	int tls_api_sent_frames_test();
+	int tls_api_cubic_test();
+	int tls_api_bbr_test();
+	int tls_api_pacing_test();
+	int tls_api_hystart_test();
+	int tls_api_pto_test();
+	int tls_api_rack_test();
+	int tls_api_ack_policy_test();
     int http0dot9_test();
     int tls_api_hrr_test();
     int ackrange_test();
@@ -20,8 +20,9 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
+#include <time.h>
 #include "../picoquic/picoquic_internal.h"
 
 /*
@@ -115,15 +116,17 @@ int sacktest()
 
     if (ret == 0)
     {
-        if (cnx.first_sack_item.end_of_sack_range != 21 ||
-            cnx.first_sack_item.start_of_sack_range != 1 ||
-            cnx.time_stamp_largest_received != highest_seen_time ||
-            cnx.first_sack_item.next_sack != NULL)
+        if (cnx.sack_list.nb_ranges != 1 ||
+            cnx.sack_list.ranges[0].end_of_sack_range != 21 ||
+            cnx.sack_list.ranges[0].start_of_sack_range != 1 ||
+            cnx.time_stamp_largest_received != highest_seen_time)
         {
             ret = -1;
         }
     }
 
+    picoquic_sack_list_free(&cnx.sack_list);
+
     return ret;
 }
 
@@ -232,7 +235,6 @@ static int basic_ack_parse(uint8_t * bytes, size_t bytes_max,
 				{
 				case 0:
 					ack_range = bytes[byte_index++];
-					byte_index += 1;
 					break;
 				case 1:
 					ack_range = PICOPARSE_16(bytes + byte_index);
@@ -331,6 +333,213 @@ int sendacktest()
 		}
 	}
 
+	picoquic_sack_list_free(&cnx.sack_list);
+
+	return ret;
+}
+
+/*
+ * Fuzz test of the ACK encoding. Random lists of ranges, with short and
+ * long ranges and gaps, are encoded in a random amount of space, then
+ * decoded by a sending connection. The packets acknowledged by the decoder
+ * must be exactly those in the ranges that the encoder did not truncate.
+ */
+
+#define SENDACK_FUZZ_ROUNDS 1000
+#define SENDACK_FUZZ_RANGES_MAX 40
+#define SENDACK_FUZZ_PROBES_MAX (5 * SENDACK_FUZZ_RANGES_MAX)
+
+static uint64_t sendack_fuzz_random(uint64_t * seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+
+	return *seed;
+}
+
+static int sendack_fuzz_probe(picoquic_cnx_t * cnx, uint64_t * probes, size_t * nb_probes, uint64_t pn64)
+{
+	int ret = 0;
+
+	if (*nb_probes == 0 || probes[*nb_probes - 1] < pn64)
+	{
+		picoquic_sent_packet_t * p = NULL;
+
+		if (picoquic_reserve_retransmit_ring(cnx, pn64) != 0 ||
+			(p = picoquic_create_sent_packet(cnx->quic)) == NULL)
+		{
+			ret = -1;
+		}
+		else
+		{
+			memset(p, 0, sizeof(picoquic_sent_packet_t));
+			p->sequence_number = pn64;
+			p->length = 100;
+			picoquic_enqueue_retransmit_packet(cnx, p);
+			probes[(*nb_probes)++] = pn64;
+		}
+	}
+
+	return ret;
+}
+
+int sendack_fuzz_test()
+{
+	int ret = 0;
+	uint64_t seed = 0xDEADBEEFCAFEull;
+	uint64_t base;
+	uint64_t range_start[SENDACK_FUZZ_RANGES_MAX];
+	uint64_t range_end[SENDACK_FUZZ_RANGES_MAX];
+	uint64_t probes[SENDACK_FUZZ_PROBES_MAX];
+	uint8_t bytes[1500];
+	picoquic_quic_t * quic = NULL;
+	picoquic_cnx_t * sender = NULL;
+	picoquic_cnx_t receiver;
+	struct sockaddr_in test4;
+
+	memset(&test4, 0, sizeof(test4));
+	test4.sin_family = AF_INET;
+	memset(&receiver, 0, sizeof(receiver));
+
+	quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL);
+	if (quic == NULL)
+	{
+		ret = -1;
+	}
+	else
+	{
+		sender = picoquic_create_cnx(quic, 1000, (struct sockaddr *)&test4, 0, 0, NULL, NULL);
+		if (sender == NULL)
+		{
+			ret = -1;
+		}
+	}
+
+	base = (sender == NULL) ? 0 : sender->send_sequence + 1000;
+
+	for (int round = 0; ret == 0 && round < SENDACK_FUZZ_ROUNDS; round++)
+	{
+		size_t nb_ranges = 1 + (size_t)(sendack_fuzz_random(&seed) % SENDACK_FUZZ_RANGES_MAX);
+		size_t bytes_max = (round % 4 == 0) ? sizeof(bytes) : 6 + (size_t)(sendack_fuzz_random(&seed) % 120);
+		size_t nb_probes = 0;
+		size_t consumed = 0;
+		size_t decoded = 0;
+		size_t nb_encoded = 0;
+		uint64_t truncated_before = receiver.nb_ack_ranges_truncated;
+		uint64_t pn64 = base;
+
+		picoquic_sack_list_init(&receiver.sack_list, PICOQUIC_DEFAULT_SACK_RANGE_MAX);
+
+		/* Ranges of 1 to 20 packets, a few of 200 to 400, rarely 70000,
+		 * and gaps of 1 to 20 packets or 200 to 1000 */
+		for (size_t i = 0; ret == 0 && i < nb_ranges; i++)
+		{
+			uint64_t r = sendack_fuzz_random(&seed);
+			uint64_t length = (r % 50 == 0) ? 70000 + r % 10 :
+				(r % 5 == 0) ? 200 + r % 200 : 1 + r % 20;
+			uint64_t gap = ((r >> 16) % 4 == 0) ? 200 + (r >> 20) % 800 : 1 + (r >> 20) % 20;
+
+			range_start[i] = pn64;
+			range_end[i] = pn64 + length - 1;
+			pn64 = range_end[i] + 1 + gap;
+
+			if (picoquic_update_sack_list(&receiver.sack_list, range_start[i], range_end[i], NULL) != 0)
+			{
+				ret = -1;
+			}
+		}
+
+		/* Probe the packets at the edges and in the middle of each range */
+		for (size_t i = 0; ret == 0 && i < nb_ranges; i++)
+		{
+			ret = sendack_fuzz_probe(sender, probes, &nb_probes, range_start[i] - 1);
+			if (ret == 0)
+			{
+				ret = sendack_fuzz_probe(sender, probes, &nb_probes, range_start[i]);
+			}
+			if (ret == 0)
+			{
+				ret = sendack_fuzz_probe(sender, probes, &nb_probes, (range_start[i] + range_end[i]) / 2);
+			}
+			if (ret == 0)
+			{
+				ret = sendack_fuzz_probe(sender, probes, &nb_probes, range_end[i]);
+			}
+			if (ret == 0)
+			{
+				ret = sendack_fuzz_probe(sender, probes, &nb_probes, range_end[i] + 1);
+			}
+		}
+
+		if (ret == 0)
+		{
+			sender->send_sequence = range_end[nb_ranges - 1] + 1 + sendack_fuzz_random(&seed) % 64;
+			ret = picoquic_prepare_ack_frame(&receiver, 0, bytes, bytes_max, &consumed);
+		}
+
+		if (ret == 0 && consumed > 0)
+		{
+			nb_encoded = nb_ranges - (size_t)(receiver.nb_ack_ranges_truncated - truncated_before);
+
+			if (consumed > bytes_max ||
+				(bytes_max == sizeof(bytes) && nb_encoded != nb_ranges) ||
+				picoquic_decode_ack_frame(sender, bytes, consumed, 0, &decoded, 0) != 0 ||
+				decoded != consumed)
+			{
+				ret = -1;
+			}
+		}
+
+		/* A packet is acknowledged if it is in one of the highest encoded ranges */
+		for (size_t i = 0; ret == 0 && i < nb_probes; i++)
+		{
+			int is_acked = 0;
+
+			for (size_t j = nb_ranges - nb_encoded; j < nb_ranges; j++)
+			{
+				if (probes[i] >= range_start[j] && probes[i] <= range_end[j])
+				{
+					is_acked = 1;
+					break;
+				}
+			}
+
+			if (is_acked != (picoquic_find_sent_packet(sender, probes[i]) == NULL))
+			{
+				ret = -1;
+			}
+		}
+
+		while (sender != NULL && sender->retransmit_newest != NULL)
+		{
+			picoquic_dequeue_retransmit_packet(sender, sender->retransmit_newest, 1);
+		}
+
+		picoquic_sack_list_free(&receiver.sack_list);
+		base = sender->send_sequence + 1000;
+	}
+
+	/* A single short range fits in 7 bytes */
+	if (ret == 0)
+	{
+		size_t consumed = 0;
+
+		picoquic_sack_list_init(&receiver.sack_list, PICOQUIC_DEFAULT_SACK_RANGE_MAX);
+		if (picoquic_update_sack_list(&receiver.sack_list, base, base + 10, NULL) != 0 ||
+			picoquic_prepare_ack_frame(&receiver, 0, bytes, sizeof(bytes), &consumed) != 0 ||
+			consumed != 7)
+		{
+			ret = -1;
+		}
+		picoquic_sack_list_free(&receiver.sack_list);
+	}
+
+	if (quic != NULL)
+	{
+		picoquic_free(quic);
+	}
+
 	return ret;
 }
 
@@ -356,10 +565,10 @@ static const size_t nb_ack_range = sizeof(ack_range) / sizeof(test_ack_range_t);
 int ackrange_test()
 {
     int ret = 0;
-    picoquic_sack_item_t sack0;
+    picoquic_sack_list_t sack0;
     uint64_t blockmax = 0;
 
-    memset(&sack0, 0, sizeof(picoquic_sack_item_t));
+    picoquic_sack_list_init(&sack0, PICOQUIC_DEFAULT_SACK_RANGE_MAX);
 
     for (size_t i = 0; i < nb_ack_range; i++)
     {
@@ -393,20 +602,225 @@ int ackrange_test()
         ret = -1;
     }
 
-    if (ret == 0 && sack0.start_of_sack_range != 0)
+    if (ret == 0 && sack0.nb_ranges != 1)
     {
         ret = -1;
     }
 
-    if (ret == 0 && sack0.end_of_sack_range != 7500)
+    if (ret == 0 && sack0.ranges[0].start_of_sack_range != 0)
     {
         ret = -1;
     }
 
-    if (ret == 0 && sack0.next_sack != NULL)
+    if (ret == 0 && sack0.ranges[0].end_of_sack_range != 7500)
     {
         ret = -1;
     }
 
+    picoquic_sack_list_free(&sack0);
+
     return ret;
-}
\ No newline at end of file
+}
+
+/*
+ * Micro benchmark, comparing the range array to the linked list of
+ * ranges that was used before. The packets arrive with some reordering
+ * and a fraction is never received, so the list has many holes.
+ * Each arrival is checked for duplicates then recorded, as in the
+ * receive path.
+ */
+
+#define SACK_BENCH_NB_PACKETS 100000
+#define SACK_BENCH_LOSS_PERIOD 97
+#define SACK_BENCH_DELAY_PERIOD 7
+#define SACK_BENCH_DELAY 400
+#define SACK_BENCH_RANGE_MAX PICOQUIC_DEFAULT_SACK_RANGE_MAX
+
+typedef struct st_sackbench_item_t
+{
+    struct st_sackbench_item_t * next_sack;
+    uint64_t start_of_sack_range;
+    uint64_t end_of_sack_range;
+} sackbench_item_t;
+
+static int sackbench_list_is_received(sackbench_item_t * sack, uint64_t pn64)
+{
+    while (sack != NULL && pn64 < sack->start_of_sack_range)
+    {
+        sack = sack->next_sack;
+    }
+
+    return (sack != NULL && pn64 <= sack->end_of_sack_range) ? 1 : 0;
+}
+
+static int sackbench_list_record(sackbench_item_t ** first, uint64_t pn64)
+{
+    int ret = 0;
+    sackbench_item_t ** previous = first;
+    sackbench_item_t * sack = *first;
+
+    while (sack != NULL && sack->start_of_sack_range > pn64 + 1)
+    {
+        previous = &sack->next_sack;
+        sack = sack->next_sack;
+    }
+
+    if (sack != NULL && sack->start_of_sack_range <= pn64 && pn64 <= sack->end_of_sack_range)
+    {
+        ret = 1;
+    }
+    else if (sack != NULL && sack->start_of_sack_range == pn64 + 1)
+    {
+        sackbench_item_t * next = sack->next_sack;
+
+        sack->start_of_sack_range = pn64;
+        if (next != NULL && next->end_of_sack_range + 1 == pn64)
+        {
+            sack->start_of_sack_range = next->start_of_sack_range;
+            sack->next_sack = next->next_sack;
+            free(next);
+        }
+    }
+    else if (sack != NULL && sack->end_of_sack_range + 1 == pn64)
+    {
+        sack->end_of_sack_range = pn64;
+    }
+    else
+    {
+        sackbench_item_t * new_hole = (sackbench_item_t *)malloc(sizeof(sackbench_item_t));
+
+        if (new_hole == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            new_hole->start_of_sack_range = pn64;
+            new_hole->end_of_sack_range = pn64;
+            new_hole->next_sack = sack;
+            *previous = new_hole;
+        }
+    }
+
+    return ret;
+}
+
+static void sackbench_list_delete(sackbench_item_t * sack)
+{
+    while (sack != NULL)
+    {
+        sackbench_item_t * next = sack->next_sack;
+        free(sack);
+        sack = next;
+    }
+}
+
+static size_t sackbench_arrival_order(uint64_t * arrivals)
+{
+    size_t nb_arrivals = 0;
+
+    for (uint64_t i = 0; i < SACK_BENCH_NB_PACKETS + SACK_BENCH_DELAY; i++)
+    {
+        if (i < SACK_BENCH_NB_PACKETS && (i % SACK_BENCH_LOSS_PERIOD) != 0 &&
+            (i % SACK_BENCH_DELAY_PERIOD) != 0)
+        {
+            arrivals[nb_arrivals++] = i;
+        }
+
+        if (i >= SACK_BENCH_DELAY)
+        {
+            uint64_t late = i - SACK_BENCH_DELAY;
+
+            if ((late % SACK_BENCH_LOSS_PERIOD) != 0 && (late % SACK_BENCH_DELAY_PERIOD) == 0)
+            {
+                arrivals[nb_arrivals++] = late;
+            }
+        }
+    }
+
+    return nb_arrivals;
+}
+
+int sack_bench_test()
+{
+    int ret = 0;
+    uint64_t * arrivals = (uint64_t *)malloc(sizeof(uint64_t) * SACK_BENCH_NB_PACKETS);
+    size_t nb_arrivals = 0;
+    sackbench_item_t * first_sack = NULL;
+    picoquic_cnx_t cnx;
+    clock_t start;
+    clock_t list_ticks = 0;
+    clock_t array_ticks = 0;
+
+    memset(&cnx, 0, sizeof(cnx));
+    picoquic_sack_list_init(&cnx.sack_list, SACK_BENCH_RANGE_MAX);
+
+    if (arrivals == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        nb_arrivals = sackbench_arrival_order(arrivals);
+
+        /* Linked list */
+        start = clock();
+        for (size_t i = 0; ret == 0 && i < nb_arrivals; i++)
+        {
+            if (sackbench_list_is_received(first_sack, arrivals[i]) != 0 ||
+                sackbench_list_record(&first_sack, arrivals[i]) != 0)
+            {
+                ret = -1;
+            }
+        }
+        list_ticks = clock() - start;
+
+        /* Range array */
+        start = clock();
+        for (size_t i = 0; ret == 0 && i < nb_arrivals; i++)
+        {
+            if (picoquic_is_pn_already_received(&cnx, arrivals[i]) != 0 ||
+                picoquic_record_pn_received(&cnx, arrivals[i], i) != 0)
+            {
+                ret = -1;
+            }
+        }
+        array_ticks = clock() - start;
+
+        /* The array is bounded, the most recent ranges are kept */
+        if (ret == 0 && (cnx.sack_list.nb_ranges > SACK_BENCH_RANGE_MAX ||
+            picoquic_sack_list_largest(&cnx.sack_list) != SACK_BENCH_NB_PACKETS - 1))
+        {
+            ret = -1;
+        }
+
+        /* Both versions agree above the horizon, everything below counts as received */
+        for (uint64_t pn64 = 0; ret == 0 && pn64 < SACK_BENCH_NB_PACKETS + 10; pn64++)
+        {
+            int is_received = picoquic_is_pn_already_received(&cnx, pn64);
+
+            if (pn64 < cnx.sack_list.horizon)
+            {
+                ret = (is_received) ? 0 : -1;
+            }
+            else if (is_received != sackbench_list_is_received(first_sack, pn64))
+            {
+                ret = -1;
+            }
+        }
+
+        if (ret == 0)
+        {
+            printf("    Linked list: %.3f ms, range array: %.3f ms.\n",
+                1000.0*((double)list_ticks) / CLOCKS_PER_SEC,
+                1000.0*((double)array_ticks) / CLOCKS_PER_SEC);
+        }
+
+        free(arrivals);
+    }
+
+    sackbench_list_delete(first_sack);
+    picoquic_sack_list_free(&cnx.sack_list);
+
+    return ret;
+}
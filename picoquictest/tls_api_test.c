@@ -62,6 +62,7 @@ typedef struct st_test_api_stream_t {
 	size_t q_recv_nb;
 	size_t r_len;
 	size_t r_recv_nb;
+	size_t r_pulled;
 	uint8_t * q_src;
 	uint8_t * q_rcv;
 	uint8_t * r_src;
@@ -88,6 +89,9 @@ typedef struct st_picoquic_test_tls_api_ctx_t {
 	test_api_stream_t test_stream[PICOQUIC_TEST_MAX_TEST_STREAMS];
 	picoquictest_sim_link_t * c_to_s_link;
 	picoquictest_sim_link_t * s_to_c_link;
+	size_t zero_copy_chunk_size;
+	size_t nb_bytes_released;
+	int pull_response;
 } picoquic_test_tls_api_ctx_t;
 
 static test_api_stream_desc_t test_scenario_oneway[] = {
@@ -259,6 +263,79 @@ static int test_api_queue_initial_queries(picoquic_test_tls_api_ctx_t * test_ctx
 	return ret;
 }
 
+/*
+ * Responses are either copied in the stream, or, if a chunk size is set,
+ * queued without copy in chunks of that size, or pulled by the stack.
+ * The chunks point to the source buffer of the stream, so releasing them
+ * only counts the bytes.
+ */
+static void test_api_release_chunk(uint8_t * bytes, size_t length, void * release_ctx)
+{
+	picoquic_test_tls_api_ctx_t * ctx = (picoquic_test_tls_api_ctx_t *)release_ctx;
+
+	ctx->nb_bytes_released += length;
+}
+
+static size_t test_api_provide_response(picoquic_cnx_t * cnx,
+	uint32_t stream_id, uint8_t * bytes, size_t bytes_max, int * is_fin, void * provider_ctx)
+{
+	test_api_stream_t * test_stream = (test_api_stream_t *)provider_ctx;
+	size_t length = test_stream->r_len - test_stream->r_pulled;
+
+	if (length > bytes_max)
+	{
+		length = bytes_max;
+	}
+
+	memcpy(bytes, test_stream->r_src + test_stream->r_pulled, length);
+	test_stream->r_pulled += length;
+	*is_fin = (test_stream->r_pulled >= test_stream->r_len);
+
+	return length;
+}
+
+static int test_api_send_response(picoquic_test_tls_api_ctx_t * ctx, picoquic_cnx_t * cnx,
+	uint32_t stream_id, test_api_stream_t * test_stream)
+{
+	int ret = 0;
+	uint8_t * bytes = test_stream->r_src;
+	size_t length = test_stream->r_len;
+
+	if (ctx->pull_response)
+	{
+		ret = picoquic_set_stream_data_provider(cnx, stream_id, test_api_provide_response, test_stream);
+
+		if (ret == 0)
+		{
+			ret = picoquic_mark_active_stream(cnx, stream_id, 1);
+		}
+	}
+	else if (ctx->zero_copy_chunk_size == 0)
+	{
+		ret = picoquic_add_to_stream(cnx, stream_id, bytes, length, 1);
+	}
+	else
+	{
+		size_t offset = 0;
+
+		while (ret == 0 && offset < length)
+		{
+			size_t chunk_length = length - offset;
+
+			if (chunk_length > ctx->zero_copy_chunk_size)
+			{
+				chunk_length = ctx->zero_copy_chunk_size;
+			}
+
+			ret = picoquic_add_buffer_to_stream(cnx, stream_id, bytes + offset, chunk_length,
+				(offset + chunk_length >= length) ? 1 : 0, test_api_release_chunk, ctx);
+			offset += chunk_length;
+		}
+	}
+
+	return ret;
+}
+
 static void test_api_callback(picoquic_cnx_t * cnx,
 	uint32_t stream_id, uint8_t * bytes, size_t length, 
 	picoquic_call_back_event_t fin_or_event, void * callback_ctx)
@@ -276,6 +353,12 @@ static void test_api_callback(picoquic_cnx_t * cnx,
         return;
     }
 
+	if (fin_or_event == picoquic_callback_stream_readable)
+	{
+		/* the application read tests poll the streams */
+		return;
+	}
+
 	if (cb_ctx->client_mode)
 	{
 		ctx = (picoquic_test_tls_api_ctx_t *)(
@@ -337,9 +420,8 @@ static void test_api_callback(picoquic_cnx_t * cnx,
 				else if (cb_ctx->error_detected == 0)
 				{
 					/* send a response */
-					if (picoquic_add_to_stream(ctx->cnx_server, stream_id,
-						ctx->test_stream[stream_index].r_src,
-						ctx->test_stream[stream_index].r_len, 1) != 0)
+					if (test_api_send_response(ctx, ctx->cnx_server, stream_id,
+						&ctx->test_stream[stream_index]) != 0)
 					{
 						cb_ctx->error_detected |= test_api_fail_cannot_send_response;
 					}
@@ -371,9 +453,8 @@ static void test_api_callback(picoquic_cnx_t * cnx,
 				else if (cb_ctx->error_detected == 0)
 				{
 					/* send a response */
-					if (picoquic_add_to_stream(ctx->cnx_client, stream_id,
-						ctx->test_stream[stream_index].r_src,
-						ctx->test_stream[stream_index].r_len, 1) != 0)
+					if (test_api_send_response(ctx, ctx->cnx_client, stream_id,
+						&ctx->test_stream[stream_index]) != 0)
 					{
 						cb_ctx->error_detected |= test_api_fail_cannot_send_response;
 					}
@@ -731,6 +812,16 @@ static int tls_api_init_ctx(picoquic_test_tls_api_ctx_t ** pctx, uint32_t propos
 	return ret;
 }
 
+static uint64_t tls_api_next_wake_time(picoquic_cnx_t * cnx, uint64_t current_time, uint64_t next_time)
+{
+	if (cnx != NULL && cnx->next_wake_time > current_time && cnx->next_wake_time < next_time)
+	{
+		next_time = cnx->next_wake_time;
+	}
+
+	return next_time;
+}
+
 static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx, 
 	uint64_t *simulated_time, int * was_active)
 {
@@ -762,13 +853,13 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 
 				target_link = test_ctx->s_to_c_link;
 			}
-			picoquic_delete_stateless_packet(sp);
+			picoquic_delete_stateless_packet(test_ctx->qserver, sp);
 		}
 
 		if (packet->length == 0)
 		{
 			/* check whether the client has something to send */
-			picoquic_packet * p = picoquic_create_packet();
+			picoquic_packet * p = picoquic_create_packet(test_ctx->qclient);
 
 			if (p == NULL)
 			{
@@ -783,26 +874,37 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 				}
 				else
 				{
-					p->length = 0;
 					packet->length = 0;
 				}
 
-				if (ret == 0)
+				picoquic_delete_packet(test_ctx->qclient, p);
+				p = NULL;
+
+				if (ret == 0 && packet->length > 0)
 				{
-					if (p->length > 0)
-					{
-						/* queue in c_to_s */
-						target_link = test_ctx->c_to_s_link;
-					}
-					else if (test_ctx->cnx_server != NULL)
+					/* queue in c_to_s */
+					target_link = test_ctx->c_to_s_link;
+				}
+			}
+
+			if (ret == 0 && target_link == NULL && test_ctx->cnx_server != NULL)
+			{
+				p = picoquic_create_packet(test_ctx->qserver);
+
+				if (p == NULL)
+				{
+					ret = -1;
+				}
+				else
+				{
+					ret = picoquic_prepare_packet(test_ctx->cnx_server, p, *simulated_time,
+						packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length);
+					picoquic_delete_packet(test_ctx->qserver, p);
+
+					if (ret == 0 && packet->length > 0)
 					{
-						ret = picoquic_prepare_packet(test_ctx->cnx_server, p, *simulated_time,
-							packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length);
-						if (ret == 0 && p->length > 0)
-						{
-							/* copy and queue in s to c */
-							target_link = test_ctx->s_to_c_link;
-						}
+						/* copy and queue in s to c */
+						target_link = test_ctx->s_to_c_link;
 					}
 				}
 			}
@@ -819,15 +921,19 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 
 			free(packet);
 
-			*simulated_time += 5000;
-			next_time = picoquictest_sim_link_next_arrival(test_ctx->s_to_c_link, *simulated_time);
+			next_time = *simulated_time + 5000;
+			next_time = picoquictest_sim_link_next_arrival(test_ctx->s_to_c_link, next_time);
 			next_time = picoquictest_sim_link_next_arrival(test_ctx->c_to_s_link, next_time);
 
+			/* Do not skip the time at which a connection is due, e.g. to send a paced packet */
+			next_time = tls_api_next_wake_time(test_ctx->cnx_client, *simulated_time, next_time);
+			next_time = tls_api_next_wake_time(test_ctx->cnx_server, *simulated_time, next_time);
+			*simulated_time = next_time;
+
 			packet = picoquictest_sim_link_dequeue(test_ctx->s_to_c_link, next_time);
 
 			if (packet != NULL)
 			{
-				*simulated_time = next_time;
 				ret = picoquic_incoming_packet(test_ctx->qclient, packet->bytes, packet->length,
 					(struct sockaddr *)&test_ctx->server_addr, *simulated_time);
 				*was_active |= 1;
@@ -838,7 +944,6 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 
 				if (packet != NULL)
 				{
-					*simulated_time = next_time;
 					ret = picoquic_incoming_packet(test_ctx->qserver, packet->bytes, packet->length,
 						(struct sockaddr *)&test_ctx->client_addr, *simulated_time);
 
@@ -1178,6 +1283,1730 @@ int tls_api_very_long_congestion_test()
 	return tls_api_one_scenario_test(test_scenario_very_long, sizeof(test_scenario_very_long), 0, 128000, 10000);
 }
 
+/*
+ * Packet pool test.
+ * Send a long stream. Once the congestion window is full, packets are freed
+ * by acknowledgements as fast as they are created, so almost all requests
+ * should be served by the pool. Then verify that the high-water mark is
+ * enforced.
+ */
+
+int tls_api_packet_pool_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	uint64_t nb_hit[2] = { 0, 0 };
+	uint64_t nb_miss[2] = { 0, 0 };
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		picoquic_get_packet_pool_stats(test_ctx->qclient, &nb_hit[0], &nb_miss[0]);
+		picoquic_get_packet_pool_stats(test_ctx->qserver, &nb_hit[1], &nb_miss[1]);
+
+		for (int i = 0; ret == 0 && i < 2; i++)
+		{
+			if (nb_hit[i] == 0 || nb_miss[i] * 10 > nb_hit[i])
+			{
+				ret = -1;
+			}
+		}
+	}
+
+	if (ret == 0)
+	{
+		picoquic_set_packet_pool_max(test_ctx->qserver, 2);
+
+		if (test_ctx->qserver->packet_pool_size > 2)
+		{
+			ret = -1;
+		}
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Retransmission by reference test.
+ * Send a long stream with losses. Lost data is copied again from the
+ * stream send queue, which must be emptied as acknowledgements arrive.
+ */
+
+static int tls_api_check_send_queues(picoquic_cnx_t * cnx)
+{
+	int ret = 0;
+	picoquic_stream_head * stream = &cnx->first_stream;
+
+	while (ret == 0 && stream != NULL)
+	{
+		if (stream->send_queue != NULL || stream->send_next != NULL ||
+			stream->sent_offset != stream->queued_offset)
+		{
+			ret = -1;
+		}
+		stream = stream->next_stream;
+	}
+
+	return ret;
+}
+
+int tls_api_retransmit_by_reference_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		loss_mask = 0x30000;
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		if (test_ctx->server_callback.error_detected ||
+			test_ctx->client_callback.error_detected ||
+			test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_check_send_queues(test_ctx->cnx_client);
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_check_send_queues(test_ctx->cnx_server);
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Retransmit ring test.
+ * Send a long stream with losses and queuing delays, and after each round
+ * verify that every queued packet is found through the sequence number
+ * index, and that the bytes in transit match the queued packets.
+ */
+
+static int tls_api_check_retransmit_queue(picoquic_cnx_t * cnx)
+{
+	int ret = 0;
+	uint64_t bytes_in_transit = 0;
+	picoquic_sent_packet_t * p = cnx->retransmit_newest;
+
+	while (ret == 0 && p != NULL)
+	{
+		if (picoquic_find_sent_packet(cnx, p->sequence_number) != p ||
+			(p->next_packet != NULL && p->next_packet->sequence_number >= p->sequence_number))
+		{
+			ret = -1;
+		}
+		bytes_in_transit += p->length + p->checksum_overhead;
+		p = p->next_packet;
+	}
+
+	if (ret == 0 && bytes_in_transit != cnx->bytes_in_transit)
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int tls_api_retransmit_ring_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	int nb_trials = 0;
+	int nb_inactive = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 10000, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		loss_mask = 0x30000;
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+	}
+
+	while (ret == 0 && nb_trials < 100000 && nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+		nb_trials++;
+
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		if (ret == 0)
+		{
+			ret = tls_api_check_retransmit_queue(test_ctx->cnx_client);
+		}
+
+		if (ret == 0)
+		{
+			ret = tls_api_check_retransmit_queue(test_ctx->cnx_server);
+		}
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0 && test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len)
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Zero copy send test.
+ * The server sends a long response with losses, queuing the response in
+ * chunks without copying it. All chunks must be released once the data is
+ * acknowledged, and the send queues must be empty.
+ */
+
+int tls_api_zero_copy_send_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		test_ctx->zero_copy_chunk_size = 10000;
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		loss_mask = 0x30000;
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		if (test_ctx->server_callback.error_detected ||
+			test_ctx->client_callback.error_detected ||
+			test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+			test_ctx->nb_bytes_released != test_ctx->test_stream[0].r_len)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_check_send_queues(test_ctx->cnx_server);
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Pull mode test.
+ * The server provides a long response just in time, through a data provider.
+ * Without losses, the data kept by the server is never more than the data in
+ * transit. With losses, the data is repeated from the copy kept by the stack.
+ * The copies are recycled once acknowledged, so at the end they are all back
+ * in the pool of the connection.
+ */
+
+static int tls_api_pull_one_test(uint64_t init_loss_mask)
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	int nb_trials = 0;
+	int nb_inactive = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		test_ctx->pull_response = 1;
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		loss_mask = init_loss_mask;
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+	}
+
+	while (ret == 0 && nb_trials < 100000 && nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+		picoquic_stream_head * stream;
+
+		nb_trials++;
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		stream = picoquic_find_stream(test_ctx->cnx_server, test_ctx->test_stream[0].stream_id, 0);
+
+		if (ret == 0 && init_loss_mask == 0 && stream != NULL &&
+			stream->queued_offset - stream->acked_offset > test_ctx->cnx_server->bytes_in_transit)
+		{
+			ret = -1;
+		}
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0)
+	{
+		if (test_ctx->server_callback.error_detected ||
+			test_ctx->client_callback.error_detected ||
+			test_ctx->test_stream[0].r_pulled != test_ctx->test_stream[0].r_len ||
+			test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+			test_ctx->test_stream[0].r_received != picoquic_callback_stream_fin)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_check_send_queues(test_ctx->cnx_server);
+	}
+
+	if (ret == 0 && test_ctx->cnx_server->pulled_data_pool_size == 0)
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+int tls_api_pull_stream_test()
+{
+	int ret = tls_api_pull_one_test(0);
+
+	if (ret == 0)
+	{
+		ret = tls_api_pull_one_test(0x30000);
+	}
+
+	return ret;
+}
+
+/*
+ * Application read test. The client reads the response itself, and stops
+ * reading at first. The server must stop at the stream flow control limit,
+ * with the data buffered by the client limited to the window. The transfer
+ * completes once the client reads again, a few kilobytes per round.
+ */
+
+#define TLS_API_APP_READ_CHUNK 4000
+
+int tls_api_app_read_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	int nb_trials = 0;
+	int nb_inactive = 0;
+	int is_reading = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	picoquic_stream_head * stream = NULL;
+	test_api_stream_t * test_stream = NULL;
+	uint8_t buffer[TLS_API_APP_READ_CHUNK];
+	uint64_t initial_window = 0;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		picoquic_set_app_read_mode(test_ctx->cnx_client, 1);
+		initial_window = test_ctx->cnx_client->local_parameters.initial_max_stream_data;
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+		test_stream = &test_ctx->test_stream[0];
+	}
+
+	if (ret == 0 && ((stream = picoquic_find_stream(test_ctx->cnx_client, test_stream->stream_id, 0)) == NULL ||
+		!stream->is_app_read))
+	{
+		ret = -1;
+	}
+
+	while (ret == 0 && nb_trials < 100000 && nb_inactive < 256 &&
+		test_stream->r_received == picoquic_callback_no_event &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+
+		nb_trials++;
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+
+		if (ret == 0 && !is_reading)
+		{
+			/* Nothing is read, so the peer is limited to the initial window */
+			if (test_stream->r_recv_nb != 0 || stream->consumed_offset != 0 ||
+				stream->fin_offset > initial_window || stream->recv_ring_size > 2 * initial_window)
+			{
+				ret = -1;
+			}
+			else if (nb_inactive >= 16)
+			{
+				/* The transfer stalled: all the window was received, start reading */
+				if (picoquic_stream_readable_offset(stream) != initial_window)
+				{
+					ret = -1;
+				}
+				is_reading = 1;
+			}
+		}
+
+		if (ret == 0 && is_reading)
+		{
+			size_t nb_read = 0;
+			int is_fin = 0;
+
+			ret = picoquic_stream_read(test_ctx->cnx_client, test_stream->stream_id,
+				buffer, sizeof(buffer), &nb_read, &is_fin);
+
+			if (ret == 0)
+			{
+				test_api_receive_stream_data(buffer, nb_read,
+					(is_fin) ? picoquic_callback_stream_fin : picoquic_callback_no_event,
+					test_stream->r_rcv, test_stream->r_len, test_stream->r_src,
+					&test_stream->r_recv_nb, &test_stream->r_received,
+					&test_ctx->client_callback.error_detected);
+			}
+		}
+	}
+
+	if (ret == 0 && (!is_reading || test_stream->r_received != picoquic_callback_stream_fin ||
+		test_stream->r_recv_nb != test_stream->r_len ||
+		test_ctx->client_callback.error_detected != 0 ||
+		test_ctx->server_callback.error_detected != 0 ||
+		stream->recv_ring != NULL))
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Packing test. The client sends eight short queries at once, and the
+ * server sends eight short responses. The frames of several streams are
+ * packed in the same packets, so much fewer packets are sent than streams.
+ */
+
+static test_api_stream_desc_t test_scenario_packing[] = {
+	{ 1, 0, 40, 40 },
+	{ 3, 0, 40, 40 },
+	{ 5, 0, 40, 40 },
+	{ 7, 0, 40, 40 },
+	{ 9, 0, 40, 40 },
+	{ 11, 0, 40, 40 },
+	{ 13, 0, 40, 40 },
+	{ 15, 0, 40, 40 }
+};
+
+#define TLS_API_PACKING_NB_STREAMS (sizeof(test_scenario_packing) / sizeof(test_api_stream_desc_t))
+
+int tls_api_stream_packing_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	uint64_t nb_packets[2][2];
+	uint64_t nb_bytes_used[2][2];
+	uint64_t nb_bytes_mtu[2][2];
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		picoquic_get_packing_stats(test_ctx->cnx_client, &nb_packets[0][0], &nb_bytes_used[0][0], &nb_bytes_mtu[0][0]);
+		picoquic_get_packing_stats(test_ctx->cnx_server, &nb_packets[1][0], &nb_bytes_used[1][0], &nb_bytes_mtu[1][0]);
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_packing, sizeof(test_scenario_packing));
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0 && (test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	for (size_t i = 0; ret == 0 && i < TLS_API_PACKING_NB_STREAMS; i++)
+	{
+		if (test_ctx->test_stream[i].q_recv_nb != test_ctx->test_stream[i].q_len ||
+			test_ctx->test_stream[i].r_recv_nb != test_ctx->test_stream[i].r_len ||
+			test_ctx->test_stream[i].r_received != picoquic_callback_stream_fin)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0)
+	{
+		picoquic_get_packing_stats(test_ctx->cnx_client, &nb_packets[0][1], &nb_bytes_used[0][1], &nb_bytes_mtu[0][1]);
+		picoquic_get_packing_stats(test_ctx->cnx_server, &nb_packets[1][1], &nb_bytes_used[1][1], &nb_bytes_mtu[1][1]);
+	}
+
+	for (int i = 0; ret == 0 && i < 2; i++)
+	{
+		/* The queries or the responses fit in one packet, plus a few acknowledgements */
+		if (nb_packets[i][1] - nb_packets[i][0] >= TLS_API_PACKING_NB_STREAMS / 2 ||
+			nb_bytes_used[i][1] - nb_bytes_used[i][0] > nb_bytes_mtu[i][1] - nb_bytes_mtu[i][0])
+		{
+			ret = -1;
+		}
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Retransmission merge test. The client sends three short queries in three
+ * separate packets, which are all lost, then queues a fourth query. When
+ * the retransmission timer fires, the three lost packets are repeated in a
+ * single packet, which also carries the new query.
+ */
+
+static test_api_stream_desc_t test_scenario_retransmit_merge[] = {
+	{ 1, 0, 100, 0 },
+	{ 3, 0, 100, 0 },
+	{ 5, 0, 100, 0 },
+	{ 7, 0, 100, 0 }
+};
+
+#define TLS_API_MERGE_NB_STREAMS (sizeof(test_scenario_retransmit_merge) / sizeof(test_api_stream_desc_t))
+
+static int tls_api_send_client_packet(picoquic_test_tls_api_ctx_t * test_ctx, uint64_t simulated_time,
+	size_t * send_length)
+{
+	int ret = 0;
+	uint8_t send_buffer[PICOQUIC_MAX_PACKET_SIZE];
+	picoquic_packet * p = picoquic_create_packet(test_ctx->qclient);
+
+	if (p == NULL)
+	{
+		ret = -1;
+	}
+	else
+	{
+		ret = picoquic_prepare_packet(test_ctx->cnx_client, p, simulated_time,
+			send_buffer, sizeof(send_buffer), send_length);
+		picoquic_delete_packet(test_ctx->qclient, p);
+	}
+
+	return ret;
+}
+
+int tls_api_retransmit_merge_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	size_t send_length = 0;
+	picoquic_sent_packet_t * sent = NULL;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	/* Let the handshake settle, so nothing is left to repeat */
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0 && !picoquic_is_cnx_backlog_empty(test_ctx->cnx_client))
+	{
+		ret = -1;
+	}
+
+	for (size_t i = 0; ret == 0 && i < TLS_API_MERGE_NB_STREAMS; i++)
+	{
+		ret = test_api_init_test_stream(&test_ctx->test_stream[i],
+			test_scenario_retransmit_merge[i].stream_id, 0,
+			test_scenario_retransmit_merge[i].q_len, test_scenario_retransmit_merge[i].r_len);
+
+		if (ret == 0)
+		{
+			test_ctx->nb_test_streams = i + 1;
+			ret = picoquic_add_to_stream(test_ctx->cnx_client, test_ctx->test_stream[i].stream_id,
+				test_ctx->test_stream[i].q_src, test_ctx->test_stream[i].q_len, 1);
+			test_ctx->test_stream[i].q_sent = 1;
+		}
+
+		/* The first queries are sent in their own packet, which is lost */
+		if (ret == 0 && i < TLS_API_MERGE_NB_STREAMS - 1)
+		{
+			ret = tls_api_send_client_packet(test_ctx, simulated_time, &send_length);
+
+			if (ret == 0 && (send_length == 0 || test_ctx->cnx_client->retransmit_newest == NULL ||
+				test_ctx->cnx_client->retransmit_newest->nb_frames != 1))
+			{
+				ret = -1;
+			}
+			simulated_time += 1000;
+		}
+	}
+
+	if (ret == 0)
+	{
+		simulated_time += test_ctx->cnx_client->retransmit_timer;
+		ret = tls_api_send_client_packet(test_ctx, simulated_time, &send_length);
+	}
+
+	/* A single packet carries the frames of all the streams */
+	if (ret == 0 && (send_length == 0 || (sent = test_ctx->cnx_client->retransmit_newest) == NULL ||
+		sent != test_ctx->cnx_client->retransmit_oldest))
+	{
+		ret = -1;
+	}
+
+	for (size_t i = 0; ret == 0 && i < TLS_API_MERGE_NB_STREAMS; i++)
+	{
+		int is_found = 0;
+
+		for (int j = 0; j < sent->nb_frames; j++)
+		{
+			if (sent->frames[j].frame_type == picoquic_sent_frame_stream &&
+				sent->frames[j].stream_id == test_ctx->test_stream[i].stream_id)
+			{
+				is_found = 1;
+			}
+		}
+
+		if (!is_found)
+		{
+			ret = -1;
+		}
+	}
+
+	/* And the queries are all received */
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	for (size_t i = 0; ret == 0 && i < TLS_API_MERGE_NB_STREAMS; i++)
+	{
+		if (test_ctx->test_stream[i].q_recv_nb != test_ctx->test_stream[i].q_len ||
+			test_ctx->test_stream[i].q_received != picoquic_callback_stream_fin)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 && (test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Sent frames test.
+ * The client sends short data on more streams than a packet can describe,
+ * plus a stream reset. The first packet is lost and the second one is
+ * acknowledged: only the stream data described in the second packet is
+ * released, and the frames of the first packet are repeated.
+ */
+#define TLS_API_SENT_FRAMES_NB_STREAMS 24
+#define TLS_API_SENT_FRAMES_RESET_STREAM (2 * TLS_API_SENT_FRAMES_NB_STREAMS + 1)
+
+static int tls_api_ack_client_packet(picoquic_test_tls_api_ctx_t * test_ctx, uint64_t sequence_number,
+	uint64_t current_time)
+{
+	int ret = 0;
+	picoquic_cnx_t acker;
+	uint8_t bytes[256];
+	size_t consumed = 0;
+	size_t decoded = 0;
+
+	memset(&acker, 0, sizeof(acker));
+	picoquic_sack_list_init(&acker.sack_list, PICOQUIC_DEFAULT_SACK_RANGE_MAX);
+	acker.time_stamp_largest_received = current_time;
+
+	if (picoquic_record_pn_received(&acker, sequence_number, current_time) != 0 ||
+		picoquic_prepare_ack_frame(&acker, current_time, bytes, sizeof(bytes), &consumed) != 0 ||
+		consumed == 0 ||
+		picoquic_decode_ack_frame(test_ctx->cnx_client, bytes, consumed, 0, &decoded, current_time) != 0 ||
+		decoded != consumed)
+	{
+		ret = -1;
+	}
+
+	picoquic_sack_list_free(&acker.sack_list);
+
+	return ret;
+}
+
+static int tls_api_sent_frames_find(picoquic_sent_packet_t * p, picoquic_sent_frame_type_enum frame_type,
+	uint32_t stream_id)
+{
+	int is_found = 0;
+
+	for (int i = 0; p != NULL && i < p->nb_frames; i++)
+	{
+		if (p->frames[i].frame_type == frame_type && p->frames[i].stream_id == stream_id)
+		{
+			is_found = 1;
+			break;
+		}
+	}
+
+	return is_found;
+}
+
+int tls_api_sent_frames_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	size_t send_length = 0;
+	uint64_t lost_sequence = 0;
+	uint64_t acked_sequence = 0;
+	picoquic_sent_packet_t * lost = NULL;
+	picoquic_sent_packet_t * acked = NULL;
+	picoquic_sent_packet_t * repeat = NULL;
+	uint8_t is_lost[TLS_API_SENT_FRAMES_NB_STREAMS];
+	uint8_t buffer[10];
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	/* Let the handshake settle, so nothing is left to repeat */
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	memset(buffer, 0x5a, sizeof(buffer));
+
+	for (uint32_t i = 0; ret == 0 && i < TLS_API_SENT_FRAMES_NB_STREAMS; i++)
+	{
+		ret = picoquic_add_to_stream(test_ctx->cnx_client, 2 * i + 1, buffer, sizeof(buffer), 1);
+	}
+
+	if (ret == 0)
+	{
+		ret = picoquic_reset_stream(test_ctx->cnx_client, TLS_API_SENT_FRAMES_RESET_STREAM);
+	}
+
+	/* The first packet is full of frame descriptions, the second gets the rest */
+	if (ret == 0)
+	{
+		ret = tls_api_send_client_packet(test_ctx, simulated_time, &send_length);
+
+		if (ret == 0 && (send_length == 0 || (lost = test_ctx->cnx_client->retransmit_newest) == NULL ||
+			lost->nb_frames != PICOQUIC_MAX_SENT_FRAMES))
+		{
+			ret = -1;
+		}
+		else
+		{
+			lost_sequence = lost->sequence_number;
+		}
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_send_client_packet(test_ctx, simulated_time, &send_length);
+
+		if (ret == 0 && (send_length == 0 || (acked = test_ctx->cnx_client->retransmit_newest) == lost ||
+			lost->nb_frames + acked->nb_frames != TLS_API_SENT_FRAMES_NB_STREAMS + 1))
+		{
+			ret = -1;
+		}
+		else
+		{
+			acked_sequence = acked->sequence_number;
+		}
+	}
+
+	/* Every frame is described in one of the packets */
+	for (uint32_t i = 0; ret == 0 && i < TLS_API_SENT_FRAMES_NB_STREAMS; i++)
+	{
+		is_lost[i] = (uint8_t)tls_api_sent_frames_find(lost, picoquic_sent_frame_stream, 2 * i + 1);
+
+		if (is_lost[i] == tls_api_sent_frames_find(acked, picoquic_sent_frame_stream, 2 * i + 1))
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 &&
+		tls_api_sent_frames_find(lost, picoquic_sent_frame_reset_stream, TLS_API_SENT_FRAMES_RESET_STREAM) ==
+		tls_api_sent_frames_find(acked, picoquic_sent_frame_reset_stream, TLS_API_SENT_FRAMES_RESET_STREAM))
+	{
+		ret = -1;
+	}
+
+	/* Acknowledge the second packet only. This releases its description. */
+	if (ret == 0)
+	{
+		simulated_time += 1000;
+		ret = tls_api_ack_client_packet(test_ctx, acked_sequence, simulated_time);
+	}
+
+	if (ret == 0 && (picoquic_find_sent_packet(test_ctx->cnx_client, acked_sequence) != NULL ||
+		picoquic_find_sent_packet(test_ctx->cnx_client, lost_sequence) != lost))
+	{
+		ret = -1;
+	}
+
+	/* The data of the acknowledged frames is released, the other is kept */
+	for (uint32_t i = 0; ret == 0 && i < TLS_API_SENT_FRAMES_NB_STREAMS; i++)
+	{
+		picoquic_stream_head * stream = picoquic_find_stream(test_ctx->cnx_client, 2 * i + 1, 0);
+
+		if (stream == NULL)
+		{
+			ret = -1;
+		}
+		else if (is_lost[i])
+		{
+			if (stream->acked_offset != 0 || stream->send_queue == NULL)
+			{
+				ret = -1;
+			}
+		}
+		else if (stream->acked_offset != sizeof(buffer) || stream->send_queue != NULL)
+		{
+			ret = -1;
+		}
+	}
+
+	/* The lost packet is repeated with the same frames */
+	if (ret == 0)
+	{
+		simulated_time += test_ctx->cnx_client->retransmit_timer;
+		ret = tls_api_send_client_packet(test_ctx, simulated_time, &send_length);
+
+		if (ret == 0 && (send_length == 0 ||
+			picoquic_find_sent_packet(test_ctx->cnx_client, lost_sequence) != NULL ||
+			(repeat = test_ctx->cnx_client->retransmit_newest) == NULL ||
+			repeat->nb_frames != PICOQUIC_MAX_SENT_FRAMES))
+		{
+			ret = -1;
+		}
+	}
+
+	for (uint32_t i = 0; ret == 0 && i < TLS_API_SENT_FRAMES_NB_STREAMS; i++)
+	{
+		if (tls_api_sent_frames_find(repeat, picoquic_sent_frame_stream, 2 * i + 1) != is_lost[i])
+		{
+			ret = -1;
+		}
+	}
+
+	/* Once the repeat is acknowledged, all the data is released */
+	if (ret == 0)
+	{
+		simulated_time += 1000;
+		ret = tls_api_ack_client_packet(test_ctx, repeat->sequence_number, simulated_time);
+	}
+
+	for (uint32_t i = 0; ret == 0 && i < TLS_API_SENT_FRAMES_NB_STREAMS; i++)
+	{
+		picoquic_stream_head * stream = picoquic_find_stream(test_ctx->cnx_client, 2 * i + 1, 0);
+
+		if (stream == NULL || stream->acked_offset != sizeof(buffer) || stream->send_queue != NULL)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 && !picoquic_is_cnx_backlog_empty(test_ctx->cnx_client))
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * ACK only test.
+ * After a query and response, the last packets only carry acknowledgements.
+ * They must not linger in the retransmit queue or count as bytes in transit,
+ * and their acknowledgement must still be found.
+ */
+int tls_api_ack_only_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_q_and_r, sizeof(test_scenario_q_and_r));
+	}
+
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0 && (test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+		test_ctx->server_callback.error_detected || test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	/* The client acknowledged the response with an ACK only packet */
+	if (ret == 0 && picoquic_find_ack_only_packet(test_ctx->cnx_client,
+		test_ctx->cnx_client->send_sequence - 1) == NULL)
+	{
+		ret = -1;
+	}
+
+	if (ret == 0 && (!picoquic_is_cnx_backlog_empty(test_ctx->cnx_client) ||
+		!picoquic_is_cnx_backlog_empty(test_ctx->cnx_server) ||
+		test_ctx->cnx_client->retransmit_newest != NULL ||
+		test_ctx->cnx_server->retransmit_newest != NULL ||
+		test_ctx->cnx_client->bytes_in_transit != 0 ||
+		test_ctx->cnx_server->bytes_in_transit != 0))
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Stream scheduler test.
+ * The client sends four queries at once, and the server responds with one
+ * bulk transfer on stream 1 and three short transfers on streams 3, 5 and 7.
+ * The completion time of each response is measured under each scheduling
+ * policy of the server.
+ */
+
+static test_api_stream_desc_t test_scenario_scheduler[] = {
+	{ 1, 0, 257, 200000 },
+	{ 3, 0, 257, 20000 },
+	{ 5, 0, 257, 20000 },
+	{ 7, 0, 257, 20000 }
+};
+
+#define TLS_API_SCHEDULER_NB_STREAMS (sizeof(test_scenario_scheduler) / sizeof(test_api_stream_desc_t))
+
+static int tls_api_stream_scheduler_one_test(picoquic_stream_scheduler_t const * scheduler,
+	uint8_t const * priority, uint8_t const * weight, uint64_t * completion_time)
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	int nb_inactive = 0;
+	size_t nb_completed = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		picoquic_set_default_stream_scheduler(test_ctx->qserver, scheduler);
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	for (size_t i = 0; ret == 0 && priority != NULL && i < TLS_API_SCHEDULER_NB_STREAMS; i++)
+	{
+		ret = picoquic_set_stream_priority(test_ctx->cnx_server,
+			test_scenario_scheduler[i].stream_id, priority[i], weight[i]);
+	}
+
+	if (ret == 0)
+	{
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_scheduler, sizeof(test_scenario_scheduler));
+	}
+
+	for (size_t i = 0; i < TLS_API_SCHEDULER_NB_STREAMS; i++)
+	{
+		completion_time[i] = 0;
+	}
+
+	while (ret == 0 && nb_completed < TLS_API_SCHEDULER_NB_STREAMS && nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		for (size_t i = 0; ret == 0 && i < TLS_API_SCHEDULER_NB_STREAMS; i++)
+		{
+			if (completion_time[i] == 0 &&
+				test_ctx->test_stream[i].r_received != picoquic_callback_no_event)
+			{
+				completion_time[i] = simulated_time;
+				nb_completed++;
+			}
+		}
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0 && (nb_completed != TLS_API_SCHEDULER_NB_STREAMS ||
+		test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	for (size_t i = 0; ret == 0 && i < TLS_API_SCHEDULER_NB_STREAMS; i++)
+	{
+		if (test_ctx->test_stream[i].r_recv_nb != test_ctx->test_stream[i].r_len)
+		{
+			ret = -1;
+		}
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/* Check whether the bulk transfer on stream 1 completes after all the short ones */
+static int tls_api_scheduler_bulk_is_last(uint64_t * completion_time)
+{
+	int bulk_is_last = 1;
+
+	for (size_t i = 1; i < TLS_API_SCHEDULER_NB_STREAMS; i++)
+	{
+		if (completion_time[i] >= completion_time[0])
+		{
+			bulk_is_last = 0;
+		}
+	}
+
+	return bulk_is_last;
+}
+
+int tls_api_stream_scheduler_test()
+{
+	uint64_t completion_time[TLS_API_SCHEDULER_NB_STREAMS];
+	uint8_t const short_first_priority[TLS_API_SCHEDULER_NB_STREAMS] = { 8, 1, 1, 1 };
+	uint8_t const equal_weight[TLS_API_SCHEDULER_NB_STREAMS] = { 16, 16, 16, 16 };
+	uint8_t const unequal_weight[TLS_API_SCHEDULER_NB_STREAMS] = { 16, 64, 4, 4 };
+	int ret = 0;
+
+	/* Equal priorities: the lowest stream ID is served first, as before */
+	ret = tls_api_stream_scheduler_one_test(picoquic_strict_priority_scheduler, NULL, NULL, completion_time);
+
+	if (ret == 0 && tls_api_scheduler_bulk_is_last(completion_time))
+	{
+		ret = -1;
+	}
+
+	/* Short streams have a higher priority, and complete before the bulk one */
+	if (ret == 0)
+	{
+		ret = tls_api_stream_scheduler_one_test(picoquic_strict_priority_scheduler,
+			short_first_priority, equal_weight, completion_time);
+
+		if (ret == 0 && !tls_api_scheduler_bulk_is_last(completion_time))
+		{
+			ret = -1;
+		}
+	}
+
+	/* Round robin lets the short streams complete first */
+	if (ret == 0)
+	{
+		ret = tls_api_stream_scheduler_one_test(picoquic_round_robin_scheduler, NULL, NULL, completion_time);
+
+		if (ret == 0 && !tls_api_scheduler_bulk_is_last(completion_time))
+		{
+			ret = -1;
+		}
+	}
+
+	/* Fair queuing behaves as round robin with equal weights */
+	if (ret == 0)
+	{
+		ret = tls_api_stream_scheduler_one_test(picoquic_wfq_scheduler, NULL, NULL, completion_time);
+
+		if (ret == 0 && !tls_api_scheduler_bulk_is_last(completion_time))
+		{
+			ret = -1;
+		}
+	}
+
+	/* The stream with the larger weight completes first */
+	if (ret == 0)
+	{
+		ret = tls_api_stream_scheduler_one_test(picoquic_wfq_scheduler,
+			short_first_priority, unequal_weight, completion_time);
+
+		if (ret == 0 && (!tls_api_scheduler_bulk_is_last(completion_time) ||
+			completion_time[1] >= completion_time[2] ||
+			completion_time[1] >= completion_time[3]))
+		{
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Congestion control test on a long fat link: 1 Gbps, 20 ms RTT, with a
+ * drop tail queue of the specified delay, and optionally random losses.
+ * The server sends a long response, and the completion time is measured
+ * with each congestion algorithm. The RTT is kept below the minimum
+ * retransmit timer, so that the comparison is not dominated by spurious
+ * timeouts. The options turn off features of the server, to measure what
+ * they bring. The drops that happen before the window of the server first
+ * reaches half the bandwidth delay product are counted apart. Even paced
+ * over half the RTT, such a window is sent below the link rate, so these
+ * drops are caused by bursts overflowing the queue, not by the link being
+ * full.
+ */
+
+static test_api_stream_desc_t test_scenario_long_fat[] = {
+	{ 1, 0, 257, 20000000 }
+};
+
+#define TLS_API_CONGESTION_NO_PACING 1
+#define TLS_API_CONGESTION_NO_HYSTART 2
+#define TLS_API_LONG_FAT_BDP 2500000 /* bytes in 20 ms at 1 Gbps */
+#define TLS_API_LONG_FAT_BURST_CWIN (TLS_API_LONG_FAT_BDP / PICOQUIC_PACING_WINDOW_GAIN)
+
+static int tls_api_congestion_one_test(picoquic_congestion_algorithm_t const * alg,
+	test_api_stream_desc_t * scenario, size_t sizeof_scenario,
+	uint64_t init_loss_mask, uint64_t queue_delay_max, uint32_t options,
+	uint64_t * completion_time, uint64_t * pacing_rate, uint64_t * nb_dropped, uint64_t * nb_burst_dropped)
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	uint64_t nb_burst = 0;
+	int has_reached_burst_cwin = 0;
+	int nb_inactive = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	*completion_time = 0;
+
+	if (ret == 0)
+	{
+		picoquic_set_default_congestion_algorithm(test_ctx->qserver, alg);
+		picoquic_set_congestion_algorithm(test_ctx->cnx_client, alg);
+
+		test_ctx->c_to_s_link->picosec_per_byte = 8000;
+		test_ctx->c_to_s_link->microsec_latency = 10000;
+		test_ctx->s_to_c_link->picosec_per_byte = 8000;
+		test_ctx->s_to_c_link->microsec_latency = 10000;
+
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, queue_delay_max, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		picoquic_set_pacing(test_ctx->cnx_server, (options&TLS_API_CONGESTION_NO_PACING) == 0);
+		picoquic_set_hystart(test_ctx->cnx_server, (options&TLS_API_CONGESTION_NO_HYSTART) == 0);
+
+		loss_mask = init_loss_mask;
+		ret = test_api_init_send_recv_scenario(test_ctx, scenario, sizeof_scenario);
+	}
+
+	while (ret == 0 && test_ctx->test_stream[0].r_received == picoquic_callback_no_event &&
+		nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		if (test_ctx->cnx_server->cwin >= TLS_API_LONG_FAT_BURST_CWIN)
+		{
+			has_reached_burst_cwin = 1;
+		}
+		else if (!has_reached_burst_cwin)
+		{
+			nb_burst = test_ctx->s_to_c_link->packets_dropped;
+		}
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0 && (test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+		test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	if (ret == 0)
+	{
+		*completion_time = simulated_time;
+		*pacing_rate = test_ctx->cnx_server->pacing_rate;
+		*nb_dropped = test_ctx->s_to_c_link->packets_dropped;
+		if (nb_burst_dropped != NULL)
+		{
+			*nb_burst_dropped = nb_burst;
+		}
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * With a drop tail queue of 4 ms, much smaller than the bandwidth delay
+ * product, halving the window after a loss leaves the link underused, and
+ * New Reno only grows it by one packet per RTT. Cubic backs off less and
+ * grows back faster, completing in about 320 ms instead of 375 ms.
+ */
+int tls_api_cubic_test()
+{
+	uint64_t newreno_time = 0;
+	uint64_t cubic_time = 0;
+	uint64_t pacing_rate = 0;
+	uint64_t nb_dropped = 0;
+	int ret = tls_api_congestion_one_test(picoquic_newreno_algorithm,
+		test_scenario_long_fat, sizeof(test_scenario_long_fat), 0, 4000, 0,
+		&newreno_time, &pacing_rate, &nb_dropped, NULL);
+
+	if (ret == 0)
+	{
+		ret = tls_api_congestion_one_test(picoquic_cubic_algorithm,
+			test_scenario_long_fat, sizeof(test_scenario_long_fat), 0, 4000, 0,
+			&cubic_time, &pacing_rate, &nb_dropped, NULL);
+	}
+
+	if (ret == 0 && cubic_time >= newreno_time)
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * With random losses that are not caused by congestion, BBR keeps sending
+ * at the bottleneck rate while New Reno keeps reducing its window. The
+ * pacing rate computed by BBR follows the link rate, about 130 MB/s. The
+ * transfer is short enough to end in startup, where the pacing gain is 2.89.
+ */
+#define TLS_API_BBR_LOSS_MASK 0x0000010000000100ull
+
+int tls_api_bbr_test()
+{
+	uint64_t newreno_time = 0;
+	uint64_t bbr_time = 0;
+	uint64_t pacing_rate = 0;
+	uint64_t nb_dropped = 0;
+	int ret = tls_api_congestion_one_test(picoquic_newreno_algorithm,
+		test_scenario_long_fat, sizeof(test_scenario_long_fat), TLS_API_BBR_LOSS_MASK, 10000, 0,
+		&newreno_time, &pacing_rate, &nb_dropped, NULL);
+
+	if (ret == 0)
+	{
+		ret = tls_api_congestion_one_test(picoquic_bbr_algorithm,
+			test_scenario_long_fat, sizeof(test_scenario_long_fat), TLS_API_BBR_LOSS_MASK, 10000, 0,
+			&bbr_time, &pacing_rate, &nb_dropped, NULL);
+	}
+
+	if (ret == 0 && (bbr_time >= newreno_time ||
+		pacing_rate < 65000000 || pacing_rate > 420000000))
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Pacing test on the long fat link, with a drop tail queue of only 1 ms,
+ * much less than the bandwidth delay product. Without pacing, the bursts
+ * overflow the queue early in slow start, about 185 packets are dropped
+ * while the window is still small, and the transfer takes about 1.1
+ * seconds. With pacing, no packet is dropped before the window reaches
+ * half the bandwidth delay product, and the transfer completes in about
+ * 0.52 second.
+ */
+int tls_api_pacing_test()
+{
+	uint64_t burst_time = 0;
+	uint64_t burst_dropped = 0;
+	uint64_t paced_time = 0;
+	uint64_t paced_dropped = 0;
+	uint64_t pacing_rate = 0;
+	uint64_t nb_dropped = 0;
+	int ret = tls_api_congestion_one_test(picoquic_newreno_algorithm,
+		test_scenario_long_fat, sizeof(test_scenario_long_fat), 0, 1000, TLS_API_CONGESTION_NO_PACING,
+		&burst_time, &pacing_rate, &nb_dropped, &burst_dropped);
+
+	if (ret == 0)
+	{
+		ret = tls_api_congestion_one_test(picoquic_newreno_algorithm,
+			test_scenario_long_fat, sizeof(test_scenario_long_fat), 0, 1000, 0,
+			&paced_time, &pacing_rate, &nb_dropped, &paced_dropped);
+	}
+
+	if (ret == 0 && (paced_dropped >= burst_dropped || paced_time >= burst_time))
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * HyStart++ test on the long fat link, with a drop tail queue of 20 ms,
+ * as large as the bandwidth delay product. The response is longer than in
+ * the other tests, so the transfer goes on after the slow start. Without a
+ * delay based exit, the slow start overshoots the queue and about 4400
+ * packets are dropped. With HyStart++, the RTT increase slows down the
+ * growth of the window. The conservative slow start still lasts a few
+ * rounds, so the queue still overflows, but only about 2500 packets are
+ * dropped, and the transfer completes a little earlier. The test requires
+ * HyStart++ to drop at most two thirds as many packets.
+ */
+
+static test_api_stream_desc_t test_scenario_hystart[] = {
+	{ 1, 0, 257, 40000000 }
+};
+
+int tls_api_hystart_test()
+{
+	uint64_t overshoot_time = 0;
+	uint64_t overshoot_dropped = 0;
+	uint64_t hystart_time = 0;
+	uint64_t hystart_dropped = 0;
+	uint64_t pacing_rate = 0;
+	int ret = tls_api_congestion_one_test(picoquic_newreno_algorithm,
+		test_scenario_hystart, sizeof(test_scenario_hystart), 0, 20000, TLS_API_CONGESTION_NO_HYSTART,
+		&overshoot_time, &pacing_rate, &overshoot_dropped, NULL);
+
+	if (ret == 0)
+	{
+		ret = tls_api_congestion_one_test(picoquic_newreno_algorithm,
+			test_scenario_hystart, sizeof(test_scenario_hystart), 0, 20000, 0,
+			&hystart_time, &pacing_rate, &hystart_dropped, NULL);
+	}
+
+	if (ret == 0 && (3 * hystart_dropped > 2 * overshoot_dropped || hystart_time > overshoot_time))
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Probe timeout test on a 20 ms RTT path. A query sent in a single packet
+ * is lost, and so is its first repeat. The probe timeout follows the RTT,
+ * so the response arrives in about 200 ms, instead of more than a second
+ * if the second repeat waited for a fixed one second timer.
+ */
+static test_api_stream_desc_t test_scenario_pto[] = {
+	{ 1, 0, 100, 100 }
+};
+
+int tls_api_pto_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	uint64_t query_time = 0;
+	size_t send_length = 0;
+	int nb_inactive = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		test_ctx->c_to_s_link->microsec_latency = 10000;
+		test_ctx->s_to_c_link->microsec_latency = 10000;
+
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	/* Let the handshake settle, so nothing is left to repeat */
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_pto, sizeof(test_scenario_pto));
+	}
+
+	/* The query is lost */
+	if (ret == 0)
+	{
+		query_time = simulated_time;
+		ret = tls_api_send_client_packet(test_ctx, simulated_time, &send_length);
+
+		if (ret == 0 && send_length == 0)
+		{
+			ret = -1;
+		}
+	}
+
+	/* And so is the first repeat */
+	loss_mask = 1;
+
+	while (ret == 0 && test_ctx->test_stream[0].r_received == picoquic_callback_no_event &&
+		nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0 && (test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+		simulated_time - query_time > 400000 ||
+		test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * RACK test. The first packet of a query is held in the network for
+ * longer than the reordering window, and arrives after the packets sent
+ * after it. The client declares it lost, then receives the ACK of the
+ * original packet: the loss is spurious, and the reordering window
+ * must be enlarged.
+ */
+static test_api_stream_desc_t test_scenario_rack[] = {
+	{ 1, 0, 4000, 100 }
+};
+
+int tls_api_rack_test()
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	uint64_t release_time = 0;
+	picoquictest_sim_packet_t * held_packet = NULL;
+	int nb_inactive = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	if (ret == 0)
+	{
+		test_ctx->c_to_s_link->microsec_latency = 10000;
+		test_ctx->s_to_c_link->microsec_latency = 10000;
+
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	/* Let the handshake settle, so nothing is left to repeat */
+	if (ret == 0)
+	{
+		ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_rack, sizeof(test_scenario_rack));
+	}
+
+	while (ret == 0 && test_ctx->test_stream[0].r_received == picoquic_callback_no_event &&
+		nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+
+		if (held_packet == NULL && release_time == 0 && test_ctx->c_to_s_link->first_packet != NULL)
+		{
+			/* Hold the first packet of the query for 20 ms */
+			held_packet = test_ctx->c_to_s_link->first_packet;
+			test_ctx->c_to_s_link->first_packet = held_packet->next_packet;
+			if (test_ctx->c_to_s_link->first_packet == NULL)
+			{
+				test_ctx->c_to_s_link->last_packet = NULL;
+			}
+			release_time = held_packet->arrival_time + 20000;
+		}
+		else if (held_packet != NULL && simulated_time >= release_time)
+		{
+			/* Deliver it before the packets still in transit */
+			held_packet->arrival_time = simulated_time;
+			held_packet->next_packet = test_ctx->c_to_s_link->first_packet;
+			test_ctx->c_to_s_link->first_packet = held_packet;
+			if (test_ctx->c_to_s_link->last_packet == NULL)
+			{
+				test_ctx->c_to_s_link->last_packet = held_packet;
+			}
+			held_packet = NULL;
+		}
+
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0 && (test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+		test_ctx->cnx_client->nb_spurious == 0 ||
+		test_ctx->cnx_client->rack_reorder_mult <= PICOQUIC_RACK_REORDER_MULT_MIN ||
+		test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	if (held_packet != NULL)
+	{
+		free(held_packet);
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * ACK policy test. A long transfer on a 10 Gbps link is run once with the
+ * default policy and once with the adaptive policy at the client, which
+ * receives the data. The adaptive policy must send much fewer ACK packets
+ * without slowing down the transfer.
+ */
+static int tls_api_ack_policy_one_test(int ack_adaptive, uint64_t * completion_time, uint64_t * nb_acks)
+{
+	uint64_t simulated_time = 0;
+	uint64_t loss_mask = 0;
+	uint64_t nb_sent_before = 0;
+	int nb_inactive = 0;
+	picoquic_test_tls_api_ctx_t * test_ctx = NULL;
+	int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN);
+
+	*completion_time = 0;
+	*nb_acks = 0;
+
+	if (ret == 0)
+	{
+		picoquic_set_default_congestion_algorithm(test_ctx->qserver, picoquic_cubic_algorithm);
+		picoquic_set_congestion_algorithm(test_ctx->cnx_client, picoquic_cubic_algorithm);
+
+		test_ctx->c_to_s_link->picosec_per_byte = 800;
+		test_ctx->c_to_s_link->microsec_latency = 1000;
+		test_ctx->s_to_c_link->picosec_per_byte = 800;
+		test_ctx->s_to_c_link->microsec_latency = 1000;
+
+		ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+	}
+
+	if (ret == 0)
+	{
+		if (ack_adaptive)
+		{
+			picoquic_set_ack_policy(test_ctx->cnx_client, PICOQUIC_ACK_FREQUENCY_DEFAULT,
+				PICOQUIC_MAX_ACK_DELAY, 1, 1);
+		}
+
+		nb_sent_before = test_ctx->c_to_s_link->packets_sent;
+		ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_long_fat, sizeof(test_scenario_long_fat));
+	}
+
+	while (ret == 0 && test_ctx->test_stream[0].r_received == picoquic_callback_no_event &&
+		nb_inactive < 256 &&
+		test_ctx->cnx_client->cnx_state == picoquic_state_client_ready &&
+		test_ctx->cnx_server->cnx_state == picoquic_state_server_ready)
+	{
+		int was_active = 0;
+
+		ret = tls_api_one_sim_round(test_ctx, &simulated_time, &was_active);
+
+		nb_inactive = (was_active) ? 0 : nb_inactive + 1;
+	}
+
+	if (ret == 0 && (test_ctx->test_stream[0].r_recv_nb != test_ctx->test_stream[0].r_len ||
+		test_ctx->server_callback.error_detected ||
+		test_ctx->client_callback.error_detected))
+	{
+		ret = -1;
+	}
+
+	if (ret == 0)
+	{
+		*completion_time = simulated_time;
+		*nb_acks = test_ctx->c_to_s_link->packets_sent - nb_sent_before;
+	}
+
+	if (test_ctx != NULL)
+	{
+		tls_api_delete_ctx(test_ctx);
+		test_ctx = NULL;
+	}
+
+	return ret;
+}
+
+int tls_api_ack_policy_test()
+{
+	uint64_t default_time = 0;
+	uint64_t default_acks = 0;
+	uint64_t adaptive_time = 0;
+	uint64_t adaptive_acks = 0;
+	int ret = tls_api_ack_policy_one_test(0, &default_time, &default_acks);
+
+	if (ret == 0)
+	{
+		ret = tls_api_ack_policy_one_test(1, &adaptive_time, &adaptive_acks);
+	}
+
+	if (ret == 0 && (4 * adaptive_acks > default_acks || adaptive_time > default_time + default_time / 8))
+	{
+		ret = -1;
+	}
+
+	return ret;
+}
 
 /*
  * Server reset test.